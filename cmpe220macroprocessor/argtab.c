@@ -89,6 +89,7 @@ int argtab_add(argtab_t * table, const char * symbol, const char * value)
         if(element != NULL)
         {
             strcpy_s(element->key, ARGTAB_STRING_SIZE, symbol);
+            element->version = 0;
             
 			element->valIsArray = *value == '(' ? true : false;
 
@@ -143,6 +144,7 @@ int argtab_set(argtab_t * table, const char * symbol, const char * value)
         if(element)
         {
             // hash key found
+            element->version++;
 			element->valIsArray = *value == '(' ? true : false;
 
 			if(element->valIsArray)
@@ -219,6 +221,35 @@ char * argtab_get(argtab_t * table, const char * symbol)
     return result;
 }
 
+/**
+ * Function: argtab_isArray
+ * Description:
+ *  - Checks whether the value of the given symbol was inserted as an array.
+ * Parameters:
+ *  - table: Pointer to ARGTAB.
+ *  - symbol: Symbol to look up.
+ * Returns:
+ *  - true if the symbol is found and its value is an array, false otherwise.
+ */
+bool argtab_isArray(argtab_t * table, const char * symbol)
+{
+    bool result = false;
+    struct argtab_data ** ht = NULL;
+    struct argtab_data * found = NULL;
+
+    if(table && symbol)
+    {
+        ht = &(table->data);
+        HASH_FIND_STR(*ht, symbol, found);
+        if(found)
+        {
+            result = found->valIsArray;
+        }
+    }
+
+    return result;
+}
+
 /**
  * Function: argtab_clear
  * Description:
@@ -20,6 +20,7 @@ struct argtab_data
     char            key[ARGTAB_STRING_SIZE];
     char            value[ARGTAB_STRING_SIZE];
 	bool			valIsArray;
+    unsigned int    version;    // incremented every time the value is set
     UT_hash_handle  hh;
 };
 
@@ -34,6 +35,7 @@ argtab_t *	argtab_alloc(void);
 void        argtab_free(argtab_t * table);
 int         argtab_add(argtab_t * table, const char * symbol, const char * value);
 char *      argtab_get(argtab_t * table, const char * symbol);
+bool        argtab_isArray(argtab_t * table, const char * symbol);
 int         argtab_set(argtab_t * table, const char * symbol, const char * value);
 int         argtab_addOrSet(argtab_t * table, const char * symbol, const char * value);
 void        argtab_clear(argtab_t * table);
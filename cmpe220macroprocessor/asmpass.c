@@ -0,0 +1,629 @@
+/*
+ * asmpass.c - Contains functions for pass 1 of a SIC/XE assembler over the
+ * output (--symtab).
+ *
+ * Every line written to the output goes through asmpass_line, whether it was
+ * expanded, replayed from a cache or merged from a thread, and is assigned
+ * its address while it is written: LOCCTR, SYMTAB and the literal pool are
+ * built as in pass 1 of the assembler, which then does not have to read the
+ * output again. The sidecar file has one record per line:
+ *
+ *   LINE number address length format opcode
+ *   SYMBOL name address
+ *   LITERAL text address length
+ *   ERROR number message
+ *   PROGRAM name start length
+ *   FORMATS 1=count 2=count 3=count 4=count other=count
+ *
+ * Addresses and lengths of PROGRAM are in hex, the other lengths are bytes.
+ * Format 0 (other) is a directive, or data. PROGRAM and FORMATS come last.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include "definitions.h"
+#include "asmpass.h"
+
+// Instruction of the SIC/XE machine, and its format (3 for format 3 or 4)
+typedef struct
+{
+    const char *    name;
+    int             format;
+} asmpass_opcode_t;
+
+// sorted by name, for bsearch
+const asmpass_opcode_t ASMPASS_OPTAB[] =
+{
+    {"ADD", 3}, {"ADDF", 3}, {"ADDR", 2}, {"AND", 3}, {"CLEAR", 2}, {"COMP", 3},
+    {"COMPF", 3}, {"COMPR", 2}, {"DIV", 3}, {"DIVF", 3}, {"DIVR", 2}, {"FIX", 1},
+    {"FLOAT", 1}, {"HIO", 1}, {"J", 3}, {"JEQ", 3}, {"JGT", 3}, {"JLT", 3},
+    {"JSUB", 3}, {"LDA", 3}, {"LDB", 3}, {"LDCH", 3}, {"LDF", 3}, {"LDL", 3},
+    {"LDS", 3}, {"LDT", 3}, {"LDX", 3}, {"LPS", 3}, {"MUL", 3}, {"MULF", 3},
+    {"MULR", 2}, {"NORM", 1}, {"OR", 3}, {"RD", 3}, {"RMO", 2}, {"RSUB", 3},
+    {"SHIFTL", 2}, {"SHIFTR", 2}, {"SIO", 1}, {"SSK", 3}, {"STA", 3}, {"STB", 3},
+    {"STCH", 3}, {"STF", 3}, {"STI", 3}, {"STL", 3}, {"STS", 3}, {"STSW", 3},
+    {"STT", 3}, {"STX", 3}, {"SUB", 3}, {"SUBF", 3}, {"SUBR", 2}, {"SVC", 2},
+    {"TD", 3}, {"TIO", 1}, {"TIX", 3}, {"TIXR", 2}, {"WD", 3}
+};
+
+// local function definitions
+int asmpass_compareOpcodes(const void * key, const void * element);
+void asmpass_statement(asmpass_t * pass, const char * label, const char * opcode, char * operand);
+char * asmpass_operand(char * operators);
+int asmpass_dataLength(const char * operand);
+int asmpass_value(asmpass_t * pass, const char * expression, int * value);
+void asmpass_define(asmpass_t * pass, const char * label, int address);
+void asmpass_literal(asmpass_t * pass, const char * operand);
+void asmpass_placeLiterals(asmpass_t * pass);
+void asmpass_error(asmpass_t * pass, const char * message, const char * text);
+
+/**
+ * Function: asmpass_alloc
+ * Description:
+ *  - Allocates a pass 1 writing its records to an open file. The file is not
+ *    closed by asmpass_free.
+ * Parameters:
+ *  - file: Open sidecar file.
+ * Returns:
+ *  - If successful, returns pointer to new pass. Otherwise, returns NULL.
+ */
+asmpass_t * asmpass_alloc(FILE * file)
+{
+    asmpass_t * pass;
+
+    if(file == NULL)
+    {
+        return NULL;
+    }
+
+    pass = (asmpass_t *) malloc(sizeof(asmpass_t));
+    if(pass)
+    {
+        memset(pass, 0, sizeof(asmpass_t));
+        pass->file = file;
+        pass->parseInfo = parse_info_alloc();
+        pass->pendingTail = &pass->pending;
+        if(pass->parseInfo == NULL)
+        {
+            free(pass);
+            pass = NULL;
+        }
+    }
+
+    return pass;
+}
+
+/**
+ * Function: asmpass_free
+ * Description:
+ *  - Frees the pass, with its SYMTAB and literal pool.
+ * Parameters:
+ *  - pass: Pointer to the pass.
+ * Returns:
+ *  - none
+ */
+void asmpass_free(asmpass_t * pass)
+{
+    asmpass_symbol_t * symbol;
+    asmpass_symbol_t * tmp;
+
+    if(pass == NULL)
+    {
+        return;
+    }
+
+    HASH_ITER(hh, pass->symbols, symbol, tmp)
+    {
+        HASH_DEL(pass->symbols, symbol);
+        free(symbol->name);
+        free(symbol);
+    }
+    HASH_ITER(hh, pass->literals, symbol, tmp)
+    {
+        HASH_DEL(pass->literals, symbol);
+        free(symbol->name);
+        free(symbol);
+    }
+
+    parse_info_free(pass->parseInfo);
+    free(pass);
+}
+
+/**
+ * Function: asmpass_finish
+ * Description:
+ *  - Ends the pass: places the literals no LTORG or END placed, and writes
+ *    the program length and the count of each format.
+ * Parameters:
+ *  - pass: Pointer to the pass.
+ * Returns:
+ *  - SUCCESS, or FAILURE if the sidecar could not be written.
+ */
+int asmpass_finish(asmpass_t * pass)
+{
+    if(pass == NULL)
+    {
+        return FAILURE;
+    }
+
+    if(!pass->ended)
+    {
+        asmpass_placeLiterals(pass);
+    }
+
+    fprintf(pass->file, "PROGRAM %s %06X %06X\n", (pass->programName[0] != '\0') ? pass->programName : "-",
+        pass->startAddress, pass->endAddress - pass->startAddress);
+    fprintf(pass->file, "FORMATS 1=%d 2=%d 3=%d 4=%d other=%d\n", pass->formats[1], pass->formats[2],
+        pass->formats[3], pass->formats[4], pass->formats[0]);
+
+    if(fflush(pass->file) != 0 || ferror(pass->file))
+    {
+        pass->failed = TRUE;
+    }
+    return pass->failed ? FAILURE : SUCCESS;
+}
+
+/**
+ * Function: asmpass_getFormat
+ * Description:
+ *  - Looks up an instruction in OPTAB.
+ * Parameters:
+ *  - opcode: Opcode, + in front for format 4.
+ * Returns:
+ *  - The format of the instruction, 1 to 4, or 0 if it is not an
+ *    instruction (or + is in front of a format 1 or 2 instruction).
+ */
+int asmpass_getFormat(const char * opcode)
+{
+    const asmpass_opcode_t * found;
+    int extended;
+
+    if(opcode == NULL)
+    {
+        return 0;
+    }
+
+    extended = (opcode[0] == '+');
+    found = (const asmpass_opcode_t *) bsearch(opcode + extended, ASMPASS_OPTAB,
+        sizeof(ASMPASS_OPTAB) / sizeof(ASMPASS_OPTAB[0]), sizeof(asmpass_opcode_t), asmpass_compareOpcodes);
+    if(found == NULL)
+    {
+        return 0;
+    }
+    if(extended)
+    {
+        return (found->format == 3) ? 4 : 0;
+    }
+    return found->format;
+}
+
+/**
+ * Function: asmpass_getLength
+ * Description:
+ *  - Length of the code or data of a statement.
+ * Parameters:
+ *  - opcode: Opcode, + in front for format 4.
+ *  - operand: First operand, or "".
+ * Returns:
+ *  - Length in bytes: the format of an instruction, the size of BYTE, WORD,
+ *    RESB and RESW, and 0 for a directive.
+ */
+int asmpass_getLength(const char * opcode, const char * operand)
+{
+    int format = asmpass_getFormat(opcode);
+
+    if(format > 0 || opcode == NULL || operand == NULL)
+    {
+        return format;
+    }
+    if(strcmp("WORD", opcode) == 0)
+    {
+        return 3;
+    }
+    if(strcmp("RESW", opcode) == 0)
+    {
+        return 3 * atoi(operand);
+    }
+    if(strcmp("RESB", opcode) == 0)
+    {
+        return atoi(operand);
+    }
+    if(strcmp("BYTE", opcode) == 0)
+    {
+        return asmpass_dataLength(operand);
+    }
+    return 0;
+}
+
+/**
+ * Function: asmpass_compareOpcodes
+ * Description:
+ *  - Compares an opcode with an entry of OPTAB, for bsearch.
+ * Parameters:
+ *  - key: Opcode.
+ *  - element: Entry of OPTAB.
+ * Returns:
+ *  - Less than, equal to or greater than 0, as strcmp.
+ */
+int asmpass_compareOpcodes(const void * key, const void * element)
+{
+    return strcmp((const char *) key, ((const asmpass_opcode_t *) element)->name);
+}
+
+/**
+ * Function: asmpass_line
+ * Description:
+ *  - Assembles one output line. Comment and blank lines have no address.
+ * Parameters:
+ *  - pass: Pointer to the pass.
+ *  - line: The line, without its newline.
+ * Returns:
+ *  - none
+ */
+void asmpass_line(asmpass_t * pass, const char * line)
+{
+    parse_info_t * info = pass->parseInfo;
+    char label[CURRENT_LINE_SIZE];
+    const char * rest;
+    size_t length;
+
+    if(pass == NULL || line == NULL || pass->failed)
+    {
+        return;
+    }
+
+    pass->lineNumber++;
+    if(pass->ended || *line == '.')
+    {
+        return;
+    }
+
+    // the parser needs an opcode after the label, a label alone is defined here
+    length = strcspn(line, " \t");
+    rest = line + length;
+    rest += strspn(rest, " \t");
+    if(*rest == '\0')
+    {
+        if(length > 0 && length < sizeof(label))
+        {
+            strncpy_s(label, sizeof(label), line, length);
+            asmpass_define(pass, label, pass->locctr);
+        }
+        return;
+    }
+
+    if(parse_line(info, line) != 0 || info->isComment || info->opcode == NULL || info->opcode[0] == '.')
+    {
+        return;
+    }
+    asmpass_statement(pass, info->label, info->opcode, asmpass_operand(info->operators));
+}
+
+/**
+ * Function: asmpass_statement
+ * Description:
+ *  - Assigns the address of a statement, defines its label and advances
+ *    LOCCTR by its length.
+ * Parameters:
+ *  - pass: Pointer to the pass.
+ *  - label: Label, or NULL.
+ *  - opcode: Opcode.
+ *  - operand: First operand, or "".
+ * Returns:
+ *  - none
+ */
+void asmpass_statement(asmpass_t * pass, const char * label, const char * opcode, char * operand)
+{
+    int address = pass->locctr;
+    int length = 0;
+    int format = asmpass_getFormat(opcode);
+    int value;
+
+    if(format > 0)
+    {
+        length = format;
+        if(operand[0] == '=')
+        {
+            asmpass_literal(pass, operand);
+        }
+    }
+    else if(strcmp("START", opcode) == 0)
+    {
+        value = (int) strtol(operand, NULL, 16);
+        address = pass->startAddress = pass->locctr = pass->endAddress = value;
+        if(label != NULL)
+        {
+            strncpy_s(pass->programName, ASMPASS_NAME_SIZE, label, _TRUNCATE);
+            label = NULL;
+        }
+    }
+    else if(strcmp("WORD", opcode) == 0 || strcmp("RESW", opcode) == 0 ||
+        strcmp("RESB", opcode) == 0 || strcmp("BYTE", opcode) == 0)
+    {
+        length = asmpass_getLength(opcode, operand);
+    }
+    else if(strcmp("EQU", opcode) == 0)
+    {
+        if(asmpass_value(pass, operand, &value) != SUCCESS)
+        {
+            asmpass_error(pass, "EQU of an undefined symbol", operand);
+            value = pass->locctr;
+        }
+        address = value;
+    }
+    else if(strcmp("ORG", opcode) == 0)
+    {
+        if(asmpass_value(pass, operand, &value) != SUCCESS)
+        {
+            asmpass_error(pass, "ORG of an undefined symbol", operand);
+            value = pass->locctr;
+        }
+        pass->locctr = value;
+    }
+    else if(strcmp("LTORG", opcode) == 0 || strcmp("END", opcode) == 0)
+    {
+        pass->ended = (strcmp("END", opcode) == 0);
+        asmpass_placeLiterals(pass);
+    }
+    else if(strcmp("BASE", opcode) != 0 && strcmp("NOBASE", opcode) != 0 &&
+        strcmp("EXTDEF", opcode) != 0 && strcmp("EXTREF", opcode) != 0)
+    {
+        asmpass_error(pass, "unknown opcode", opcode);
+        return;
+    }
+
+    if(label != NULL)
+    {
+        asmpass_define(pass, label, address);
+    }
+
+    fprintf(pass->file, "LINE %d %06X %d %d %s\n", pass->lineNumber, address, length, format, opcode);
+    pass->formats[format]++;
+    pass->locctr += length;
+    if(pass->locctr > pass->endAddress)
+    {
+        pass->endAddress = pass->locctr;
+    }
+}
+
+/**
+ * Function: asmpass_operand
+ * Description:
+ *  - Finds the first operand of a statement: the rest of the line is a
+ *    comment. A quoted constant may contain spaces.
+ * Parameters:
+ *  - operators: Operators found by parse_line, or NULL. Cut after the operand.
+ * Returns:
+ *  - The operand, or "" if there is none.
+ */
+char * asmpass_operand(char * operators)
+{
+    char * end;
+    int quoted = FALSE;
+
+    if(operators == NULL)
+    {
+        return "";
+    }
+
+    for(end = operators; *end != '\0' && (quoted || !isspace(*end)); end++)
+    {
+        if(*end == '\'')
+        {
+            quoted = !quoted;
+        }
+    }
+    *end = '\0';
+    return operators;
+}
+
+/**
+ * Function: asmpass_dataLength
+ * Description:
+ *  - Length of a constant: C'..' takes a byte per character, X'..' a byte
+ *    per two hex digits, and a number a word.
+ * Parameters:
+ *  - operand: The constant, without the = of a literal.
+ * Returns:
+ *  - Length in bytes.
+ */
+int asmpass_dataLength(const char * operand)
+{
+    const char * end;
+    int length;
+
+    if((operand[0] == 'C' || operand[0] == 'X') && operand[1] == '\'')
+    {
+        end = strchr(operand + 2, '\'');
+        length = (end != NULL) ? (int) (end - operand - 2) : (int) strlen(operand + 2);
+        return (operand[0] == 'C') ? length : (length + 1) / 2;
+    }
+    return 3;
+}
+
+/**
+ * Function: asmpass_value
+ * Description:
+ *  - Evaluates the operand of EQU or ORG: terms added and subtracted, each a
+ *    decimal number, a symbol defined before, or * for LOCCTR.
+ * Parameters:
+ *  - pass: Pointer to the pass.
+ *  - expression: The operand.
+ *  - value: Set to its value.
+ * Returns:
+ *  - SUCCESS, or FAILURE if a symbol is not defined yet.
+ */
+int asmpass_value(asmpass_t * pass, const char * expression, int * value)
+{
+    asmpass_symbol_t * symbol;
+    char name[ASMPASS_NAME_SIZE];
+    const char * term = expression;
+    size_t length;
+    int sign = 1;
+
+    *value = 0;
+    while(*term != '\0')
+    {
+        length = strcspn(term, "+-");
+        if(length == 1 && *term == '*')
+        {
+            *value += sign * pass->locctr;
+        }
+        else if(length > 0 && isdigit(*term))
+        {
+            *value += sign * atoi(term);
+        }
+        else
+        {
+            if(length == 0 || length >= ASMPASS_NAME_SIZE)
+            {
+                return FAILURE;
+            }
+            memcpy(name, term, length);
+            name[length] = '\0';
+            HASH_FIND_STR(pass->symbols, name, symbol);
+            if(symbol == NULL)
+            {
+                return FAILURE;
+            }
+            *value += sign * symbol->address;
+        }
+
+        term += length;
+        if(*term != '\0')
+        {
+            sign = (*term == '-') ? -1 : 1;
+            term++;
+        }
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Function: asmpass_define
+ * Description:
+ *  - Enters a label in SYMTAB. A label defined twice is an error.
+ * Parameters:
+ *  - pass: Pointer to the pass.
+ *  - label: The label.
+ *  - address: Its address.
+ * Returns:
+ *  - none
+ */
+void asmpass_define(asmpass_t * pass, const char * label, int address)
+{
+    asmpass_symbol_t * symbol;
+
+    HASH_FIND_STR(pass->symbols, label, symbol);
+    if(symbol != NULL)
+    {
+        asmpass_error(pass, "duplicate symbol", label);
+        return;
+    }
+
+    symbol = (asmpass_symbol_t *) calloc(1, sizeof(asmpass_symbol_t));
+    if(symbol == NULL || (symbol->name = _strdup(label)) == NULL)
+    {
+        free(symbol);
+        pass->failed = TRUE;
+        return;
+    }
+    symbol->address = address;
+    HASH_ADD_KEYPTR(hh, pass->symbols, symbol->name, strlen(symbol->name), symbol);
+    pass->numSymbols++;
+
+    fprintf(pass->file, "SYMBOL %s %06X\n", label, address);
+}
+
+/**
+ * Function: asmpass_literal
+ * Description:
+ *  - Enters a literal in the pool, the first time it is used since the
+ *    last LTORG. It is placed at the next LTORG or END.
+ * Parameters:
+ *  - pass: Pointer to the pass.
+ *  - operand: The literal, with its =.
+ * Returns:
+ *  - none
+ */
+void asmpass_literal(asmpass_t * pass, const char * operand)
+{
+    asmpass_symbol_t * literal;
+
+    HASH_FIND_STR(pass->literals, operand, literal);
+    if(literal != NULL)
+    {
+        return;
+    }
+
+    literal = (asmpass_symbol_t *) calloc(1, sizeof(asmpass_symbol_t));
+    if(literal == NULL || (literal->name = _strdup(operand)) == NULL)
+    {
+        free(literal);
+        pass->failed = TRUE;
+        return;
+    }
+    literal->address = -1;
+    literal->length = asmpass_dataLength(operand + 1);
+    HASH_ADD_KEYPTR(hh, pass->literals, literal->name, strlen(literal->name), literal);
+
+    *pass->pendingTail = literal;
+    pass->pendingTail = &literal->next;
+}
+
+/**
+ * Function: asmpass_placeLiterals
+ * Description:
+ *  - Places the literals used since the last LTORG at LOCCTR, in the order
+ *    they were first used. A literal used again after is a new one.
+ * Parameters:
+ *  - pass: Pointer to the pass.
+ * Returns:
+ *  - none
+ */
+void asmpass_placeLiterals(asmpass_t * pass)
+{
+    asmpass_symbol_t * literal;
+
+    for(literal = pass->pending; literal != NULL; literal = literal->next)
+    {
+        literal->address = pass->locctr;
+        fprintf(pass->file, "LITERAL %s %06X %d\n", literal->name, literal->address, literal->length);
+        pass->locctr += literal->length;
+        pass->numLiterals++;
+        HASH_DEL(pass->literals, literal);
+    }
+    if(pass->locctr > pass->endAddress)
+    {
+        pass->endAddress = pass->locctr;
+    }
+
+    while(pass->pending != NULL)
+    {
+        literal = pass->pending;
+        pass->pending = literal->next;
+        free(literal->name);
+        free(literal);
+    }
+    pass->pendingTail = &pass->pending;
+}
+
+/**
+ * Function: asmpass_error
+ * Description:
+ *  - Writes an error record for the current line.
+ * Parameters:
+ *  - pass: Pointer to the pass.
+ *  - message: What is wrong.
+ *  - text: The opcode or operand in error.
+ * Returns:
+ *  - none
+ */
+void asmpass_error(asmpass_t * pass, const char * message, const char * text)
+{
+    fprintf(pass->file, "ERROR %d %s %s\n", pass->lineNumber, message, text);
+    pass->numErrors++;
+}
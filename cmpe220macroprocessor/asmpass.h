@@ -0,0 +1,56 @@
+/*
+ * asmpass.h - Contains functions and definitions for pass 1 of a SIC/XE
+ * assembler, run on the output lines as they are written (--symtab).
+ */
+
+#ifndef ASMPASS_H_
+#define ASMPASS_H_
+
+#include <stdio.h>
+#include "uthash\uthash.h"
+#include "parser.h"
+
+#define ASMPASS_FORMATS     (5)     // formats 1 to 4, and 0 for directives and data
+#define ASMPASS_NAME_SIZE   (16)
+
+// Symbol of SYMTAB, or literal of the literal pool, with its address
+typedef struct asmpass_symbol_s
+{
+    char *                      name;
+    int                         address;    // -1 for a literal not placed yet
+    int                         length;     // bytes of a literal
+    struct asmpass_symbol_s *   next;       // next literal waiting for LTORG or END
+    UT_hash_handle              hh;
+} asmpass_symbol_t;
+
+// Pass 1 of the output: the records are written to the sidecar file as each
+// line is assigned its address, so memory grows with the symbols, not the lines
+typedef struct asmpass_s
+{
+    FILE *              file;           // sidecar file
+    parse_info_t *      parseInfo;
+    int                 lineNumber;     // output lines seen
+    int                 locctr;
+    int                 startAddress;
+    int                 endAddress;     // highest LOCCTR reached
+    char                programName[ASMPASS_NAME_SIZE];
+    int                 ended;          // END was seen, later lines are not assembled
+    asmpass_symbol_t *  symbols;        // SYMTAB
+    asmpass_symbol_t *  literals;       // literal pool
+    asmpass_symbol_t *  pending;        // literals to place at the next LTORG or END
+    asmpass_symbol_t ** pendingTail;
+    int                 numSymbols;
+    int                 numLiterals;
+    int                 numErrors;
+    int                 formats[ASMPASS_FORMATS];   // lines of each format
+    int                 failed;         // out of memory or write error
+} asmpass_t;
+
+asmpass_t * asmpass_alloc(FILE * file);
+void        asmpass_free(asmpass_t * pass);
+void        asmpass_line(asmpass_t * pass, const char * line);
+int         asmpass_finish(asmpass_t * pass);
+int         asmpass_getFormat(const char * opcode);
+int         asmpass_getLength(const char * opcode, const char * operand);
+
+#endif /* ASMPASS_H_ */
@@ -0,0 +1,429 @@
+/*
+ * budget.c - Contains functions for expansion budgets.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include "definitions.h"
+#include "budget.h"
+#include "thread.h"
+
+// local function definitions
+int budget_update(budget_t * budget, int kind, int value, int isAmount);
+
+// Names used on the command line and in messages, in budget kind order
+static const char * budgetNames[BUDGET_KINDS] = { "lines", "loops", "depth", "deftab", "ms" };
+
+/**
+ * Function: budget_alloc
+ * Description:
+ *  - Allocates memory for the expansion budgets, with the default limits, and
+ *    starts the clock for the file.
+ * Parameters:
+ *  - none
+ * Returns:
+ *  - If successful, returns pointer to new budgets. Otherwise, returns NULL.
+ */
+budget_t * budget_alloc(void)
+{
+    budget_t * budget = (budget_t *) malloc(sizeof(budget_t));
+    if(budget)
+    {
+        // initialize to zero, no limits
+        memset(budget, 0, sizeof(budget_t));
+        budget->invocationLimit[BUDGET_LOOPS] = DEFAULT_INVOCATION_LOOPS;
+        budget->fileLimit[BUDGET_DEPTH] = DEFAULT_FILE_DEPTH;
+        budget->exceededKind = -1;
+        budget->fileStart = thread_now();
+    }
+
+    return budget;
+}
+
+/**
+ * Function: budget_free
+ * Description:
+ *  - De-allocates the memory associated with the budgets.
+ * Parameters:
+ *  - budget: Pointer to the budgets.
+ * Returns:
+ *  - none
+ */
+void budget_free(budget_t * budget)
+{
+    free(budget);
+}
+
+/**
+ * Function: budget_setLimit
+ * Description:
+ *  - Sets a limit from a "name=value" option, for example "loops=5000".
+ *    A value of 0 removes the limit, so the value must be all digits: a typo
+ *    must not turn a limit off.
+ * Parameters:
+ *  - budget: Pointer to the budgets.
+ *  - spec: Option text.
+ *  - perInvocation: TRUE to limit each top level invocation, FALSE to limit
+ *    the whole file.
+ * Returns:
+ *  - SUCCESS, or FAILURE if the name is unknown or the value is empty, not
+ *    a number, negative or too large.
+ */
+int budget_setLimit(budget_t * budget, const char * spec, int perInvocation)
+{
+    int kind;
+    long value;
+    size_t nameLength;
+    const char * equals;
+    char * end;
+
+    if(budget == NULL || spec == NULL || (equals = strchr(spec, '=')) == NULL)
+    {
+        return FAILURE;
+    }
+
+    // strtol would take leading blanks and a sign
+    if(equals[1] < '0' || equals[1] > '9')
+    {
+        return FAILURE;
+    }
+    errno = 0;
+    value = strtol(equals + 1, &end, 10);
+    if(*end != '\0' || errno == ERANGE || value > INT_MAX)
+    {
+        return FAILURE;
+    }
+
+    nameLength = equals - spec;
+    for(kind = 0; kind < BUDGET_KINDS; kind++)
+    {
+        if(strlen(budgetNames[kind]) == nameLength && strncmp(budgetNames[kind], spec, nameLength) == 0)
+        {
+            if(perInvocation)
+            {
+                budget->invocationLimit[kind] = (int) value;
+            }
+            else
+            {
+                budget->fileLimit[kind] = (int) value;
+            }
+            return SUCCESS;
+        }
+    }
+
+    return FAILURE;
+}
+
+/**
+ * Function: budget_reset
+ * Description:
+ *  - Clears the usage and restarts the clock for a new file, keeping the
+ *    limits.
+ * Parameters:
+ *  - budget: Pointer to the budgets.
+ * Returns:
+ *  - none
+ */
+void budget_reset(budget_t * budget)
+{
+    if(budget)
+    {
+        memset(budget->fileUsed, 0, sizeof(budget->fileUsed));
+        memset(budget->invocationUsed, 0, sizeof(budget->invocationUsed));
+        memset(budget->invocationPeak, 0, sizeof(budget->invocationPeak));
+        budget->inInvocation = FALSE;
+        budget->exceededKind = -1;
+        budget->ticks = 0;
+        budget->fileStart = thread_now();
+    }
+}
+
+/**
+ * Function: budget_startInvocation
+ * Description:
+ *  - Starts counting for a top level invocation.
+ * Parameters:
+ *  - budget: Pointer to the budgets.
+ * Returns:
+ *  - none
+ */
+void budget_startInvocation(budget_t * budget)
+{
+    if(budget)
+    {
+        memset(budget->invocationUsed, 0, sizeof(budget->invocationUsed));
+        budget->invocationStart = thread_now();
+        budget->inInvocation = TRUE;
+    }
+}
+
+/**
+ * Function: budget_endInvocation
+ * Description:
+ *  - Stops counting for the running top level invocation. Usage outside of
+ *    invocations (top level macro definitions) only counts for the file.
+ * Parameters:
+ *  - budget: Pointer to the budgets.
+ * Returns:
+ *  - none
+ */
+void budget_endInvocation(budget_t * budget)
+{
+    if(budget)
+    {
+        budget->inInvocation = FALSE;
+    }
+}
+
+/**
+ * Function: budget_charge
+ * Description:
+ *  - Adds to the usage of a cumulative budget (lines, loops, deftab).
+ * Parameters:
+ *  - budget: Pointer to the budgets.
+ *  - kind: Budget kind.
+ *  - amount: Amount used.
+ * Returns:
+ *  - SUCCESS, or FAILURE if a limit is exceeded. exceededKind and
+ *    exceededPerInvocation tell which one.
+ */
+int budget_charge(budget_t * budget, int kind, int amount)
+{
+    return budget_update(budget, kind, amount, TRUE);
+}
+
+/**
+ * Function: budget_reach
+ * Description:
+ *  - Records a level reached for a budget that is not cumulative (depth,
+ *    time). Usage is the highest level reached.
+ * Parameters:
+ *  - budget: Pointer to the budgets.
+ *  - kind: Budget kind.
+ *  - value: Level reached.
+ * Returns:
+ *  - SUCCESS, or FAILURE if a limit is exceeded.
+ */
+int budget_reach(budget_t * budget, int kind, int value)
+{
+    return budget_update(budget, kind, value, FALSE);
+}
+
+/**
+ * Function: budget_credit
+ * Description:
+ *  - Gives back an amount charged to a budget, for memory that is freed
+ *    (DEFTAB lines). Usage does not go below 0, and the peaks stay.
+ * Parameters:
+ *  - budget: Pointer to the budgets.
+ *  - kind: Budget kind.
+ *  - amount: Amount given back.
+ * Returns:
+ *  - none
+ */
+void budget_credit(budget_t * budget, int kind, int amount)
+{
+    if(budget == NULL || kind < 0 || kind >= BUDGET_KINDS || amount <= 0)
+    {
+        return;
+    }
+
+    budget->fileUsed[kind] -= (amount < budget->fileUsed[kind]) ? amount : budget->fileUsed[kind];
+    if(budget->inInvocation)
+    {
+        budget->invocationUsed[kind] -= (amount < budget->invocationUsed[kind]) ? amount : budget->invocationUsed[kind];
+    }
+}
+
+/**
+ * Function: budget_tick
+ * Description:
+ *  - Counts a line or loop towards the next check of the time elapsed. The
+ *    clock is read once every BUDGET_TICK_INTERVAL ticks, as lines are
+ *    written far more often than a millisecond passes.
+ * Parameters:
+ *  - budget: Pointer to the budgets.
+ * Returns:
+ *  - SUCCESS, or FAILURE if a limit is exceeded.
+ */
+int budget_tick(budget_t * budget)
+{
+    if(budget == NULL || ++budget->ticks < BUDGET_TICK_INTERVAL)
+    {
+        return SUCCESS;
+    }
+
+    budget->ticks = 0;
+    return budget_checkTime(budget);
+}
+
+/**
+ * Function: budget_checkTime
+ * Description:
+ *  - Checks the wall time elapsed for the file and for the running
+ *    invocation.
+ * Parameters:
+ *  - budget: Pointer to the budgets.
+ * Returns:
+ *  - SUCCESS, or FAILURE if a limit is exceeded.
+ */
+int budget_checkTime(budget_t * budget)
+{
+    long long now;
+    int fileTime;
+    int invocationTime;
+
+    if(budget == NULL)
+    {
+        return SUCCESS;
+    }
+
+    // in 64 bits: milliseconds of a long run do not fit in microseconds of 32
+    now = thread_now();
+    fileTime = (int) ((now - budget->fileStart) / 1000);
+    invocationTime = (int) ((now - budget->invocationStart) / 1000);
+
+    if(budget_reach(budget, BUDGET_TIME, fileTime) != SUCCESS)
+    {
+        return FAILURE;
+    }
+
+    // the file level was just checked, only the invocation level is left
+    if(budget->inInvocation)
+    {
+        if(invocationTime > budget->invocationUsed[BUDGET_TIME])
+        {
+            budget->invocationUsed[BUDGET_TIME] = invocationTime;
+        }
+        if(invocationTime > budget->invocationPeak[BUDGET_TIME])
+        {
+            budget->invocationPeak[BUDGET_TIME] = invocationTime;
+        }
+        if(budget->invocationLimit[BUDGET_TIME] > 0 && invocationTime > budget->invocationLimit[BUDGET_TIME])
+        {
+            budget->exceededKind = BUDGET_TIME;
+            budget->exceededPerInvocation = TRUE;
+            return FAILURE;
+        }
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Function: budget_getName
+ * Description:
+ *  - Gets the name of a budget kind, as used by the -l and -L options.
+ * Parameters:
+ *  - kind: Budget kind.
+ * Returns:
+ *  - Name of the budget.
+ */
+const char * budget_getName(int kind)
+{
+    if(kind < 0 || kind >= BUDGET_KINDS)
+    {
+        return "unknown";
+    }
+
+    return budgetNames[kind];
+}
+
+/**
+ * Function: budget_report
+ * Description:
+ *  - Prints the diagnostic for an exceeded limit.
+ * Parameters:
+ *  - budget: Pointer to the budgets.
+ *  - macroName: Name of the macro being expanded or defined.
+ *  - line: Line being processed when the limit was exceeded.
+ * Returns:
+ *  - FAILURE, so callers can return the result directly.
+ */
+int budget_report(budget_t * budget, const char * macroName, const char * line)
+{
+    int kind = budget->exceededKind;
+    int limit = budget->exceededPerInvocation ? budget->invocationLimit[kind] : budget->fileLimit[kind];
+
+    printError("ERROR: Expansion budget exceeded: more than %d %s per %s (see -%c %s=N).\n"
+        "    Macro %s, at line:\n    %s%s",
+        limit, budget_getName(kind), budget->exceededPerInvocation ? "invocation" : "file",
+        budget->exceededPerInvocation ? 'L' : 'l', budget_getName(kind),
+        macroName != NULL ? macroName : "(none)", line != NULL ? line : "",
+        (line == NULL || line[0] == '\0' || line[strlen(line) - 1] != '\n') ? "\n" : "");
+
+    return FAILURE;
+}
+
+/**
+ * Function: budget_update
+ * Description:
+ *  - Updates the file and invocation usage of a budget and checks the limits.
+ *    Time is handled by budget_tick, as it is measured separately for the
+ *    file and the invocation.
+ * Parameters:
+ *  - budget: Pointer to the budgets.
+ *  - kind: Budget kind.
+ *  - value: Amount used, or level reached.
+ *  - isAmount: TRUE if value is added, FALSE if it is a level.
+ * Returns:
+ *  - SUCCESS, or FAILURE if a limit is exceeded.
+ */
+int budget_update(budget_t * budget, int kind, int value, int isAmount)
+{
+    long long * fileUsed;
+    long long * invocationUsed;
+
+    if(budget == NULL || kind < 0 || kind >= BUDGET_KINDS)
+    {
+        return SUCCESS;
+    }
+
+    fileUsed = &budget->fileUsed[kind];
+    invocationUsed = &budget->invocationUsed[kind];
+
+    if(isAmount)
+    {
+        *fileUsed += value;
+    }
+    else if(value > *fileUsed)
+    {
+        *fileUsed = value;
+    }
+
+    if(budget->fileLimit[kind] > 0 && *fileUsed > budget->fileLimit[kind])
+    {
+        budget->exceededKind = kind;
+        budget->exceededPerInvocation = FALSE;
+        return FAILURE;
+    }
+
+    if(budget->inInvocation && kind != BUDGET_TIME)
+    {
+        if(isAmount)
+        {
+            *invocationUsed += value;
+        }
+        else if(value > *invocationUsed)
+        {
+            *invocationUsed = value;
+        }
+
+        if(*invocationUsed > budget->invocationPeak[kind])
+        {
+            budget->invocationPeak[kind] = *invocationUsed;
+        }
+
+        if(budget->invocationLimit[kind] > 0 && *invocationUsed > budget->invocationLimit[kind])
+        {
+            budget->exceededKind = kind;
+            budget->exceededPerInvocation = TRUE;
+            return FAILURE;
+        }
+    }
+
+    return SUCCESS;
+}
@@ -0,0 +1,54 @@
+/*
+ * budget.h - Contains functions and definitions for expansion budgets.
+ */
+
+#ifndef BUDGET_H_
+#define BUDGET_H_
+
+// Budget kinds
+#define BUDGET_LINES        (0)     // lines written by expansions
+#define BUDGET_LOOPS        (1)     // WHILE iterations
+#define BUDGET_DEPTH        (2)     // nested invocations
+#define BUDGET_DEFTAB       (3)     // lines DEFTAB grew by, less the lines retired from its end
+#define BUDGET_TIME         (4)     // elapsed milliseconds
+#define BUDGET_KINDS        (5)
+
+// Default limits, 0 means no limit
+#define DEFAULT_INVOCATION_LOOPS    (1000000)
+#define DEFAULT_FILE_DEPTH          (1024)
+
+// Lines and loops between two readings of the clock by budget_tick
+#define BUDGET_TICK_INTERVAL        (64)
+
+// Limits and usage for the whole file, and for one top level invocation
+// (including the invocations nested in it)
+typedef struct
+{
+    int     fileLimit[BUDGET_KINDS];
+    int     invocationLimit[BUDGET_KINDS];
+    long long fileUsed[BUDGET_KINDS];       // 64 bits: lines of a large file do not fit in an int
+    long long invocationUsed[BUDGET_KINDS]; // of the running invocation
+    long long invocationPeak[BUDGET_KINDS]; // most used by any invocation
+    int     inInvocation;
+    long long fileStart;                    // thread_now() microseconds, wall time
+    long long invocationStart;
+    int     ticks;                          // since the clock was read
+    int     exceededKind;                   // set when a limit is exceeded
+    int     exceededPerInvocation;
+} budget_t;
+
+budget_t *      budget_alloc(void);
+void            budget_free(budget_t * budget);
+int             budget_setLimit(budget_t * budget, const char * spec, int perInvocation);
+void            budget_reset(budget_t * budget);
+void            budget_startInvocation(budget_t * budget);
+void            budget_endInvocation(budget_t * budget);
+int             budget_charge(budget_t * budget, int kind, int amount);
+int             budget_reach(budget_t * budget, int kind, int value);
+void            budget_credit(budget_t * budget, int kind, int amount);
+int             budget_tick(budget_t * budget);
+int             budget_checkTime(budget_t * budget);
+const char *    budget_getName(int kind);
+int             budget_report(budget_t * budget, const char * macroName, const char * line);
+
+#endif /* BUDGET_H_ */
@@ -0,0 +1,241 @@
+/*
+ * catalog.c - Contains functions for the macro catalog.
+ *
+ * Expansions read the macros of a library through its read-only mapping, and
+ * enter those they use in their own (thread local) NAMTAB and DEFTAB, so any
+ * number of them can share one mapping without locks. The catalog holds the
+ * mapping to use, as a reference counted snapshot:
+ *
+ *  - an expansion pins the current snapshot when it starts, and releases it
+ *    once its tables are freed, so the library cannot change under it.
+ *  - reloading publishes a new snapshot with one pointer exchange. Expansions
+ *    started after it use the new library, those running finish with theirs.
+ *  - a snapshot is closed by whoever drops its last reference.
+ *
+ * Pinning loads the pointer and then takes a reference. A publisher waits for
+ * the expansions between those two steps (pinning) before dropping the
+ * reference of the catalog, so a snapshot is never referenced once freed.
+ * Both sides store one counter and then load the other, with a full fence in
+ * between, so either the publisher sees pinning or the expansion sees the
+ * new pointer.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "definitions.h"
+#include "catalog.h"
+
+// local function definitions
+catalog_snapshot_t * catalog_snapshotAlloc(library_t * library);
+
+/**
+ * Function: catalog_alloc
+ * Description:
+ *  - Allocates memory for a catalog, holding no library.
+ * Parameters:
+ *  - none
+ * Returns:
+ *  - If successful, returns pointer to new catalog. Otherwise, returns NULL.
+ */
+catalog_t * catalog_alloc(void)
+{
+    catalog_t * catalog = (catalog_t *) malloc(sizeof(catalog_t));
+    if(catalog)
+    {
+        memset(catalog, 0, sizeof(catalog_t));
+        catalog->current = catalog_snapshotAlloc(NULL);
+        if(catalog->current == NULL)
+        {
+            free(catalog);
+            catalog = NULL;
+        }
+    }
+
+    return catalog;
+}
+
+/**
+ * Function: catalog_free
+ * Description:
+ *  - De-allocates memory for a catalog, and closes its library. Every
+ *    snapshot pinned must have been released.
+ * Parameters:
+ *  - catalog: Pointer to the catalog.
+ * Returns:
+ *  - none
+ */
+void catalog_free(catalog_t * catalog)
+{
+    if(catalog)
+    {
+        catalog_release(catalog, catalog->current);
+        free(catalog);
+    }
+}
+
+/**
+ * Function: catalog_publish
+ * Description:
+ *  - Makes a library the one used by the expansions started from now on.
+ *    The library before it is closed once no expansion holds it.
+ * Parameters:
+ *  - catalog: Pointer to the catalog.
+ *  - library: Library to publish, owned by the catalog from now on. NULL
+ *    for no library.
+ * Returns:
+ *  - SUCCESS, or FAILURE if out of memory (the library is then closed).
+ */
+int catalog_publish(catalog_t * catalog, library_t * library)
+{
+    catalog_snapshot_t * snapshot;
+    catalog_snapshot_t * old;
+
+    if(catalog == NULL)
+    {
+        library_close(library);
+        return FAILURE;
+    }
+
+    snapshot = catalog_snapshotAlloc(library);
+    if(snapshot == NULL)
+    {
+        library_close(library);
+        return FAILURE;
+    }
+
+    snapshot->generation = THREAD_INCREMENT(&catalog->generation);
+    old = (catalog_snapshot_t *) THREAD_EXCHANGE_POINTER(&catalog->current, snapshot);
+    thread_fence();
+
+    // an expansion may have loaded the old pointer and not referenced it yet
+    while(THREAD_LOAD(&catalog->pinning) != 0)
+    {
+        thread_yield();
+    }
+
+    catalog_release(catalog, old);
+    return SUCCESS;
+}
+
+/**
+ * Function: catalog_reload
+ * Description:
+ *  - Loads a library file, or a file of definitions, and publishes it. On
+ *    failure, the library published before stays.
+ * Parameters:
+ *  - catalog: Pointer to the catalog.
+ *  - fileName: Name of the library file.
+ * Returns:
+ *  - SUCCESS or FAILURE
+ */
+int catalog_reload(catalog_t * catalog, const char * fileName)
+{
+    return catalog_reloadFiles(catalog, &fileName, 1);
+}
+
+/**
+ * Function: catalog_reloadFiles
+ * Description:
+ *  - Loads library files on the THREADS threads, merges them and publishes
+ *    the result (see libload.c). On failure, the library published before
+ *    stays.
+ * Parameters:
+ *  - catalog: Pointer to the catalog.
+ *  - fileNames: Library files, from the lowest priority to the highest.
+ *  - numFiles: Number of files.
+ * Returns:
+ *  - SUCCESS or FAILURE
+ */
+int catalog_reloadFiles(catalog_t * catalog, const char * const * fileNames, int numFiles)
+{
+    library_t * library;
+
+    if(catalog == NULL || fileNames == NULL || fileNames[0] == NULL || numFiles <= 0)
+    {
+        return FAILURE;
+    }
+
+    library = libload_open(fileNames, numFiles, THREADS);
+    if(library == NULL)
+    {
+        return FAILURE;
+    }
+
+    return catalog_publish(catalog, library);
+}
+
+/**
+ * Function: catalog_pin
+ * Description:
+ *  - Takes a reference to the current snapshot, for an expansion about to
+ *    start. Its library stays mapped until catalog_release.
+ * Parameters:
+ *  - catalog: Pointer to the catalog.
+ * Returns:
+ *  - The snapshot, or NULL if catalog is NULL.
+ */
+catalog_snapshot_t * catalog_pin(catalog_t * catalog)
+{
+    catalog_snapshot_t * snapshot;
+
+    if(catalog == NULL)
+    {
+        return NULL;
+    }
+
+    THREAD_INCREMENT(&catalog->pinning);
+    thread_fence();
+    snapshot = (catalog_snapshot_t *) THREAD_LOAD_POINTER(&catalog->current);
+    THREAD_INCREMENT(&snapshot->references);
+    THREAD_ADD(&catalog->pinning, -1);
+
+    THREAD_INCREMENT(&catalog->pinned);
+    return snapshot;
+}
+
+/**
+ * Function: catalog_release
+ * Description:
+ *  - Drops a reference to a snapshot, and closes its library if it was the
+ *    last one.
+ * Parameters:
+ *  - catalog: Pointer to the catalog.
+ *  - snapshot: Snapshot returned by catalog_pin, may be NULL.
+ * Returns:
+ *  - none
+ */
+void catalog_release(catalog_t * catalog, catalog_snapshot_t * snapshot)
+{
+    if(snapshot != NULL && THREAD_ADD(&snapshot->references, -1) == 0)
+    {
+        library_close(snapshot->library);
+        free(snapshot);
+        if(catalog != NULL)
+        {
+            THREAD_INCREMENT(&catalog->reclaimed);
+        }
+    }
+}
+
+/**
+ * Function: catalog_snapshotAlloc
+ * Description:
+ *  - Allocates memory for a snapshot, referenced by the catalog.
+ * Parameters:
+ *  - library: Library of the snapshot, may be NULL.
+ * Returns:
+ *  - If successful, returns pointer to new snapshot. Otherwise, returns NULL.
+ */
+catalog_snapshot_t * catalog_snapshotAlloc(library_t * library)
+{
+    catalog_snapshot_t * snapshot = (catalog_snapshot_t *) malloc(sizeof(catalog_snapshot_t));
+    if(snapshot)
+    {
+        memset(snapshot, 0, sizeof(catalog_snapshot_t));
+        snapshot->library = library;
+        snapshot->references = 1;
+    }
+
+    return snapshot;
+}
@@ -0,0 +1,39 @@
+/*
+ * catalog.h - Contains functions and definitions for the macro catalog: the
+ * library shared by concurrent expansions, which can be replaced while they
+ * run.
+ */
+
+#ifndef CATALOG_H_
+#define CATALOG_H_
+
+#include "thread.h"
+#include "library.h"
+
+// Library as published at one time. It is never changed once published, and
+// is closed when the last expansion holding it releases it.
+typedef struct
+{
+    library_t *     library;        // NULL for no library
+    volatile long   references;     // the catalog's own, and one per pin
+    long            generation;     // 1 for the first library published
+} catalog_snapshot_t;
+
+typedef struct
+{
+    catalog_snapshot_t *    current;
+    volatile long           pinning;    // expansions between loading current and referencing it
+    volatile long           generation;
+    volatile long           pinned;     // snapshots pinned, for the statistics
+    volatile long           reclaimed;  // snapshots closed
+} catalog_t;
+
+catalog_t *             catalog_alloc(void);
+void                    catalog_free(catalog_t * catalog);
+int                     catalog_publish(catalog_t * catalog, library_t * library);
+int                     catalog_reload(catalog_t * catalog, const char * fileName);
+int                     catalog_reloadFiles(catalog_t * catalog, const char * const * fileNames, int numFiles);
+catalog_snapshot_t *    catalog_pin(catalog_t * catalog);
+void                    catalog_release(catalog_t * catalog, catalog_snapshot_t * snapshot);
+
+#endif /* CATALOG_H_ */
@@ -5,8 +5,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
+#include <stdarg.h>
 #include "definitions.h"
 #include "parser.h"
+#include "asmpass.h"
+#include "tokout.h"
+#include "peephole.h"
 #include "test.h"
 
 // Initialize global variables
@@ -16,30 +21,119 @@
 BOOL VERBOSE = FALSE;
 
 // Expanding flag - for function expand
-BOOL EXPANDING = FALSE; 
+THREAD_LOCAL BOOL EXPANDING = FALSE; 
 
 // OPCODE - to determine what the opcode currently is
-char OPCODE[SHORT_STRING_SIZE];
+THREAD_LOCAL char OPCODE[SHORT_STRING_SIZE];
 
 // Expanded Label - to keep track of labels included with macro invocations
-BOOL EXPAND_LABEL = FALSE;
-char EXPANDED_LABEL[SHORT_STRING_SIZE];
+THREAD_LOCAL BOOL EXPAND_LABEL = FALSE;
+THREAD_LOCAL char EXPANDED_LABEL[SHORT_STRING_SIZE];
 
 // Unique ID - Used to identify a macro invocation, for unique label generation
-int  UNIQUE_ID = 0;
+THREAD_LOCAL int  UNIQUE_ID = 0;
 
-// Pointer to current index of definitions table
-int deftabIndex;
+// Unique label format - digits and base of the prefix, and the number of IDs
+// that fit (set through setUniqueLabelFormat)
+int  UNIQUE_LABEL_DIGITS = DEFAULT_UNIQUE_LABEL_DIGITS;
+int  UNIQUE_LABEL_BASE = DEFAULT_UNIQUE_LABEL_BASE;
+int  UNIQUE_LABEL_LIMIT = DEFAULT_UNIQUE_LABEL_BASE * DEFAULT_UNIQUE_LABEL_BASE;
 
 
 // Pointer to current line of input file
-char currentLine [CURRENT_LINE_SIZE];
+THREAD_LOCAL char currentLine [CURRENT_LINE_SIZE];
 
 // Pointers to table structures
-deftab_t * deftab = NULL;
-namtab_t * namtab = NULL;
-argtab_t * argtab = NULL;
+THREAD_LOCAL deftab_t * deftab = NULL;
+THREAD_LOCAL namtab_t * namtab = NULL;
+THREAD_LOCAL argtab_t * argtab = NULL;
 
+// Expansion frame stack - one frame per active macro invocation
+THREAD_LOCAL expstack_t * expstack = NULL;
+
+// Expansion cache - recorded expansions of pure macro invocations
+THREAD_LOCAL expcache_t * expcache = NULL;
+
+// Expansion budgets - limits and usage for the file and for each invocation
+THREAD_LOCAL budget_t * budget = NULL;
+
+// Macro libraries - files to load before processing, from the lowest priority
+// to the highest (see libload.c), and file to write after
+const char * LIBRARY_FILES[MAX_LIBRARY_FILES];
+int NUM_LIBRARY_FILES = 0;
+char * EMIT_LIBRARY_FILE = NULL;
+THREAD_LOCAL library_t * library = NULL;
+
+// Build cache - directory of expanded files kept by content, NULL for none
+char * CACHE_DIR = NULL;
+
+// Symbol table sidecar - pass 1 of the assembler run on the output lines as
+// they are written (see asmpass.c), NULL for none
+char * SYMTAB_FILE = NULL;
+
+// Tokenized output - the output lines with their tokens, opcode classes and
+// input lines, for tools to map (see tokout.c), NULL for none
+char * TOKENS_FILE = NULL;
+
+// Peephole flag - removes the instructions of the output that change nothing
+// (see peephole.c)
+BOOL PEEPHOLE = FALSE;
+
+// Dependency file - written with -MD (named after the output file) or -MF,
+// listing the files read
+BOOL DEPFILE = FALSE;
+char * DEPFILE_NAME = NULL;
+THREAD_LOCAL depfile_t * dependencies = NULL;
+
+// Include search path - directories searched for INCLUDE files (-I), NULL for none
+include_path_t * includePath = NULL;
+
+// Include cache - files read by INCLUDE, kept for every input the process
+// expands and shared by its threads, NULL until include_getCache
+include_cache_t * includeCache = NULL;
+
+// Included files - of the input being processed, each file is included once
+THREAD_LOCAL depfile_t * included = NULL;
+
+// Deferred unique labels - set on the threads of a parallel expansion
+THREAD_LOCAL parallel_labels_t * DEFERRED_LABELS = NULL;
+
+// Watch mode - expands the input again when a file it was made from changes,
+// keeping the state of the last run, NULL when not watching
+BOOL WATCH = FALSE;
+watch_t * watch = NULL;
+
+// Expansion server - socket to serve requests on (--serve), or to send the
+// input to (--connect), NULL for none, and the library for the server to
+// replace its own with (--reload)
+char * SERVE_SOCKET = NULL;
+char * CONNECT_SOCKET = NULL;
+char * RELOAD_LIBRARY = NULL;
+
+// Statistics flag - prints counters to console when done
+BOOL STATS = FALSE;
+
+// Pipelined flag - reads and writes the files on their own threads
+BOOL PIPELINED = FALSE;
+
+// Threads - number of threads for tokenizing and expanding, 1 for none
+int  THREADS = 1;
+
+// Quiet flag - errors are only kept in ERROR_MESSAGE, not printed
+THREAD_LOCAL BOOL QUIET = FALSE;
+
+// First error reported while processing the input
+THREAD_LOCAL char ERROR_MESSAGE[CURRENT_LINE_SIZE];
+
+// Console for errors and statistics - stdout if NULL, stderr when the output
+// is written to stdout
+FILE * MESSAGE_FILE = NULL;
+
+
+
+// The library target (MACROPROC_LIBRARY) is used through macroproc.h, and
+// leaves out the command line
+#ifndef MACROPROC_LIBRARY
 
 /**
 * Function: printUsage
@@ -54,13 +148,454 @@ argtab_t * argtab = NULL;
 void printUsage(void)
 {
 	printf("\nUsage:\n");
-	printf("    -i inputFile (Input file name)\n");
-	printf("    -o outputFile (Output file name)\n");
+	printf("    -i inputFile (Input file name, - for standard input)\n");
+	printf("    -o outputFile (Output file name, - for standard output)\n");
+	printf("    -w digits (Unique label digits, default %d)\n", DEFAULT_UNIQUE_LABEL_DIGITS);
+	printf("    -b base (Unique label base, 2 to 62, default %d: A-Z. 36 adds 0-9, and above 36 a-z follow,\n", DEFAULT_UNIQUE_LABEL_BASE);
+	printf("       so labels that differ only in case, such as $Aa and $AA, clash in assemblers that ignore case)\n");
+	printf("    -l name=limit (Expansion budget for the whole file, 0 for no limit)\n");
+	printf("    -L name=limit (Expansion budget for each invocation, 0 for no limit)\n");
+	printf("       names: lines, loops, deftab, depth, ms (defaults: -L loops=%d -l depth=%d)\n",
+		DEFAULT_INVOCATION_LOOPS, DEFAULT_FILE_DEPTH);
+	printf("    --library file (Load macros before the input file: a library written with --emit-library, or a file of\n");
+	printf("       definitions. Repeat for more files, loaded on the -j threads; a macro of a later file replaces the same\n");
+	printf("       macro of an earlier one)\n");
+	printf("    --emit-library file (Save the macros and SET variables as a precompiled library)\n");
+	printf("    --cache directory (Reuse the output of an earlier run with the same input, library and options)\n");
+	printf("    --symtab file (Run pass 1 of the SIC/XE assembler on the output as it is written, and write the\n");
+	printf("       address of each line, SYMTAB, the literal pool and the instruction formats to this file)\n");
+	printf("    --tokens file (Also write the output lines tokenized, with their opcode classes and input lines, to this\n");
+	printf("       binary file for tools to map; see tokout.h. Expands on one thread)\n");
+	printf("    --peephole (Remove instructions of the output that change nothing, such as a second CLEAR X, or LDA M\n");
+	printf("       after STA M; labels and the targets of * jumps are kept)\n");
+	printf("    -I directory (Search this directory for INCLUDE files, after the current directory)\n");
+	printf("    -MD (Write the files read to a dependency file, named after the output file with .d)\n");
+	printf("    -MF file (Write the dependency file to this file)\n");
+	printf("    --watch (Expand the input again each time a file it was made from changes)\n");
+	printf("    --serve socket (Serve expansion requests on a local socket, -j of them at once)\n");
+	printf("    --connect socket (Send the input to a server to expand, -s for its statistics)\n");
+	printf("    --reload file (With --connect: make the server use this library for the requests from now on)\n");
 	printf("    -v (Verbose mode)\n");
+	printf("    -s (Print statistics when done)\n");
+	printf("    -p (Pipelined: read and write the files on their own threads)\n");
+	printf("    -j threads (Tokenize and expand the input on this many threads, 0 for one per processor)\n");
 	printf("    -t (Unit test mode - will be removed in production code)\n");
 	printf("    -? (Display usage info)\n\n");
 }
 
+/**
+* Function: writeDependencies
+* Description:
+*  - Writes the dependency file of a successful run, and frees the list of
+*    dependencies.
+* Parameters:
+*  - outputFileName - name of the output file, the target of the rule
+*  - result - result of the run
+* Returns:
+* result, or FAILURE if the dependency file could not be written
+*/
+int writeDependencies(const char *outputFileName, int result)
+{
+	char *fileName;
+
+	if (dependencies == NULL || (!DEPFILE && DEPFILE_NAME == NULL))
+	{
+		depfile_free(dependencies);
+		dependencies = NULL;
+		return result;
+	}
+
+	fileName = (DEPFILE_NAME != NULL) ? _strdup(DEPFILE_NAME) : depfile_getName(outputFileName);
+	if (result == SUCCESS && (fileName == NULL || depfile_write(dependencies, fileName, outputFileName) != SUCCESS))
+	{
+		printError("ERROR: Could not write the dependency file %s\n", (fileName != NULL) ? fileName : "");
+		result = FAILURE;
+	}
+
+	free(fileName);
+	depfile_free(dependencies);
+	dependencies = NULL;
+	return result;
+}
+
+/**
+* Function: openOutputPasses
+* Description:
+*  - Starts the passes over the output stream: the peephole optimizer
+*    (--peephole), and the passes that write the sidecar files, pass 1 of the
+*    assembler (--symtab) and the tokenized output (--tokens). The sidecars
+*    are written as the output lines are.
+* Parameters:
+*  - output - the output stream
+* Returns:
+* SUCCESS (0), or FAILURE (-1) if a pass could not be started
+*/
+int openOutputPasses(stream_t *output)
+{
+	FILE *file = NULL;
+
+	if (output == NULL)
+	{
+		return SUCCESS;
+	}
+
+	if (PEEPHOLE)
+	{
+		output->peephole = peephole_alloc(output);
+		if (output->peephole == NULL)
+		{
+			printError("ERROR - %s: Out of memory!\n", __func__);
+			return FAILURE;
+		}
+	}
+
+	if (SYMTAB_FILE != NULL)
+	{
+		if (fopen_s(&file, SYMTAB_FILE, "w") == 0 && file != NULL)
+		{
+			output->asmpass = asmpass_alloc(file);
+			if (output->asmpass == NULL)
+			{
+				fclose(file);
+			}
+		}
+		if (output->asmpass == NULL)
+		{
+			printError("ERROR: Could not write the symbol table %s\n", SYMTAB_FILE);
+			return FAILURE;
+		}
+	}
+
+	// the header of the tokenized output is written last, so it is a file
+	if (TOKENS_FILE != NULL)
+	{
+		file = NULL;
+		if (fopen_s(&file, TOKENS_FILE, "wb") == 0 && file != NULL)
+		{
+			output->tokout = tokout_alloc(file);
+			if (output->tokout == NULL)
+			{
+				fclose(file);
+			}
+		}
+		if (output->tokout == NULL)
+		{
+			printError("ERROR: Could not write the tokenized output %s\n", TOKENS_FILE);
+			return FAILURE;
+		}
+	}
+	return SUCCESS;
+}
+
+/**
+* Function: closeOutputPasses
+* Description:
+*  - Ends the passes over the output stream, and closes the sidecar files.
+*    A run that failed leaves no sidecars.
+* Parameters:
+*  - output - the output stream
+*  - result - result of the run
+* Returns:
+* result, or FAILURE if a sidecar could not be written
+*/
+int closeOutputPasses(stream_t *output, int result)
+{
+	FILE *file;
+
+	if (output == NULL)
+	{
+		return result;
+	}
+
+	peephole_free(output->peephole);
+	output->peephole = NULL;
+	if (output->asmpass != NULL)
+	{
+		file = output->asmpass->file;
+		asmpass_free(output->asmpass);
+		output->asmpass = NULL;
+		if (fclose(file) != 0 && result == SUCCESS)
+		{
+			printError("ERROR: Could not write the symbol table %s\n", SYMTAB_FILE);
+			result = FAILURE;
+		}
+	}
+	if (output->tokout != NULL)
+	{
+		file = output->tokout->file;
+		tokout_free(output->tokout);
+		output->tokout = NULL;
+		if (fclose(file) != 0 && result == SUCCESS)
+		{
+			printError("ERROR: Could not write the tokenized output %s\n", TOKENS_FILE);
+			result = FAILURE;
+		}
+	}
+
+	if (result != SUCCESS)
+	{
+		if (SYMTAB_FILE != NULL)
+		{
+			remove(SYMTAB_FILE);
+		}
+		if (TOKENS_FILE != NULL)
+		{
+			remove(TOKENS_FILE);
+		}
+	}
+	return result;
+}
+
+/**
+* Function: watchInput
+* Description:
+*  - Watch mode: expands the input file, then waits for a file it was made
+*    from (the input, the library or an included file) to change, and
+*    expands it again, until the program is stopped. Each run replays the
+*    invocations that did not change from the expansion cache, and writes
+*    only the part of the output file that changed. A run that fails leaves
+*    the output file as it was.
+* Parameters:
+*  - inputFileName - name of the input file
+*  - outputFileName - name of the output file
+* Returns:
+* FAILURE (-1) when the files can no longer be watched
+*/
+int watchInput(const char *inputFileName, const char *outputFileName)
+{
+	FILE *console = (MESSAGE_FILE != NULL) ? MESSAGE_FILE : stdout;
+	include_file_t *file;
+	stream_t *input;
+	stream_t *output;
+	char *path;
+	int result;
+	int i;
+
+	// the expansion cache kept between runs is the one of this thread
+	THREADS = 1;
+	PIPELINED = FALSE;
+
+	watch = watch_alloc();
+	if (watch == NULL || include_getCache() == NULL)
+	{
+		printError("ERROR: Could not start watch mode\n");
+		watch_free(watch);
+		watch = NULL;
+		return FAILURE;
+	}
+
+	do
+	{
+		watch_begin(watch);
+
+		// the files read by this run are the files to watch
+		dependencies = depfile_alloc();
+		depfile_add(dependencies, inputFileName);
+		for (i = 0; i < NUM_LIBRARY_FILES; i++)
+		{
+			depfile_add(dependencies, LIBRARY_FILES[i]);
+		}
+
+		// the input is kept tokenized like an included file, and only read
+		// again when it changes
+		path = watch_getFullPath(inputFileName);
+		file = (path != NULL) ? include_load(includeCache, path) : NULL;
+		input = (file != NULL) ? stream_allocTokens(file->text, file->size, file->lines, file->numLines) : NULL;
+		if (input != NULL)
+		{
+			input->source = file;
+		}
+		else
+		{
+			include_release(file);
+		}
+		output = stream_allocOutput(NULL, 0);
+		free(path);
+
+		if (NUM_LIBRARY_FILES > 0)
+		{
+			library = libload_open(LIBRARY_FILES, NUM_LIBRARY_FILES, THREADS);
+		}
+
+		result = FAILURE;
+		if (input == NULL)
+		{
+			printError("ERROR: Could not read input file %s\n", inputFileName);
+		}
+		else if (output != NULL && (NUM_LIBRARY_FILES == 0 || library != NULL) && openOutputPasses(output) == SUCCESS)
+		{
+			result = processInput(input, output);
+		}
+		result = closeOutputPasses(output, result);
+
+		if (result == SUCCESS && watch_splice(watch, outputFileName, output) != SUCCESS)
+		{
+			printError("ERROR: Could not write the output\n");
+			result = FAILURE;
+		}
+		if (STATS && result == SUCCESS)
+		{
+			fprintf(console, "    Watch: run %d, %d macros changed, %d invocations affected, output bytes %u to %u written\n",
+				watch->runs, watch->changedMacros, watch->changedSites,
+				(unsigned int) watch->spliceStart, (unsigned int) watch->spliceEnd);
+		}
+
+		watch_setFiles(watch, dependencies);
+		writeDependencies(outputFileName, result);
+		stream_free(input);
+		stream_free(output);
+		library_close(library);
+		library = NULL;
+
+		if (VERBOSE)
+		{
+			printf("WATCH: waiting for %d files to change\n", watch->numFiles);
+		}
+		fflush(console);
+	} while (watch_wait(watch) == SUCCESS);
+
+	printError("ERROR: Could not watch the input files\n");
+	watch_free(watch);
+	watch = NULL;
+	include_cacheFree(includeCache);
+	includeCache = NULL;
+	return FAILURE;
+}
+
+/**
+* Function: connectInput
+* Description:
+*  - Client of an expansion server (--connect): sends the input file to be
+*    expanded, as its path, or inline when it is standard input, and writes
+*    the output file from the response. With --reload, first makes the
+*    server map a new library. With -s, prints the statistics of the server.
+* Parameters:
+*  - inputFileName - name of the input file, NULL for none
+*  - outputFileName - name of the output file
+* Returns:
+* SUCCESS (0) or FAILURE (-1)
+*/
+int connectInput(const char *inputFileName, const char *outputFileName)
+{
+	FILE *console = (MESSAGE_FILE != NULL) ? MESSAGE_FILE : stdout;
+	char header[SERVER_HEADER_SIZE];
+	char *path = NULL;
+	char *body = NULL;
+	char *response = NULL;
+	size_t bodySize = 0;
+	size_t responseSize;
+	FILE *outputFile = NULL;
+	int result;
+
+	if (outputFileName != NULL && strcmp("-", outputFileName) == 0)
+	{
+		MESSAGE_FILE = console = stderr;
+	}
+
+	// requests already being expanded finish with the library they have
+	if (RELOAD_LIBRARY != NULL)
+	{
+		path = watch_getFullPath(RELOAD_LIBRARY);
+		if (path == NULL || strlen(path) + strlen("LIBRARY ") >= sizeof(header))
+		{
+			fprintf(stderr, "Can't find library file %s\n", RELOAD_LIBRARY);
+			free(path);
+			return FAILURE;
+		}
+		sprintf_s(header, sizeof(header), "LIBRARY %s", path);
+		free(path);
+		path = NULL;
+
+		result = server_request(CONNECT_SOCKET, header, NULL, 0, &response, &responseSize);
+		if (response != NULL)
+		{
+			if (result == SUCCESS)
+				fprintf(console, "%s", response);
+			else
+				printError("%s", response);
+		}
+		else
+		{
+			printError("ERROR: Could not reach the server on socket %s\n", CONNECT_SOCKET);
+		}
+		free(response);
+		response = NULL;
+		if (result != SUCCESS || inputFileName == NULL || outputFileName == NULL)
+		{
+			return result;
+		}
+	}
+
+	// the server reads a named file itself, from where it was started
+	if (strcmp("-", inputFileName) == 0)
+	{
+		body = server_readAll(stdin, &bodySize);
+		sprintf_s(header, sizeof(header), "EXPAND %u", (unsigned int) bodySize);
+	}
+	else
+	{
+#ifdef _WIN32
+		path = _fullpath(NULL, inputFileName, 0);
+#else
+		path = realpath(inputFileName, NULL);
+#endif
+		if (path != NULL && strlen(path) + strlen("FILE ") < sizeof(header))
+		{
+			sprintf_s(header, sizeof(header), "FILE %s", path);
+		}
+	}
+	if (body == NULL && path == NULL)
+	{
+		fprintf(stderr, "Can't open input file in main!\n");
+		return FAILURE;
+	}
+
+	result = server_request(CONNECT_SOCKET, header, body, bodySize, &response, &responseSize);
+	if (result == SUCCESS)
+	{
+		if (strcmp("-", outputFileName) == 0)
+		{
+			outputFile = stdout;
+		}
+		else
+		{
+			fopen_s(&outputFile, outputFileName, "w");
+		}
+		if (outputFile == NULL || fwrite(response, 1, responseSize, outputFile) != responseSize ||
+			fflush(outputFile) != 0)
+		{
+			printError("ERROR: Could not write the output\n");
+			result = FAILURE;
+		}
+		if (outputFile != NULL && outputFile != stdout)
+		{
+			fclose(outputFile);
+		}
+	}
+	else if (response != NULL)
+	{
+		printError("%s", response);
+	}
+	else
+	{
+		printError("ERROR: Could not reach the server on socket %s\n", CONNECT_SOCKET);
+	}
+	free(response);
+	free(body);
+	free(path);
+
+	if (STATS && server_request(CONNECT_SOCKET, "STATS", NULL, 0, &response, &responseSize) == SUCCESS)
+	{
+		fprintf(console, "\n%s", response);
+	}
+	if (STATS)
+	{
+		free(response);
+	}
+
+	return result;
+}
+
 /**
 * Function: main
 * Description:
@@ -68,9 +603,22 @@ void printUsage(void)
 *    Prints the information to the user.
 * Parameters:
 * Flags 
-* -i inputFile (required)
-* -o outputFile (required)
+* -i inputFile (required, - for standard input)
+* -o outputFile (required, - for standard output)
+* -w digits (optional - unique label digits)
+* -b base (optional - unique label base)
+* --cache directory (optional - build cache)
+* -I directory (optional - include search path)
+* -MD (optional - dependency file)
+* -MF file (optional - dependency file name)
+* --watch (optional - watch mode)
+* --serve socket (optional - expansion server, no input or output file)
+* --connect socket (optional - client of an expansion server)
+* --reload file (optional - library for the server, -i and -o not required)
 * -v (optional - verbose mode)
+* -s (optional - print statistics)
+* -p (optional - pipelined file I/O)
+* -j threads (optional - parallel tokenizing and expansion)
 * -t (optional - test mode)
 * -? (optional - display usage info)
 * Returns:
@@ -85,25 +633,112 @@ int main(int argc, char* argv[])
 	errno_t rc;
 	FILE *inputFile;
 	FILE *outputFile;
+	stream_t *input = NULL;
+	stream_t *output = NULL;
+	pipeline_t *pipeline = NULL;
+	linetab_t *lines = NULL;
+	filecache_t *cache = NULL;
+	int changed;
+	int i;
 
 	if (VERBOSE)
 		printf("beginning cmpe220 macroprocessor\n");
 
 	/** HANDLE ARGUMENTS **/
+	budget = budget_alloc();
 	result = parseInputCommand(&inputFileName, &outputFileName, argc, argv);
 
 	if (result == FAILURE || argc < 3)
 	{
 		// Break early, if possible
+		budget_free(budget);
+		return result;
+	}
+	else if (SERVE_SOCKET != NULL)
+	{
+		// Server runs until it is stopped
+		result = server_run(SERVE_SOCKET, THREADS);
+		budget_free(budget);
+		include_cacheFree(includeCache);
+		includeCache = NULL;
+		include_pathFree(includePath);
+		return result;
+	}
+	else if (CONNECT_SOCKET != NULL)
+	{
+		result = connectInput(inputFileName, outputFileName);
+		budget_free(budget);
+		include_pathFree(includePath);
+		return result;
+	}
+	else if (WATCH)
+	{
+		// Watch mode runs until the program is stopped
+		result = watchInput(inputFileName, outputFileName);
+		budget_free(budget);
+		include_pathFree(includePath);
 		return result;
 	}
 	else
 	{
+		// Dependencies: the input and library files, and the files included
+		// while processing, for the dependency file and the build cache
+		if (DEPFILE || DEPFILE_NAME != NULL || CACHE_DIR != NULL)
+		{
+			dependencies = depfile_alloc();
+			if (strcmp("-", inputFileName) != 0)
+			{
+				depfile_add(dependencies, inputFileName);
+			}
+			for (i = 0; i < NUM_LIBRARY_FILES; i++)
+			{
+				depfile_add(dependencies, LIBRARY_FILES[i]);
+			}
+		}
+
 		// File I/O
 		////////////////////////////////////////////////////////////////////////////////////////////
-			// Open INPUT file
-		//Output is the last operand (argc-1)
-		rc = fopen_s(&inputFile, inputFileName, "r");
+		// Build cache: an input file expanded before with the same library and
+		// options is copied from the cache, without processing it. Writing a
+		// library or a sidecar is more output than the cache keeps.
+		if (CACHE_DIR != NULL && strcmp("-", inputFileName) != 0 && EMIT_LIBRARY_FILE == NULL &&
+			SYMTAB_FILE == NULL && TOKENS_FILE == NULL)
+		{
+			cache = filecache_open(CACHE_DIR, inputFileName, LIBRARY_FILES, NUM_LIBRARY_FILES);
+		}
+		if (cache != NULL && cache->hit)
+		{
+			for (i = 0; i < cache->includes->size; i++)
+			{
+				depfile_add(dependencies, cache->includes->files[i]);
+			}
+			result = filecache_install(cache->entryFileName, outputFileName, &changed);
+			if (result != SUCCESS)
+			{
+				fprintf(stderr, "Can't write output file in main!\n");
+			}
+			else if (STATS)
+			{
+				fprintf((strcmp("-", outputFileName) == 0) ? stderr : stdout,
+					"\nStatistics:\n    Build cache: hit, output file %s\n", changed ? "written" : "unchanged");
+			}
+			filecache_free(cache);
+			budget_free(budget);
+			include_pathFree(includePath);
+			return writeDependencies(outputFileName, result);
+		}
+
+		// Open INPUT file, "-" reads standard input so the program can run in
+		// a pipeline. Lines are read as they arrive, one at a time.
+		if (strcmp("-", inputFileName) == 0)
+		{
+			inputFile = stdin;
+			setvbuf(stdin, NULL, _IOFBF, STREAM_CHUNK_SIZE);
+		}
+		else
+		{
+			rc = fopen_s(&inputFile, inputFileName, "r");
+		}
 
 		// Error check
 		if (inputFile == NULL) {
@@ -115,9 +750,27 @@ int main(int argc, char* argv[])
 		{
 			printf("input file is opened\n");
 		}
-		// Open OUTPUT file
-		//Output is the last operand (argc-1)
-		rc = fopen_s(&outputFile, outputFileName, "w");
+		// Open OUTPUT file, "-" writes standard output in chunks, and moves the
+		// errors and statistics to stderr. A cache miss is written to a file
+		// in the cache, and copied to the output file when done.
+		if (cache != NULL && (fopen_s(&outputFile, cache->tempFileName, "w") != 0 || outputFile == NULL))
+		{
+			filecache_free(cache);
+			cache = NULL;
+		}
+		if (strcmp("-", outputFileName) == 0)
+		{
+			if (cache == NULL)
+			{
+				outputFile = stdout;
+				setvbuf(stdout, NULL, _IOFBF, STREAM_CHUNK_SIZE);
+			}
+			MESSAGE_FILE = stderr;
+		}
+		else if (cache == NULL)
+		{
+			rc = fopen_s(&outputFile, outputFileName, "w");
+		}
 
 		// Error check
 		if (outputFile == NULL) {
@@ -134,60 +787,203 @@ int main(int argc, char* argv[])
 		//free(inputFileName);
 		//free(outputFileName);
 
+		// map the precompiled macros, or process the files of definitions on
+		// threads and merge them; processInput enters the macros on first use
+		if (NUM_LIBRARY_FILES > 0)
+		{
+			library = libload_open(LIBRARY_FILES, NUM_LIBRARY_FILES, THREADS);
+		}
+
 		// MACROPROCESSOR LOOP
 		///////////////////////////////////////////////////////////////////
- 		EXPANDING = FALSE;
-        argtab = argtab_alloc();
-        deftab = deftab_alloc();
-        namtab = namtab_alloc();
+		// the input file is mapped and tokenized ahead on worker threads, if
+		// it can be mapped; otherwise it is read as usual
+		if (THREADS > 1 && inputFile != stdin)
+		{
+			lines = linetab_open(inputFileName, THREADS);
+		}
 
-		// reset result
+		if (PIPELINED)
+		{
+			// reading and writing overlap the expansion, output order is kept
+			pipeline = pipeline_start((lines == NULL) ? inputFile : NULL, outputFile);
+			if (pipeline == NULL)
+			{
+				printError("ERROR: Could not start the reader and writer threads\n");
+			}
+			input = (lines != NULL) ? stream_allocLines(lines) : stream_allocPipeline(pipeline);
+			output = stream_allocPipeline(pipeline);
+		}
+		else
+		{
+			input = (lines != NULL) ? stream_allocLines(lines) : stream_allocFile(inputFile);
+			output = stream_allocFile(outputFile);
+		}
 		result = FAILURE;
+		if (input != NULL && output != NULL && (NUM_LIBRARY_FILES == 0 || library != NULL) &&
+			openOutputPasses(output) == SUCCESS)
+		{
+			result = processInput(input, output);
+		}
+
+		// CLEANUP
+		////////////////////////////////////////////////////////////////////////////
+		if (pipeline != NULL && pipeline_finish(pipeline) != SUCCESS && result == SUCCESS)
+		{
+			printError("ERROR: Could not read the input or write the output\n");
+			result = FAILURE;
+		}
+		if (lines != NULL && lines->failed && result == SUCCESS)
+		{
+			printError("ERROR: Could not tokenize the input\n");
+			result = FAILURE;
+		}
+		result = closeOutputPasses(output, result);
+		linetab_close(lines);
+		stream_free(input);
+		stream_free(output);
+		budget_free(budget);
+		library_close(library);
+		include_cacheFree(includeCache);
+		includeCache = NULL;
+		include_pathFree(includePath);
+
+		// Close Files, standard streams stay open but must be flushed
+		if (inputFile != stdin)
+		{
+			fclose(inputFile);
+		}
+		if (outputFile != stdout)
+		{
+			fclose(outputFile);
+		}
+		else if (fflush(stdout) != 0 && result == SUCCESS)
+		{
+			printError("ERROR: Could not write the output\n");
+			result = FAILURE;
+		}
 
-		do
+		// a miss goes to the output file, and is kept if it was expanded
+		if (cache != NULL)
 		{
-			//Getline will fill currentLine buffer
-			getline(inputFile);
-
-			if(VERBOSE)
-			{
-				printf("currentLine is %s", currentLine);
-			}
-			
-			// Error check
-			/*if (currentLine[0] == '\0')
-				printf("ERROR in getLine\n");
-				break;*/
-
-			result = processLine(inputFile, outputFile, currentLine);
-
-			if (result != SUCCESS)
+			if (filecache_install(cache->tempFileName, outputFileName, NULL) != SUCCESS && result == SUCCESS)
 			{
-				printf("ERROR in processLine\n");
+				printError("ERROR: Could not write the output\n");
 				result = FAILURE;
-				break;
 			}
+			filecache_store(cache, result == SUCCESS, dependencies);
+			filecache_free(cache);
+		}
 
-		}while(strncmp("END", OPCODE, strlen("END")) != 0);
+		return writeDependencies(outputFileName, result);
+	}
 
-		// CLEANUP
-		////////////////////////////////////////////////////////////////////////////
+	return SUCCESS;
+}
 
-        // de-allocate data structures
-        namtab_free(namtab);
-        deftab_free(deftab);
-        argtab_free(argtab);
+#endif // MACROPROC_LIBRARY
 
-		// Close Files
-		fclose(inputFile);
-		fclose(outputFile);
+/**
+* Function: printStatistics
+* Description:
+*  - Prints the counters collected while processing the input file.
+* Parameters:
+*  - outputFile - the output stream
+* Returns:
+*  - none
+*/
+void printStatistics(stream_t * outputFile)
+{
+	int i;
+	int hits = 0;
+	int misses = 0;
+	int size = 0;
+	expcache_t * variants;
+	FILE * console = (MESSAGE_FILE != NULL) ? MESSAGE_FILE : stdout;
+
+	fprintf(console, "\nStatistics:\n");
+	fprintf(console, "    Macro invocations: %d\n", UNIQUE_ID);
+	if(library != NULL && library->header != NULL)
+	{
+		fprintf(console, "    Library macros: %ld of %u loaded\n", THREAD_LOAD(&library->numLoaded), library->header->numMacros);
+		if(library->numFiles > 1)
+		{
+			fprintf(console, "    Library files: %d merged, %d macros replaced by a later file\n",
+				library->numFiles, library->numReplaced);
+		}
+	}
+	if(expcache != NULL)
+	{
+		fprintf(console, "    Expansion cache: %d hits, %d misses, %d entries\n",
+			expcache->hits, expcache->misses, expcache->size);
+	}
+	if(includeCache != NULL)
+	{
+		fprintf(console, "    Include cache: %ld hits, %ld misses\n", THREAD_LOAD(&includeCache->hits), THREAD_LOAD(&includeCache->misses));
+	}
 
-		return result;
+	for(i = 0; i < namtab->size; i++)
+	{
+		variants = namtab->array[i]->variants;
+		if(variants != NULL)
+		{
+			hits += variants->hits;
+			misses += variants->misses;
+			size += variants->size;
+		}
 	}
+	fprintf(console, "    Specialized variants: %d hits, %d misses, %d variants\n", hits, misses, size);
+	fprintf(console, "    Macro definitions: %d, %d redefined, DEFTAB %d lines (%d free, %d reused)\n",
+		namtab->size, namtab->redefinitions, deftab->size, deftab->freeLines, deftab->reusedLines);
 
-	return SUCCESS;
+	if(expstack != NULL)
+	{
+		fprintf(console, "    WHILE body lines: %d reused, %d substituted\n",
+			expstack->renderHits, expstack->renderMisses);
+	}
+	if(outputFile != NULL && outputFile->asmpass != NULL)
+	{
+		fprintf(console, "    Pass 1: program length %06X, %d symbols, %d literals, formats 1/2/3/4 %d/%d/%d/%d, %d errors\n",
+			outputFile->asmpass->endAddress - outputFile->asmpass->startAddress, outputFile->asmpass->numSymbols,
+			outputFile->asmpass->numLiterals, outputFile->asmpass->formats[1], outputFile->asmpass->formats[2],
+			outputFile->asmpass->formats[3], outputFile->asmpass->formats[4], outputFile->asmpass->numErrors);
+	}
+	if(outputFile != NULL && outputFile->peephole != NULL)
+	{
+		fprintf(console, "    Peephole: %d lines (%d bytes) removed, %d jumps adjusted, %d warnings;",
+			outputFile->peephole->numRemoved, outputFile->peephole->bytesRemoved,
+			outputFile->peephole->numAdjusted, outputFile->peephole->numUnsafe);
+		for(i = 0; i < PEEPHOLE_RULES; i++)
+		{
+			fprintf(console, " %s %d", peephole_getRuleName(i), outputFile->peephole->hits[i]);
+		}
+		fprintf(console, "\n");
+	}
+	if(outputFile != NULL && outputFile->tokout != NULL)
+	{
+		fprintf(console, "    Tokenized output: %u lines, %u origins, %d comments, %d instructions, %d data, %d directives, %d other\n",
+			outputFile->tokout->numLines, outputFile->tokout->numOrigins, outputFile->tokout->classes[TOKOUT_CLASS_COMMENT],
+			outputFile->tokout->classes[TOKOUT_CLASS_FORMAT1] + outputFile->tokout->classes[TOKOUT_CLASS_FORMAT2] +
+			outputFile->tokout->classes[TOKOUT_CLASS_FORMAT3] + outputFile->tokout->classes[TOKOUT_CLASS_FORMAT4],
+			outputFile->tokout->classes[TOKOUT_CLASS_DATA], outputFile->tokout->classes[TOKOUT_CLASS_DIRECTIVE],
+			outputFile->tokout->classes[TOKOUT_CLASS_OTHER]);
+	}
+
+	// how close the file came to its limits
+	if(budget != NULL)
+	{
+		budget_checkTime(budget);
+		for(i = 0; i < BUDGET_KINDS; i++)
+		{
+			fprintf(console, "    Budget %-6s: %lld per file (limit %d), %lld peak per invocation (limit %d)\n",
+				budget_getName(i), budget->fileUsed[i], budget->fileLimit[i],
+				budget->invocationPeak[i], budget->invocationLimit[i]);
+		}
+	}
 }
 
+#ifndef MACROPROC_LIBRARY
+
 /**
 * Function: parseInputCommand
 * Description:
@@ -207,6 +1003,8 @@ int main(int argc, char* argv[])
 int parseInputCommand(char **inputFileName, char **outputFileName, int argc, char * argv[])
 {
 	int i;
+	int labelDigits = UNIQUE_LABEL_DIGITS;
+	int labelBase = UNIQUE_LABEL_BASE;
 
 	if(argc <= 1)
 	{
@@ -236,6 +1034,33 @@ int parseInputCommand(char **inputFileName, char **outputFileName, int argc, cha
 			{
 				VERBOSE = TRUE;
 			}
+			else if(strcmp("-s", argv[i]) == 0)
+			{
+				STATS = TRUE;
+			}
+			else if(strcmp("-p", argv[i]) == 0)
+			{
+				PIPELINED = TRUE;
+			}
+			else if(strcmp("-j", argv[i]) == 0)
+			{
+				// must also be followed by a number of threads
+				if(i+1 < argc && atoi(argv[i+1]) >= 0)
+				{
+					THREADS = atoi(argv[i+1]);
+					if(THREADS == 0)
+					{
+						THREADS = thread_countProcessors();
+					}
+					i++;
+				}
+				else
+				{
+					// bad arguments - print usage
+					printUsage();
+					return FAILURE;
+				}
+			}
 			else if(strcmp("-i", argv[i]) == 0)
 			{
 				// must also be followed by input file name
@@ -267,6 +1092,157 @@ int parseInputCommand(char **inputFileName, char **outputFileName, int argc, cha
 					return FAILURE;
 				}
 			}
+			else if(strcmp("--library", argv[i]) == 0 || strcmp("--emit-library", argv[i]) == 0)
+			{
+				// must also be followed by library file name
+				if(i+1 < argc && (strcmp("--library", argv[i]) != 0 || NUM_LIBRARY_FILES < MAX_LIBRARY_FILES))
+				{
+					if(strcmp("--library", argv[i]) == 0)
+						LIBRARY_FILES[NUM_LIBRARY_FILES++] = argv[i+1];
+					else
+						EMIT_LIBRARY_FILE = argv[i+1];
+					i++;
+				}
+				else
+				{
+					// bad arguments - print usage
+					printUsage();
+					return FAILURE;
+				}
+			}
+			else if(strcmp("-I", argv[i]) == 0)
+			{
+				// must also be followed by a directory
+				if(includePath == NULL)
+				{
+					includePath = include_pathAlloc();
+				}
+				if(i+1 < argc && include_addDir(includePath, argv[i+1]) == SUCCESS)
+				{
+					i++;
+				}
+				else
+				{
+					// bad arguments - print usage
+					printUsage();
+					return FAILURE;
+				}
+			}
+			else if(strcmp("-MD", argv[i]) == 0)
+			{
+				DEPFILE = TRUE;
+			}
+			else if(strcmp("-MF", argv[i]) == 0)
+			{
+				// must also be followed by the dependency file name
+				if(i+1 < argc)
+				{
+					i++;
+					DEPFILE_NAME = argv[i];
+				}
+				else
+				{
+					// bad arguments - print usage
+					printUsage();
+					return FAILURE;
+				}
+			}
+			else if(strcmp("--watch", argv[i]) == 0)
+			{
+				WATCH = TRUE;
+			}
+			else if(strcmp("--peephole", argv[i]) == 0)
+			{
+				PEEPHOLE = TRUE;
+			}
+			else if(strcmp("--serve", argv[i]) == 0 || strcmp("--connect", argv[i]) == 0 ||
+				strcmp("--reload", argv[i]) == 0)
+			{
+				// must also be followed by the socket or library name
+				if(i+1 < argc)
+				{
+					if(strcmp("--serve", argv[i]) == 0)
+						SERVE_SOCKET = argv[i+1];
+					else if(strcmp("--connect", argv[i]) == 0)
+						CONNECT_SOCKET = argv[i+1];
+					else
+						RELOAD_LIBRARY = argv[i+1];
+					i++;
+				}
+				else
+				{
+					// bad arguments - print usage
+					printUsage();
+					return FAILURE;
+				}
+			}
+			else if(strcmp("--cache", argv[i]) == 0)
+			{
+				// must also be followed by the cache directory
+				if(i+1 < argc)
+				{
+					i++;
+					CACHE_DIR = argv[i];
+				}
+				else
+				{
+					// bad arguments - print usage
+					printUsage();
+					return FAILURE;
+				}
+			}
+			else if(strcmp("--symtab", argv[i]) == 0 || strcmp("--tokens", argv[i]) == 0)
+			{
+				// must also be followed by the sidecar file name
+				if(i+1 < argc)
+				{
+					if(strcmp("--symtab", argv[i]) == 0)
+						SYMTAB_FILE = argv[i+1];
+					else
+						TOKENS_FILE = argv[i+1];
+					i++;
+				}
+				else
+				{
+					// bad arguments - print usage
+					printUsage();
+					return FAILURE;
+				}
+			}
+			else if(strcmp("-l", argv[i]) == 0 || strcmp("-L", argv[i]) == 0)
+			{
+				// must also be followed by name=limit
+				if(i+1 < argc && budget_setLimit(budget, argv[i+1], strcmp("-L", argv[i]) == 0) == SUCCESS)
+				{
+					i++;
+				}
+				else
+				{
+					// bad arguments - print usage
+					printError("ERROR: %s needs name=limit, with a limit of 0 or more digits: %s\n",
+						argv[i], (i+1 < argc) ? argv[i+1] : "(none)");
+					printUsage();
+					return FAILURE;
+				}
+			}
+			else if(strcmp("-w", argv[i]) == 0 || strcmp("-b", argv[i]) == 0)
+			{
+				// must also be followed by a number
+				if(i+1 < argc)
+				{
+					if(strcmp("-w", argv[i]) == 0)
+						labelDigits = atoi(argv[i+1]);
+					else
+						labelBase = atoi(argv[i+1]);
+					i++;
+				}
+				else
+				{
+					// bad arguments - print usage
+					printUsage();
+					return FAILURE;
+				}
+			}
 			else // unrecognized options
 			{
 				printUsage();
@@ -274,13 +1250,36 @@ int parseInputCommand(char **inputFileName, char **outputFileName, int argc, cha
 			}
 		}
 
-		// make sure we have input and output files defined
-		if(inputFileName == NULL || outputFileName == NULL)
+		// make sure we have input and output files defined, the server gets
+		// them with each request, and a client may only replace its library
+		if(SERVE_SOCKET == NULL && (CONNECT_SOCKET == NULL || RELOAD_LIBRARY == NULL) &&
+		   (*inputFileName == NULL || *outputFileName == NULL))
+		{
+			printUsage();
+			return FAILURE;
+		}
+
+		// standard output has no name to put a .d after
+		if(DEPFILE && DEPFILE_NAME == NULL && *outputFileName != NULL && strcmp("-", *outputFileName) == 0)
+		{
+			printUsage();
+			return FAILURE;
+		}
+
+		// watch mode reads the input and rewrites the output, both files
+		if(WATCH && (*inputFileName == NULL || *outputFileName == NULL ||
+		   strcmp("-", *inputFileName) == 0 || strcmp("-", *outputFileName) == 0))
 		{
 			printUsage();
 			return FAILURE;
 		}
 
+		if(setUniqueLabelFormat(labelBase, labelDigits) != SUCCESS)
+		{
+			printError("ERROR: Unique labels need 1 to %d digits in a base from 2 to 62.\n", MAX_UNIQUE_LABEL_DIGITS);
+			return FAILURE;
+		}
+
 	
 	}
 
@@ -288,10 +1287,43 @@ int parseInputCommand(char **inputFileName, char **outputFileName, int argc, cha
 }
 
 
-char* getline(FILE * inputFile)
+#endif // MACROPROC_LIBRARY
+
+/**
+* Function: printError
+* Description:
+*  - Reports an error. The first error is kept in ERROR_MESSAGE for callers
+*    of the library API, and errors are printed unless QUIET is set.
+* Parameters:
+*  - format - printf format of the message, followed by its arguments.
+* Returns:
+*  - none
+*/
+void printError(const char * format, ...)
+{
+	char message[CURRENT_LINE_SIZE];
+	va_list args;
+
+	va_start(args, format);
+	_vsnprintf_s(message, sizeof(message), _TRUNCATE, format, args);
+	va_end(args);
+
+	if (ERROR_MESSAGE[0] == '\0')
+	{
+		strcpy_s(ERROR_MESSAGE, sizeof(ERROR_MESSAGE), message);
+	}
+
+	if (!QUIET)
+	{
+		fprintf((MESSAGE_FILE != NULL) ? MESSAGE_FILE : stdout, "%s", message);
+	}
+}
+
+char* getline(stream_t * inputFile)
 {
 	char * line = NULL;
 	char * argtab_val = NULL; 
+	expstack_frame_t * frame = NULL;
 
 	// Error check
 	if (inputFile == NULL) {
@@ -299,10 +1331,12 @@ char* getline(FILE * inputFile)
 		return NULL;
 	}
 
-	if(EXPANDING)
+	if(EXPANDING && (frame = expstack_top(expstack)) != NULL)
 	{	
-		// get next line of macro definition from DEFTAB
-		line = deftab_get(deftab, deftabIndex);
+		// get next line of macro definition from DEFTAB, at the cursor of the
+		// innermost invocation
+		frame->lineIndex = frame->cursor;
+		line = deftab_get(deftab, frame->cursor++);
 		strcpy_s(currentLine, sizeof(currentLine), line);
 
 		// substitute arguments from ARGTAB with values 
@@ -313,8 +1347,12 @@ char* getline(FILE * inputFile)
 	}
 	else
 	{
-		// read next line from input file;
-		fgets(currentLine,sizeof(currentLine),inputFile);
+		// read next line from input file, NULL at the end of the input
+		if (stream_gets(inputFile, currentLine, sizeof(currentLine)) == NULL)
+		{
+			currentLine[0] = '\0';
+			return NULL;
+		}
 	}
 
 	return currentLine;
@@ -425,7 +1463,8 @@ void strReplace(char * string, size_t bufsize, const char * replace, const char
 			}
 			// Get index value
 			arrayEndPtr = strpbrk(arrayIndexPtr, "]");
-			strncpy_s(arrayIndexBuffer, ARGTAB_STRING_SIZE, ++arrayIndexPtr, (arrayEndPtr - arrayIndexPtr));
+			arrayIndexPtr++;
+			strncpy_s(arrayIndexBuffer, ARGTAB_STRING_SIZE, arrayIndexPtr, (arrayEndPtr - arrayIndexPtr));
 
 			if (*arrayIndexBuffer == '&')
 			{
@@ -472,18 +1511,19 @@ void strReplace(char * string, size_t bufsize, const char * replace, const char
 *    pending labels that need to be included in expanded macro lines. Also takes
 *    care of any post-line processing, such as unique label generation.
 * Parameters:
-*  - outputFile - FILE pointer to output file.
+*  - outputFile - Output stream.
 *  - line - Pointer to line of code that will be printed.
 * Returns:
 *  - SUCCESS if printed
 *  - FAILURE if line == NULL, or outputFile is null
 */
-int printOutputLine(FILE * outputFile, char * line)
+int printOutputLine(stream_t * outputFile, char * line)
 {
 	int result = FAILURE;
     parse_info_t * parseInfo = NULL;
     char tmpLine[CURRENT_LINE_SIZE];
-    char uniquePrefix[UNIQUE_LABEL_DIGITS + 2];
+    expstack_frame_t * frame;
+    int labelCount = 0;
     if(outputFile != NULL && line != NULL)
     {
         parseInfo = parse_info_alloc();
@@ -503,23 +1543,34 @@ int printOutputLine(FILE * outputFile, char * line)
         // check if we need to include a label in an expanded line
         if(parseInfo->isComment == FALSE && EXPAND_LABEL == TRUE)
         {
-            fprintf(outputFile, EXPANDED_LABEL);
+            stream_puts(outputFile, EXPANDED_LABEL);
             line += strlen(EXPANDED_LABEL);
-            fprintf(outputFile, line);
+            stream_puts(outputFile, line);
             memset(EXPANDED_LABEL, 0, sizeof(EXPANDED_LABEL));
             EXPAND_LABEL = FALSE;
         }
         else // just print the line
         {
-            // unique label generation
             strcpy_s(tmpLine, sizeof(tmpLine), line);
-            memset(uniquePrefix, 0, sizeof(uniquePrefix));
-            getUniquePrefix(UNIQUE_ID, uniquePrefix, sizeof(uniquePrefix));
-			strReplace(tmpLine, sizeof(tmpLine), "$", uniquePrefix, FALSE);
-			if(tmpLine[strlen(tmpLine)-1] == '\n')
-				fprintf(outputFile, "%s", tmpLine);
-			else
-				fprintf(outputFile, "%s\n", tmpLine);
+
+            // unique label generation - only for macro body lines that had
+            // '$' markers when the macro was defined
+            frame = expstack_top(expstack);
+            if(frame != NULL)
+            {
+                labelCount = deftab_getLabelCount(deftab, frame->lineIndex);
+                result = emitFrameLine(outputFile, frame, tmpLine, sizeof(tmpLine), labelCount);
+            }
+            else
+            {
+                result = writeExpandedLine(outputFile, tmpLine, sizeof(tmpLine), 0, UNIQUE_ID, NULL);
+            }
+
+            if(result != SUCCESS)
+            {
+                parse_info_free(parseInfo);
+                return FAILURE;
+            }
         }
         parse_info_free(parseInfo);
 		return SUCCESS;
@@ -527,27 +1578,155 @@ int printOutputLine(FILE * outputFile, char * line)
 	return result;
 }
 
+/**
+* Function: writeExpandedLine
+* Description:
+*  - Stamps the unique label prefix of an invocation into a line and writes
+*    it to the output file, ending it with a newline.
+* Parameters:
+*  - outputFile - Output stream.
+*  - line - Line to write. Stamped in place.
+*  - bufsize - Size of the line buffer.
+*  - labelCount - Number of '$' markers to stamp, from DEFTAB.
+*  - uniqueId - Invocation ID used for the prefix.
+*  - macroName - Name of the macro being expanded, for error messages.
+* Returns:
+*  - SUCCESS, or FAILURE if the invocation ID does not fit in the configured
+*    unique label digits.
+*/
+int writeExpandedLine(stream_t * outputFile, char * line, size_t bufsize, int labelCount, int uniqueId, const char * macroName)
+{
+    char uniquePrefix[MAX_UNIQUE_LABEL_DIGITS + 2];
+
+    // threads of a parallel expansion do not know the IDs before their region
+    if(labelCount > 0 && DEFERRED_LABELS != NULL)
+    {
+        return parallel_deferLabels(DEFERRED_LABELS, outputFile, line, bufsize, labelCount, uniqueId);
+    }
+
+    if(labelCount > 0)
+    {
+        if(getUniquePrefix(uniqueId, uniquePrefix, sizeof(uniquePrefix)) != SUCCESS)
+        {
+            printError("ERROR: Macro %s invocation %d needs more than %d unique label digits (see -w and -b).\n",
+                macroName, uniqueId, UNIQUE_LABEL_DIGITS);
+            return FAILURE;
+        }
+        stampUniqueLabels(line, bufsize, uniquePrefix, labelCount);
+    }
+
+	stream_puts(outputFile, line);
+	if(line[strlen(line)-1] != '\n')
+		stream_puts(outputFile, "\n");
+
+    return SUCCESS;
+}
+
+/**
+* Function: setUniqueLabelFormat
+* Description:
+*  - Sets the number of digits and the base used for unique label prefixes.
+*    Digits are taken from "A-Z", then "0-9", then "a-z", so base 26 (the
+*    default) gives the original two-letter prefixes and every base agrees on
+*    the first 26 IDs. Bases above 36 use lowercase digits, and their labels
+*    only stay distinct for an assembler that tells case apart.
+* Parameters:
+*  - base: Number of distinct digits, 2 to 62.
+*  - digits: Number of digits after the '$', 1 to MAX_UNIQUE_LABEL_DIGITS.
+* Returns:
+*  - SUCCESS, or FAILURE if base or digits are out of range.
+*/
+int setUniqueLabelFormat(int base, int digits)
+{
+    int i;
+    int limit = 1;
+
+    if(base < 2 || base > (int)(sizeof(UNIQUE_LABEL_ALPHABET) - 1) ||
+       digits < 1 || digits > MAX_UNIQUE_LABEL_DIGITS)
+    {
+        return FAILURE;
+    }
+
+    // number of distinct prefixes, clamped to the range of UNIQUE_ID
+    for(i = 0; i < digits; i++)
+    {
+        limit = (limit > INT_MAX / base) ? INT_MAX : limit * base;
+    }
+
+    UNIQUE_LABEL_BASE = base;
+    UNIQUE_LABEL_DIGITS = digits;
+    UNIQUE_LABEL_LIMIT = limit;
+    return SUCCESS;
+}
+
 /**
 * Function: getUniquePrefix
 * Description:
 *  - Given an integer representing a unique ID, returns the corresponding
-*    unique label prefix, a two-letter identifier.
+*    unique label prefix: '$' followed by UNIQUE_LABEL_DIGITS digits in
+*    UNIQUE_LABEL_BASE. Digits are written right to left from a lookup table.
 * Parameters:
 *  - id: Unique identifier in decimal form.
 *  - prefix: Pointer to string buffer for result
 *  - bufferSize: Size of the string buffer
 * Returns:
+*  - SUCCESS, or FAILURE if the ID does not fit in the configured number of
+*    digits or the buffer is too small.
+*/
+int getUniquePrefix(int id, char * prefix, size_t bufferSize)
+{
+    static const char alphabet[] = UNIQUE_LABEL_ALPHABET;
+    int i;
+
+    if(prefix == NULL || id < 0 || id >= UNIQUE_LABEL_LIMIT ||
+       bufferSize < (size_t)(UNIQUE_LABEL_DIGITS + 2))
+    {
+        return FAILURE;
+    }
+
+    prefix[0] = '$';
+    for(i = UNIQUE_LABEL_DIGITS; i > 0; i--)
+    {
+        prefix[i] = alphabet[id % UNIQUE_LABEL_BASE];
+        id /= UNIQUE_LABEL_BASE;
+    }
+    prefix[UNIQUE_LABEL_DIGITS + 1] = '\0';
+
+    return SUCCESS;
+}
+
+/**
+* Function: stampUniqueLabels
+* Description:
+*  - Inserts the digits of a unique label prefix after the first count '$'
+*    markers in the line, in place.
+* Parameters:
+*  - line: Line to stamp. Result will be written here too.
+*  - bufsize: Size of the line buffer.
+*  - prefix: Prefix from getUniquePrefix, including the leading '$'.
+*  - count: Number of markers recorded in DEFTAB for this line.
+* Returns:
 *  - none
 */
-void getUniquePrefix(int id, char * prefix, size_t bufferSize)
+void stampUniqueLabels(char * line, size_t bufsize, const char * prefix, int count)
 {
-    char digit1 = 'A';
-    char digit2 = 'A';
-    if(id >= 0 && id < MAX_UNIQUE_LABELS && prefix != NULL)
+    char * marker = line;
+    size_t digits = strlen(prefix) - 1;
+    size_t length = strlen(line);
+
+    while(count-- > 0 && (marker = strchr(marker, '$')) != NULL)
     {
-        digit1 += (id / 26);
-        digit2 += (id % 26);
-        sprintf_s(prefix, bufferSize, "$%c%c", digit1, digit2);
+        if(length + digits >= bufsize)
+        {
+            // no room left, same as strReplace truncating
+            break;
+        }
+
+        marker++;
+        memmove(marker + digits, marker, length - (marker - line) + 1);
+        memcpy(marker, prefix + 1, digits);
+        marker += digits;
+        length += digits;
     }
 }
 
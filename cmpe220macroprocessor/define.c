@@ -21,12 +21,34 @@
 #include "definitions.h"
 #include "parser.h"
 
+// Lines of a definition, entered into DEFTAB together once MEND is read
+typedef struct
+{
+	char **	lines;
+	int *	loopDepths;
+	int		size;
+	int		capacity;
+} definition_t;
+
+// local function definitions
+int addDefinitionLine(definition_t * body, const char * line, int loopDepth);
+void freeDefinition(definition_t * body);
+int getLineEffects(parse_info_t * parse_info, argtab_t * params);
+void getControlParameters(parse_info_t * parse_info, argtab_t * params, argtab_t * found);
+char * joinParameters(const char * prototype, argtab_t * found, int isFound);
+
 /**
 * Function: define
 * Description:
 *  - Handles the definitions of macros. Enters information into NAMTAB and
 *    DEFTAB. Substitutes positional notation for parameters. Also, handles
-*    recursive MACRO declarations.
+*    recursive MACRO declarations. Records the effects of the body in the
+*    NAMTAB entry, so pure invocations can be served from the expansion cache,
+*    and splits the parameters of macros with IF/WHILE into the ones feeding
+*    control flow (static) and the ones only spliced into lines (dynamic).
+*  - A macro defined again (a nested definition, on each invocation of the
+*    macro around it) replaces its entry, and the lines of the old
+*    definition are reused once no invocation is expanding it.
 * Parameters:
 *  - inputFile: File pointer to the already open input file.
 *  - outputFile: File pointer to the already open outputfile.
@@ -35,12 +57,16 @@
 * Returns:
 *  - If successful, returns SUCCESS. Otherwise, returns FAILURE.
 */
-int define(FILE * inputFile, FILE * outputFile, const char * macroLine)
+int define(stream_t * inputFile, stream_t * outputFile, const char * macroLine)
 {
 	parse_info_t * parse_info = NULL;
 	namtab_entry_t * namtab_entry = NULL;
+	definition_t body;
 	int index = 0;
+	int existing = -1;
 	int level = 1;
+	int loopDepth = 0;
+	int deftabSize;
 	int i = 0;
 	const char argDelim[] = ", ";
 	char * params = NULL;
@@ -48,29 +74,34 @@ int define(FILE * inputFile, FILE * outputFile, const char * macroLine)
 	char * nextToken = NULL;
 	char * tmpString;
     char * currLine;
+	argtab_t * parameters = NULL;
+	argtab_t * controlParameters = NULL;
+	char * prototype = NULL;
+	char key[ARGTAB_STRING_SIZE];
+	char value[ARGTAB_STRING_SIZE];
 
 	if(argtab == NULL || deftab == NULL || namtab == NULL)
 	{
 		// data structures not initialized
-		printf("ERROR - %s: Data structures not initialized!\n", __func__);
+		printError("ERROR - %s: Data structures not initialized!\n", __func__);
 		return FAILURE;
 	}
 	else if(inputFile == NULL || outputFile == NULL)
 	{
 		// bad file pointers
-		printf("ERROR - %s: Bad file pointer!\n", __func__);
+		printError("ERROR - %s: Bad file pointer!\n", __func__);
 		return FAILURE;
 	}
 	else if(macroLine == NULL)
 	{
 		// null string for macro line
-		printf("ERROR - %s: Null string for macro line!\n", __func__);
+		printError("ERROR - %s: Null string for macro line!\n", __func__);
 		return FAILURE;
 	}
 
 	// parse the macro line
 	parse_info = parse_info_alloc();
-	if(parse_line(parse_info, macroLine) != 0)
+	if(parse_inputLine(parse_info, macroLine, inputFile) != 0)
 	{
 		// something went wrong
 		parse_info_free(parse_info);
@@ -80,7 +111,7 @@ int define(FILE * inputFile, FILE * outputFile, const char * macroLine)
 	// make sure we're dealing with a macro definition line
 	if(parse_info->opcode == NULL || parse_info->label == NULL || strncmp("MACRO", parse_info->opcode, strlen("MACRO")) != 0)
 	{
-		printf("ERROR: Invalid macro definition:\n%s\n\n", macroLine);
+		printError("ERROR: Invalid macro definition:\n%s\n\n", macroLine);
 		parse_info_free(parse_info);
 		return FAILURE;
 	}
@@ -88,28 +119,96 @@ int define(FILE * inputFile, FILE * outputFile, const char * macroLine)
 	// enter the macro name into NAMTAB
 	index = namtab_add(namtab, parse_info->label, 0, 0); // use 0 indices for now
 	namtab_entry = namtab_getIndex(namtab, index);
+	if(namtab_entry == NULL)
+	{
+		printError("ERROR - %s: Out of memory!\n", __func__);
+		parse_info_free(parse_info);
+		return FAILURE;
+	}
+
+	// the lines are entered into DEFTAB once MEND is read, so library macros
+	// entered by the lookups of getLineEffects do not come between them
+	memset(&body, 0, sizeof(body));
 
-	// enter macro prototype into DEFTAB
-	namtab_entry->deftabStart = deftab_add(deftab, macroLine);
+	// enter macro prototype
+	if(addDefinitionLine(&body, macroLine, 0) != SUCCESS)
+	{
+		printError("ERROR - %s: Out of memory!\n", __func__);
+		parse_info_free(parse_info);
+		freeDefinition(&body);
+		return FAILURE;
+	}
+
+	// collect parameter names, to tell them apart from SET variables in the body
+	parameters = argtab_alloc();
+	controlParameters = argtab_alloc();
+	if(parse_info->operators != NULL)
+	{
+		prototype = _strdup(parse_info->operators);
+		tmpString = _strdup(parse_info->operators);
+		token = strtok_s(tmpString, argDelim, &nextToken);
+		while(token != NULL)
+		{
+			splitKeyValuePair(token, key, sizeof(key), value, sizeof(value));
+			argtab_add(parameters, key, "");
+			token = strtok_s(NULL, argDelim, &nextToken);
+		}
+		free(tmpString);
+	}
 
 	while(level > 0)
 	{
 		//  GET Next LINE
 		currLine = getline(inputFile);
+		if(currLine == NULL)
+		{
+			printError("ERROR: Macro %s has no MEND.\n", namtab_entry->symbol);
+			parse_info_free(parse_info);
+			argtab_free(parameters);
+			argtab_free(controlParameters);
+			free(prototype);
+			freeDefinition(&body);
+			return FAILURE;
+		}
 		parse_info_clear(parse_info);
-		if(parse_line(parse_info, currentLine) != SUCCESS)
+		if(parse_inputLine(parse_info, currentLine, inputFile) != SUCCESS)
 		{
 			parse_info_free(parse_info);
+			argtab_free(parameters);
+			argtab_free(controlParameters);
+			free(prototype);
+			freeDefinition(&body);
 			return FAILURE;
 		}
 
 		if(parse_info->isComment == FALSE)
 		{
-			
+			namtab_entry->effects |= getLineEffects(parse_info, parameters);
+			getControlParameters(parse_info, parameters, controlParameters);
+
+			// mark WHILE bodies, so expansion knows which lines are repeated
+			if(parse_info->opcode != NULL && strncmp("WHILE", parse_info->opcode, strlen("WHILE")) == 0)
+			{
+				loopDepth++;
+			}
+
 			// Substitute positional notation for parameters
-			tmpString = _strdup(currentLine);
-			index = deftab_add(deftab, tmpString);
-			free(tmpString);
+			if(addDefinitionLine(&body, currentLine, loopDepth) != SUCCESS)
+			{
+				printError("ERROR - %s: Out of memory!\n", __func__);
+				parse_info_free(parse_info);
+				argtab_free(parameters);
+				argtab_free(controlParameters);
+				free(prototype);
+				freeDefinition(&body);
+				return FAILURE;
+			}
+
+			if(parse_info->opcode != NULL && strncmp("ENDW", parse_info->opcode, strlen("ENDW")) == 0 && loopDepth > 0)
+			{
+				loopDepth--;
+			}
+
 			if(parse_info->opcode != NULL && strncmp("MACRO", parse_info->opcode, strlen("MACRO")) == 0)
 			{
 				level++;
@@ -121,10 +220,349 @@ int define(FILE * inputFile, FILE * outputFile, const char * macroLine)
 		}
 	}
 
-	// store in NAMTAB pointers to beginning and end of definition
-	namtab_entry->deftabEnd = index;
+	// store in NAMTAB pointers to beginning and end of definition, in a
+	// place left by a replaced definition if one is large enough
+	deftabSize = deftab->size;
+	namtab_entry->deftabStart = deftab_addLines(deftab, body.lines, body.loopDepths, body.size);
+	if(namtab_entry->deftabStart < 0)
+	{
+		printError("ERROR - %s: Out of memory!\n", __func__);
+		parse_info_free(parse_info);
+		argtab_free(parameters);
+		argtab_free(controlParameters);
+		free(prototype);
+		freeDefinition(&body);
+		return FAILURE;
+	}
+	namtab_entry->deftabEnd = namtab_entry->deftabStart + body.size - 1;
+	body.size = 0; // the lines belong to DEFTAB now
+	freeDefinition(&body);
+
+	// only the lines that grew DEFTAB count, not those put in a free range
+	if(budget_charge(budget, BUDGET_DEFTAB, deftab->size - deftabSize) != SUCCESS)
+	{
+		budget_report(budget, namtab_entry->symbol, macroLine);
+		parse_info_free(parse_info);
+		argtab_free(parameters);
+		argtab_free(controlParameters);
+		free(prototype);
+		return FAILURE;
+	}
+
+	// a macro defined again replaces the entry found by namtab_get, and its
+	// old expansions. The entry stays at index: lines of the body only add
+	// entries after it (library macros they refer to).
+	existing = namtab_find(namtab, namtab_entry->symbol);
+	if(existing >= 0 && existing != index)
+	{
+		expcache_removeMacro(expcache, namtab_entry->symbol);
+		if(namtab_replace(namtab, existing, index) == SUCCESS)
+		{
+			reclaimDefinitions();
+		}
+	}
+
+	// only bodies with conditionals are worth specializing
+	if((namtab_entry->effects & MACRO_CONDITIONALS) && prototype != NULL)
+	{
+		namtab_entry->staticParams = joinParameters(prototype, controlParameters, TRUE);
+		namtab_entry->dynamicParams = joinParameters(prototype, controlParameters, FALSE);
+	}
 
 	// free allocated memory
 	parse_info_free(parse_info);
+	argtab_free(parameters);
+	argtab_free(controlParameters);
+	free(prototype);
 	return SUCCESS;
 }
+
+/**
+* Function: reclaimDefinitions
+* Description:
+*  - Frees the replaced macro definitions that no invocation is expanding
+*    anymore, and retires their DEFTAB lines for the next definitions to use.
+*    The lines DEFTAB shrinks by are given back to the deftab budget.
+*    Called after a definition, and at the end of each top level invocation.
+* Parameters:
+*  - none
+* Returns:
+*  - Number of definitions freed.
+*/
+int reclaimDefinitions(void)
+{
+	namtab_entry_t * entry;
+	BOOL busy;
+	int count = 0;
+	int deftabSize;
+	int i = 0;
+	int j;
+
+	if(namtab == NULL || deftab == NULL)
+	{
+		return 0;
+	}
+
+	deftabSize = deftab->size;
+	while(i < namtab->numRetired)
+	{
+		// a frame reads the lines of the definition it started with
+		entry = namtab->retired[i];
+		busy = FALSE;
+		for(j = 0; expstack != NULL && j < expstack->size && !busy; j++)
+		{
+			busy = (expstack->array[j].entry == entry);
+		}
+
+		if(busy)
+		{
+			i++;
+		}
+		else
+		{
+			deftab_retire(deftab, entry->deftabStart, entry->deftabEnd);
+			namtab_removeRetired(namtab, i);
+			count++;
+		}
+	}
+
+	budget_credit(budget, BUDGET_DEFTAB, deftabSize - deftab->size);
+	return count;
+}
+
+/**
+* Function: addDefinitionLine
+* Description:
+*  - Adds a copy of a line to the lines of a definition.
+* Parameters:
+*  - body: Lines of the definition.
+*  - line: The line.
+*  - loopDepth: Number of WHILE loops around the line.
+* Returns:
+*  - SUCCESS, or FAILURE if memory ran out.
+*/
+int addDefinitionLine(definition_t * body, const char * line, int loopDepth)
+{
+	char ** tmpLines;
+	int * tmpDepths;
+	int capacity;
+
+	if(body->size >= body->capacity)
+	{
+		capacity = 2 * body->capacity + 8;
+		tmpLines = (char **) realloc(body->lines, capacity * sizeof(char *));
+		if(tmpLines == NULL)
+		{
+			return FAILURE;
+		}
+		body->lines = tmpLines;
+		tmpDepths = (int *) realloc(body->loopDepths, capacity * sizeof(int));
+		if(tmpDepths == NULL)
+		{
+			return FAILURE;
+		}
+		body->loopDepths = tmpDepths;
+		body->capacity = capacity;
+	}
+
+	body->lines[body->size] = _strdup(line);
+	if(body->lines[body->size] == NULL)
+	{
+		return FAILURE;
+	}
+	body->loopDepths[body->size++] = loopDepth;
+	return SUCCESS;
+}
+
+/**
+* Function: freeDefinition
+* Description:
+*  - Frees the lines of a definition that were not entered into DEFTAB.
+* Parameters:
+*  - body: Lines of the definition.
+* Returns:
+*  - none
+*/
+void freeDefinition(definition_t * body)
+{
+	int i;
+
+	for(i = 0; i < body->size; i++)
+	{
+		free(body->lines[i]);
+	}
+	free(body->lines);
+	free(body->loopDepths);
+	memset(body, 0, sizeof(definition_t));
+}
+
+/**
+* Function: getLineEffects
+* Description:
+*  - Finds the effects of one macro body line: SET statements, references to
+*    variables that are not parameters, '$' labels, IF/WHILE, nested MACRO
+*    definitions and invocations of macros already in NAMTAB.
+* Parameters:
+*  - parse_info: The parsed body line.
+*  - params: ARGTAB holding the parameter names of the macro.
+* Returns:
+*  - Combination of the MACRO_* effect flags.
+*/
+int getLineEffects(parse_info_t * parse_info, argtab_t * params)
+{
+	int effects = 0;
+	int n;
+	const char * ptr;
+	char name[ARGTAB_STRING_SIZE];
+
+	if(parse_info->label != NULL && strchr(parse_info->label, '$') != NULL)
+	{
+		effects |= MACRO_UNIQUE_LABELS;
+	}
+
+	if(parse_info->opcode != NULL)
+	{
+		if(strncmp("SET", parse_info->opcode, strlen("SET")) == 0)
+		{
+			effects |= MACRO_WRITES_SET;
+		}
+		else if(strncmp("IF", parse_info->opcode, strlen("IF")) == 0 ||
+			strncmp("WHILE", parse_info->opcode, strlen("WHILE")) == 0)
+		{
+			effects |= MACRO_CONDITIONALS;
+		}
+		else if(strncmp("MACRO", parse_info->opcode, strlen("MACRO")) == 0)
+		{
+			effects |= MACRO_DEFINES;
+		}
+		else if(namtab_get(namtab, parse_info->opcode) != NULL)
+		{
+			effects |= MACRO_INVOKES;
+		}
+	}
+
+	if(parse_info->operators != NULL)
+	{
+		if(strchr(parse_info->operators, '$') != NULL)
+		{
+			effects |= MACRO_UNIQUE_LABELS;
+		}
+
+		// every &NAME that is not a parameter has to be a SET variable
+		for(ptr = strchr(parse_info->operators, '&'); ptr != NULL; ptr = strchr(ptr + 1, '&'))
+		{
+			n = 1;
+			while(n < (int)sizeof(name) - 1 && (isalnum((unsigned char)ptr[n]) || ptr[n] == '_'))
+			{
+				n++;
+			}
+			strncpy_s(name, sizeof(name), ptr, n);
+			if(argtab_get(params, name) == NULL)
+			{
+				effects |= MACRO_READS_SET;
+			}
+		}
+	}
+
+	return effects;
+}
+
+/**
+* Function: getControlParameters
+* Description:
+*  - Finds the parameters one macro body line uses for control flow: the ones
+*    in IF/WHILE/SET operands, a SET target, and array indexes. Expansion
+*    results depend on the values of these, while all other parameters are
+*    only copied into the expanded lines.
+* Parameters:
+*  - parse_info: The parsed body line.
+*  - params: ARGTAB holding the parameter names of the macro.
+*  - found: ARGTAB the control parameters are added to.
+* Returns:
+*  - none
+*/
+void getControlParameters(parse_info_t * parse_info, argtab_t * params, argtab_t * found)
+{
+	int isControl = FALSE;
+	int n;
+	const char * ptr;
+	char name[ARGTAB_STRING_SIZE];
+
+	if(parse_info->opcode != NULL)
+	{
+		isControl = (strncmp("IF", parse_info->opcode, strlen("IF")) == 0 ||
+			strncmp("WHILE", parse_info->opcode, strlen("WHILE")) == 0 ||
+			strncmp("SET", parse_info->opcode, strlen("SET")) == 0);
+	}
+
+	if(isControl && parse_info->label != NULL && argtab_get(params, parse_info->label) != NULL)
+	{
+		argtab_addOrSet(found, parse_info->label, "");
+	}
+
+	if(parse_info->operators != NULL)
+	{
+		for(ptr = strchr(parse_info->operators, '&'); ptr != NULL; ptr = strchr(ptr + 1, '&'))
+		{
+			n = 1;
+			while(n < (int)sizeof(name) - 1 && (isalnum((unsigned char)ptr[n]) || ptr[n] == '_'))
+			{
+				n++;
+			}
+			strncpy_s(name, sizeof(name), ptr, n);
+			if(argtab_get(params, name) != NULL &&
+			   (isControl || (ptr > parse_info->operators && ptr[-1] == '[')))
+			{
+				argtab_addOrSet(found, name, "");
+			}
+		}
+	}
+}
+
+/**
+* Function: joinParameters
+* Description:
+*  - Lists the prototype parameters that are (or are not) in the given ARGTAB,
+*    in prototype order, separated by commas.
+* Parameters:
+*  - prototype: Operators of the macro prototype line.
+*  - found: ARGTAB of control parameters.
+*  - isFound: TRUE to list the parameters in found, FALSE for the others.
+* Returns:
+*  - String allocated with malloc, or NULL if no parameter is listed.
+*/
+char * joinParameters(const char * prototype, argtab_t * found, int isFound)
+{
+	const char argDelim[] = ", ";
+	char * result = NULL;
+	char * tmpString;
+	char * token;
+	char * nextToken = NULL;
+	size_t bufsize = 2 * strlen(prototype) + 1; // room for '&' added to keys
+	char key[ARGTAB_STRING_SIZE];
+	char value[ARGTAB_STRING_SIZE];
+
+	tmpString = _strdup(prototype);
+	token = strtok_s(tmpString, argDelim, &nextToken);
+	while(token != NULL)
+	{
+		splitKeyValuePair(token, key, sizeof(key), value, sizeof(value));
+		if((argtab_get(found, key) != NULL) == (isFound == TRUE))
+		{
+			if(result == NULL)
+			{
+				result = (char *) malloc(bufsize);
+				strcpy_s(result, bufsize, key);
+			}
+			else
+			{
+				strcat_s(result, bufsize, ",");
+				strcat_s(result, bufsize, key);
+			}
+		}
+		token = strtok_s(NULL, argDelim, &nextToken);
+	}
+	free(tmpString);
+
+	return result;
+}
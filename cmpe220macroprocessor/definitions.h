@@ -8,6 +8,21 @@
 #include "deftab.h"
 #include "namtab.h"
 #include "argtab.h"
+#include "expcache.h"
+#include "expstack.h"
+#include "budget.h"
+#include "library.h"
+#include "libload.h"
+#include "catalog.h"
+#include "stream.h"
+#include "pipeline.h"
+#include "linetab.h"
+#include "parallel.h"
+#include "filecache.h"
+#include "depfile.h"
+#include "include.h"
+#include "watch.h"
+#include "server.h"
 
 // For those used to GCC.. :-)
 #define __func__ __FUNCTION__
@@ -20,14 +35,17 @@
 #define SUCCESS 0
 #define FAILURE -1
 #define SKIP -2
+#define END_OF_INPUT -3
 
 // Constants
 #define CURRENT_LINE_SIZE   (256)
 #define SHORT_STRING_SIZE   (16)
-#define UNIQUE_LABEL_DIGITS (2)
-#define MAX_UNIQUE_LABELS   (26 * 26)
-#define MAX_NESTED_COND_SIZE  (24)
+#define DEFAULT_UNIQUE_LABEL_DIGITS (2)
+#define DEFAULT_UNIQUE_LABEL_BASE   (26)
+#define MAX_UNIQUE_LABEL_DIGITS     (8)
+#define UNIQUE_LABEL_ALPHABET "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789abcdefghijklmnopqrstuvwxyz"
 #define MAX_NESTED_WHILE_SIZE (8)
+#define MAX_LIBRARY_FILES     (64)
 
 // Pretty Print Sizes
 #define kOpCodeStart		SHORT_STRING_SIZE
@@ -36,50 +54,154 @@
 
 // Function Definitions
 ////////////////////////////////////////////////////////////////////////////////////////
-char* getline(FILE *inputFile);
-int processLine(FILE * inputFile, FILE* outputFile, const char * macroLine);
-int define(FILE * inputFile, FILE * outputFile, const char * macroLine);
-int expand(FILE *inputFile, FILE *outputFile, const char *macroName);
+char* getline(stream_t *inputFile);
+int processLine(stream_t * inputFile, stream_t * outputFile, const char * macroLine);
+int define(stream_t * inputFile, stream_t * outputFile, const char * macroLine);
+int reclaimDefinitions(void);
+int expand(stream_t *inputFile, stream_t *outputFile, const char *macroName);
+int emitFrameLine(stream_t *outputFileDes, expstack_frame_t *frame, char *line, size_t bufsize, int labelCount);
 void printUsage(void);
 int getPositiveMin(int a, int b);
 void strReplace(char * string, size_t bufsize, const char * replace, const char * with, BOOL valIsArray);
 int arrayValueForIndex(const char *stringArray, char *arrayVal, char *index);
 void splitKeyValuePair(const char * string, char * key, size_t keysize, char * value, size_t valuesize);
 int parseInputCommand(char **inputFileName, char **outputFileName, int argc, char * argv[]);
-int printOutputLine(FILE * outputFile, char * line);
-void getUniquePrefix(int id, char * prefix, size_t bufferSize);
+int writeDependencies(const char *outputFileName, int result);
+int openOutputPasses(stream_t *output);
+int closeOutputPasses(stream_t *output, int result);
+int watchInput(const char *inputFileName, const char *outputFileName);
+int connectInput(const char *inputFileName, const char *outputFileName);
+int printOutputLine(stream_t * outputFile, char * line);
+int writeExpandedLine(stream_t * outputFile, char * line, size_t bufsize, int labelCount, int uniqueId, const char * macroName);
+void printStatistics(stream_t * outputFile);
+void printError(const char * format, ...);
+int processInput(stream_t * inputFile, stream_t * outputFile);
+int processBegin(stream_t * inputFile, stream_t * outputFile);
+int processStep(stream_t * inputFile, stream_t * outputFile);
+int processEnd(stream_t * outputFile, int result);
+void processFree(void);
+int expandStep(stream_t *inputFile, stream_t *outputFile);
+void unwindFrames(void);
+int setUniqueLabelFormat(int base, int digits);
+int getUniquePrefix(int id, char * prefix, size_t bufferSize);
+void stampUniqueLabels(char * line, size_t bufsize, const char * prefix, int count);
 int evaluateExpressionOperands(char *operands);
 
 // Declare global variables
 ///////////////////////////////////////////////////////////////////////////////////////////////
+// The expansion state is THREAD_LOCAL, so each thread of a parallel expansion
+// (see parallel.c) works with its own tables. The options are shared.
 
 // Verbose flag - prints line numbers to output file and debug information to console
 extern BOOL VERBOSE;
 
+// Statistics flag - prints counters to console when done
+extern BOOL STATS;
+
+// Pipelined flag - reads and writes the files on their own threads
+extern BOOL PIPELINED;
+
+// Threads - number of threads for tokenizing and expanding, 1 for none
+extern int  THREADS;
+
+// Quiet flag - errors are only kept in ERROR_MESSAGE, not printed
+extern THREAD_LOCAL BOOL QUIET;
+
+// First error reported while processing the input
+extern THREAD_LOCAL char ERROR_MESSAGE[CURRENT_LINE_SIZE];
+
+// Console for errors and statistics - stdout if NULL
+extern FILE * MESSAGE_FILE;
+
 // Expanding flag - for function expand
-extern BOOL EXPANDING; 
+extern THREAD_LOCAL BOOL EXPANDING; 
 
 // OPCODE - to determine what the opcode currently is
-extern char OPCODE[SHORT_STRING_SIZE];
+extern THREAD_LOCAL char OPCODE[SHORT_STRING_SIZE];
 
 // Expanded Label - to keep track of labels included with macro invocations
-extern BOOL EXPAND_LABEL;
-extern char EXPANDED_LABEL[SHORT_STRING_SIZE];
+extern THREAD_LOCAL BOOL EXPAND_LABEL;
+extern THREAD_LOCAL char EXPANDED_LABEL[SHORT_STRING_SIZE];
 
 // Unique ID - Used to identify a macro invocation, for unique label generation
-extern int  UNIQUE_ID;
+extern THREAD_LOCAL int  UNIQUE_ID;
 
-// Pointer to current index of definitions table
-extern int deftabIndex;
+// Unique label format - digits and base of the prefix, and the number of IDs that fit
+extern int  UNIQUE_LABEL_DIGITS;
+extern int  UNIQUE_LABEL_BASE;
+extern int  UNIQUE_LABEL_LIMIT;
 
 // Pointer to current line of input file
-extern char currentLine[CURRENT_LINE_SIZE];
+extern THREAD_LOCAL char currentLine[CURRENT_LINE_SIZE];
 
 
 // Pointers to table structures
-extern deftab_t * deftab;
-extern namtab_t * namtab;
-extern argtab_t * argtab;
+extern THREAD_LOCAL deftab_t * deftab;
+extern THREAD_LOCAL namtab_t * namtab;
+extern THREAD_LOCAL argtab_t * argtab;
+
+// Expansion frame stack - one frame per active macro invocation
+extern THREAD_LOCAL expstack_t * expstack;
+
+// Expansion cache - recorded expansions of pure macro invocations
+extern THREAD_LOCAL expcache_t * expcache;
+
+// Expansion budgets - limits and usage for the file and for each invocation
+extern THREAD_LOCAL budget_t * budget;
+
+// Macro libraries - files to load before processing, from the lowest priority
+// to the highest (see libload.c), and file to write after
+extern const char * LIBRARY_FILES[MAX_LIBRARY_FILES];
+extern int NUM_LIBRARY_FILES;
+extern char * EMIT_LIBRARY_FILE;
+extern THREAD_LOCAL library_t * library;
+
+// Build cache - directory of expanded files kept by content, NULL for none
+extern char * CACHE_DIR;
+
+// Symbol table sidecar - pass 1 of the assembler run on the output lines as
+// they are written (see asmpass.c), NULL for none
+extern char * SYMTAB_FILE;
+
+// Tokenized output - the output lines with their tokens, opcode classes and
+// input lines, for tools to map (see tokout.c), NULL for none
+extern char * TOKENS_FILE;
+
+// Peephole flag - removes the instructions of the output that change nothing
+// (see peephole.c)
+extern BOOL PEEPHOLE;
+
+// Dependency file - written with -MD (named after the output file) or -MF,
+// listing the files read, which are added as they are opened
+extern BOOL DEPFILE;
+extern char * DEPFILE_NAME;
+extern THREAD_LOCAL depfile_t * dependencies;
+
+// Include search path - directories searched for INCLUDE files (-I), NULL for none
+extern include_path_t * includePath;
+
+// Include cache - files read by INCLUDE, kept for every input the process
+// expands and shared by its threads, NULL until include_getCache
+extern include_cache_t * includeCache;
+
+// Included files - of the input being processed, each file is included once
+extern THREAD_LOCAL depfile_t * included;
+
+// Deferred unique labels - set on the threads of a parallel expansion, which
+// leave the labels to be stamped when their output is merged
+extern THREAD_LOCAL parallel_labels_t * DEFERRED_LABELS;
+
+// Watch mode - expands the input again when a file it was made from changes,
+// keeping the state of the last run (see watch.c), NULL when not watching
+extern BOOL WATCH;
+extern watch_t * watch;
+
+// Expansion server - socket to serve requests on (--serve), or to send the
+// input to (--connect), NULL for none, and the library for the server to
+// replace its own with (--reload)
+extern char * SERVE_SOCKET;
+extern char * CONNECT_SOCKET;
+extern char * RELOAD_LIBRARY;
 
 
 
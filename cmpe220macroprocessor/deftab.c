@@ -8,10 +8,18 @@
 #include "definitions.h"
 #include "deftab.h"
 
+// local function definitions
+int deftab_grow(deftab_t * table, int count);
+void deftab_setLine(deftab_t * table, int index, char * data);
+int deftab_addFree(deftab_t * table, int start, int count);
+
 /**
  * Function: deftab_alloc
  * Description:
- *  - Allocates memory for the DEFTAB data structure.
+ *  - Allocates memory for the DEFTAB data structure. Lines added with
+ *    deftab_add are copied into the table, lines of mapped libraries stay in
+ *    the mapping. The lines of a definition that was replaced are retired,
+ *    and their place is used again by the definitions after it.
  * Parameters:
  *  - none
  * Returns:
@@ -21,19 +29,35 @@
 deftab_t * deftab_alloc(void)
 {
     char ** array;
+    int *   labelCount;
+    int *   loopDepth;
+    char *  isMapped;
     deftab_t * table = (deftab_t *) malloc(sizeof(deftab_t));
     if(table)
     {
         // initialize to zero
-        memset(table, 0, sizeof(table));
+        memset(table, 0, sizeof(deftab_t));
 
         // allocate memory for string array (start with capacity of 1)
         array = (char **) malloc(sizeof(char *));
-        if(array)
+        labelCount = (int *) malloc(sizeof(int));
+        loopDepth = (int *) malloc(sizeof(int));
+        isMapped = (char *) malloc(sizeof(char));
+        if(array && labelCount && loopDepth && isMapped)
         {
             table->size = 0;
             table->capacity = 1;
             table->array = array;
+            table->labelCount = labelCount;
+            table->loopDepth = loopDepth;
+            table->isMapped = isMapped;
+        }
+        else
+        {
+            free(array);
+            free(labelCount);
+            free(loopDepth);
+            free(isMapped);
         }
     }
 
@@ -61,13 +85,21 @@ void deftab_free(deftab_t * table)
             for(i = 0; i < table->size; i++)
             {
                 //printf("%s: Free item %d @ 0x%08x\n", __func__, i, table->array[i]);
-                free(table->array[i]);
+                if(!table->isMapped[i])
+                {
+                    free(table->array[i]);
+                }
             }
 
             //printf("%s: Free array @ 0x%08x\n", __func__, table->array);
             free(table->array);
         }
 
+        free(table->labelCount);
+        free(table->loopDepth);
+        free(table->isMapped);
+        free(table->free);
+
         //printf("%s: Free table @ 0x%08x\n", __func__, table);
         free(table);
     }
@@ -87,48 +119,134 @@ void deftab_free(deftab_t * table)
 int deftab_add(deftab_t * table, const char * data)
 {
     int		result = -1;
-    int		bufsize;
-    char **	tmpArray;
     char *	tmpData;
 
-    if(table && table->array && data)
+    if(table && table->array && data && deftab_grow(table, 1) == SUCCESS)
     {
-        // check if array is full, if so, then grow capacity
-        if(table->size >= table->capacity)
+        // copy string to new location
+        tmpData = _strdup(data);
+        if(tmpData)
         {
-            // allocate a new array with twice the capacity as this one
-            tmpArray = (char **) malloc(2 * table->capacity * sizeof(char *));
+            // add new string to array
+            result = table->size++;
+            deftab_setLine(table, result, tmpData);
 
-            // copy contents to new array
-            memcpy(tmpArray, table->array, table->capacity * sizeof(char *));
+            //printf("%s: Added item %d @ 0x%08x = '%s'\n", __func__, result, table->array[result], table->array[result]);
+        }
+    }
 
-            // free the old array
-            free(table->array);
+    return result;
+}
 
-            // point to new array
-            table->array = tmpArray;
+/**
+ * Function: deftab_addLines
+ * Description:
+ *  - Adds the lines of a definition to the DEFTAB table, one after the
+ *    other: in the first free range they fit, or else at the end.
+ * Parameters:
+ *  - table: Pointer to DEFTAB table.
+ *  - lines: Strings to add to the table. The table takes them over, and
+ *    they must have been allocated with malloc.
+ *  - loopDepths: WHILE nesting of each line.
+ *  - count: Number of lines.
+ * Returns:
+ *  - If successful, returns the index of the first line. Otherwise, returns
+ *    -1, and no line is added (the lines are not taken over).
+ */
+int deftab_addLines(deftab_t * table, char ** lines, const int * loopDepths, int count)
+{
+    int result = -1;
+    int i;
 
-            // capacity has doubled
-            table->capacity *= 2;
+    if(table == NULL || table->array == NULL || lines == NULL || loopDepths == NULL || count <= 0)
+    {
+        return -1;
+    }
+
+    for(i = 0; i < table->numFree && result < 0; i++)
+    {
+        if(table->free[i].count >= count)
+        {
+            result = table->free[i].start;
+            table->free[i].start += count;
+            table->free[i].count -= count;
+            if(table->free[i].count == 0)
+            {
+                memmove(&table->free[i], &table->free[i + 1], (table->numFree - i - 1) * sizeof(deftab_range_t));
+                table->numFree--;
+            }
+            table->freeLines -= count;
+            table->reusedLines += count;
+        }
+    }
 
-            //printf("%s: Increased array capacity to %d\n", __func__, table->capacity);
+    if(result < 0)
+    {
+        if(deftab_grow(table, count) != SUCCESS)
+        {
+            return -1;
         }
+        result = table->size;
+        table->size += count;
+    }
 
-        // allocate memory for string
-        bufsize = strlen(data) + 1;
-        tmpData = (char *) malloc(bufsize);
+    for(i = 0; i < count; i++)
+    {
+        deftab_setLine(table, result + i, lines[i]);
+        table->loopDepth[result + i] = loopDepths[i];
+    }
 
-        // copy string to new location
-        strcpy_s(tmpData, bufsize, data);
+    return result;
+}
+
+/**
+ * Function: deftab_retire
+ * Description:
+ *  - Frees the lines of a definition no longer used, so deftab_addLines
+ *    can put another one in their place. Free lines at the end of the table
+ *    are removed.
+ * Parameters:
+ *  - table: Pointer to DEFTAB table.
+ *  - start: Index of the first line.
+ *  - end: Index of the last line.
+ * Returns:
+ *  - none
+ */
+void deftab_retire(deftab_t * table, int start, int end)
+{
+    int i;
 
-        // add new string to array
-        result = table->size++;
-        table->array[result] = tmpData;
+    if(table == NULL || table->array == NULL || start < 0 || end < start || end >= table->size)
+    {
+        return;
+    }
 
-        //printf("%s: Added item %d @ 0x%08x = '%s'\n", __func__, result, table->array[result], table->array[result]);
+    for(i = start; i <= end; i++)
+    {
+        if(!table->isMapped[i])
+        {
+            free(table->array[i]);
+        }
+        table->array[i] = NULL;
+        table->labelCount[i] = 0;
+        table->loopDepth[i] = 0;
+        table->isMapped[i] = FALSE;
     }
 
-    return result;
+    // when out of memory, the lines stay unused
+    if(deftab_addFree(table, start, end - start + 1) != SUCCESS)
+    {
+        return;
+    }
+
+    // the last range is not kept when it reaches the end of the table
+    i = table->numFree - 1;
+    if(table->free[i].start + table->free[i].count == table->size)
+    {
+        table->size = table->free[i].start;
+        table->freeLines -= table->free[i].count;
+        table->numFree--;
+    }
 }
 
 /**
@@ -140,16 +258,287 @@ int deftab_add(deftab_t * table, const char * data)
  *  - index: Zero-based index of the string to retrieve.
  * Returns:
  *  - If successful, returns pointer to the string stored at the specified
- *    location. Otherwise, returns NULL.
+ *    location. Otherwise, returns NULL. Mapped lines are read-only.
  */
 char * deftab_get(deftab_t * table, int index)
 {
     char * result = NULL;
 
-    if(table && index >= 0)
+    if(table && index >= 0 && index < table->size)
     {
         result = table->array[index];
     }
 
     return result;
 }
+
+/**
+ * Function: deftab_getLabelCount
+ * Description:
+ *  - Retrieves the number of '$' unique label markers in the line located at
+ *    the specified index in the DEFTAB.
+ * Parameters:
+ *  - table: Pointer to DEFTAB table.
+ *  - index: Zero-based index of the line.
+ * Returns:
+ *  - Number of markers, or 0 if the index is not valid.
+ */
+int deftab_getLabelCount(deftab_t * table, int index)
+{
+    int result = 0;
+
+    if(table && index >= 0 && index < table->size)
+    {
+        result = table->labelCount[index];
+    }
+
+    return result;
+}
+
+/**
+ * Function: deftab_setLoopDepth
+ * Description:
+ *  - Sets the WHILE nesting depth of the line located at the specified index
+ *    in the DEFTAB. WHILE and ENDW lines count as part of their loop. Mapped
+ *    lines already carry their depth and are not changed.
+ * Parameters:
+ *  - table: Pointer to DEFTAB table.
+ *  - index: Zero-based index of the line.
+ *  - depth: Number of WHILE loops around the line.
+ * Returns:
+ *  - none
+ */
+void deftab_setLoopDepth(deftab_t * table, int index, int depth)
+{
+    if(table && index >= 0 && index < table->size && !table->isMapped[index])
+    {
+        table->loopDepth[index] = depth;
+    }
+}
+
+/**
+ * Function: deftab_getLoopDepth
+ * Description:
+ *  - Retrieves the WHILE nesting depth of the line located at the specified
+ *    index in the DEFTAB.
+ * Parameters:
+ *  - table: Pointer to DEFTAB table.
+ *  - index: Zero-based index of the line.
+ * Returns:
+ *  - Loop depth, or 0 if the index is not valid.
+ */
+int deftab_getLoopDepth(deftab_t * table, int index)
+{
+    int result = 0;
+
+    if(table && index >= 0 && index < table->size)
+    {
+        result = table->loopDepth[index];
+    }
+
+    return result;
+}
+
+/**
+ * Function: deftab_addMapped
+ * Description:
+ *  - Adds lines of a mapped macro library to the DEFTAB table, without
+ *    copying their text. The mapping must stay valid until the table is
+ *    freed. Libraries add the lines of a macro when it is first used, so they
+ *    can come between lines added with deftab_add.
+ * Parameters:
+ *  - table: Pointer to DEFTAB table.
+ *  - base: Start of the mapped library.
+ *  - bytes: Size of the mapped library.
+ *  - records: Line records to add.
+ *  - count: Number of line records.
+ * Returns:
+ *  - If successful, returns the index of the first line. Otherwise, returns
+ *    -1, and no line is added.
+ */
+int deftab_addMapped(deftab_t * table, const char * base, unsigned int bytes, const deftab_record_t * records, int count)
+{
+    int result = -1;
+    int i;
+
+    if(table && table->array && base && records && count >= 0)
+    {
+        // check every line lies in the mapping before adding any
+        for(i = 0; i < count; i++)
+        {
+            if(records[i].text >= bytes)
+            {
+                return -1;
+            }
+        }
+
+        if(deftab_grow(table, count) == SUCCESS)
+        {
+            result = table->size;
+            for(i = 0; i < count; i++)
+            {
+                table->array[table->size] = (char *) base + records[i].text;
+                table->labelCount[table->size] = records[i].labelCount;
+                table->loopDepth[table->size] = records[i].loopDepth;
+                table->isMapped[table->size] = TRUE;
+                table->size++;
+            }
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Function: deftab_setLine
+ * Description:
+ *  - Stores a line at an index of the table, counting its unique label
+ *    markers.
+ * Parameters:
+ *  - table: Pointer to DEFTAB table.
+ *  - index: Index of the line, within the size of the table.
+ *  - data: The line, allocated with malloc, taken over by the table.
+ * Returns:
+ *  - none
+ */
+void deftab_setLine(deftab_t * table, int index, char * data)
+{
+    char *	marker;
+    int		count = 0;
+
+    // count unique label markers now, so expansion only has to stamp
+    // lines that contain them
+    for(marker = strchr(data, '$'); marker != NULL; marker = strchr(marker + 1, '$'))
+    {
+        count++;
+    }
+
+    table->array[index] = data;
+    table->labelCount[index] = count;
+    table->loopDepth[index] = 0;
+    table->isMapped[index] = FALSE;
+}
+
+/**
+ * Function: deftab_addFree
+ * Description:
+ *  - Adds a range of lines to the free ranges, joining it with the ranges
+ *    next to it.
+ * Parameters:
+ *  - table: Pointer to DEFTAB table.
+ *  - start: Index of the first line.
+ *  - count: Number of lines.
+ * Returns:
+ *  - SUCCESS, or FAILURE if memory ran out.
+ */
+int deftab_addFree(deftab_t * table, int start, int count)
+{
+    deftab_range_t * tmpFree;
+    int i;
+
+    // position of the range, in order of start
+    for(i = 0; i < table->numFree && table->free[i].start < start; i++)
+    {
+    }
+
+    if(i > 0 && table->free[i - 1].start + table->free[i - 1].count == start)
+    {
+        // joins the range before it, and maybe the one after it
+        table->free[i - 1].count += count;
+        if(i < table->numFree && start + count == table->free[i].start)
+        {
+            table->free[i - 1].count += table->free[i].count;
+            memmove(&table->free[i], &table->free[i + 1], (table->numFree - i - 1) * sizeof(deftab_range_t));
+            table->numFree--;
+        }
+    }
+    else if(i < table->numFree && start + count == table->free[i].start)
+    {
+        table->free[i].start = start;
+        table->free[i].count += count;
+    }
+    else
+    {
+        if(table->numFree >= table->freeCapacity)
+        {
+            tmpFree = (deftab_range_t *) realloc(table->free, (2 * table->freeCapacity + 1) * sizeof(deftab_range_t));
+            if(tmpFree == NULL)
+            {
+                return FAILURE;
+            }
+            table->free = tmpFree;
+            table->freeCapacity = 2 * table->freeCapacity + 1;
+        }
+        memmove(&table->free[i + 1], &table->free[i], (table->numFree - i) * sizeof(deftab_range_t));
+        table->free[i].start = start;
+        table->free[i].count = count;
+        table->numFree++;
+    }
+
+    table->freeLines += count;
+    return SUCCESS;
+}
+
+/**
+ * Function: deftab_grow
+ * Description:
+ *  - Makes room for more lines, at least doubling the capacity.
+ * Parameters:
+ *  - table: Pointer to DEFTAB table.
+ *  - count: Number of lines to make room for.
+ * Returns:
+ *  - If successful, returns SUCCESS. Otherwise, returns FAILURE and the table
+ *    is unchanged.
+ */
+int deftab_grow(deftab_t * table, int count)
+{
+    int		capacity;
+    char **	tmpArray;
+    int *	tmpCount;
+    int *	tmpDepth;
+    char *	tmpMapped;
+
+    // check if array is full, if so, then grow capacity
+    if(table->size + count <= table->capacity)
+    {
+        return SUCCESS;
+    }
+
+    capacity = (2 * table->capacity > table->size + count) ? 2 * table->capacity : table->size + count;
+
+    // allocate new arrays
+    tmpArray = (char **) malloc(capacity * sizeof(char *));
+    tmpCount = (int *) malloc(capacity * sizeof(int));
+    tmpDepth = (int *) malloc(capacity * sizeof(int));
+    tmpMapped = (char *) malloc(capacity * sizeof(char));
+    if(tmpArray == NULL || tmpCount == NULL || tmpDepth == NULL || tmpMapped == NULL)
+    {
+        free(tmpArray);
+        free(tmpCount);
+        free(tmpDepth);
+        free(tmpMapped);
+        return FAILURE;
+    }
+
+    // copy contents to new arrays
+    memcpy(tmpArray, table->array, table->size * sizeof(char *));
+    memcpy(tmpCount, table->labelCount, table->size * sizeof(int));
+    memcpy(tmpDepth, table->loopDepth, table->size * sizeof(int));
+    memcpy(tmpMapped, table->isMapped, table->size * sizeof(char));
+
+    // free the old arrays
+    free(table->array);
+    free(table->labelCount);
+    free(table->loopDepth);
+    free(table->isMapped);
+
+    // point to new arrays
+    table->array = tmpArray;
+    table->labelCount = tmpCount;
+    table->loopDepth = tmpDepth;
+    table->isMapped = tmpMapped;
+    table->capacity = capacity;
+
+    //printf("%s: Increased array capacity to %d\n", __func__, table->capacity);
+    return SUCCESS;
+}
@@ -5,16 +5,46 @@
 #ifndef DEFTAB_H_
 #define DEFTAB_H_
 
+// Line record of a precompiled DEFTAB, as stored in a macro library. The
+// text is an offset from the start of the library.
+typedef struct
+{
+    unsigned int    text;
+    int             labelCount;
+    int             loopDepth;
+} deftab_record_t;
+
+// Lines of a retired definition, free to hold a new one
+typedef struct
+{
+    int     start;
+    int     count;
+} deftab_range_t;
+
 typedef struct
 {
     int     size;
     int     capacity;
     char **	array;
+    int *   labelCount;     // number of '$' unique label markers in each line
+    int *   loopDepth;      // WHILE nesting of each line, set by define
+    char *  isMapped;       // TRUE if the line is read in place from a mapped library
+    deftab_range_t * free;  // sorted by start, none at the end of the table
+    int     numFree;
+    int     freeCapacity;
+    int     freeLines;      // lines in the free ranges
+    int     reusedLines;    // lines added in a free range instead of at the end
 } deftab_t;
 
 deftab_t *  deftab_alloc(void);
 void        deftab_free(deftab_t *);
 int         deftab_add(deftab_t * table, const char * data);
+int         deftab_addMapped(deftab_t * table, const char * base, unsigned int bytes, const deftab_record_t * records, int count);
+int         deftab_addLines(deftab_t * table, char ** lines, const int * loopDepths, int count);
+void        deftab_retire(deftab_t * table, int start, int end);
 char *      deftab_get(deftab_t * table, int index);
+int         deftab_getLabelCount(deftab_t * table, int index);
+void        deftab_setLoopDepth(deftab_t * table, int index, int depth);
+int         deftab_getLoopDepth(deftab_t * table, int index);
 
 #endif /* DEFTAB_H_ */
@@ -0,0 +1,221 @@
+/*
+ * depfile.c - Contains functions for dependency files (-MD, -MF).
+ *
+ * The file is one makefile rule, as compilers write with -MD:
+ *
+ *   output.txt: input.txt \
+ *    macros.lib
+ *
+ * so make and ninja (deps = gcc) re-run the processor when any file the
+ * output was made from changes.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "definitions.h"
+#include "depfile.h"
+
+// local function definitions
+void depfile_writeName(FILE * file, const char * name);
+
+/**
+ * Function: depfile_alloc
+ * Description:
+ *  - Allocates memory for an empty list of dependencies.
+ * Parameters:
+ *  - none
+ * Returns:
+ *  - If successful, returns pointer to new list. Otherwise, returns NULL.
+ */
+depfile_t * depfile_alloc(void)
+{
+    depfile_t * depfile = (depfile_t *) malloc(sizeof(depfile_t));
+    if(depfile != NULL)
+    {
+        memset(depfile, 0, sizeof(depfile_t));
+    }
+
+    return depfile;
+}
+
+/**
+ * Function: depfile_free
+ * Description:
+ *  - De-allocates a list of dependencies.
+ * Parameters:
+ *  - depfile: Pointer to the list.
+ * Returns:
+ *  - none
+ */
+void depfile_free(depfile_t * depfile)
+{
+    int i;
+
+    if(depfile)
+    {
+        for(i = 0; i < depfile->size; i++)
+        {
+            free(depfile->files[i]);
+        }
+        free(depfile->files);
+        free(depfile);
+    }
+}
+
+/**
+ * Function: depfile_add
+ * Description:
+ *  - Adds a file that was read, unless it is already listed.
+ * Parameters:
+ *  - depfile: Pointer to the list, or NULL when no dependency file is written.
+ *  - fileName: Name of the file, as it was opened.
+ * Returns:
+ *  - SUCCESS, or FAILURE if out of memory.
+ */
+int depfile_add(depfile_t * depfile, const char * fileName)
+{
+    char ** files;
+
+    if(depfile == NULL || fileName == NULL || depfile_has(depfile, fileName))
+    {
+        return SUCCESS;
+    }
+
+    if(depfile->size == depfile->capacity)
+    {
+        files = (char **) realloc(depfile->files, (depfile->capacity + 8) * sizeof(char *));
+        if(files == NULL)
+        {
+            return FAILURE;
+        }
+        depfile->files = files;
+        depfile->capacity += 8;
+    }
+
+    depfile->files[depfile->size] = _strdup(fileName);
+    if(depfile->files[depfile->size] == NULL)
+    {
+        return FAILURE;
+    }
+    depfile->size++;
+
+    return SUCCESS;
+}
+
+/**
+ * Function: depfile_has
+ * Description:
+ *  - Tells whether a file is listed.
+ * Parameters:
+ *  - depfile: Pointer to the list.
+ *  - fileName: Name of the file.
+ * Returns:
+ *  - TRUE if the file is listed, otherwise FALSE.
+ */
+int depfile_has(depfile_t * depfile, const char * fileName)
+{
+    int i;
+
+    for(i = 0; depfile != NULL && i < depfile->size; i++)
+    {
+        if(strcmp(depfile->files[i], fileName) == 0)
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/**
+ * Function: depfile_write
+ * Description:
+ *  - Writes the dependencies as a makefile rule for the target.
+ * Parameters:
+ *  - depfile: Pointer to the list.
+ *  - fileName: Name of the dependency file.
+ *  - target: Name of the output file.
+ * Returns:
+ *  - SUCCESS, or FAILURE if the file could not be written.
+ */
+int depfile_write(depfile_t * depfile, const char * fileName, const char * target)
+{
+    FILE * file = NULL;
+    int i;
+
+    if(depfile == NULL || fopen_s(&file, fileName, "w") != 0 || file == NULL)
+    {
+        return FAILURE;
+    }
+
+    depfile_writeName(file, target);
+    fputc(':', file);
+    for(i = 0; i < depfile->size; i++)
+    {
+        fputs((i == 0) ? " " : " \\\n ", file);
+        depfile_writeName(file, depfile->files[i]);
+    }
+    fputc('\n', file);
+
+    return (fclose(file) == 0) ? SUCCESS : FAILURE;
+}
+
+/**
+ * Function: depfile_getName
+ * Description:
+ *  - Names the dependency file of -MD after the output file: its extension
+ *    is replaced by .d (out.txt gives out.d).
+ * Parameters:
+ *  - outputFileName: Name of the output file.
+ * Returns:
+ *  - If successful, returns the new name, to be freed. Otherwise, returns NULL.
+ */
+char * depfile_getName(const char * outputFileName)
+{
+    size_t size = strlen(outputFileName) + 3;
+    char * name = (char *) malloc(size);
+    char * dot;
+
+    if(name)
+    {
+        strcpy_s(name, size, outputFileName);
+
+        // only a dot after the last directory separator starts the extension
+        dot = strrchr(name, '.');
+        if(dot != NULL && strchr(dot, '/') == NULL && strchr(dot, '\\') == NULL)
+        {
+            *dot = '\0';
+        }
+        strcat_s(name, size, ".d");
+    }
+
+    return name;
+}
+
+/**
+ * Function: depfile_writeName
+ * Description:
+ *  - Writes a file name, escaped as make reads it: spaces and '#' with a
+ *    backslash, '$' doubled.
+ * Parameters:
+ *  - file: Dependency file.
+ *  - name: File name.
+ * Returns:
+ *  - none
+ */
+void depfile_writeName(FILE * file, const char * name)
+{
+    for(; *name != '\0'; name++)
+    {
+        if(*name == ' ' || *name == '#')
+        {
+            fputc('\\', file);
+        }
+        else if(*name == '$')
+        {
+            fputc('$', file);
+        }
+        fputc(*name, file);
+    }
+}
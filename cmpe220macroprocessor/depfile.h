@@ -0,0 +1,24 @@
+/*
+ * depfile.h - Contains functions and definitions for dependency files, the
+ * files an output was made from in the format of a makefile rule.
+ */
+
+#ifndef DEPFILE_H_
+#define DEPFILE_H_
+
+// Files read while making one output, in the order they were first read
+typedef struct
+{
+    char ** files;
+    int     size;
+    int     capacity;
+} depfile_t;
+
+depfile_t *     depfile_alloc(void);
+void            depfile_free(depfile_t * depfile);
+int             depfile_add(depfile_t * depfile, const char * fileName);
+int             depfile_has(depfile_t * depfile, const char * fileName);
+int             depfile_write(depfile_t * depfile, const char * fileName, const char * target);
+char *          depfile_getName(const char * outputFileName);
+
+#endif /* DEPFILE_H_ */
@@ -6,6 +6,9 @@
  * This is an implementation of the macroprocessor EXPAND function
  * that expand macros based on their definition in DEFTAB and writes
  * the expanded assembly program to an outputfile.
+ *
+ * Nested invocations do not recurse: each invocation is a frame on the
+ * expansion stack, and a single loop always works on the top frame.
  * 
  * Author: Rajesh Somasundaran <rsomasundaran@gmail.com>
  * Date: Apr 14 2012
@@ -23,15 +26,42 @@
 
 // local function definitions
 int setUpArguments (const char * macroDef, const char *line, const char *macroName);
-int commentOutMacroCall(char *inputLine, FILE *outputfd);
+int commentOutMacroCall(char *inputLine, stream_t *outputfd);
 int getNumArguments(char *line);
 int evaluateIFOperands(char *operands);
-char *currentLabel = NULL;
+int expandLine(stream_t *inputFileDes, stream_t *outputFileDes, expstack_frame_t *frame, parse_info_t *parsedLine);
+char *getCacheKey(const char *macroName, const char *invocationLine, unsigned long long digest);
+int replayExpansion(stream_t *outputFileDes, expcache_entry_t *cached, const char *macroName);
+int finishFrame(stream_t *outputFileDes, expstack_frame_t *frame);
+expcache_entry_t *getVariant(expstack_frame_t *frame);
+char *getVariantKey(expstack_frame_t *frame);
+void getParameterMarker(int index, char *marker, size_t size);
+void copyArgument(argtab_t *to, const char *toKey, argtab_t *from, const char *fromKey);
+int spliceVariant(stream_t *outputFileDes, expstack_frame_t *frame, expcache_entry_t *variant);
+int abandonSpecialization(stream_t *outputFileDes, expstack_frame_t *frame);
+void renderOperators(expstack_frame_t *frame, const char *operators, char *buffer, size_t bufsize);
+int isRenderCurrent(expstack_render_t *render, argtab_t *table);
+void keepRender(expstack_render_t *render, argtab_t *table, const char *operators, const char *text);
 
 /*
  * expand:
  * Main function to expand MACRO with its definition as found in DEFTAB
  *
+ * Pushes a frame for the invocation onto the expansion stack. If no expansion
+ * is running yet, the frames are then expanded until the stack is empty.
+ * Otherwise (invocation found inside a macro body) the running loop picks up
+ * the new frame, so nesting depth is not limited by the C stack.
+ *
+ * Invocations of pure macros (see MACRO_IMPURE) are recorded in the expansion
+ * cache, and later invocations with the same label and operands replay the
+ * recorded lines with only the unique label prefix stamped again.
+ *
+ * Macros with IF/WHILE are specialized: the first invocation for a combination
+ * of static parameters (see define) records the lines it emits as a
+ * branch-free variant, with markers in place of the dynamic parameters. Later
+ * invocations with the same static values only splice their dynamic values
+ * into the variant, without evaluating any conditional.
+ *
  * Parameters:
  *  - inputFileDes - File descriptor for the input assembly program file
  *  - outputFileDes - File descriptor for the output (expanded) assembly program file
@@ -39,58 +69,48 @@ char *currentLabel = NULL;
  * Returns:
  * SUCCESS (0) or FAILURE (-1)
  */
-int expand(FILE *inputFileDes, FILE *outputFileDes, const char *macroName)  
+int expand(stream_t *inputFileDes, stream_t *outputFileDes, const char *macroName)  
 {
-	
-	// Condition Statement level - For conditional macro expansion
-	int CONDSTATEMENTLEVEL = 0;
-	//int WHILESTATEMENTLEVEL = 0;
-	/* 
-		For nested ifs, we keep track of result of the IF expression evaluation
-		Global variable IFSTATEMENTLEVEL is a pointer to the current index in array
-		
-		For nested whiles, we keep track of the definition line number in an array,
-		so that we can go back to that line when the while loops back. 
-		WHILESTATEMENTLEVEL is a pointer to the level of indirection in nested while loops.
-	*/
-	BOOL shouldEvaluateSection = TRUE;
-	int ifExpressionResult;
-	BOOL isWhileExpression = FALSE;
-	int nestedCondArray[MAX_NESTED_COND_SIZE];
-	int nestedWhileArray[MAX_NESTED_WHILE_SIZE];
+	char *macroInvocation;
 	char *line;
-	char *labelledLine;
-    char *macroInvocation;
-	const char opDelim[] = "& ";
-	//int argCount;
-	int endOfMacroDef;
-	int bufferLen;
-	int sizeOfTAB; 
+	char *cacheKey = NULL;
+	int result;
 	namtab_entry_t *nameEntry;
-	parse_info_t *parsedLine = parse_info_alloc();
-	int i = 0;
-
-	/* 
-		Initialize variables
-	*/
-	EXPANDING = TRUE;
-	memset(nestedCondArray, '\0', MAX_NESTED_COND_SIZE);
-	//memset(nestedWhileArray, '\0', MAX_NESTED_WHILE_SIZE);
-	nestedCondArray[0] = TRUE;
-	//nestedWhileArray[0] = TRUE;
+	expstack_frame_t *frame;
+	expcache_entry_t *cached;
+	expcache_entry_t *variant;
 
 	if(VERBOSE) {
 		printf("EXPAND: Expanding Macro: %s ...\n", macroName);
 	}
 
     // check for null pointers
-    if(inputFileDes == NULL || outputFileDes == NULL || macroName == NULL)
+    if(inputFileDes == NULL || outputFileDes == NULL || macroName == NULL || expstack == NULL)
     {
         return FAILURE;
     }
 
+	/* Usage of an invocation from the source file includes the invocations nested in it */
+	if (!EXPANDING) {
+		budget_startInvocation(budget);
+	}
+
+	/* 
+	 * Output of a nested invocation is written as it happens, so it can't go
+	 * into the variant or cache record of the invoking macro
+	 */
+	frame = expstack_top(expstack);
+	if (frame != NULL) {
+		if (frame->variant != NULL && abandonSpecialization(outputFileDes, frame) == FAILURE) {
+			return FAILURE;
+		}
+		if (frame->record != NULL) {
+			expcache_entryFree(frame->record);
+			frame->record = NULL;
+			frame->entry->effects |= MACRO_INVOKES;
+		}
+	}
 
-	
 	/* Write macro invocation line to the output file as a comment */
     macroInvocation = _strdup(currentLine);
 	if (commentOutMacroCall(macroInvocation, outputFileDes) == FAILURE) {
@@ -100,7 +120,7 @@ int expand(FILE *inputFileDes, FILE *outputFileDes, const char *macroName)
 
 	/* 
 	 * Read from NAMTAB, the starting and ending index of macro definition in DEFTAB
-	 * and process each line from DEFTAB
+	 * and push a frame for this invocation
 	 */
 	nameEntry = namtab_get(namtab, macroName);
 	if (nameEntry == NULL) {
@@ -108,214 +128,836 @@ int expand(FILE *inputFileDes, FILE *outputFileDes, const char *macroName)
 		return FAILURE;
 	}
 
-	/*
-		Set up arguments to get from deftab
-	*/
-	deftabIndex = (nameEntry->deftabStart);  // First line is macro prototype!
-	endOfMacroDef = nameEntry->deftabEnd;
+	/* Replay pure invocations that were expanded before */
+	if (expcache != NULL && (nameEntry->effects & MACRO_IMPURE) == 0) {
+		cacheKey = getCacheKey(macroName, macroInvocation, (watch != NULL) ? watch_getDigest(nameEntry) : 0);
+		cached = expcache_get(expcache, cacheKey);
+		if (cached != NULL) {
+			expcache->hits++;
+			free(cacheKey);
+			free(macroInvocation);
+			return replayExpansion(outputFileDes, cached, macroName);
+		}
+		expcache->misses++;
+	}
 
-	/*
-		Get number of parameters from macro definitino
-	*/
-	// Get macro definition line
-	line = getline(inputFileDes);
-	
+	frame = expstack_push(expstack, nameEntry);
+	if (frame == NULL) {
+		free(cacheKey);
+        free(macroInvocation);
+		return FAILURE;
+	}
+	frame->uniqueId = UNIQUE_ID++;	// invocation ID
+	frame->record = expcache_entryAlloc(cacheKey);	// NULL if not cacheable
+	free(cacheKey);
+	frame->parentArgtab = argtab;
+	argtab = frame->argtab;
+
+	if (budget_reach(budget, BUDGET_DEPTH, expstack->size) != SUCCESS) {
+		budget_report(budget, macroName, macroInvocation);
+        free(macroInvocation);
+		unwindFrames();
+		return FAILURE;
+	}
+
+	// First line is macro prototype!
+	line = deftab_get(deftab, frame->cursor++);
 
 	/* Create ARGTAB with arguments from macro invocation */
 	if (setUpArguments(macroInvocation, line, macroName) == FAILURE) {
         free(macroInvocation);
+		unwindFrames();
 		return FAILURE;
 	}
     free(macroInvocation);
-	
 
-	// Increment deftabIndex to point to first line of definition
-	deftabIndex++;
+	/* Splice the arguments into a variant specialized before */
+	if ((nameEntry->effects & MACRO_CONDITIONALS) && (nameEntry->effects & MACRO_NOT_SPECIALIZABLE) == 0) {
+		variant = getVariant(frame);
+		if (variant != NULL) {
+			result = spliceVariant(outputFileDes, frame, variant);
+			if (result == SUCCESS) {
+				result = finishFrame(outputFileDes, frame);
+			}
+			if (result == FAILURE) {
+				unwindFrames();
+			}
+			return result;
+		}
+	}
 
-	while (deftabIndex < endOfMacroDef) {	// Assumes the MACRO definition ends with MEND in DEFTAB!
-		line = getline(inputFileDes);
+	// expandStep continues with the new frame, one line at a time
+	EXPANDING = TRUE;
+	return SUCCESS;
+}
 
-		/* If macro invocation came with a label, copy the label down to next available line
-			where there is not a conditional macro variable
-		*/
-		if (currentLabel != NULL && *line != '&') {
-			bufferLen = strlen(currentLabel) + strlen(line) + (2 * sizeof(char));
-			labelledLine = (char *) malloc(bufferLen);
-			memset(labelledLine, '\0', bufferLen);
+/*
+ * expandStep:
+ * Expands the next line of the innermost invocation, or finishes the
+ * invocation when its lines are done. The caller steps until EXPANDING is
+ * cleared, so output can be consumed as it is produced.
+ *
+ * Parameters:
+ *  - inputFileDes - File descriptor for the input assembly program file
+ *  - outputFileDes - File descriptor for the output (expanded) assembly program file
+ * Returns:
+ * SUCCESS (0) or FAILURE (-1)
+ */
+int expandStep(stream_t *inputFileDes, stream_t *outputFileDes)
+{
+	int result;
+	expstack_frame_t *frame = expstack_top(expstack);
+	parse_info_t *parsedLine;
 
-			sizeOfTAB = sizeof('\t');
-			strcpy_s(labelledLine, bufferLen, currentLabel);
-			strcat_s(labelledLine, bufferLen, &line[sizeOfTAB]+1);
-			strcpy_s(line, bufferLen, labelledLine);
+	if (frame == NULL) {
+		EXPANDING = FALSE;
+		return SUCCESS;
+	}
 
-			currentLabel = NULL;
-			free(labelledLine);
-		}
-		
-		/* Parse for conditional expansion*/
-		if(parse_line(parsedLine, line) == FAILURE)
-		{
+	if (frame->cursor >= frame->end) {	// Assumes the MACRO definition ends with MEND in DEFTAB!
+		if (finishFrame(outputFileDes, frame) == FAILURE) {
+			unwindFrames();
 			return FAILURE;
 		}
+		EXPANDING = !expstack_isEmpty(expstack);
+		return SUCCESS;
+	}
+
+	parsedLine = parse_info_alloc();
+	if (parsedLine == NULL) {
+		unwindFrames();
+		return FAILURE;
+	}
 
+	result = expandLine(inputFileDes, outputFileDes, frame, parsedLine);
+	parse_info_free(parsedLine);
+	if (result == FAILURE) {
+		unwindFrames();
+	}
+
+	return result;
+}
+
+/*
+ * expandLine:
+ * Expands one line of the macro definition of an invocation: conditional
+ * keywords move the cursor, other lines are substituted and processed.
+ *
+ * Parameters:
+ *  - inputFileDes - File descriptor for the input assembly program file
+ *  - outputFileDes - File descriptor for the output (expanded) assembly program file
+ *  - frame - Innermost invocation
+ *  - parsedLine - Parse info to use for the line
+ * Returns:
+ * SUCCESS (0) or FAILURE (-1)
+ */
+int expandLine(stream_t *inputFileDes, stream_t *outputFileDes, expstack_frame_t *frame, parse_info_t *parsedLine)
+{
+	/* 
+		For nested ifs, each frame keeps track of result of the IF expression evaluation
+		frame->condLevel is a pointer to the current index in frame->condStack
+		
+		For nested whiles, we keep track of the definition line number in the same array,
+		so that we can go back to that line when the while loops back. 
+	*/
+	int ifExpressionResult;
+	BOOL isWhileExpression = FALSE;
+	char *line;
+	char *labelledLine;
+	int bufferLen;
+	int sizeOfTAB; 
+
+	line = getline(inputFileDes);
+
+	/* If macro invocation came with a label, copy the label down to next available line
+		where there is not a conditional macro variable
+	*/
+	if (frame->label != NULL && *line != '&') {
+		bufferLen = strlen(frame->label) + strlen(line) + (2 * sizeof(char));
+		labelledLine = (char *) malloc(bufferLen);
+		memset(labelledLine, '\0', bufferLen);
+
+		sizeOfTAB = sizeof('\t');
+		strcpy_s(labelledLine, bufferLen, frame->label);
+		strcat_s(labelledLine, bufferLen, &line[sizeOfTAB]+1);
+		strcpy_s(line, CURRENT_LINE_SIZE, labelledLine);
+
+		free(frame->label);
+		frame->label = NULL;
+		free(labelledLine);
+	}
 	
-		/* 
-			Substitute arguments for operators here
-		*/
-		if(parsedLine->operators != NULL && shouldEvaluateSection)
-		{
-			// Copy parsedLine->operators to currentLine buffer
-			strncpy_s(currentLine, CURRENT_LINE_SIZE, parsedLine->operators, strlen(parsedLine->operators));
+	/* Parse for conditional expansion*/
+	if(parse_line(parsedLine, line) == FAILURE)
+	{
+		return FAILURE;
+	}
 
-			argtab_substituteValues(argtab, currentLine, sizeof(currentLine));
 
-			// Move currentLine back to parsedLine->operators
-			free(parsedLine->operators);
-			parsedLine->operators = _strdup(currentLine);
+	/* 
+		Substitute arguments for operators here
+	*/
+	if(parsedLine->operators != NULL && frame->shouldEvaluateSection)
+	{
+		renderOperators(frame, parsedLine->operators, currentLine, sizeof(currentLine));
 
-			
-		}
-		// Write back into currentLine
-		parse_reconstruct_string(parsedLine, currentLine); 
-			
-		/* 
-			Check for conditional expansion keywords - IF, ELSE, ENDIF, WHILE, ENDW
-			Algorithm is as follows:
-			1. When line hits IF or WHILE, increment the respective counter
-			2. If is allowed to evaluate the entire section, then evaluate the expression
-			3. else set the array value to SKIP.
-			4. when endif is hit, decrement the respective counter and restore the previous result
-			4A.If endw is hit, evaluate the while expression again.  if result is still good, loop
-			4B.If while result is bad, then skip to the endw line, decrement counter, and restore previous while result.
-			5. if an ELSE is hit, and allowed to evaluate the entire section, evaluate what follows until endif.
-			6. if else is hit and not allowed to evaluate the entire section, skip the section.
-		*/
-		if(strncmp(parsedLine->opcode, "IF", strlen("IF")) == SUCCESS || 
-			strncmp(parsedLine->opcode, "WHILE", strlen("WHILE")) == SUCCESS)
-		{
-			isWhileExpression = (strncmp(parsedLine->opcode, "WHILE", strlen("WHILE")) == SUCCESS);
+		// Move currentLine back to parsedLine->operators
+		free(parsedLine->operators);
+		parsedLine->operators = _strdup(currentLine);
 
-			// Increment global variable
-			
-			CONDSTATEMENTLEVEL++;
 		
-			
-			// Evaluate operands only if allowed to evaluate entire section
-			if(shouldEvaluateSection)
-			{
-				ifExpressionResult = evaluateIFOperands(parsedLine->operators);
-			}
-			else
-				ifExpressionResult = SKIP;
-
-			if(ifExpressionResult == FAILURE)
-			{
-				printf("ERROR: Failed to parse operands in IF statement.\n");
-				return FAILURE;
-			}
-            else if(ifExpressionResult == SKIP)
-			{
-				nestedCondArray[CONDSTATEMENTLEVEL] = SKIP;
-			}
-			else
-			{
-				//only put while def line input here if the while evals true
-				nestedCondArray[CONDSTATEMENTLEVEL] = (isWhileExpression && ifExpressionResult) ? deftabIndex : ifExpressionResult;
-			}
+	}
+	// Write back into currentLine
+	parse_reconstruct_string(parsedLine, currentLine); 
+		
+	/* 
+		Check for conditional expansion keywords - IF, ELSE, ENDIF, WHILE, ENDW
+		Algorithm is as follows:
+		1. When line hits IF or WHILE, increment the respective counter
+		2. If is allowed to evaluate the entire section, then evaluate the expression
+		3. else set the array value to SKIP.
+		4. when endif is hit, decrement the respective counter and restore the previous result
+		4A.If endw is hit, evaluate the while expression again.  if result is still good, loop
+		4B.If while result is bad, then skip to the endw line, decrement counter, and restore previous while result.
+		5. if an ELSE is hit, and allowed to evaluate the entire section, evaluate what follows until endif.
+		6. if else is hit and not allowed to evaluate the entire section, skip the section.
+	*/
+	if(parsedLine->opcode == NULL)
+	{
+		// nothing to check
+	}
+	else if(strncmp(parsedLine->opcode, "IF", strlen("IF")) == SUCCESS || 
+		strncmp(parsedLine->opcode, "WHILE", strlen("WHILE")) == SUCCESS)
+	{
+		isWhileExpression = (strncmp(parsedLine->opcode, "WHILE", strlen("WHILE")) == SUCCESS);
 
-			// Only evaluate section if it's true, otherwise skip
-			shouldEvaluateSection = (ifExpressionResult == TRUE);
-			
-			// skip over if line
-			deftabIndex++;
-			continue;
+		frame->condLevel++;
+		if(frame->condLevel >= MAX_NESTED_COND_SIZE)
+		{
+			printError("ERROR: IF/WHILE statements nested too deeply in macro %s.\n", frame->entry->symbol);
+			return FAILURE;
+		}
+		
+		// Evaluate operands only if allowed to evaluate entire section
+		if(frame->shouldEvaluateSection)
+		{
+			ifExpressionResult = evaluateIFOperands(parsedLine->operators);
+		}
+		else
+			ifExpressionResult = SKIP;
 
+		if(ifExpressionResult == FAILURE)
+		{
+			printError("ERROR: Failed to parse operands in IF statement.\n");
+			return FAILURE;
 		}
-		else if(strncmp(parsedLine->opcode, "ENDIF", strlen("ENDIF")) == SUCCESS || 
-			strncmp(parsedLine->opcode, "ENDW", strlen("ENDW")) == SUCCESS)
+            else if(ifExpressionResult == SKIP)
+		{
+			frame->condStack[frame->condLevel] = SKIP;
+		}
+		else
 		{
-			isWhileExpression = strncmp(parsedLine->opcode, "ENDW", strlen("ENDW")) == SUCCESS;			
+			//only put while def line input here if the while evals true
+			frame->condStack[frame->condLevel] = (isWhileExpression && ifExpressionResult) ? frame->lineIndex : ifExpressionResult;
+		}
 
-			// Resets shouldEvaluateSection to the value from before the if/while started
-			// IF/WHILE STATEMENT LEVELs were decremented before this section
-			if (isWhileExpression)
-			{
-				//If the while expression evaluated to false, break out of the loop
-				if(shouldEvaluateSection == FALSE)
-				{
-					//if current while condition is false
-					CONDSTATEMENTLEVEL--;
-					shouldEvaluateSection = (nestedCondArray[CONDSTATEMENTLEVEL] == TRUE);
-				}
-				else{
-					//While statements need to loop back if still true
-					deftabIndex = nestedCondArray[CONDSTATEMENTLEVEL];
-					CONDSTATEMENTLEVEL --;
-					continue;
-				}
-				
-			}
-			else
-			{
-				CONDSTATEMENTLEVEL--;
-				// If an if loop inside while loop, while loop is a line number
-				// Fortunately, line 0 must always be definition line, not while
-				shouldEvaluateSection = (nestedCondArray[CONDSTATEMENTLEVEL] >= TRUE);
-			}
+		// Only evaluate section if it's true, otherwise skip
+		frame->shouldEvaluateSection = (ifExpressionResult == TRUE);
+		return SUCCESS;
 
-			deftabIndex++;
+	}
+	else if(strncmp(parsedLine->opcode, "ENDIF", strlen("ENDIF")) == SUCCESS || 
+		strncmp(parsedLine->opcode, "ENDW", strlen("ENDW")) == SUCCESS)
+	{
+		isWhileExpression = strncmp(parsedLine->opcode, "ENDW", strlen("ENDW")) == SUCCESS;			
 
-			//Check if global variable is less than 0
-			if(CONDSTATEMENTLEVEL < 0)
+		// Resets shouldEvaluateSection to the value from before the if/while started
+		if (isWhileExpression && frame->shouldEvaluateSection)
+		{
+			if (budget_charge(budget, BUDGET_LOOPS, 1) != SUCCESS || budget_tick(budget) != SUCCESS)
 			{
-				printf("ERROR: Number of ENDIF/ENDW Statements do not match with number of IF/WHILE statements");
+				budget_report(budget, frame->entry->symbol, deftab_get(deftab, frame->condStack[frame->condLevel]));
 				return FAILURE;
 			}
 
-			continue;
-			
+			//While statements need to loop back if still true
+			frame->cursor = frame->condStack[frame->condLevel];
+			frame->condLevel--;
+			return SUCCESS;
 		}
-		else if(strncmp(parsedLine->opcode, "ELSE", strlen("ELSE")) == SUCCESS && CONDSTATEMENTLEVEL > 0)
+
+		frame->condLevel--;
+
+		//Check if nesting level is less than 0
+		if(frame->condLevel < 0)
 		{
-			//Process the next line until endif only if IF evaluation was false
-			// Likewise, if the IF was true, then evaluate is FALSE
-			if(nestedCondArray[CONDSTATEMENTLEVEL] > -1)
-			{
-				// section not skipped, so flip the section evaluation
-				shouldEvaluateSection = !shouldEvaluateSection;
-		
-				//Replace the value inside the nestedIFArray with the new value
-				// in case a new if/endif disrupts parsing
-				nestedCondArray[CONDSTATEMENTLEVEL] = shouldEvaluateSection;
-			}
+			printError("ERROR: Number of ENDIF/ENDW Statements do not match with number of IF/WHILE statements");
+			return FAILURE;
+		}
 
-			deftabIndex++;
-			continue;
+		if (isWhileExpression)
+		{
+			//If the while expression evaluated to false, break out of the loop
+			frame->shouldEvaluateSection = (frame->condStack[frame->condLevel] == TRUE);
+		}
+		else
+		{
+			// If an if loop inside while loop, while loop is a line number
+			// Fortunately, line 0 must always be definition line, not while
+			frame->shouldEvaluateSection = (frame->condStack[frame->condLevel] >= TRUE);
 		}
+		return SUCCESS;
+		
+	}
+	else if(strncmp(parsedLine->opcode, "ELSE", strlen("ELSE")) == SUCCESS && frame->condLevel > 0)
+	{
+		//Process the next line until endif only if IF evaluation was false
+		// Likewise, if the IF was true, then evaluate is FALSE
+		if(frame->condStack[frame->condLevel] > -1)
+		{
+			// section not skipped, so flip the section evaluation
+			frame->shouldEvaluateSection = !frame->shouldEvaluateSection;
 	
+			//Replace the value inside the condStack with the new value
+			// in case a new if/endif disrupts parsing
+			frame->condStack[frame->condLevel] = frame->shouldEvaluateSection;
+		}
+		return SUCCESS;
+	}
+
 
-		if(shouldEvaluateSection == TRUE)
+	if(frame->shouldEvaluateSection == TRUE)
+	{
+		if(VERBOSE)
 		{
-			if(VERBOSE)
-			{
-				printf("currentLine is %s\n", currentLine);
-			}
-			processLine(inputFileDes, outputFileDes, currentLine);
+			printf("currentLine is %s\n", currentLine);
+		}
+		// may push a frame for a nested invocation, or consume body lines for a nested definition
+		if(processLine(inputFileDes, outputFileDes, currentLine) != SUCCESS)
+		{
+			return FAILURE;
 		}
-	
-		deftabIndex++;
 	}
-	
+
+	return SUCCESS;
+}
+
+/*
+ * unwindFrames:
+ * Abandons every active invocation after an error and restores the ARGTAB
+ * that was in use before the outermost invocation.
+ *
+ * Parameters:
+ *  - none
+ * Returns:
+ *  - none
+ */
+void unwindFrames(void)
+{
+	expstack_frame_t *frame;
+
+	while ((frame = expstack_top(expstack)) != NULL) {
+		argtab = frame->parentArgtab;
+		expstack_pop(expstack);
+	}
 	EXPANDING = FALSE;
-	UNIQUE_ID++;        // increment invocation ID
-    argtab_clear(argtab); // also clear the argtab -- otherwise, screws up getline
+}
+
+
+
+
+/*
+ * getCacheKey:
+ * Builds the expansion cache key of an invocation: the macro name, the
+ * invocation label and the operands, one per line. The cache of watch mode is
+ * kept from run to run, so its keys also hold the digest of the definition.
+ *
+ * Parameters:
+ *  - macroName - Name of MACRO being expanded
+ *  - invocationLine - macro invocation line
+ *  - digest - Digest of the macro definition, 0 for none
+ * Returns:
+ *  - Key allocated with malloc, or NULL on failure
+ */
+char *getCacheKey(const char *macroName, const char *invocationLine, unsigned long long digest)
+{
+	parse_info_t *parsedLine = parse_info_alloc();
+	char *key = NULL;
+	const char *label;
+	const char *operators;
+	int bufferLen;
+
+	if (parsedLine == NULL || parse_line(parsedLine, invocationLine) == FAILURE) {
+		parse_info_free(parsedLine);
+		return NULL;
+	}
+
+	label = (parsedLine->label != NULL) ? parsedLine->label : "";
+	operators = (parsedLine->operators != NULL) ? parsedLine->operators : "";
+	bufferLen = strlen(macroName) + strlen(label) + strlen(operators) + 3 + 17;
+	key = (char *) malloc(bufferLen);
+	if (key != NULL && digest != 0) {
+		sprintf_s(key, bufferLen, "%s\n%s\n%s\n%016llx", macroName, label, operators, digest);
+	}
+	else if (key != NULL) {
+		sprintf_s(key, bufferLen, "%s\n%s\n%s", macroName, label, operators);
+	}
 
-	// free memory
 	parse_info_free(parsedLine);
+	return key;
+}
+
+/*
+ * replayExpansion:
+ * Writes a cached expansion to the output file, stamped with the unique label
+ * prefix of a new invocation.
+ *
+ * Parameters:
+ *  - outputFileDes - File descriptor for the output (expanded) assembly program file
+ *  - cached - Recorded expansion from the expansion cache
+ *  - macroName - Name of MACRO being expanded
+ * Returns:
+ * SUCCESS (0) or FAILURE (-1)
+ */
+int replayExpansion(stream_t *outputFileDes, expcache_entry_t *cached, const char *macroName)
+{
+	char line[CURRENT_LINE_SIZE];
+	int uniqueId = UNIQUE_ID++;	// invocation ID
+	int i;
+
+	for (i = 0; i < cached->size; i++) {
+		strcpy_s(line, sizeof(line), cached->lines[i]);
+		if (budget_charge(budget, BUDGET_LINES, 1) != SUCCESS || budget_tick(budget) != SUCCESS) {
+			return budget_report(budget, macroName, line);
+		}
+		if (writeExpandedLine(outputFileDes, line, sizeof(line), cached->labelCount[i], uniqueId, macroName) != SUCCESS) {
+			return FAILURE;
+		}
+	}
+
+	return SUCCESS;
+}
+
+
+/*
+ * finishFrame:
+ * Completes the top frame once its body is done: a variant specialized by it
+ * is kept for the macro and spliced into the output, a recorded expansion is
+ * kept in the expansion cache, and the frame is popped.
+ *
+ * Parameters:
+ *  - outputFileDes - File descriptor for the output (expanded) assembly program file
+ *  - frame - Top frame of the expansion stack
+ * Returns:
+ * SUCCESS (0) or FAILURE (-1)
+ */
+int finishFrame(stream_t *outputFileDes, expstack_frame_t *frame)
+{
+	expcache_entry_t *variant = frame->variant;
+	int result = SUCCESS;
+
+	if (variant != NULL) {
+		frame->variant = NULL;
+		result = spliceVariant(outputFileDes, frame, variant);
+
+		// the macro's variant cache owns the variant if added
+		if (expcache_add(frame->entry->variants, variant) != SUCCESS) {
+			expcache_entryFree(variant);
+		}
+	}
+
+	// keep the recorded expansion, the cache owns it if added
+	if (frame->record != NULL && expcache_add(expcache, frame->record) == SUCCESS) {
+		frame->record = NULL;
+	}
+	argtab = frame->parentArgtab;
+	expstack_pop(expstack);
+
+	return result;
+}
+
+/*
+ * emitFrameLine:
+ * Emits an expanded line of the top frame. While a variant is specialized the
+ * line still holds parameter markers and is only recorded. Otherwise it is
+ * recorded for the expansion cache, if the invocation is cached, charged to
+ * the line budget, and written with the unique label prefix of the invocation.
+ *
+ * Parameters:
+ *  - outputFileDes - File descriptor for the output (expanded) assembly program file
+ *  - frame - Top frame of the expansion stack
+ *  - line - Expanded line, before unique label stamping. Stamped in place.
+ *  - bufsize - Size of the line buffer
+ *  - labelCount - Number of '$' markers to stamp, from DEFTAB
+ * Returns:
+ * SUCCESS (0) or FAILURE (-1)
+ */
+int emitFrameLine(stream_t *outputFileDes, expstack_frame_t *frame, char *line, size_t bufsize, int labelCount)
+{
+	if (frame->variant != NULL) {
+		if (expcache_entryAddLine(frame->variant, line, labelCount) == SUCCESS) {
+			return SUCCESS;
+		}
+		if (abandonSpecialization(outputFileDes, frame) == FAILURE) {
+			return FAILURE;
+		}
+	}
+
+	// record the line, unstamped, if this invocation is being cached
+	if (frame->record != NULL && expcache_entryAddLine(frame->record, line, labelCount) != SUCCESS) {
+		expcache_entryFree(frame->record);
+		frame->record = NULL;
+	}
+
+	if (budget_charge(budget, BUDGET_LINES, 1) != SUCCESS || budget_tick(budget) != SUCCESS) {
+		return budget_report(budget, frame->entry->symbol, line);
+	}
+
+	return writeExpandedLine(outputFileDes, line, bufsize, labelCount, frame->uniqueId, frame->entry->symbol);
+}
+
+/*
+ * getVariant:
+ * Binds the dynamic parameters of a specializable invocation to their markers
+ * and looks up the variant for its static parameter values. If there is none
+ * yet, the frame starts specializing one: its ARGTAB maps each dynamic
+ * parameter to its marker, so the expanded lines keep the markers.
+ *
+ * Parameters:
+ *  - frame - Top frame, with the invocation arguments set up
+ * Returns:
+ *  - The cached variant, or NULL if the frame is specializing a new one
+ */
+expcache_entry_t *getVariant(expstack_frame_t *frame)
+{
+	namtab_entry_t *entry = frame->entry;
+	expcache_entry_t *variant = NULL;
+	char *key;
+	char *names;
+	char *name;
+	char *nextToken = NULL;
+	char marker[8];
+	int i = 0;
+
+	argtab_clear(frame->spliceArgs);
+	if (entry->dynamicParams != NULL) {
+		names = _strdup(entry->dynamicParams);
+		for (name = strtok_s(names, ",", &nextToken); name != NULL; name = strtok_s(NULL, ",", &nextToken)) {
+			getParameterMarker(i++, marker, sizeof(marker));
+			copyArgument(frame->spliceArgs, marker, frame->argtab, name);
+			argtab_set(frame->argtab, name, marker);
+		}
+		free(names);
+	}
+
+	if (entry->variants == NULL) {
+		entry->variants = expcache_alloc();
+	}
+
+	key = getVariantKey(frame);
+	variant = expcache_get(entry->variants, key);
+	if (variant != NULL) {
+		entry->variants->hits++;
+	}
+	else {
+		entry->variants->misses++;
+		frame->variant = expcache_entryAlloc(key);
+	}
+
+	free(key);
+	return variant;
+}
+
+/*
+ * getVariantKey:
+ * Builds the variant key of an invocation: the invocation label and the
+ * values of the static parameters, one per line. Array values keep their
+ * parentheses.
+ *
+ * Parameters:
+ *  - frame - Top frame, with the invocation arguments set up
+ * Returns:
+ *  - Key allocated with malloc
+ */
+char *getVariantKey(expstack_frame_t *frame)
+{
+	char *key;
+	char *names;
+	char *name;
+	char *value;
+	char *nextToken = NULL;
+	int bufferLen = 2;
+
+	if (frame->label != NULL) {
+		bufferLen += strlen(frame->label);
+	}
+	if (frame->entry->staticParams != NULL) {
+		// at most one value (plus parens and newline) per name
+		bufferLen += (ARGTAB_STRING_SIZE + 3) * (strlen(frame->entry->staticParams) + 1);
+	}
+
+	key = (char *) malloc(bufferLen);
+	strcpy_s(key, bufferLen, (frame->label != NULL) ? frame->label : "");
+	strcat_s(key, bufferLen, "\n");
+
+	if (frame->entry->staticParams != NULL) {
+		names = _strdup(frame->entry->staticParams);
+		for (name = strtok_s(names, ",", &nextToken); name != NULL; name = strtok_s(NULL, ",", &nextToken)) {
+			value = argtab_get(frame->argtab, name);
+			if (argtab_isArray(frame->argtab, name)) {
+				strcat_s(key, bufferLen, "(");
+				strcat_s(key, bufferLen, value);
+				strcat_s(key, bufferLen, ")");
+			}
+			else if (value != NULL) {
+				strcat_s(key, bufferLen, value);
+			}
+			strcat_s(key, bufferLen, "\n");
+		}
+		free(names);
+	}
+
+	return key;
+}
+
+/*
+ * getParameterMarker:
+ * Gets the marker standing in for a dynamic parameter in specialized variants.
+ * Markers start with a control character, so they never match a parameter
+ * name or text of the macro body.
+ *
+ * Parameters:
+ *  - index - Position of the parameter in the dynamic parameter list
+ *  - marker - Buffer for the marker
+ *  - size - Size of the buffer
+ * Returns:
+ *  - none
+ */
+void getParameterMarker(int index, char *marker, size_t size)
+{
+	sprintf_s(marker, size, "\x01%c%c", 'A' + (index / 26) % 26, 'A' + index % 26);
+}
+
+/*
+ * copyArgument:
+ * Copies an argument value between ARGTABs, keeping array values arrays.
+ *
+ * Parameters:
+ *  - to - Destination ARGTAB
+ *  - toKey - Symbol to add or set in the destination
+ *  - from - Source ARGTAB
+ *  - fromKey - Symbol to copy from the source
+ * Returns:
+ *  - none
+ */
+void copyArgument(argtab_t *to, const char *toKey, argtab_t *from, const char *fromKey)
+{
+	char value[ARGTAB_STRING_SIZE + 2];
+	char *fromValue = argtab_get(from, fromKey);
+
+	if (fromValue == NULL) {
+		return;
+	}
+
+	if (argtab_isArray(from, fromKey)) {
+		sprintf_s(value, sizeof(value), "(%s)", fromValue);
+	}
+	else {
+		strcpy_s(value, sizeof(value), fromValue);
+	}
+	argtab_addOrSet(to, toKey, value);
+}
+
+/*
+ * spliceVariant:
+ * Writes a specialized variant to the output file, with the values of the
+ * dynamic parameters spliced in for their markers.
+ *
+ * Parameters:
+ *  - outputFileDes - File descriptor for the output (expanded) assembly program file
+ *  - frame - Top frame, with its dynamic parameters bound to their markers
+ *  - variant - Variant for the static parameter values of the invocation
+ * Returns:
+ * SUCCESS (0) or FAILURE (-1)
+ */
+int spliceVariant(stream_t *outputFileDes, expstack_frame_t *frame, expcache_entry_t *variant)
+{
+	char line[CURRENT_LINE_SIZE];
+	int i;
+
+	for (i = 0; i < variant->size; i++) {
+		strcpy_s(line, sizeof(line), variant->lines[i]);
+		argtab_substituteValues(frame->spliceArgs, line, sizeof(line));
+		if (emitFrameLine(outputFileDes, frame, line, sizeof(line), variant->labelCount[i]) != SUCCESS) {
+			return FAILURE;
+		}
+	}
 
 	return SUCCESS;
 }
 
+/*
+ * abandonSpecialization:
+ * Stops specializing a variant in the top frame, when its output can't be
+ * held back any longer (a nested invocation). The lines recorded so far are
+ * written with the arguments spliced in, the dynamic parameters get their
+ * values back for the rest of the body, and the macro is no longer
+ * specialized.
+ *
+ * Parameters:
+ *  - outputFileDes - File descriptor for the output (expanded) assembly program file
+ *  - frame - Top frame of the expansion stack
+ * Returns:
+ * SUCCESS (0) or FAILURE (-1)
+ */
+int abandonSpecialization(stream_t *outputFileDes, expstack_frame_t *frame)
+{
+	expcache_entry_t *variant = frame->variant;
+	char *names;
+	char *name;
+	char *nextToken = NULL;
+	char marker[8];
+	int i = 0;
+	int result;
+
+	frame->variant = NULL;
+	frame->entry->effects |= MACRO_INVOKES;
+
+	result = spliceVariant(outputFileDes, frame, variant);
+	expcache_entryFree(variant);
+
+	if (frame->entry->dynamicParams != NULL) {
+		names = _strdup(frame->entry->dynamicParams);
+		for (name = strtok_s(names, ",", &nextToken); name != NULL; name = strtok_s(NULL, ",", &nextToken)) {
+			getParameterMarker(i++, marker, sizeof(marker));
+			copyArgument(frame->argtab, name, frame->spliceArgs, marker);
+		}
+		free(names);
+	}
+
+	return result;
+}
+
+/*
+ * renderOperators:
+ * Substitutes argument and SET variable values into the operators of the
+ * line last read by the frame. Lines in WHILE bodies keep their substituted
+ * text, which later iterations reuse as long as none of the variables the
+ * line refers to was set since.
+ *
+ * Parameters:
+ *  - frame - Top frame of the expansion stack
+ *  - operators - Operators of the line, from DEFTAB
+ *  - buffer - Buffer for the substituted operators
+ *  - bufsize - Size of the buffer
+ * Returns:
+ *  - none
+ */
+void renderOperators(expstack_frame_t *frame, const char *operators, char *buffer, size_t bufsize)
+{
+	expstack_render_t *render = NULL;
+
+	if (deftab_getLoopDepth(deftab, frame->lineIndex) > 0) {
+		if (frame->renders == NULL) {
+			frame->renders = (expstack_render_t *) calloc(frame->end - frame->entry->deftabStart + 1, sizeof(expstack_render_t));
+		}
+		if (frame->renders != NULL) {
+			render = &frame->renders[frame->lineIndex - frame->entry->deftabStart];
+		}
+	}
+
+	if (render != NULL && render->text != NULL && isRenderCurrent(render, frame->argtab)) {
+		expstack->renderHits++;
+		strcpy_s(buffer, bufsize, render->text);
+		return;
+	}
+
+	strncpy_s(buffer, bufsize, operators, strlen(operators));
+	argtab_substituteValues(frame->argtab, buffer, bufsize);
+
+	if (render != NULL) {
+		expstack->renderMisses++;
+		keepRender(render, frame->argtab, operators, buffer);
+	}
+}
+
+/*
+ * isRenderCurrent:
+ * Checks whether a rendered line is still what substitution would produce:
+ * no variable was added to the ARGTAB and none of its inputs was set since.
+ *
+ * Parameters:
+ *  - render - Rendered line
+ *  - table - ARGTAB of the frame
+ * Returns:
+ *  - TRUE or FALSE
+ */
+int isRenderCurrent(expstack_render_t *render, argtab_t *table)
+{
+	int i;
+
+	if (render->numVariables != HASH_COUNT(table->data)) {
+		return FALSE;
+	}
+
+	for (i = 0; i < render->numInputs; i++) {
+		if (render->inputs[i]->version != render->versions[i]) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * keepRender:
+ * Keeps the substituted text of a WHILE body line, with its inputs: every
+ * ARGTAB element whose name occurs in the operators, as substitution
+ * replaces names wherever they occur. Text that still refers to a variable
+ * is not kept, since it may change meaning when that variable is set.
+ *
+ * Parameters:
+ *  - render - Rendered line to fill in
+ *  - table - ARGTAB of the frame
+ *  - operators - Operators of the line, from DEFTAB
+ *  - text - Substituted operators
+ * Returns:
+ *  - none
+ */
+void keepRender(expstack_render_t *render, argtab_t *table, const char *operators, const char *text)
+{
+	struct argtab_data *element, *tmp;
+	unsigned int count = HASH_COUNT(table->data);
+
+	free(render->text);
+	free(render->inputs);
+	free(render->versions);
+	memset(render, 0, sizeof(expstack_render_t));
+
+	if (strchr(text, '&') != NULL) {
+		return;
+	}
+
+	render->inputs = (struct argtab_data **) malloc((count + 1) * sizeof(struct argtab_data *));
+	render->versions = (unsigned int *) malloc((count + 1) * sizeof(unsigned int));
+	render->text = _strdup(text);
+	if (render->inputs == NULL || render->versions == NULL || render->text == NULL) {
+		free(render->text);
+		free(render->inputs);
+		free(render->versions);
+		memset(render, 0, sizeof(expstack_render_t));
+		return;
+	}
+
+	HASH_ITER(hh, table->data, element, tmp) {
+		if (strstr(operators, element->key) != NULL) {
+			render->inputs[render->numInputs] = element;
+			render->versions[render->numInputs] = element->version;
+			render->numInputs++;
+		}
+	}
+	render->numVariables = count;
+}
 
 /*
  * setUpArguments:
@@ -367,7 +1009,7 @@ int setUpArguments (const char *currLine, const char *macroDef, const char *macr
 	 * for the first instruction in the macro definition, while expanding.
 	 */
 	if (splitDefLine->label != NULL) {
-		currentLabel = _strdup(splitInvLine->label);
+		expstack_top(expstack)->label = _strdup(splitInvLine->label);
 	}
 
     // make sure we have operators
@@ -396,7 +1038,7 @@ int setUpArguments (const char *currLine, const char *macroDef, const char *macr
             splitKeyValuePair(defOperand, tmpKey, sizeof(tmpKey), tmpValue, sizeof(tmpValue));
 			if(argtab_addOrSet(argtab, tmpKey, tmpValue) == FAILURE)
 			{
-				printf("Illegal Parameter!\n");
+				printError("Illegal Parameter!\n");
 				return FAILURE;
 			}
             defOperand = strtok_s(NULL, ", ", &nextDefToken);
@@ -409,7 +1051,7 @@ int setUpArguments (const char *currLine, const char *macroDef, const char *macr
             splitKeyValuePair(operand, tmpKey, sizeof(tmpKey), tmpValue, sizeof(tmpValue));
             if (argtab_set(argtab, tmpKey, tmpValue) == FAILURE)
 			{
-				printf("Illegal Parameter!\n");
+				printError("Illegal Parameter!\n");
 				return FAILURE;
 			}
             operand = strtok_s(NULL, ", ", &nextInvToken);
@@ -440,7 +1082,7 @@ int setUpArguments (const char *currLine, const char *macroDef, const char *macr
 			//clear out previous operand
 			memset(operand, '\0', SHORT_STRING_SIZE);
 
-			if(endPtr != NULL)
+			if(endPtr != NULL && *endPtr != '\0')
 			{
 				startPtr = endPtr + 1;
 				//remove spaces
@@ -634,7 +1276,7 @@ int getNumArguments(char *line)
  * SUCCESS (0) or FAILURE (-1)
  */
 
-int commentOutMacroCall(char *inputLine, FILE *outputfd)
+int commentOutMacroCall(char *inputLine, stream_t *outputfd)
 {
     int bufferLen;
 	char *commentedLine;
@@ -656,7 +1298,11 @@ int commentOutMacroCall(char *inputLine, FILE *outputfd)
 		strcpy_s(commentedLine, bufferLen, ".");
 		strcat_s(commentedLine, bufferLen, inputLine);
 
-		fprintf(outputfd, commentedLine);
+		stream_puts(outputfd, commentedLine);
+
+		// invocations inside a macro body were reconstructed without the newline
+		if(commentedLine[strlen(commentedLine) - 1] != '\n')
+			stream_puts(outputfd, "\n");
 
         free(commentedLine);
 		return SUCCESS;
@@ -684,7 +1330,7 @@ int evaluateIFOperands(char *operands)
 	char * middleoperand = NULL;
 	char * rightoperand = NULL;
 	char *ptr = operands;
-    char val[30];
+    char val[32];
     int n, count = 0, result = 0;
 
 
@@ -742,4 +1388,4 @@ int evaluateIFOperands(char *operands)
 		return atoi(leftoperand) >= atoi(rightoperand);
 
 	return FAILURE;
-}
\ No newline at end of file
+}
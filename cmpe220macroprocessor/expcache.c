@@ -0,0 +1,273 @@
+/*
+ * expcache.c - Contains functions for the expansion cache.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "definitions.h"
+#include "expcache.h"
+
+/**
+ * Function: expcache_alloc
+ * Description:
+ *  - Allocates memory for an expansion cache.
+ * Parameters:
+ *  - none
+ * Returns:
+ *  - If successful, returns pointer to new cache. Otherwise, returns NULL.
+ */
+expcache_t * expcache_alloc(void)
+{
+    expcache_t * cache = (expcache_t *) malloc(sizeof(expcache_t));
+    if(cache != NULL)
+    {
+        // initialize values
+        memset(cache, 0, sizeof(expcache_t));
+        cache->data = NULL;
+    }
+
+    return cache;
+}
+
+/**
+ * Function: expcache_free
+ * Description:
+ *  - Frees the cache and every entry in it.
+ * Parameters:
+ *  - cache: Pointer to expansion cache.
+ * Returns:
+ *  - none
+ */
+void expcache_free(expcache_t * cache)
+{
+    expcache_entry_t *i, *tmp;
+
+    if(cache)
+    {
+        HASH_ITER(hh, cache->data, i, tmp)
+        {
+            HASH_DEL(cache->data, i);
+            expcache_entryFree(i);
+        }
+        free(cache);
+    }
+}
+
+/**
+ * Function: expcache_get
+ * Description:
+ *  - Looks up the expansion recorded for the given key.
+ * Parameters:
+ *  - cache: Pointer to expansion cache.
+ *  - key: Key built from macro name, invocation label and operands.
+ * Returns:
+ *  - Pointer to the entry, or NULL if there is none.
+ */
+expcache_entry_t * expcache_get(expcache_t * cache, const char * key)
+{
+    expcache_entry_t * found = NULL;
+
+    if(cache && key)
+    {
+        HASH_FIND(hh, cache->data, key, strlen(key), found);
+    }
+
+    return found;
+}
+
+/**
+ * Function: expcache_add
+ * Description:
+ *  - Adds a recorded expansion to the cache. The cache takes ownership of the
+ *    entry only if it was added.
+ * Parameters:
+ *  - cache: Pointer to expansion cache.
+ *  - entry: Entry from expcache_entryAlloc.
+ * Returns:
+ *  - SUCCESS if added, FAILURE if the key exists or the cache is full.
+ */
+int expcache_add(expcache_t * cache, expcache_entry_t * entry)
+{
+    if(cache == NULL || entry == NULL || cache->size >= EXPCACHE_MAX_ENTRIES ||
+       expcache_get(cache, entry->key) != NULL)
+    {
+        return FAILURE;
+    }
+
+    HASH_ADD_KEYPTR(hh, cache->data, entry->key, strlen(entry->key), entry);
+    cache->size++;
+    return SUCCESS;
+}
+
+/**
+ * Function: expcache_remove
+ * Description:
+ *  - Removes an entry from the cache and frees it.
+ * Parameters:
+ *  - cache: Pointer to expansion cache.
+ *  - entry: Entry in the cache.
+ * Returns:
+ *  - none
+ */
+void expcache_remove(expcache_t * cache, expcache_entry_t * entry)
+{
+    if(cache && entry)
+    {
+        HASH_DEL(cache->data, entry);
+        cache->size--;
+        expcache_entryFree(entry);
+    }
+}
+
+/**
+ * Function: expcache_removeMacro
+ * Description:
+ *  - Removes the expansions of a macro, when it is defined again.
+ * Parameters:
+ *  - cache: Pointer to expansion cache.
+ *  - symbol: Name of the macro, the part of the keys before the first
+ *    newline.
+ * Returns:
+ *  - Number of entries removed.
+ */
+int expcache_removeMacro(expcache_t * cache, const char * symbol)
+{
+    expcache_entry_t *entry, *tmp;
+    size_t length;
+    int count = 0;
+
+    if(cache == NULL || symbol == NULL)
+    {
+        return 0;
+    }
+
+    length = strlen(symbol);
+    HASH_ITER(hh, cache->data, entry, tmp)
+    {
+        if(strncmp(entry->key, symbol, length) == 0 && entry->key[length] == '\n')
+        {
+            expcache_remove(cache, entry);
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/**
+ * Function: expcache_entryAlloc
+ * Description:
+ *  - Allocates an empty entry to record an expansion into.
+ * Parameters:
+ *  - key: Key of the invocation being recorded.
+ * Returns:
+ *  - If successful, returns pointer to the entry. Otherwise, returns NULL.
+ */
+expcache_entry_t * expcache_entryAlloc(const char * key)
+{
+    expcache_entry_t * entry;
+
+    if(key == NULL)
+    {
+        return NULL;
+    }
+
+    entry = (expcache_entry_t *) malloc(sizeof(expcache_entry_t));
+    if(entry)
+    {
+        memset(entry, 0, sizeof(expcache_entry_t));
+        entry->key = _strdup(key);
+        if(entry->key == NULL)
+        {
+            free(entry);
+            entry = NULL;
+        }
+    }
+
+    return entry;
+}
+
+/**
+ * Function: expcache_entryFree
+ * Description:
+ *  - Frees an entry and its lines.
+ * Parameters:
+ *  - entry: Pointer to the entry.
+ * Returns:
+ *  - none
+ */
+void expcache_entryFree(expcache_entry_t * entry)
+{
+    int i;
+
+    if(entry)
+    {
+        for(i = 0; i < entry->size; i++)
+        {
+            free(entry->lines[i]);
+        }
+        free(entry->lines);
+        free(entry->labelCount);
+        free(entry->key);
+        free(entry);
+    }
+}
+
+/**
+ * Function: expcache_entryAddLine
+ * Description:
+ *  - Appends an expanded line to a recorded expansion.
+ * Parameters:
+ *  - entry: Pointer to the entry.
+ *  - line: Expanded line, before unique label stamping.
+ *  - labelCount: Number of '$' markers to stamp in the line.
+ * Returns:
+ *  - SUCCESS or FAILURE
+ */
+int expcache_entryAddLine(expcache_entry_t * entry, const char * line, int labelCount)
+{
+    char ** tmpLines;
+    int *   tmpCount;
+    int     capacity;
+
+    if(entry == NULL || line == NULL)
+    {
+        return FAILURE;
+    }
+
+    // check if arrays are full, if so, then grow capacity
+    if(entry->size >= entry->capacity)
+    {
+        capacity = (entry->capacity == 0) ? 8 : 2 * entry->capacity;
+        tmpLines = (char **) malloc(capacity * sizeof(char *));
+        tmpCount = (int *) malloc(capacity * sizeof(int));
+        if(tmpLines == NULL || tmpCount == NULL)
+        {
+            free(tmpLines);
+            free(tmpCount);
+            return FAILURE;
+        }
+
+        if(entry->size > 0)
+        {
+            memcpy(tmpLines, entry->lines, entry->size * sizeof(char *));
+            memcpy(tmpCount, entry->labelCount, entry->size * sizeof(int));
+        }
+        free(entry->lines);
+        free(entry->labelCount);
+        entry->lines = tmpLines;
+        entry->labelCount = tmpCount;
+        entry->capacity = capacity;
+    }
+
+    entry->lines[entry->size] = _strdup(line);
+    if(entry->lines[entry->size] == NULL)
+    {
+        return FAILURE;
+    }
+    entry->labelCount[entry->size] = labelCount;
+    entry->size++;
+
+    return SUCCESS;
+}
@@ -0,0 +1,44 @@
+/*
+ * expcache.h - Contains functions and definitions for the expansion cache.
+ */
+
+#ifndef EXPCACHE_H_
+#define EXPCACHE_H_
+
+#include "uthash\uthash.h"
+
+#define EXPCACHE_MAX_ENTRIES (4096)
+
+// Expanded text of one pure invocation. Lines are stored before unique label
+// stamping, with the number of '$' markers to stamp in each.
+typedef struct expcache_entry
+{
+    char *          key;
+    int             size;
+    int             capacity;
+    char **         lines;
+    int *           labelCount;
+    UT_hash_handle  hh;
+} expcache_entry_t;
+
+// Cache keyed by (macro name, invocation label, invocation operands), and in
+// watch mode the digest of the macro definition
+typedef struct
+{
+    int                 size;
+    int                 hits;
+    int                 misses;
+    expcache_entry_t *  data;
+} expcache_t;
+
+expcache_t *        expcache_alloc(void);
+void                expcache_free(expcache_t * cache);
+expcache_entry_t *  expcache_get(expcache_t * cache, const char * key);
+int                 expcache_add(expcache_t * cache, expcache_entry_t * entry);
+void                expcache_remove(expcache_t * cache, expcache_entry_t * entry);
+int                 expcache_removeMacro(expcache_t * cache, const char * symbol);
+expcache_entry_t *  expcache_entryAlloc(const char * key);
+void                expcache_entryFree(expcache_entry_t * entry);
+int                 expcache_entryAddLine(expcache_entry_t * entry, const char * line, int labelCount);
+
+#endif /* EXPCACHE_H_ */
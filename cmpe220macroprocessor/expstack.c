@@ -0,0 +1,255 @@
+/*
+ * expstack.c - Contains functions for the expansion frame stack.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "definitions.h"
+#include "expstack.h"
+
+// local function definitions
+void expstack_freeRenders(expstack_frame_t * frame);
+
+/**
+ * Function: expstack_alloc
+ * Description:
+ *  - Allocates memory for the expansion frame stack.
+ * Parameters:
+ *  - none
+ * Returns:
+ *  - If successful, returns pointer to new stack. Otherwise, returns NULL.
+ */
+expstack_t * expstack_alloc(void)
+{
+    expstack_frame_t * array;
+    expstack_t * stack = (expstack_t *) malloc(sizeof(expstack_t));
+    if(stack)
+    {
+        // initialize to zero
+        memset(stack, 0, sizeof(expstack_t));
+
+        // allocate memory for frame array (start with capacity of 4)
+        array = (expstack_frame_t *) malloc(4 * sizeof(expstack_frame_t));
+        if(array)
+        {
+            memset(array, 0, 4 * sizeof(expstack_frame_t));
+            stack->size = 0;
+            stack->capacity = 4;
+            stack->array = array;
+        }
+    }
+
+    return stack;
+}
+
+/**
+ * Function: expstack_free
+ * Description:
+ *  - De-allocates the memory associated with the stack, including the ARGTABs
+ *    kept by frames that are no longer in use.
+ * Parameters:
+ *  - stack: Pointer to the expansion stack.
+ * Returns:
+ *  - none
+ */
+void expstack_free(expstack_t * stack)
+{
+    int i;
+
+    if(stack)
+    {
+        if(stack->array)
+        {
+            for(i = 0; i < stack->capacity; i++)
+            {
+                argtab_free(stack->array[i].argtab);
+                free(stack->array[i].label);
+                expcache_entryFree(stack->array[i].record);
+                expcache_entryFree(stack->array[i].variant);
+                argtab_free(stack->array[i].spliceArgs);
+                expstack_freeRenders(&stack->array[i]);
+            }
+
+            free(stack->array);
+        }
+
+        free(stack);
+    }
+}
+
+/**
+ * Function: expstack_push
+ * Description:
+ *  - Pushes a new frame for an invocation of the given macro. The frame cursor
+ *    points at the macro prototype line, and the frame gets its own (empty)
+ *    ARGTABs. ARGTABs are kept when frames are popped and reused by the next
+ *    frame at the same depth, so nesting does not allocate per invocation.
+ *  - NOTE: Pointers to frames are invalidated by the next push.
+ * Parameters:
+ *  - stack: Pointer to the expansion stack.
+ *  - entry: NAMTAB entry of the macro being invoked.
+ * Returns:
+ *  - If successful, returns pointer to the new top frame. Otherwise, returns
+ *    NULL.
+ */
+expstack_frame_t * expstack_push(expstack_t * stack, namtab_entry_t * entry)
+{
+    expstack_frame_t *  frame = NULL;
+    expstack_frame_t *  tmpArray;
+    argtab_t *          table;
+    argtab_t *          spliceArgs;
+
+    if(stack && stack->array && entry)
+    {
+        // check if array is full, if so, then grow capacity
+        if(stack->size >= stack->capacity)
+        {
+            tmpArray = (expstack_frame_t *) malloc(2 * stack->capacity * sizeof(expstack_frame_t));
+            if(tmpArray == NULL)
+            {
+                return NULL;
+            }
+
+            memcpy(tmpArray, stack->array, stack->capacity * sizeof(expstack_frame_t));
+            memset(tmpArray + stack->capacity, 0, stack->capacity * sizeof(expstack_frame_t));
+            free(stack->array);
+            stack->array = tmpArray;
+            stack->capacity *= 2;
+        }
+
+        frame = &stack->array[stack->size];
+
+        // reuse the ARGTAB left behind by a previous frame at this depth
+        table = frame->argtab;
+        if(table == NULL)
+        {
+            table = argtab_alloc();
+            if(table == NULL)
+            {
+                return NULL;
+            }
+        }
+        argtab_clear(table);
+
+        spliceArgs = frame->spliceArgs;
+        if(spliceArgs == NULL)
+        {
+            spliceArgs = argtab_alloc();
+            if(spliceArgs == NULL)
+            {
+                frame->argtab = table;
+                return NULL;
+            }
+        }
+
+        memset(frame, 0, sizeof(expstack_frame_t));
+        frame->entry = entry;
+        frame->cursor = entry->deftabStart;
+        frame->lineIndex = entry->deftabStart;
+        frame->end = entry->deftabEnd;
+        frame->argtab = table;
+        frame->spliceArgs = spliceArgs;
+        frame->condStack[0] = TRUE;
+        frame->shouldEvaluateSection = TRUE;
+
+        stack->size++;
+    }
+
+    return frame;
+}
+
+/**
+ * Function: expstack_pop
+ * Description:
+ *  - Removes the top frame from the stack. Its ARGTABs are cleared and kept
+ *    for reuse. Any unfinished cache recording or variant, and the rendered
+ *    WHILE body lines, are discarded.
+ * Parameters:
+ *  - stack: Pointer to the expansion stack.
+ * Returns:
+ *  - none
+ */
+void expstack_pop(expstack_t * stack)
+{
+    expstack_frame_t * frame;
+
+    if(stack && stack->size > 0)
+    {
+        frame = &stack->array[--stack->size];
+        argtab_clear(frame->argtab);
+        argtab_clear(frame->spliceArgs);
+        free(frame->label);
+        frame->label = NULL;
+
+        // a recording still attached here was not completed
+        expcache_entryFree(frame->record);
+        frame->record = NULL;
+        expcache_entryFree(frame->variant);
+        frame->variant = NULL;
+        expstack_freeRenders(frame);
+        frame->entry = NULL;
+    }
+}
+
+/**
+ * Function: expstack_top
+ * Description:
+ *  - Retrieves the frame of the innermost active invocation.
+ * Parameters:
+ *  - stack: Pointer to the expansion stack.
+ * Returns:
+ *  - Pointer to the top frame, or NULL if the stack is empty.
+ */
+expstack_frame_t * expstack_top(expstack_t * stack)
+{
+    expstack_frame_t * result = NULL;
+
+    if(stack && stack->size > 0)
+    {
+        result = &stack->array[stack->size - 1];
+    }
+
+    return result;
+}
+
+/**
+ * Function: expstack_isEmpty
+ * Description:
+ *  - Checks whether any invocation is being expanded.
+ * Parameters:
+ *  - stack: Pointer to the expansion stack.
+ * Returns:
+ *  - TRUE if there are no frames on the stack, FALSE otherwise.
+ */
+int expstack_isEmpty(expstack_t * stack)
+{
+    return (stack == NULL || stack->size == 0);
+}
+
+/**
+ * Function: expstack_freeRenders
+ * Description:
+ *  - De-allocates the rendered WHILE body lines kept by a frame.
+ * Parameters:
+ *  - frame: Pointer to the frame.
+ * Returns:
+ *  - none
+ */
+void expstack_freeRenders(expstack_frame_t * frame)
+{
+    int i;
+
+    if(frame && frame->renders && frame->entry)
+    {
+        for(i = 0; i <= frame->end - frame->entry->deftabStart; i++)
+        {
+            free(frame->renders[i].text);
+            free(frame->renders[i].inputs);
+            free(frame->renders[i].versions);
+        }
+
+        free(frame->renders);
+        frame->renders = NULL;
+    }
+}
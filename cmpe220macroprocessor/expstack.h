@@ -0,0 +1,62 @@
+/*
+ * expstack.h - Contains functions and definitions for the expansion frame stack.
+ */
+
+#ifndef EXPSTACK_H_
+#define EXPSTACK_H_
+
+#include "namtab.h"
+#include "argtab.h"
+#include "expcache.h"
+
+#define MAX_NESTED_COND_SIZE  (24)
+
+// Substituted operators of a WHILE body line, with the ARGTAB elements they
+// were rendered from and the versions those elements had at the time
+typedef struct
+{
+    char *                  text;
+    unsigned int            numVariables;   // elements in ARGTAB when rendered
+    int                     numInputs;
+    struct argtab_data **   inputs;
+    unsigned int *          versions;
+} expstack_render_t;
+
+// One frame per active macro invocation. The body is never copied, the frame
+// only holds a cursor into DEFTAB.
+typedef struct
+{
+    namtab_entry_t *    entry;          // macro being expanded
+    int                 cursor;         // next DEFTAB index to read
+    int                 lineIndex;      // DEFTAB index of the line last read
+    int                 end;            // DEFTAB index of MEND
+    argtab_t *          argtab;         // arguments and SET variables of this invocation
+    argtab_t *          parentArgtab;   // ARGTAB to restore when the frame is popped
+    int                 condLevel;      // current IF/WHILE nesting level
+    int                 condStack[MAX_NESTED_COND_SIZE];
+    int                 shouldEvaluateSection;
+    int                 uniqueId;       // invocation ID for unique label generation
+    char *              label;          // invocation label, pending until first line
+    expcache_entry_t *  record;         // expansion being recorded for the cache, if pure
+    expcache_entry_t *  variant;        // branch-free variant being specialized, if any
+    argtab_t *          spliceArgs;     // dynamic parameter values, keyed by their markers
+    expstack_render_t * renders;        // one per body line, allocated at the first WHILE line
+} expstack_frame_t;
+
+typedef struct
+{
+    int                 size;
+    int                 capacity;
+    expstack_frame_t *  array;
+    int                 renderHits;     // WHILE body lines reused without substitution
+    int                 renderMisses;   // WHILE body lines substituted
+} expstack_t;
+
+expstack_t *        expstack_alloc(void);
+void                expstack_free(expstack_t * stack);
+expstack_frame_t *  expstack_push(expstack_t * stack, namtab_entry_t * entry);
+void                expstack_pop(expstack_t * stack);
+expstack_frame_t *  expstack_top(expstack_t * stack);
+int                 expstack_isEmpty(expstack_t * stack);
+
+#endif /* EXPSTACK_H_ */
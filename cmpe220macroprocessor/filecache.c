@@ -0,0 +1,597 @@
+/*
+ * filecache.c - Contains functions for the build cache (--cache).
+ *
+ * An input file is expanded once for each combination of its bytes, the
+ * bytes of the macro library and the options, and the files it includes.
+ * The expanded file is kept in the cache directory under a hash of them, and
+ * later runs with the same hash copy it without running the macro processor.
+ * The included files are only known after a run, so they are listed in a
+ * manifest kept under the hash of the other three. The output file is only
+ * written when its bytes change, so its modification time only changes with
+ * its contents.
+ */
+
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#else
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "definitions.h"
+#include "filecache.h"
+
+// Entries are only used by the build of the processor that wrote them
+#define FILECACHE_STAMP     "cmpe220macroprocessor " __DATE__ " " __TIME__
+
+// local function definitions
+char * filecache_path(const char * directory, const char * key, const char * suffix);
+void filecache_getKey(const unsigned char digest[SHA256_DIGEST_SIZE], char * key);
+depfile_t * filecache_readManifest(const char * fileName);
+int filecache_hashIncludes(const char * key, depfile_t * includes, char * entryKey);
+int filecache_isSame(const char * leftFileName, const char * rightFileName);
+int filecache_copy(FILE * from, FILE * to);
+
+/**
+ * Function: filecache_open
+ * Description:
+ *  - Hashes an input file, the macro library and the options, and looks up
+ *    the entry of the hash and of the files its manifest lists. The cache
+ *    directory is created if needed.
+ * Parameters:
+ *  - directory: Cache directory.
+ *  - inputFileName: Input file to expand.
+ *  - libraryFileNames: Macro library files loaded before the input file, in
+ *    order: a library merged in another order expands differently.
+ *  - numLibraries: Number of library files.
+ * Returns:
+ *  - If successful, returns pointer to new cache entry. Otherwise (the input
+ *    or library file could not be read), returns NULL.
+ */
+filecache_t * filecache_open(const char * directory, const char * inputFileName,
+    const char * const * libraryFileNames, int numLibraries)
+{
+    filecache_t * cache;
+    sha256_t context;
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    char options[CURRENT_LINE_SIZE];
+    char suffix[SHORT_STRING_SIZE];
+    char key[FILECACHE_KEY_SIZE];
+    FILE * file = NULL;
+    int i;
+
+    if(directory == NULL || inputFileName == NULL)
+    {
+        return NULL;
+    }
+
+    // everything that changes the expanded file is part of the key
+    sha256_init(&context);
+    sprintf_s(options, sizeof(options), "%s\nverbose=%d\nlabels=%d,%d\npeephole=%d\n",
+        FILECACHE_STAMP, VERBOSE, UNIQUE_LABEL_BASE, UNIQUE_LABEL_DIGITS, PEEPHOLE);
+    sha256_update(&context, options, strlen(options));
+    for(i = 0; i < BUDGET_KINDS; i++)
+    {
+        sprintf_s(options, sizeof(options), "%s=%d,%d\n", budget_getName(i),
+            budget->fileLimit[i], budget->invocationLimit[i]);
+        sha256_update(&context, options, strlen(options));
+    }
+    for(i = 0; includePath != NULL && i < includePath->size; i++)
+    {
+        sha256_update(&context, "include=", strlen("include="));
+        sha256_update(&context, includePath->dirs[i], strlen(includePath->dirs[i]) + 1);
+    }
+
+    if(filecache_hashFile(inputFileName, digest) != SUCCESS)
+    {
+        return NULL;
+    }
+    sha256_update(&context, digest, sizeof(digest));
+
+    for(i = 0; i < numLibraries; i++)
+    {
+        if(filecache_hashFile(libraryFileNames[i], digest) != SUCCESS)
+        {
+            return NULL;
+        }
+        sha256_update(&context, digest, sizeof(digest));
+    }
+
+    cache = (filecache_t *) malloc(sizeof(filecache_t));
+    if(cache == NULL)
+    {
+        return NULL;
+    }
+    memset(cache, 0, sizeof(filecache_t));
+
+    sha256_final(&context, digest);
+    filecache_getKey(digest, cache->key);
+
+#ifdef _WIN32
+    _mkdir(directory);
+    sprintf_s(suffix, sizeof(suffix), ".%d.tmp", _getpid());
+#else
+    mkdir(directory, 0777);
+    sprintf_s(suffix, sizeof(suffix), ".%d.tmp", (int) getpid());
+#endif
+
+    // the temporary file is named by the process, for builds running at once
+    cache->directory = _strdup(directory);
+    cache->inputFileName = _strdup(inputFileName);
+    cache->libraries = depfile_alloc();
+    for(i = 0; i < numLibraries && cache->libraries != NULL; i++)
+    {
+        if(depfile_add(cache->libraries, libraryFileNames[i]) != SUCCESS)
+        {
+            depfile_free(cache->libraries);
+            cache->libraries = NULL;
+        }
+    }
+    cache->manifestFileName = filecache_path(directory, cache->key, ".inc");
+    cache->tempFileName = filecache_path(directory, cache->key, suffix);
+    if(cache->directory == NULL || cache->inputFileName == NULL || cache->manifestFileName == NULL ||
+        cache->tempFileName == NULL || cache->libraries == NULL)
+    {
+        filecache_free(cache);
+        return NULL;
+    }
+
+    // an input expanded before has a manifest; the entry is there if the
+    // files it lists did not change
+    cache->includes = filecache_readManifest(cache->manifestFileName);
+    if(cache->includes != NULL && filecache_hashIncludes(cache->key, cache->includes, key) == SUCCESS)
+    {
+        cache->entryFileName = filecache_path(directory, key, ".out");
+        if(cache->entryFileName != NULL && fopen_s(&file, cache->entryFileName, "rb") == 0 && file != NULL)
+        {
+            cache->hit = TRUE;
+            fclose(file);
+        }
+    }
+
+    return cache;
+}
+
+/**
+ * Function: filecache_free
+ * Description:
+ *  - De-allocates a cache entry. The files are left as they are.
+ * Parameters:
+ *  - cache: Pointer to the cache entry.
+ * Returns:
+ *  - none
+ */
+void filecache_free(filecache_t * cache)
+{
+    if(cache)
+    {
+        free(cache->directory);
+        free(cache->inputFileName);
+        depfile_free(cache->libraries);
+        free(cache->manifestFileName);
+        free(cache->entryFileName);
+        free(cache->tempFileName);
+        depfile_free(cache->includes);
+        free(cache);
+    }
+}
+
+/**
+ * Function: filecache_store
+ * Description:
+ *  - Ends a miss: the temporary file becomes the entry, or is removed. The
+ *    manifest is written after the entry, listing the files the input
+ *    included.
+ * Parameters:
+ *  - cache: Pointer to the cache entry.
+ *  - keep: TRUE if the expansion succeeded and may be reused.
+ *  - files: Files read by the expansion, with the input and library files.
+ * Returns:
+ *  - SUCCESS, or FAILURE if the entry could not be written.
+ */
+int filecache_store(filecache_t * cache, int keep, depfile_t * files)
+{
+    char key[FILECACHE_KEY_SIZE];
+    depfile_t * includes;
+    FILE * file = NULL;
+    int result = FAILURE;
+    int i;
+
+    if(cache == NULL)
+    {
+        return FAILURE;
+    }
+
+    includes = depfile_alloc();
+    for(i = 0; keep && files != NULL && includes != NULL && i < files->size; i++)
+    {
+        if(strcmp(files->files[i], cache->inputFileName) != 0 &&
+            !depfile_has(cache->libraries, files->files[i]))
+        {
+            depfile_add(includes, files->files[i]);
+        }
+    }
+
+    free(cache->entryFileName);
+    cache->entryFileName = NULL;
+    if(keep && includes != NULL && filecache_hashIncludes(cache->key, includes, key) == SUCCESS)
+    {
+        cache->entryFileName = filecache_path(cache->directory, key, ".out");
+    }
+
+    // rename replaces the entry at once where it can; otherwise another
+    // build stored the same entry, and it is replaced
+    if(cache->entryFileName != NULL)
+    {
+        if(rename(cache->tempFileName, cache->entryFileName) != 0)
+        {
+            remove(cache->entryFileName);
+            if(rename(cache->tempFileName, cache->entryFileName) == 0)
+            {
+                result = SUCCESS;
+            }
+        }
+        else
+        {
+            result = SUCCESS;
+        }
+    }
+    remove(cache->tempFileName);
+
+    // the manifest goes through the temporary file as well
+    if(result == SUCCESS)
+    {
+        result = FAILURE;
+        if(fopen_s(&file, cache->tempFileName, "w") == 0 && file != NULL)
+        {
+            for(i = 0; i < includes->size; i++)
+            {
+                fprintf(file, "%s\n", includes->files[i]);
+            }
+            if(fclose(file) == 0)
+            {
+                remove(cache->manifestFileName);
+                result = (rename(cache->tempFileName, cache->manifestFileName) == 0) ? SUCCESS : FAILURE;
+            }
+        }
+        if(result != SUCCESS)
+        {
+            remove(cache->tempFileName);
+        }
+    }
+
+    depfile_free(includes);
+    return keep ? result : SUCCESS;
+}
+
+/**
+ * Function: filecache_install
+ * Description:
+ *  - Copies an expanded file to the output file, unless the output file
+ *    already has the same bytes. Where the file system can share the blocks
+ *    of the two files (a reflink), they are shared instead of copied.
+ * Parameters:
+ *  - fromFileName: Expanded file.
+ *  - toFileName: Output file, - for standard output.
+ *  - changed: Set to TRUE if the output file was written. May be NULL.
+ * Returns:
+ *  - SUCCESS, or FAILURE if a file could not be read or written.
+ */
+int filecache_install(const char * fromFileName, const char * toFileName, int * changed)
+{
+    FILE * from = NULL;
+    FILE * to = NULL;
+    int result = FAILURE;
+
+    if(changed != NULL)
+    {
+        *changed = FALSE;
+    }
+
+    if(strcmp("-", toFileName) != 0 && filecache_isSame(fromFileName, toFileName))
+    {
+        return SUCCESS;
+    }
+
+    if(fopen_s(&from, fromFileName, "rb") != 0 || from == NULL)
+    {
+        return FAILURE;
+    }
+
+    if(strcmp("-", toFileName) == 0)
+    {
+        result = filecache_copy(from, stdout);
+        if(fflush(stdout) != 0)
+        {
+            result = FAILURE;
+        }
+    }
+    else if(fopen_s(&to, toFileName, "wb") == 0 && to != NULL)
+    {
+#ifdef FICLONE
+        if(ioctl(fileno(to), FICLONE, fileno(from)) == 0)
+        {
+            result = SUCCESS;
+        }
+        else
+#endif
+        {
+            result = filecache_copy(from, to);
+        }
+        if(fclose(to) != 0)
+        {
+            result = FAILURE;
+        }
+    }
+
+    fclose(from);
+    if(changed != NULL)
+    {
+        *changed = TRUE;
+    }
+    return result;
+}
+
+/**
+ * Function: filecache_hashFile
+ * Description:
+ *  - Hashes the bytes of a file.
+ * Parameters:
+ *  - fileName: Name of the file.
+ *  - digest: Buffer for the SHA-256 digest.
+ * Returns:
+ *  - SUCCESS, or FAILURE if the file could not be read.
+ */
+int filecache_hashFile(const char * fileName, unsigned char digest[SHA256_DIGEST_SIZE])
+{
+    FILE * file = NULL;
+    sha256_t context;
+    char * buffer;
+    size_t size;
+    int result = SUCCESS;
+
+    if(fopen_s(&file, fileName, "rb") != 0 || file == NULL)
+    {
+        return FAILURE;
+    }
+
+    buffer = (char *) malloc(FILECACHE_COPY_SIZE);
+    if(buffer == NULL)
+    {
+        fclose(file);
+        return FAILURE;
+    }
+
+    sha256_init(&context);
+    while((size = fread(buffer, 1, FILECACHE_COPY_SIZE, file)) > 0)
+    {
+        sha256_update(&context, buffer, size);
+    }
+    if(ferror(file))
+    {
+        result = FAILURE;
+    }
+    sha256_final(&context, digest);
+
+    free(buffer);
+    fclose(file);
+    return result;
+}
+
+/**
+ * Function: filecache_path
+ * Description:
+ *  - Builds the name of a file in the cache directory.
+ * Parameters:
+ *  - directory: Cache directory.
+ *  - key: Key of the entry.
+ *  - suffix: Added after the key.
+ * Returns:
+ *  - If successful, returns the new name, to be freed. Otherwise, returns NULL.
+ */
+char * filecache_path(const char * directory, const char * key, const char * suffix)
+{
+    size_t size = strlen(directory) + strlen(key) + strlen(suffix) + 2;
+    char * path = (char *) malloc(size);
+
+    if(path)
+    {
+        sprintf_s(path, size, "%s/%s%s", directory, key, suffix);
+    }
+
+    return path;
+}
+
+/**
+ * Function: filecache_getKey
+ * Description:
+ *  - Writes a digest as a key, in hex.
+ * Parameters:
+ *  - digest: The digest.
+ *  - key: Buffer of FILECACHE_KEY_SIZE bytes for the key.
+ * Returns:
+ *  - none
+ */
+void filecache_getKey(const unsigned char digest[SHA256_DIGEST_SIZE], char * key)
+{
+    int i;
+
+    for(i = 0; i < SHA256_DIGEST_SIZE; i++)
+    {
+        sprintf_s(key + 2 * i, FILECACHE_KEY_SIZE - 2 * i, "%02x", digest[i]);
+    }
+}
+
+/**
+ * Function: filecache_readManifest
+ * Description:
+ *  - Reads the files listed by a manifest, one name per line.
+ * Parameters:
+ *  - fileName: Name of the manifest.
+ * Returns:
+ *  - The list of files, or NULL if there is no manifest.
+ */
+depfile_t * filecache_readManifest(const char * fileName)
+{
+    char line[FILECACHE_PATH_SIZE];
+    depfile_t * includes;
+    FILE * file = NULL;
+    size_t length;
+
+    if(fopen_s(&file, fileName, "r") != 0 || file == NULL)
+    {
+        return NULL;
+    }
+
+    includes = depfile_alloc();
+    while(includes != NULL && fgets(line, sizeof(line), file) != NULL)
+    {
+        length = strlen(line);
+        if(length > 0 && line[length - 1] == '\n')
+        {
+            line[length - 1] = '\0';
+        }
+        if(line[0] != '\0' && depfile_add(includes, line) != SUCCESS)
+        {
+            depfile_free(includes);
+            includes = NULL;
+        }
+    }
+
+    fclose(file);
+    return includes;
+}
+
+/**
+ * Function: filecache_hashIncludes
+ * Description:
+ *  - Hashes the key of an input with the names and bytes of the files it
+ *    included, for the name of its entry.
+ * Parameters:
+ *  - key: Key of the input.
+ *  - includes: Included files.
+ *  - entryKey: Buffer of FILECACHE_KEY_SIZE bytes for the key of the entry.
+ * Returns:
+ *  - SUCCESS, or FAILURE if an included file could not be read.
+ */
+int filecache_hashIncludes(const char * key, depfile_t * includes, char * entryKey)
+{
+    sha256_t context;
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    int i;
+
+    sha256_init(&context);
+    sha256_update(&context, key, strlen(key));
+    for(i = 0; i < includes->size; i++)
+    {
+        if(filecache_hashFile(includes->files[i], digest) != SUCCESS)
+        {
+            return FAILURE;
+        }
+        sha256_update(&context, includes->files[i], strlen(includes->files[i]) + 1);
+        sha256_update(&context, digest, sizeof(digest));
+    }
+    sha256_final(&context, digest);
+    filecache_getKey(digest, entryKey);
+
+    return SUCCESS;
+}
+
+/**
+ * Function: filecache_isSame
+ * Description:
+ *  - Compares the bytes of two files.
+ * Parameters:
+ *  - leftFileName: Name of the first file.
+ *  - rightFileName: Name of the second file.
+ * Returns:
+ *  - TRUE if both files exist and have the same bytes, otherwise FALSE.
+ */
+int filecache_isSame(const char * leftFileName, const char * rightFileName)
+{
+    FILE * left = NULL;
+    FILE * right = NULL;
+    char * leftBuffer;
+    char * rightBuffer;
+    size_t leftSize;
+    size_t rightSize;
+    int same = FALSE;
+
+    if(fopen_s(&left, leftFileName, "rb") != 0 || left == NULL)
+    {
+        return FALSE;
+    }
+    if(fopen_s(&right, rightFileName, "rb") != 0 || right == NULL)
+    {
+        fclose(left);
+        return FALSE;
+    }
+
+    leftBuffer = (char *) malloc(FILECACHE_COPY_SIZE);
+    rightBuffer = (char *) malloc(FILECACHE_COPY_SIZE);
+    if(leftBuffer != NULL && rightBuffer != NULL)
+    {
+        do
+        {
+            leftSize = fread(leftBuffer, 1, FILECACHE_COPY_SIZE, left);
+            rightSize = fread(rightBuffer, 1, FILECACHE_COPY_SIZE, right);
+            same = (leftSize == rightSize && memcmp(leftBuffer, rightBuffer, leftSize) == 0);
+        } while(same && leftSize > 0);
+
+        if(ferror(left) || ferror(right))
+        {
+            same = FALSE;
+        }
+    }
+
+    free(leftBuffer);
+    free(rightBuffer);
+    fclose(left);
+    fclose(right);
+    return same;
+}
+
+/**
+ * Function: filecache_copy
+ * Description:
+ *  - Copies the rest of one open file to another.
+ * Parameters:
+ *  - from: File to read.
+ *  - to: File to write.
+ * Returns:
+ *  - SUCCESS, or FAILURE after a read or write error.
+ */
+int filecache_copy(FILE * from, FILE * to)
+{
+    char * buffer = (char *) malloc(FILECACHE_COPY_SIZE);
+    size_t size;
+    int result = SUCCESS;
+
+    if(buffer == NULL)
+    {
+        return FAILURE;
+    }
+
+    while((size = fread(buffer, 1, FILECACHE_COPY_SIZE, from)) > 0)
+    {
+        if(fwrite(buffer, 1, size, to) != size)
+        {
+            result = FAILURE;
+            break;
+        }
+    }
+    if(ferror(from))
+    {
+        result = FAILURE;
+    }
+
+    free(buffer);
+    return result;
+}
@@ -0,0 +1,40 @@
+/*
+ * filecache.h - Contains functions and definitions for the build cache, the
+ * expanded files of earlier runs kept by content.
+ */
+
+#ifndef FILECACHE_H_
+#define FILECACHE_H_
+
+#include "sha256.h"
+#include "depfile.h"
+
+#define FILECACHE_KEY_SIZE      (2 * SHA256_DIGEST_SIZE + 1)    // hex digest
+#define FILECACHE_COPY_SIZE     (64 * 1024)                     // bytes read at a time
+#define FILECACHE_PATH_SIZE     (4096)                          // longest path in a manifest
+
+// Entry of one input file. The key is a hash of the input file, the macro
+// libraries (in order) and the options. Its manifest lists the files the input included,
+// and the entry is named by a hash of the key and those files, so an entry
+// is never out of date.
+typedef struct
+{
+    char        key[FILECACHE_KEY_SIZE];
+    char *      directory;
+    char *      inputFileName;
+    depfile_t * libraries;          // macro library files, not listed by the manifest
+    char *      manifestFileName;
+    char *      entryFileName;      // expanded file, if hit is set
+    char *      tempFileName;       // file a miss is expanded into
+    depfile_t * includes;           // files listed by the manifest, if hit is set
+    int         hit;
+} filecache_t;
+
+filecache_t *   filecache_open(const char * directory, const char * inputFileName,
+                    const char * const * libraryFileNames, int numLibraries);
+void            filecache_free(filecache_t * cache);
+int             filecache_store(filecache_t * cache, int keep, depfile_t * files);
+int             filecache_install(const char * fromFileName, const char * toFileName, int * changed);
+int             filecache_hashFile(const char * fileName, unsigned char digest[SHA256_DIGEST_SIZE]);
+
+#endif /* FILECACHE_H_ */
@@ -0,0 +1,636 @@
+/*
+ * include.c - Contains functions for INCLUDE.
+ *
+ *   INCLUDE   prelude.mac
+ *
+ * reads the lines of prelude.mac in place of the INCLUDE line, so the file
+ * can define macros, set variables and hold lines to copy. The file is looked
+ * for as named, then in each directory of the search path (-I), and is only
+ * included the first time an input includes it.
+ *
+ * Included files are kept, split into lines and tokenized, in one cache for
+ * the whole process, so every input of a batch (the library API, the -j
+ * threads, or the workers of the server) shares one copy of a common prelude
+ * and its lines are parsed from their tokens. A file is only changed before
+ * it is in the cache, so the threads read it without the lock, and each
+ * holds a reference to it until its stream is freed.
+ */
+
+#ifdef _WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#else
+#include <sys/stat.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "definitions.h"
+#include "include.h"
+
+// local function definitions
+int include_getName(const char * operands, char * name, size_t size);
+char * include_find(const char * name);
+include_file_t * include_read(const char * path);
+int include_tokenize(include_file_t * file);
+void include_fileFree(include_file_t * file);
+
+/**
+ * Function: include_pathAlloc
+ * Description:
+ *  - Allocates memory for an empty search path.
+ * Parameters:
+ *  - none
+ * Returns:
+ *  - If successful, returns pointer to new search path. Otherwise, returns NULL.
+ */
+include_path_t * include_pathAlloc(void)
+{
+    include_path_t * path = (include_path_t *) malloc(sizeof(include_path_t));
+    if(path != NULL)
+    {
+        memset(path, 0, sizeof(include_path_t));
+    }
+
+    return path;
+}
+
+/**
+ * Function: include_pathFree
+ * Description:
+ *  - De-allocates a search path.
+ * Parameters:
+ *  - path: Pointer to the search path.
+ * Returns:
+ *  - none
+ */
+void include_pathFree(include_path_t * path)
+{
+    int i;
+
+    if(path)
+    {
+        for(i = 0; i < path->size; i++)
+        {
+            free(path->dirs[i]);
+        }
+        free(path);
+    }
+}
+
+/**
+ * Function: include_addDir
+ * Description:
+ *  - Adds a directory to the end of a search path.
+ * Parameters:
+ *  - path: Pointer to the search path.
+ *  - dir: Directory.
+ * Returns:
+ *  - SUCCESS, or FAILURE if the path is full or out of memory.
+ */
+int include_addDir(include_path_t * path, const char * dir)
+{
+    if(path == NULL || dir == NULL || path->size >= INCLUDE_MAX_DIRS)
+    {
+        return FAILURE;
+    }
+
+    path->dirs[path->size] = _strdup(dir);
+    if(path->dirs[path->size] == NULL)
+    {
+        return FAILURE;
+    }
+    path->size++;
+
+    return SUCCESS;
+}
+
+/**
+ * Function: include_push
+ * Description:
+ *  - Processes an INCLUDE line: the lines of the file are read from the
+ *    input next, unless the input included the file already.
+ * Parameters:
+ *  - input: Input stream the INCLUDE line was read from.
+ *  - operands: Operands of the INCLUDE line, the file name, which may be
+ *    quoted.
+ * Returns:
+ *  - SUCCESS, or FAILURE if the file could not be found or read.
+ */
+int include_push(stream_t * input, const char * operands)
+{
+    char name[CURRENT_LINE_SIZE];
+    include_file_t * file;
+    stream_t * stream;
+    char * path;
+
+    if(EXPANDING)
+    {
+        printError("ERROR: INCLUDE can not be used inside a macro expansion\n");
+        return FAILURE;
+    }
+
+    if(include_getName(operands, name, sizeof(name)) != SUCCESS)
+    {
+        printError("ERROR: INCLUDE needs a file name\n");
+        return FAILURE;
+    }
+
+    path = include_find(name);
+    if(path == NULL)
+    {
+        printError("ERROR: Could not find include file %s\n", name);
+        return FAILURE;
+    }
+
+    // include once
+    if(depfile_has(included, path))
+    {
+        free(path);
+        return SUCCESS;
+    }
+
+    file = include_load(include_getCache(), path);
+    stream = (file != NULL) ? stream_allocTokens(file->text, file->size, file->lines, file->numLines) : NULL;
+    if(stream == NULL)
+    {
+        include_release(file);
+    }
+    else
+    {
+        stream->source = file;
+    }
+    if(stream == NULL || depfile_add(included, path) != SUCCESS || depfile_add(dependencies, path) != SUCCESS)
+    {
+        printError("ERROR: Could not read include file %s\n", path);
+        stream_free(stream);
+        free(path);
+        return FAILURE;
+    }
+    free(path);
+
+    // the INCLUDE line came from the innermost file being read
+    while(input->include != NULL)
+    {
+        input = input->include;
+    }
+    input->include = stream;
+
+    return SUCCESS;
+}
+
+/**
+ * Function: include_load
+ * Description:
+ *  - Returns an included file from the cache, reading and tokenizing it if
+ *    it is not there or changed since. The caller holds a reference to the
+ *    file, given up with include_release.
+ * Parameters:
+ *  - cache: Pointer to the cache.
+ *  - path: Full path of the file.
+ * Returns:
+ *  - The file, or NULL if it could not be read.
+ */
+include_file_t * include_load(include_cache_t * cache, const char * path)
+{
+    include_file_t * file = NULL;
+    long long modified;
+    long long fileSize;
+
+    if(cache == NULL || include_getStatus(path, &modified, &fileSize) != SUCCESS)
+    {
+        return NULL;
+    }
+
+    // the file is read with the lock held, so threads that include it at the
+    // same time wait for the one reading it
+    thread_lock(cache->lock);
+    HASH_FIND_STR(cache->files, path, file);
+    if(file != NULL)
+    {
+        if(file->modified == modified && file->fileSize == fileSize)
+        {
+            THREAD_INCREMENT(&file->references);
+            thread_unlock(cache->lock);
+            THREAD_INCREMENT(&cache->hits);
+            return file;
+        }
+        HASH_DEL(cache->files, file);
+        include_release(file);
+    }
+
+    THREAD_INCREMENT(&cache->misses);
+    file = include_read(path);
+    if(file != NULL)
+    {
+        file->modified = modified;
+        file->fileSize = fileSize;
+        file->references = 2;
+        HASH_ADD_KEYPTR(hh, cache->files, file->path, strlen(file->path), file);
+    }
+    thread_unlock(cache->lock);
+
+    return file;
+}
+
+/**
+ * Function: include_release
+ * Description:
+ *  - Gives up a reference to an included file, and frees the file when it
+ *    was the last one.
+ * Parameters:
+ *  - file: Pointer to the file, may be NULL.
+ * Returns:
+ *  - none
+ */
+void include_release(include_file_t * file)
+{
+    if(file != NULL && THREAD_ADD(&file->references, -1) == 0)
+    {
+        include_fileFree(file);
+    }
+}
+
+/**
+ * Function: include_forget
+ * Description:
+ *  - Drops a file from the cache, so it is read again the next time it is
+ *    included even if its size and modification time are the same (an edit
+ *    within the same second).
+ * Parameters:
+ *  - cache: Pointer to the cache, may be NULL.
+ *  - path: Full path of the file.
+ * Returns:
+ *  - none
+ */
+void include_forget(include_cache_t * cache, const char * path)
+{
+    include_file_t * file = NULL;
+
+    if(cache != NULL)
+    {
+        thread_lock(cache->lock);
+        HASH_FIND_STR(cache->files, path, file);
+        if(file != NULL)
+        {
+            HASH_DEL(cache->files, file);
+            include_release(file);
+        }
+        thread_unlock(cache->lock);
+    }
+}
+
+/**
+ * Function: include_cacheAlloc
+ * Description:
+ *  - Allocates memory for an empty cache of included files.
+ * Parameters:
+ *  - none
+ * Returns:
+ *  - If successful, returns pointer to new cache. Otherwise, returns NULL.
+ */
+include_cache_t * include_cacheAlloc(void)
+{
+    include_cache_t * cache = (include_cache_t *) malloc(sizeof(include_cache_t));
+    if(cache != NULL)
+    {
+        memset(cache, 0, sizeof(include_cache_t));
+        cache->lock = thread_lockAlloc();
+        if(cache->lock == NULL)
+        {
+            free(cache);
+            cache = NULL;
+        }
+    }
+
+    return cache;
+}
+
+/**
+ * Function: include_getCache
+ * Description:
+ *  - Returns the cache of the process, allocating it the first time. Threads
+ *    that get it at the same time get the same cache.
+ * Parameters:
+ *  - none
+ * Returns:
+ *  - The cache, or NULL if out of memory.
+ */
+include_cache_t * include_getCache(void)
+{
+    include_cache_t * cache = (include_cache_t *) THREAD_LOAD_POINTER(&includeCache);
+    include_cache_t * other;
+
+    if(cache == NULL)
+    {
+        cache = include_cacheAlloc();
+        if(cache != NULL)
+        {
+            other = (include_cache_t *) THREAD_COMPARE_EXCHANGE_POINTER(&includeCache, NULL, cache);
+            if(other != NULL)
+            {
+                include_cacheFree(cache);
+                cache = other;
+            }
+        }
+    }
+
+    return cache;
+}
+
+/**
+ * Function: include_cacheFree
+ * Description:
+ *  - De-allocates the cache, and the files in it that no stream holds. No
+ *    other thread may be using the cache.
+ * Parameters:
+ *  - cache: Pointer to the cache.
+ * Returns:
+ *  - none
+ */
+void include_cacheFree(include_cache_t * cache)
+{
+    include_file_t *i, *tmp;
+
+    if(cache)
+    {
+        HASH_ITER(hh, cache->files, i, tmp)
+        {
+            HASH_DEL(cache->files, i);
+            include_release(i);
+        }
+        thread_lockFree(cache->lock);
+        free(cache);
+    }
+}
+
+/**
+ * Function: include_getName
+ * Description:
+ *  - Finds the file name in the operands of an INCLUDE line: the first
+ *    word, or the text between single or double quotes.
+ * Parameters:
+ *  - operands: Operands of the line.
+ *  - name: Buffer for the name.
+ *  - size: Size of the buffer.
+ * Returns:
+ *  - SUCCESS, or FAILURE if there is no name.
+ */
+int include_getName(const char * operands, char * name, size_t size)
+{
+    const char * end;
+    size_t length;
+
+    if(operands == NULL)
+    {
+        return FAILURE;
+    }
+
+    while(*operands == ' ' || *operands == '\t')
+    {
+        operands++;
+    }
+
+    if(*operands == '\'' || *operands == '"')
+    {
+        end = strchr(operands + 1, *operands);
+        if(end == NULL)
+        {
+            return FAILURE;
+        }
+        operands++;
+    }
+    else
+    {
+        end = operands + strcspn(operands, " \t\r\n");
+    }
+
+    length = end - operands;
+    if(length == 0 || length >= size)
+    {
+        return FAILURE;
+    }
+    memcpy(name, operands, length);
+    name[length] = '\0';
+
+    return SUCCESS;
+}
+
+/**
+ * Function: include_find
+ * Description:
+ *  - Looks for a file as named, then in each directory of the search path.
+ * Parameters:
+ *  - name: Name of the file.
+ * Returns:
+ *  - Full path of the file found, to be freed, or NULL if none was found.
+ */
+char * include_find(const char * name)
+{
+    char candidate[CURRENT_LINE_SIZE];
+    long long modified;
+    long long fileSize;
+    int i;
+
+    strcpy_s(candidate, sizeof(candidate), name);
+    for(i = -1; includePath != NULL && i < includePath->size; i++)
+    {
+        if(i >= 0)
+        {
+            sprintf_s(candidate, sizeof(candidate), "%s/%s", includePath->dirs[i], name);
+        }
+        if(include_getStatus(candidate, &modified, &fileSize) == SUCCESS)
+        {
+            break;
+        }
+    }
+
+    if(include_getStatus(candidate, &modified, &fileSize) != SUCCESS)
+    {
+        return NULL;
+    }
+
+    // the same file reached by two names is one file
+#ifdef _WIN32
+    return _fullpath(NULL, candidate, 0);
+#else
+    return realpath(candidate, NULL);
+#endif
+}
+
+/**
+ * Function: include_getStatus
+ * Description:
+ *  - Tells whether a path is a file, and when it was last changed.
+ * Parameters:
+ *  - path: Path of the file.
+ *  - modified: Set to the modification time.
+ *  - fileSize: Set to the size of the file.
+ * Returns:
+ *  - SUCCESS, or FAILURE if the path is not a file.
+ */
+int include_getStatus(const char * path, long long * modified, long long * fileSize)
+{
+#ifdef _WIN32
+    struct _stat status;
+
+    if(_stat(path, &status) != 0 || (status.st_mode & _S_IFREG) == 0)
+    {
+        return FAILURE;
+    }
+#else
+    struct stat status;
+
+    if(stat(path, &status) != 0 || !S_ISREG(status.st_mode))
+    {
+        return FAILURE;
+    }
+#endif
+
+    *modified = (long long) status.st_mtime;
+    *fileSize = (long long) status.st_size;
+    return SUCCESS;
+}
+
+/**
+ * Function: include_read
+ * Description:
+ *  - Reads a file as getline does, in text mode, and tokenizes its lines.
+ * Parameters:
+ *  - path: Full path of the file.
+ * Returns:
+ *  - If successful, returns pointer to new file. Otherwise, returns NULL.
+ */
+include_file_t * include_read(const char * path)
+{
+    include_file_t * file;
+    FILE * stream = NULL;
+    size_t capacity = 4096;
+    size_t count;
+    char * text;
+
+    file = (include_file_t *) malloc(sizeof(include_file_t));
+    if(file == NULL)
+    {
+        return NULL;
+    }
+    memset(file, 0, sizeof(include_file_t));
+    file->path = _strdup(path);
+    file->text = (char *) malloc(capacity);
+
+    if(file->path == NULL || file->text == NULL || fopen_s(&stream, path, "r") != 0 || stream == NULL)
+    {
+        include_fileFree(file);
+        return NULL;
+    }
+
+    while((count = fread(file->text + file->size, 1, capacity - file->size, stream)) > 0)
+    {
+        file->size += count;
+        if(file->size == capacity)
+        {
+            text = (char *) realloc(file->text, 2 * capacity);
+            if(text == NULL)
+            {
+                break;
+            }
+            file->text = text;
+            capacity *= 2;
+        }
+    }
+
+    if(ferror(stream) || file->size == capacity || include_tokenize(file) != SUCCESS)
+    {
+        fclose(stream);
+        include_fileFree(file);
+        return NULL;
+    }
+
+    fclose(stream);
+    return file;
+}
+
+/**
+ * Function: include_tokenize
+ * Description:
+ *  - Splits the text of a file into lines, as stream_gets does, and finds
+ *    their tokens.
+ * Parameters:
+ *  - file: Pointer to the file.
+ * Returns:
+ *  - SUCCESS, or FAILURE if out of memory.
+ */
+int include_tokenize(include_file_t * file)
+{
+    linetab_entry_t * entry;
+    linetab_entry_t * lines;
+    const char * newline;
+    size_t pos = 0;
+    size_t size;
+    int capacity = 0;
+
+    while(pos < file->size)
+    {
+        if(file->numLines == capacity)
+        {
+            capacity = (capacity > 0) ? 2 * capacity : (int)(file->size / 32) + 16;
+            lines = (linetab_entry_t *) realloc(file->lines, capacity * sizeof(linetab_entry_t));
+            if(lines == NULL)
+            {
+                return FAILURE;
+            }
+            file->lines = lines;
+        }
+
+        // lines longer than the getline buffer are read in pieces
+        size = file->size - pos;
+        if(size > CURRENT_LINE_SIZE - 1)
+        {
+            size = CURRENT_LINE_SIZE - 1;
+        }
+        newline = (const char *) memchr(file->text + pos, '\n', size);
+        if(newline != NULL)
+        {
+            size = newline - (file->text + pos) + 1;
+        }
+
+        entry = &file->lines[file->numLines++];
+        memset(entry, 0, sizeof(linetab_entry_t));
+        entry->offset = pos;
+        entry->size = (unsigned char) size;
+
+        // parse_line stops at a NUL, leave such lines to it
+        if(memchr(file->text + pos, '\0', size) != NULL)
+        {
+            entry->flags = LINETAB_UNTOKENIZED;
+        }
+        else
+        {
+            linetab_tokenize(file->text + pos, (int) size, entry);
+        }
+
+        pos += size;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Function: include_fileFree
+ * Description:
+ *  - De-allocates an included file.
+ * Parameters:
+ *  - file: Pointer to the file.
+ * Returns:
+ *  - none
+ */
+void include_fileFree(include_file_t * file)
+{
+    if(file)
+    {
+        free(file->path);
+        free(file->text);
+        free(file->lines);
+        free(file);
+    }
+}
@@ -0,0 +1,62 @@
+/*
+ * include.h - Contains functions and definitions for INCLUDE, the search path
+ * and the cache of included files.
+ */
+
+#ifndef INCLUDE_H_
+#define INCLUDE_H_
+
+#include <stddef.h>
+#include "uthash\uthash.h"
+#include "linetab.h"
+#include "stream.h"
+#include "thread.h"
+
+#define INCLUDE_MAX_DIRS    (16)
+
+// Directories searched for an included file, after the current directory
+typedef struct
+{
+    char *  dirs[INCLUDE_MAX_DIRS];
+    int     size;
+} include_path_t;
+
+// Included file, read and tokenized once. The file is read again when its
+// size or modification time changes. It does not change once read, and is
+// freed when the cache and the last stream reading it have released it.
+typedef struct include_file_s
+{
+    char *              path;           // full path, the key
+    char *              text;
+    size_t              size;
+    linetab_entry_t *   lines;          // tokens of each line, as getline reads them
+    int                 numLines;
+    long long           modified;
+    long long           fileSize;
+    volatile long       references;     // the cache, and each holder from include_load
+    UT_hash_handle      hh;
+} include_file_t;
+
+// Files included by every input the process expands, on any thread. The
+// lock guards the table; the counters are updated with THREAD_INCREMENT.
+typedef struct
+{
+    include_file_t *    files;
+    thread_lock_t *     lock;
+    volatile long       hits;
+    volatile long       misses;
+} include_cache_t;
+
+include_path_t *    include_pathAlloc(void);
+void                include_pathFree(include_path_t * path);
+int                 include_addDir(include_path_t * path, const char * dir);
+int                 include_push(stream_t * input, const char * operands);
+include_file_t *    include_load(include_cache_t * cache, const char * path);
+void                include_release(include_file_t * file);
+int                 include_getStatus(const char * path, long long * modified, long long * fileSize);
+void                include_forget(include_cache_t * cache, const char * path);
+include_cache_t *   include_cacheAlloc(void);
+include_cache_t *   include_getCache(void);
+void                include_cacheFree(include_cache_t * cache);
+
+#endif /* INCLUDE_H_ */
@@ -0,0 +1,291 @@
+/*
+ * libload.c - Contains functions for loading the macro library files.
+ *
+ * Each file given with --library is loaded by one of a few threads: a
+ * library file is mapped, and a file of definitions is processed with the
+ * (THREAD_LOCAL) tables of the thread, which library_build then lays out as a
+ * library in memory. The files are merged into one library in the order they
+ * were given, a macro of a later file replacing the one of an earlier file,
+ * as if the files were processed one after the other.
+ *
+ * A file of definitions starts from empty tables: it does not see the macros
+ * and SET variables of the files before it.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "definitions.h"
+#include "libload.h"
+
+// local function definitions
+void libload_load(libload_file_t * file);
+int libload_process(libload_file_t * file);
+THREAD_RESULT libload_work(void * argument);
+
+/**
+ * Function: libload_open
+ * Description:
+ *  - Loads library files on up to numThreads threads, and merges them. A
+ *    single library file is used in place. The errors are reported in the
+ *    order of the files, and the files included by the definitions are
+ *    added to the dependencies.
+ * Parameters:
+ *  - fileNames: Library files, from the lowest priority to the highest.
+ *  - numFiles: Number of files.
+ *  - numThreads: Number of threads to load them on.
+ * Returns:
+ *  - If successful, returns pointer to the open library. Otherwise, returns
+ *    NULL.
+ */
+library_t * libload_open(const char * const * fileNames, int numFiles, int numThreads)
+{
+    libload_t loader;
+    thread_t threads[LIBLOAD_MAX_THREADS];
+    library_t ** libraries;
+    library_t * result = NULL;
+    watch_t * watching = watch;
+    int numStarted = 0;
+    int failed = FALSE;
+    int i, j;
+
+    if(fileNames == NULL || numFiles <= 0)
+    {
+        return NULL;
+    }
+
+    // a library file is mapped where it is, by the calling thread
+    if(numFiles == 1 && libload_isLibrary(fileNames[0]))
+    {
+        result = library_open(fileNames[0]);
+        if(result == NULL)
+        {
+            printError("ERROR: Could not load macro library %s\n", fileNames[0]);
+        }
+        return result;
+    }
+
+    memset(&loader, 0, sizeof(loader));
+    loader.files = (libload_file_t *) calloc(numFiles, sizeof(libload_file_t));
+    libraries = (library_t **) calloc(numFiles, sizeof(library_t *));
+    if(loader.files == NULL || libraries == NULL)
+    {
+        free(loader.files);
+        free(libraries);
+        return NULL;
+    }
+    loader.numFiles = numFiles;
+
+    // same limits as the calling thread, usage of their own
+    for(i = 0; i < numFiles; i++)
+    {
+        loader.files[i].fileName = fileNames[i];
+        loader.files[i].files = depfile_alloc();
+        loader.files[i].budget = budget_alloc();
+        if(budget != NULL && loader.files[i].budget != NULL)
+        {
+            memcpy(loader.files[i].budget, budget, sizeof(budget_t));
+            budget_reset(loader.files[i].budget);
+        }
+    }
+
+    // watch mode records the invocations of its input, not of these files
+    if(watching != NULL)
+    {
+        watch = NULL;
+    }
+
+    // the tables of the calling thread may be in use, so even one file is
+    // processed on a thread of its own
+    numThreads = (numThreads < numFiles) ? numThreads : numFiles;
+    numThreads = (numThreads < LIBLOAD_MAX_THREADS) ? numThreads : LIBLOAD_MAX_THREADS;
+    numThreads = (numThreads > 1) ? numThreads : 1;
+    for(i = 0; i < numThreads; i++)
+    {
+        if(thread_start(&threads[numStarted], libload_work, &loader) == SUCCESS)
+        {
+            numStarted++;
+        }
+    }
+    for(i = 0; i < numStarted; i++)
+    {
+        thread_join(threads[i]);
+    }
+
+    if(watching != NULL)
+    {
+        watch = watching;
+    }
+
+    for(i = 0; i < numFiles; i++)
+    {
+        for(j = 0; loader.files[i].files != NULL && j < loader.files[i].files->size; j++)
+        {
+            depfile_add(dependencies, loader.files[i].files->files[j]);
+        }
+
+        libraries[i] = loader.files[i].library;
+        if(libraries[i] == NULL)
+        {
+            if(loader.files[i].error != NULL)
+            {
+                printError("%s", loader.files[i].error);
+            }
+            printError("ERROR: Could not load macro library %s\n", loader.files[i].fileName);
+            failed = TRUE;
+        }
+    }
+
+    if(!failed)
+    {
+        result = (numFiles == 1) ? libraries[0] : library_merge(libraries, numFiles);
+    }
+
+    for(i = 0; i < numFiles; i++)
+    {
+        if(libraries[i] != result)
+        {
+            library_close(libraries[i]);
+        }
+        budget_free(loader.files[i].budget);
+        depfile_free(loader.files[i].files);
+        free(loader.files[i].error);
+    }
+    free(loader.files);
+    free(libraries);
+
+    return result;
+}
+
+/**
+ * Function: libload_isLibrary
+ * Description:
+ *  - Tells a library file written with --emit-library from a file of
+ *    definitions, by its first bytes.
+ * Parameters:
+ *  - fileName: Name of the file.
+ * Returns:
+ *  - TRUE if the file starts as a library does, FALSE otherwise.
+ */
+int libload_isLibrary(const char * fileName)
+{
+    FILE * file = NULL;
+    char magic[sizeof(LIBRARY_MAGIC)];
+    int result = FALSE;
+
+    if(fileName != NULL && fopen_s(&file, fileName, "rb") == 0 && file != NULL)
+    {
+        result = fread(magic, 1, strlen(LIBRARY_MAGIC), file) == strlen(LIBRARY_MAGIC) &&
+            memcmp(magic, LIBRARY_MAGIC, strlen(LIBRARY_MAGIC)) == 0;
+        fclose(file);
+    }
+
+    return result;
+}
+
+/**
+ * Function: libload_work
+ * Description:
+ *  - Loader thread: loads files until none is left. Its errors are kept for
+ *    libload_open to report.
+ * Parameters:
+ *  - argument: The loader.
+ * Returns:
+ *  - 0
+ */
+THREAD_RESULT libload_work(void * argument)
+{
+    libload_t * loader = (libload_t *) argument;
+    long index;
+
+    QUIET = TRUE;
+    for(index = THREAD_INCREMENT(&loader->nextFile) - 1; index < loader->numFiles;
+        index = THREAD_INCREMENT(&loader->nextFile) - 1)
+    {
+        libload_load(&loader->files[index]);
+    }
+
+    return THREAD_RETURN;
+}
+
+/**
+ * Function: libload_load
+ * Description:
+ *  - Loads one file, with the tables of this thread.
+ * Parameters:
+ *  - file: The file.
+ * Returns:
+ *  - none
+ */
+void libload_load(libload_file_t * file)
+{
+    ERROR_MESSAGE[0] = '\0';
+    if(libload_isLibrary(file->fileName))
+    {
+        file->library = library_open(file->fileName);
+    }
+    else
+    {
+        libload_process(file);
+    }
+
+    if(file->library == NULL && ERROR_MESSAGE[0] != '\0')
+    {
+        file->error = _strdup(ERROR_MESSAGE);
+    }
+}
+
+/**
+ * Function: libload_process
+ * Description:
+ *  - Processes a file of definitions as an input, and lays out its macros,
+ *    SET variables and UNIQUE_ID as a library. Its output is dropped.
+ * Parameters:
+ *  - file: The file.
+ * Returns:
+ *  - SUCCESS or FAILURE
+ */
+int libload_process(libload_file_t * file)
+{
+    FILE * inputFile = NULL;
+    stream_t * input = NULL;
+    stream_t * output = NULL;
+    char * image;
+    unsigned int size = 0;
+    int result = FAILURE;
+
+    if(fopen_s(&inputFile, file->fileName, "r") != 0 || inputFile == NULL)
+    {
+        return FAILURE;
+    }
+
+    budget = file->budget;
+    dependencies = file->files;
+    input = stream_allocFile(inputFile);
+    output = stream_allocOutput(NULL, 0);
+
+    result = processBegin(input, output);
+    while(result == SUCCESS)
+    {
+        result = processStep(input, output);
+    }
+
+    if(result == END_OF_INPUT)
+    {
+        image = library_build(&size);
+        file->library = library_openImage(image, size, file->fileName);
+        result = (file->library != NULL) ? SUCCESS : FAILURE;
+    }
+    else
+    {
+        result = FAILURE;
+    }
+
+    processFree();
+    stream_free(input);
+    stream_free(output);
+    fclose(inputFile);
+    budget = NULL;
+    dependencies = NULL;
+    return result;
+}
@@ -0,0 +1,37 @@
+/*
+ * libload.h - Contains functions and definitions for loading the macro
+ * library files given with --library, on several threads.
+ */
+
+#ifndef LIBLOAD_H_
+#define LIBLOAD_H_
+
+#include "thread.h"
+#include "budget.h"
+#include "depfile.h"
+#include "library.h"
+
+#define LIBLOAD_MAX_THREADS     (16)
+
+// A file to load: a library written with --emit-library, mapped as it is,
+// or a file of definitions, processed into a library in memory
+typedef struct
+{
+    const char *    fileName;
+    library_t *     library;    // NULL until loaded, or if it could not be
+    budget_t *      budget;     // limits for processing the definitions
+    depfile_t *     files;      // files the definitions included
+    char *          error;      // first error, reported in the order of the files
+} libload_file_t;
+
+typedef struct
+{
+    libload_file_t *    files;
+    int                 numFiles;
+    volatile long       nextFile;   // next file for a thread to take
+} libload_t;
+
+library_t * libload_open(const char * const * fileNames, int numFiles, int numThreads);
+int         libload_isLibrary(const char * fileName);
+
+#endif /* LIBLOAD_H_ */
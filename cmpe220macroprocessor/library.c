@@ -0,0 +1,901 @@
+/*
+ * library.c - Contains functions for precompiled macro libraries.
+ *
+ * A library is written after a prelude file was processed (--emit-library),
+ * and mapped read-only before the input file is processed (--library).
+ * Loading only restores the SET variables; a macro is entered into NAMTAB
+ * the first time NAMTAB is asked for it, and its DEFTAB lines are then used
+ * in place, without copying.
+ *
+ * A library can also be built in memory (library_build), and several merged
+ * into one (library_merge), for the files of definitions libload.c loads.
+ */
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "definitions.h"
+#include "library.h"
+
+// Strings of a library being written
+typedef struct
+{
+    char *          data;
+    unsigned int    size;
+    unsigned int    capacity;
+    unsigned int    offset;     // file offset of the string section
+    int             failed;     // out of memory
+} library_strings_t;
+
+// Macro or SET variable of one of the libraries being merged
+typedef struct
+{
+    const char *    name;
+    int             priority;   // index of the library, the highest is kept
+    unsigned int    index;      // in the table of its library
+} library_source_t;
+
+// local function definitions
+unsigned int library_addString(library_strings_t * strings, const char * string);
+unsigned int library_layout(library_header_t * header);
+char * library_assemble(library_header_t * header, const library_macro_t * macros, const deftab_record_t * lines,
+    const library_variable_t * variables, const library_strings_t * strings, unsigned int * size);
+int library_check(library_t * library, const char * fileName);
+int library_isTableValid(library_t * library, unsigned int offset, unsigned int count, unsigned int recordSize);
+int library_compareMacros(const void * left, const void * right);
+int library_compareSources(const void * left, const void * right);
+
+/**
+ * Function: library_emit
+ * Description:
+ *  - Writes NAMTAB, DEFTAB, the SET variables and UNIQUE_ID to a library file.
+ * Parameters:
+ *  - fileName: Name of the library file.
+ * Returns:
+ *  - If successful, returns SUCCESS. Otherwise, returns FAILURE.
+ */
+int library_emit(const char * fileName)
+{
+    FILE *          file = NULL;
+    char *          image;
+    unsigned int    size = 0;
+    int             result = FAILURE;
+
+    if(fileName == NULL)
+    {
+        return FAILURE;
+    }
+
+    image = library_build(&size);
+    if(image != NULL && fopen_s(&file, fileName, "wb") == 0 && file != NULL)
+    {
+        if(fwrite(image, 1, size, file) == size)
+        {
+            result = SUCCESS;
+        }
+        fclose(file);
+    }
+
+    if(result != SUCCESS)
+    {
+        printError("ERROR: Could not write macro library %s\n", fileName);
+    }
+
+    free(image);
+    return result;
+}
+
+/**
+ * Function: library_build
+ * Description:
+ *  - Lays out NAMTAB, DEFTAB, the SET variables and UNIQUE_ID in memory, as
+ *    library_emit writes them to a file.
+ * Parameters:
+ *  - size: Set to the size of the library.
+ * Returns:
+ *  - If successful, returns the library, allocated with malloc. Otherwise,
+ *    returns NULL.
+ */
+char * library_build(unsigned int * size)
+{
+    char *                  image;
+    library_header_t        header;
+    library_macro_t *       macros;
+    deftab_record_t *       lines;
+    library_variable_t *    variables;
+    library_strings_t       strings;
+    namtab_entry_t *        entry;
+    struct argtab_data *    element;
+    struct argtab_data *    tmp;
+    int *                   order;
+    int                     numMacros = 0;
+    int                     numVariables;
+    int                     i;
+
+    if(size == NULL || namtab == NULL || deftab == NULL || argtab == NULL)
+    {
+        return NULL;
+    }
+
+    // sort NAMTAB by symbol, so macros can be found without reading them all.
+    // A symbol is defined once, as a definition replaces the one before it.
+    order = (int *) calloc(namtab->size + 1, sizeof(int));
+    if(order == NULL)
+    {
+        return NULL;
+    }
+    for(i = 0; i < namtab->size; i++)
+    {
+        order[i] = i;
+    }
+    qsort(order, namtab->size, sizeof(int), library_compareMacros);
+    for(i = 0; i < namtab->size; i++)
+    {
+        if(numMacros == 0 || strcmp(namtab->array[order[i]]->symbol, namtab->array[order[numMacros - 1]]->symbol) != 0)
+        {
+            order[numMacros++] = order[i];
+        }
+    }
+
+    numVariables = HASH_COUNT(argtab->data);
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LIBRARY_MAGIC, sizeof(header.magic));
+    header.version = LIBRARY_VERSION;
+    header.numMacros = numMacros;
+    header.numLines = deftab->size;
+    header.numVariables = numVariables;
+    header.uniqueId = UNIQUE_ID;
+
+    macros = (library_macro_t *) calloc(header.numMacros + 1, sizeof(library_macro_t));
+    lines = (deftab_record_t *) calloc(header.numLines + 1, sizeof(deftab_record_t));
+    variables = (library_variable_t *) calloc(numVariables + 1, sizeof(library_variable_t));
+    memset(&strings, 0, sizeof(strings));
+    strings.offset = library_layout(&header);
+
+    if(macros == NULL || lines == NULL || variables == NULL)
+    {
+        free(order);
+        free(macros);
+        free(lines);
+        free(variables);
+        return NULL;
+    }
+
+    // the string section starts with an empty string, so it is never empty
+    library_addString(&strings, "");
+
+    for(i = 0; i < numMacros; i++)
+    {
+        entry = namtab_getIndex(namtab, order[i]);
+        macros[i].symbol = library_addString(&strings, entry->symbol);
+        macros[i].deftabStart = entry->deftabStart;
+        macros[i].deftabEnd = entry->deftabEnd;
+        macros[i].effects = entry->effects;
+        macros[i].staticParams = (entry->staticParams != NULL) ? library_addString(&strings, entry->staticParams) : 0;
+        macros[i].dynamicParams = (entry->dynamicParams != NULL) ? library_addString(&strings, entry->dynamicParams) : 0;
+    }
+
+    for(i = 0; i < deftab->size; i++)
+    {
+        // lines retired with a replaced definition are left empty
+        lines[i].text = library_addString(&strings, (deftab_get(deftab, i) != NULL) ? deftab_get(deftab, i) : "");
+        lines[i].labelCount = deftab_getLabelCount(deftab, i);
+        lines[i].loopDepth = deftab_getLoopDepth(deftab, i);
+    }
+
+    i = 0;
+    HASH_ITER(hh, argtab->data, element, tmp)
+    {
+        variables[i].key = library_addString(&strings, element->key);
+        variables[i].value = library_addString(&strings, element->value);
+        variables[i].isArray = element->valIsArray;
+        i++;
+    }
+
+    image = library_assemble(&header, macros, lines, variables, &strings, size);
+
+    free(order);
+    free(macros);
+    free(lines);
+    free(variables);
+    free(strings.data);
+    return image;
+}
+
+/**
+ * Function: library_merge
+ * Description:
+ *  - Builds one library from several, in memory. A macro or SET variable of
+ *    more than one library is taken from the last of them, as if their
+ *    preludes were processed one after the other, and only the DEFTAB lines
+ *    of the macros kept are copied. UNIQUE_ID is the sum of theirs.
+ * Parameters:
+ *  - libraries: Open libraries, from the lowest priority to the highest.
+ *  - count: Number of libraries.
+ * Returns:
+ *  - If successful, returns pointer to the merged library, which does not
+ *    refer to the others. Otherwise, returns NULL.
+ */
+library_t * library_merge(library_t ** libraries, int count)
+{
+    const library_header_t *    header;
+    const library_macro_t *     macro;
+    const library_variable_t *  variable;
+    const deftab_record_t *     records;
+    library_header_t            merged;
+    library_source_t *          macroSources;
+    library_source_t *          variableSources;
+    library_macro_t *           macros = NULL;
+    deftab_record_t *           lines = NULL;
+    library_variable_t *        variables = NULL;
+    library_strings_t           strings;
+    library_t *                 library;
+    library_t *                 result = NULL;
+    unsigned int                numMacros = 0;
+    unsigned int                numVariables = 0;
+    unsigned int                numDefined;
+    unsigned int                numLines = 0;
+    unsigned int                size = 0;
+    unsigned int                i, j, k;
+    char *                      image;
+    int                         valid = TRUE;
+
+    if(libraries == NULL || count <= 0)
+    {
+        return NULL;
+    }
+
+    // every macro and SET variable, with the library it comes from
+    for(i = 0; i < (unsigned int) count; i++)
+    {
+        if(libraries[i] == NULL || libraries[i]->header == NULL)
+        {
+            return NULL;
+        }
+        numMacros += libraries[i]->header->numMacros;
+        numVariables += libraries[i]->header->numVariables;
+    }
+    macroSources = (library_source_t *) calloc(numMacros + 1, sizeof(library_source_t));
+    variableSources = (library_source_t *) calloc(numVariables + 1, sizeof(library_source_t));
+    if(macroSources == NULL || variableSources == NULL)
+    {
+        free(macroSources);
+        free(variableSources);
+        return NULL;
+    }
+
+    numMacros = 0;
+    numVariables = 0;
+    for(i = 0; i < (unsigned int) count && valid; i++)
+    {
+        library = libraries[i];
+        header = library->header;
+        for(j = 0; j < header->numMacros && valid; j++)
+        {
+            macro = (const library_macro_t *)(library->base + header->macroOffset) + j;
+            valid = macro->symbol < library->size && macro->staticParams < library->size &&
+                macro->dynamicParams < library->size && macro->deftabStart >= 0 &&
+                macro->deftabStart <= macro->deftabEnd && macro->deftabEnd < (int) header->numLines;
+            macroSources[numMacros].name = library->base + macro->symbol;
+            macroSources[numMacros].priority = i;
+            macroSources[numMacros++].index = j;
+        }
+        for(j = 0; j < header->numVariables && valid; j++)
+        {
+            variable = (const library_variable_t *)(library->base + header->variableOffset) + j;
+            valid = variable->key < library->size && variable->value < library->size;
+            variableSources[numVariables].name = library->base + variable->key;
+            variableSources[numVariables].priority = i;
+            variableSources[numVariables++].index = j;
+        }
+    }
+
+    // sorted by name, the one kept first
+    numDefined = numMacros;
+    qsort(macroSources, numMacros, sizeof(library_source_t), library_compareSources);
+    qsort(variableSources, numVariables, sizeof(library_source_t), library_compareSources);
+    for(i = 0, j = 0; i < numMacros; i++)
+    {
+        if(j == 0 || strcmp(macroSources[i].name, macroSources[j - 1].name) != 0)
+        {
+            macroSources[j++] = macroSources[i];
+            library = libraries[macroSources[i].priority];
+            macro = (const library_macro_t *)(library->base + library->header->macroOffset) + macroSources[i].index;
+            numLines += macro->deftabEnd - macro->deftabStart + 1;
+        }
+    }
+    numMacros = j;
+    for(i = 0, j = 0; i < numVariables; i++)
+    {
+        if(j == 0 || strcmp(variableSources[i].name, variableSources[j - 1].name) != 0)
+        {
+            variableSources[j++] = variableSources[i];
+        }
+    }
+    numVariables = j;
+
+    memset(&merged, 0, sizeof(merged));
+    memcpy(merged.magic, LIBRARY_MAGIC, sizeof(merged.magic));
+    merged.version = LIBRARY_VERSION;
+    merged.numMacros = numMacros;
+    merged.numLines = numLines;
+    merged.numVariables = numVariables;
+    for(i = 0; i < (unsigned int) count; i++)
+    {
+        merged.uniqueId += libraries[i]->header->uniqueId;
+    }
+
+    memset(&strings, 0, sizeof(strings));
+    strings.offset = library_layout(&merged);
+    if(valid)
+    {
+        macros = (library_macro_t *) calloc(numMacros + 1, sizeof(library_macro_t));
+        lines = (deftab_record_t *) calloc(numLines + 1, sizeof(deftab_record_t));
+        variables = (library_variable_t *) calloc(numVariables + 1, sizeof(library_variable_t));
+    }
+
+    if(macros != NULL && lines != NULL && variables != NULL)
+    {
+        // the string section starts with an empty string, so it is never empty
+        library_addString(&strings, "");
+
+        // the lines of each macro follow each other, in the order of the macros
+        numLines = 0;
+        for(i = 0; i < numMacros && valid; i++)
+        {
+            library = libraries[macroSources[i].priority];
+            macro = (const library_macro_t *)(library->base + library->header->macroOffset) + macroSources[i].index;
+            records = (const deftab_record_t *)(library->base + library->header->lineOffset);
+
+            macros[i].symbol = library_addString(&strings, macroSources[i].name);
+            macros[i].deftabStart = numLines;
+            macros[i].deftabEnd = numLines + macro->deftabEnd - macro->deftabStart;
+            macros[i].effects = macro->effects;
+            macros[i].staticParams = (macro->staticParams != 0) ? library_addString(&strings, library->base + macro->staticParams) : 0;
+            macros[i].dynamicParams = (macro->dynamicParams != 0) ? library_addString(&strings, library->base + macro->dynamicParams) : 0;
+            for(k = macro->deftabStart; k <= (unsigned int) macro->deftabEnd && valid; k++)
+            {
+                valid = records[k].text < library->size;
+                lines[numLines].text = valid ? library_addString(&strings, library->base + records[k].text) : 0;
+                lines[numLines].labelCount = records[k].labelCount;
+                lines[numLines++].loopDepth = records[k].loopDepth;
+            }
+        }
+
+        for(i = 0; i < numVariables; i++)
+        {
+            library = libraries[variableSources[i].priority];
+            variable = (const library_variable_t *)(library->base + library->header->variableOffset) + variableSources[i].index;
+            variables[i].key = library_addString(&strings, variableSources[i].name);
+            variables[i].value = library_addString(&strings, library->base + variable->value);
+            variables[i].isArray = variable->isArray;
+        }
+
+        image = valid ? library_assemble(&merged, macros, lines, variables, &strings, &size) : NULL;
+        if(image != NULL)
+        {
+            result = library_openImage(image, size, "(merged)");
+        }
+        if(result != NULL)
+        {
+            result->numFiles = count;
+            result->numReplaced = numDefined - numMacros;
+        }
+    }
+
+    if(!valid)
+    {
+        printError("ERROR: A macro library to merge is not valid\n");
+    }
+
+    free(macroSources);
+    free(variableSources);
+    free(macros);
+    free(lines);
+    free(variables);
+    free(strings.data);
+    return result;
+}
+
+/**
+ * Function: library_open
+ * Description:
+ *  - Maps a library file read-only and checks its header. Pages are shared
+ *    with other processes mapping the same file.
+ * Parameters:
+ *  - fileName: Name of the library file.
+ * Returns:
+ *  - If successful, returns pointer to the open library. Otherwise, returns
+ *    NULL.
+ */
+library_t * library_open(const char * fileName)
+{
+    library_t * library;
+
+    if(fileName == NULL)
+    {
+        return NULL;
+    }
+
+    library = (library_t *) malloc(sizeof(library_t));
+    if(library == NULL)
+    {
+        return NULL;
+    }
+    memset(library, 0, sizeof(library_t));
+    library->numFiles = 1;
+
+#ifdef _WIN32
+    library->file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(library->file == INVALID_HANDLE_VALUE)
+    {
+        free(library);
+        return NULL;
+    }
+    library->size = GetFileSize(library->file, NULL);
+    if(library->size != INVALID_FILE_SIZE && library->size > 0)
+    {
+        library->mapping = CreateFileMappingA(library->file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if(library->mapping != NULL)
+        {
+            library->base = (const char *) MapViewOfFile(library->mapping, FILE_MAP_READ, 0, 0, 0);
+        }
+    }
+#else
+    {
+        struct stat status;
+        int fd = open(fileName, O_RDONLY);
+        void * base;
+
+        if(fd < 0)
+        {
+            free(library);
+            return NULL;
+        }
+        if(fstat(fd, &status) == 0 && status.st_size > 0)
+        {
+            library->size = (unsigned int) status.st_size;
+            base = mmap(NULL, library->size, PROT_READ, MAP_SHARED, fd, 0);
+            library->base = (base != MAP_FAILED) ? (const char *) base : NULL;
+        }
+        close(fd);
+    }
+#endif
+
+    if(library->base == NULL)
+    {
+        printError("ERROR: Could not map macro library %s\n", fileName);
+        library_close(library);
+        return NULL;
+    }
+
+    if(library_check(library, fileName) != SUCCESS)
+    {
+        library_close(library);
+        return NULL;
+    }
+
+    return library;
+}
+
+/**
+ * Function: library_openImage
+ * Description:
+ *  - Opens a library built in memory, as library_open opens a file.
+ * Parameters:
+ *  - image: The library, allocated with malloc. It is freed when the
+ *    library is closed, or now if it is not valid.
+ *  - size: Size of the library.
+ *  - name: Name of the library for the errors.
+ * Returns:
+ *  - If successful, returns pointer to the open library. Otherwise, returns
+ *    NULL.
+ */
+library_t * library_openImage(char * image, unsigned int size, const char * name)
+{
+    library_t * library;
+
+    if(image == NULL)
+    {
+        return NULL;
+    }
+
+    library = (library_t *) malloc(sizeof(library_t));
+    if(library == NULL)
+    {
+        free(image);
+        return NULL;
+    }
+    memset(library, 0, sizeof(library_t));
+    library->image = image;
+    library->base = image;
+    library->size = size;
+    library->numFiles = 1;
+
+    if(size == 0 || library_check(library, name) != SUCCESS)
+    {
+        library_close(library);
+        return NULL;
+    }
+
+    return library;
+}
+
+/**
+ * Function: library_load
+ * Description:
+ *  - Makes the macros of an open library available through NAMTAB, and
+ *    restores the SET variables and UNIQUE_ID of its prelude. Macros are
+ *    entered by library_resolve when first used.
+ * Parameters:
+ *  - library: Pointer to the open library.
+ * Returns:
+ *  - If successful, returns SUCCESS. Otherwise, returns FAILURE.
+ */
+int library_load(library_t * library)
+{
+    const library_header_t *    header;
+    const library_variable_t *  variables;
+    char                        value[ARGTAB_STRING_SIZE + 2];
+    unsigned int                i;
+
+    if(library == NULL || library->header == NULL || namtab == NULL || deftab == NULL || argtab == NULL)
+    {
+        return FAILURE;
+    }
+
+    header = library->header;
+    variables = (const library_variable_t *)(library->base + header->variableOffset);
+    for(i = 0; i < header->numVariables; i++)
+    {
+        if(variables[i].key >= library->size || variables[i].value >= library->size)
+        {
+            return FAILURE;
+        }
+
+        sprintf_s(value, sizeof(value), variables[i].isArray ? "(%.*s)" : "%.*s",
+            ARGTAB_STRING_SIZE - 1, library->base + variables[i].value);
+        argtab_addOrSet(argtab, library->base + variables[i].key, value);
+    }
+
+    THREAD_STORE(&library->numLoaded, 0);
+    namtab_setResolver(namtab, library_resolve, library);
+    UNIQUE_ID = header->uniqueId;
+    return SUCCESS;
+}
+
+/**
+ * Function: library_resolve
+ * Description:
+ *  - Looks up a symbol in the sorted NAMTAB of a library. If found, enters
+ *    the macro into NAMTAB and its lines into DEFTAB (in place).
+ *  - NOTE: Called by namtab_get for symbols not in NAMTAB.
+ * Parameters:
+ *  - context: Pointer to the open library.
+ *  - table: NAMTAB to enter the macro into.
+ *  - symbol: Symbol name to search for.
+ * Returns:
+ *  - If found, returns a pointer to the new NAMTAB entry. Otherwise, returns
+ *    NULL.
+ */
+namtab_entry_t * library_resolve(void * context, namtab_t * table, const char * symbol)
+{
+    library_t *                 library = (library_t *) context;
+    const library_header_t *    header;
+    const library_macro_t *     macros;
+    const library_macro_t *     macro = NULL;
+    namtab_entry_t *            entry;
+    int                         low;
+    int                         high;
+    int                         middle;
+    int                         compare;
+    int                         first;
+
+    if(library == NULL || library->header == NULL || table == NULL || symbol == NULL)
+    {
+        return NULL;
+    }
+
+    // binary search, only the symbols compared are read
+    header = library->header;
+    macros = (const library_macro_t *)(library->base + header->macroOffset);
+    low = 0;
+    high = (int) header->numMacros - 1;
+    while(low <= high && macro == NULL)
+    {
+        middle = low + (high - low) / 2;
+        if(macros[middle].symbol >= library->size)
+        {
+            break;
+        }
+
+        compare = strcmp(symbol, library->base + macros[middle].symbol);
+        if(compare == 0)
+        {
+            macro = &macros[middle];
+        }
+        else if(compare < 0)
+        {
+            high = middle - 1;
+        }
+        else
+        {
+            low = middle + 1;
+        }
+    }
+
+    if(macro == NULL)
+    {
+        return NULL;
+    }
+
+    if(macro->staticParams >= library->size || macro->dynamicParams >= library->size ||
+       macro->deftabStart < 0 || macro->deftabStart > macro->deftabEnd ||
+       macro->deftabEnd >= (int)header->numLines)
+    {
+        printError("ERROR: Macro %s of the library is not valid\n", symbol);
+        return NULL;
+    }
+
+    first = deftab_addMapped(deftab, library->base, library->size,
+        (const deftab_record_t *)(library->base + header->lineOffset) + macro->deftabStart,
+        macro->deftabEnd - macro->deftabStart + 1);
+    if(first < 0)
+    {
+        printError("ERROR: Macro %s of the library is not valid\n", symbol);
+        return NULL;
+    }
+
+    entry = namtab_getIndex(table, namtab_add(table, symbol, first, first + macro->deftabEnd - macro->deftabStart));
+    if(entry == NULL)
+    {
+        return NULL;
+    }
+    entry->effects = macro->effects;
+    if(macro->staticParams != 0)
+    {
+        entry->staticParams = _strdup(library->base + macro->staticParams);
+    }
+    if(macro->dynamicParams != 0)
+    {
+        entry->dynamicParams = _strdup(library->base + macro->dynamicParams);
+    }
+
+    THREAD_INCREMENT(&library->numLoaded);
+    return entry;
+}
+
+/**
+ * Function: library_close
+ * Description:
+ *  - Unmaps a library file, or frees a library built in memory.
+ *  - NOTE: DEFTAB refers to the mapped lines, so it must be freed first.
+ * Parameters:
+ *  - library: Pointer to the open library.
+ * Returns:
+ *  - none
+ */
+void library_close(library_t * library)
+{
+    if(library && library->image != NULL)
+    {
+        free(library->image);
+        free(library);
+    }
+    else if(library)
+    {
+#ifdef _WIN32
+        if(library->base != NULL)
+        {
+            UnmapViewOfFile(library->base);
+        }
+        if(library->mapping != NULL)
+        {
+            CloseHandle(library->mapping);
+        }
+        if(library->file != NULL && library->file != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(library->file);
+        }
+#else
+        if(library->base != NULL)
+        {
+            munmap((void *) library->base, library->size);
+        }
+#endif
+        free(library);
+    }
+}
+
+/**
+ * Function: library_addString
+ * Description:
+ *  - Appends a string to the string section of a library being written.
+ * Parameters:
+ *  - strings: String section.
+ *  - string: String to append.
+ * Returns:
+ *  - File offset of the string, or 0 if out of memory.
+ */
+unsigned int library_addString(library_strings_t * strings, const char * string)
+{
+    unsigned int length = strlen(string) + 1;
+    unsigned int result;
+    char * tmpData;
+
+    // grow capacity, at least doubling it
+    if(strings->size + length > strings->capacity)
+    {
+        strings->capacity = (strings->capacity * 2 > strings->size + length) ?
+            strings->capacity * 2 : strings->size + length;
+        tmpData = (char *) realloc(strings->data, strings->capacity);
+        if(tmpData == NULL)
+        {
+            strings->failed = TRUE;
+            return 0;
+        }
+        strings->data = tmpData;
+    }
+
+    result = strings->offset + strings->size;
+    memcpy(strings->data + strings->size, string, length);
+    strings->size += length;
+    return result;
+}
+
+/**
+ * Function: library_layout
+ * Description:
+ *  - Sets the offsets of the tables of a library being written, from their
+ *    number of records.
+ * Parameters:
+ *  - header: Header of the library.
+ * Returns:
+ *  - File offset of the string section, which follows the tables.
+ */
+unsigned int library_layout(library_header_t * header)
+{
+    header->macroOffset = sizeof(library_header_t);
+    header->lineOffset = header->macroOffset + header->numMacros * sizeof(library_macro_t);
+    header->variableOffset = header->lineOffset + header->numLines * sizeof(deftab_record_t);
+    return header->variableOffset + header->numVariables * sizeof(library_variable_t);
+}
+
+/**
+ * Function: library_assemble
+ * Description:
+ *  - Puts the header, tables and strings of a library being written one
+ *    after the other, as they are in the file.
+ * Parameters:
+ *  - header: Header, laid out with library_layout. Its file size is set.
+ *  - macros: NAMTAB.
+ *  - lines: DEFTAB.
+ *  - variables: SET variables.
+ *  - strings: String section.
+ *  - size: Set to the size of the library.
+ * Returns:
+ *  - The library, allocated with malloc, or NULL if out of memory.
+ */
+char * library_assemble(library_header_t * header, const library_macro_t * macros, const deftab_record_t * lines,
+    const library_variable_t * variables, const library_strings_t * strings, unsigned int * size)
+{
+    char * image;
+
+    if(strings->failed)
+    {
+        return NULL;
+    }
+
+    header->fileSize = strings->offset + strings->size;
+    image = (char *) malloc(header->fileSize);
+    if(image != NULL)
+    {
+        memcpy(image, header, sizeof(library_header_t));
+        memcpy(image + header->macroOffset, macros, header->numMacros * sizeof(library_macro_t));
+        memcpy(image + header->lineOffset, lines, header->numLines * sizeof(deftab_record_t));
+        memcpy(image + header->variableOffset, variables, header->numVariables * sizeof(library_variable_t));
+        memcpy(image + strings->offset, strings->data, strings->size);
+        *size = header->fileSize;
+    }
+
+    return image;
+}
+
+/**
+ * Function: library_check
+ * Description:
+ *  - Checks the header of a library, before any offset in it is trusted,
+ *    and sets the header of the open library.
+ * Parameters:
+ *  - library: Pointer to the library, mapped or built.
+ *  - fileName: Name of the library for the error.
+ * Returns:
+ *  - SUCCESS, or FAILURE if it is not a library of this version.
+ */
+int library_check(library_t * library, const char * fileName)
+{
+    const library_header_t * header = (const library_header_t *) library->base;
+
+    if(library->size < sizeof(library_header_t) ||
+       memcmp(header->magic, LIBRARY_MAGIC, sizeof(header->magic)) != 0 ||
+       header->version != LIBRARY_VERSION ||
+       header->fileSize != library->size ||
+       library->base[library->size - 1] != '\0' ||
+       !library_isTableValid(library, header->macroOffset, header->numMacros, sizeof(library_macro_t)) ||
+       !library_isTableValid(library, header->lineOffset, header->numLines, sizeof(deftab_record_t)) ||
+       !library_isTableValid(library, header->variableOffset, header->numVariables, sizeof(library_variable_t)))
+    {
+        printError("ERROR: %s is not a version %d macro library\n", fileName, LIBRARY_VERSION);
+        return FAILURE;
+    }
+    library->header = header;
+
+    return SUCCESS;
+}
+
+/**
+ * Function: library_isTableValid
+ * Description:
+ *  - Checks that a table of the library lies inside the file, and is aligned
+ *    for its records.
+ * Parameters:
+ *  - library: Pointer to the open library.
+ *  - offset: File offset of the table.
+ *  - count: Number of records.
+ *  - recordSize: Size of one record.
+ * Returns:
+ *  - TRUE or FALSE
+ */
+int library_isTableValid(library_t * library, unsigned int offset, unsigned int count, unsigned int recordSize)
+{
+    return (offset % sizeof(int)) == 0 &&
+        offset <= library->size &&
+        count <= (library->size - offset) / recordSize;
+}
+
+/**
+ * Function: library_compareMacros
+ * Description:
+ *  - Orders NAMTAB indices by symbol, then by index, for qsort.
+ * Parameters:
+ *  - left: Pointer to a NAMTAB index.
+ *  - right: Pointer to a NAMTAB index.
+ * Returns:
+ *  - Negative, zero or positive, as strcmp.
+ */
+int library_compareMacros(const void * left, const void * right)
+{
+    int leftIndex = *(const int *) left;
+    int rightIndex = *(const int *) right;
+    int result = strcmp(namtab->array[leftIndex]->symbol, namtab->array[rightIndex]->symbol);
+
+    return (result != 0) ? result : leftIndex - rightIndex;
+}
+
+/**
+ * Function: library_compareSources
+ * Description:
+ *  - Orders the macros or SET variables of the libraries being merged by
+ *    name, then from the highest priority to the lowest, for qsort.
+ * Parameters:
+ *  - left: Pointer to a library_source_t.
+ *  - right: Pointer to a library_source_t.
+ * Returns:
+ *  - Negative, zero or positive, as strcmp.
+ */
+int library_compareSources(const void * left, const void * right)
+{
+    const library_source_t * leftSource = (const library_source_t *) left;
+    const library_source_t * rightSource = (const library_source_t *) right;
+    int result = strcmp(leftSource->name, rightSource->name);
+
+    return (result != 0) ? result : rightSource->priority - leftSource->priority;
+}
@@ -0,0 +1,84 @@
+/*
+ * library.h - Contains functions and definitions for precompiled macro libraries.
+ */
+
+#ifndef LIBRARY_H_
+#define LIBRARY_H_
+
+#include "thread.h"
+#include "deftab.h"
+#include "namtab.h"
+
+#define LIBRARY_MAGIC       "CMPEMLIB"
+#define LIBRARY_VERSION     (2)
+
+/*
+ * Library file layout. Every reference is an offset from the start of the
+ * file, so the file can be mapped anywhere and shared between processes.
+ * Strings are NUL terminated and the file ends with a NUL.
+ *
+ * Macros are looked up in the sorted NAMTAB when first used, and only then
+ * entered into NAMTAB and DEFTAB, so unused macros cost nothing.
+ *
+ *   library_header_t
+ *   library_macro_t     [numMacros]     NAMTAB, sorted by symbol
+ *   deftab_record_t     [numLines]      DEFTAB
+ *   library_variable_t  [numVariables]  SET variables after the prelude
+ *   strings
+ */
+typedef struct
+{
+    char            magic[8];
+    unsigned int    version;
+    unsigned int    fileSize;
+    unsigned int    numMacros;
+    unsigned int    macroOffset;
+    unsigned int    numLines;
+    unsigned int    lineOffset;
+    unsigned int    numVariables;
+    unsigned int    variableOffset;
+    int             uniqueId;       // UNIQUE_ID after the prelude
+} library_header_t;
+
+typedef struct
+{
+    unsigned int    symbol;
+    int             deftabStart;    // index into the library DEFTAB
+    int             deftabEnd;
+    int             effects;
+    unsigned int    staticParams;   // 0 if none
+    unsigned int    dynamicParams;  // 0 if none
+} library_macro_t;
+
+typedef struct
+{
+    unsigned int    key;
+    unsigned int    value;          // without parentheses if isArray
+    int             isArray;
+} library_variable_t;
+
+// A library file mapped read-only, or a library built in memory, shared by
+// the expansions of every thread that pins it from the catalog
+typedef struct
+{
+    const char *                base;
+    unsigned int                size;
+    const library_header_t *    header;
+    void *                      file;       // platform handles
+    void *                      mapping;
+    char *                      image;      // when built in memory, instead of mapped
+    int                         numFiles;   // files merged into it
+    int                         numReplaced;// macros of a file replaced by a later file
+    volatile long               numLoaded;  // macros entered on first use, by any thread
+} library_t;
+
+int         library_emit(const char * fileName);
+char *      library_build(unsigned int * size);
+library_t * library_open(const char * fileName);
+library_t * library_openImage(char * image, unsigned int size, const char * name);
+library_t * library_merge(library_t ** libraries, int count);
+int         library_load(library_t * library);
+void        library_close(library_t * library);
+namtab_entry_t * library_resolve(void * context, namtab_t * table, const char * symbol);
+
+#endif /* LIBRARY_H_ */
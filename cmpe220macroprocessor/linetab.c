@@ -0,0 +1,565 @@
+/*
+ * linetab.c - Contains functions for the line table.
+ *
+ * Splitting the input into lines and tokenizing them does not depend on the
+ * macros defined so far, so it is done ahead of processing, by worker
+ * threads, one chunk of the mapped input at a time. The tokens are the ones
+ * parse_line would find, and parse_tokens turns them into a parse_info_t.
+ */
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include "definitions.h"
+#include "linetab.h"
+
+// Chunks the workers may tokenize ahead of processing, to bound the memory
+// used by the line table
+#define LINETAB_WINDOW          (4 * LINETAB_MAX_THREADS)
+
+// local function definitions
+int linetab_map(linetab_t * table, const char * fileName);
+int linetab_split(linetab_t * table);
+void linetab_tokenizeChunk(linetab_t * table, linetab_chunk_t * chunk);
+BOOL linetab_help(linetab_t * table);
+THREAD_RESULT linetab_work(void * argument);
+
+/**
+ * Function: linetab_open
+ * Description:
+ *  - Maps the input file and starts tokenizing it. With one thread, the
+ *    calling thread tokenizes each chunk when its lines are needed.
+ * Parameters:
+ *  - fileName: Name of the input file.
+ *  - numThreads: Threads to tokenize with, including the calling thread.
+ * Returns:
+ *  - If successful, returns pointer to new line table. Otherwise, returns NULL.
+ */
+linetab_t * linetab_open(const char * fileName, int numThreads)
+{
+    linetab_t * table;
+    int i;
+
+    if(fileName == NULL)
+    {
+        return NULL;
+    }
+
+    table = (linetab_t *) malloc(sizeof(linetab_t));
+    if(table == NULL)
+    {
+        return NULL;
+    }
+    memset(table, 0, sizeof(linetab_t));
+
+    if(linetab_map(table, fileName) != SUCCESS || linetab_split(table) != SUCCESS)
+    {
+        linetab_close(table);
+        return NULL;
+    }
+
+    // the calling thread is one of them
+    if(numThreads > LINETAB_MAX_THREADS)
+    {
+        numThreads = LINETAB_MAX_THREADS;
+    }
+    for(i = 0; i < numThreads - 1 && i < table->numChunks; i++)
+    {
+        if(thread_start(&table->threads[table->numThreads], linetab_work, table) == SUCCESS)
+        {
+            table->numThreads++;
+        }
+    }
+
+    return table;
+}
+
+/**
+ * Function: linetab_close
+ * Description:
+ *  - Stops the worker threads, unmaps the input file and de-allocates the
+ *    line table.
+ * Parameters:
+ *  - table: Pointer to the line table.
+ * Returns:
+ *  - none
+ */
+void linetab_close(linetab_t * table)
+{
+    int i;
+
+    if(table == NULL)
+    {
+        return;
+    }
+
+    THREAD_STORE(&table->stopping, TRUE);
+    for(i = 0; i < table->numThreads; i++)
+    {
+        thread_join(table->threads[i]);
+    }
+
+    for(i = 0; i < table->numChunks; i++)
+    {
+        free(table->chunks[i].lines);
+    }
+    free(table->chunks);
+
+#ifdef _WIN32
+    if(table->base != NULL)
+    {
+        UnmapViewOfFile(table->base);
+    }
+    if(table->mapping != NULL)
+    {
+        CloseHandle(table->mapping);
+    }
+    if(table->file != NULL && table->file != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(table->file);
+    }
+#else
+    if(table->base != NULL)
+    {
+        munmap((void *) table->base, table->size);
+    }
+#endif
+    free(table);
+}
+
+/**
+ * Function: linetab_next
+ * Description:
+ *  - Returns the next line, waiting for its chunk to be tokenized. The lines
+ *    of a chunk are freed when the next chunk is started.
+ * Parameters:
+ *  - table: Pointer to the line table.
+ * Returns:
+ *  - The line, or NULL at the end of the input or if a chunk failed.
+ */
+const linetab_entry_t * linetab_next(linetab_t * table)
+{
+    linetab_chunk_t * chunk;
+
+    if(table == NULL)
+    {
+        return NULL;
+    }
+
+    while(table->chunk < table->numChunks)
+    {
+        chunk = &table->chunks[table->chunk];
+        while(!THREAD_LOAD(&chunk->ready))
+        {
+            // tokenize a chunk instead of waiting, if one is left
+            if(!linetab_help(table))
+            {
+                thread_yield();
+            }
+        }
+
+        if(chunk->failed)
+        {
+            table->failed = TRUE;
+            return NULL;
+        }
+
+        if(table->line < chunk->size)
+        {
+            return &chunk->lines[table->line++];
+        }
+
+        // the workers may go on with the chunks after the window
+        free(chunk->lines);
+        chunk->lines = NULL;
+        table->line = 0;
+        table->chunk++;
+        THREAD_STORE(&table->consumed, table->chunk);
+    }
+
+    return NULL;
+}
+
+/**
+ * Function: linetab_copyLine
+ * Description:
+ *  - Copies a line as getline reads it from the file: in text mode, Windows
+ *    drops the carriage return of a line ending.
+ * Parameters:
+ *  - table: Pointer to the line table.
+ *  - entry: The line.
+ *  - buffer: Buffer for the line.
+ *  - size: Size of the buffer, in bytes.
+ * Returns:
+ *  - Length of the line in the buffer.
+ */
+int linetab_copyLine(const linetab_t * table, const linetab_entry_t * entry, char * buffer, int size)
+{
+    int length = entry->size;
+
+    if(length > size - 1)
+    {
+        length = size - 1;
+    }
+    memcpy(buffer, table->base + entry->offset, length);
+
+#ifdef _WIN32
+    if(length >= 2 && buffer[length - 2] == '\r' && buffer[length - 1] == '\n')
+    {
+        buffer[length - 2] = '\n';
+        length--;
+    }
+#endif
+
+    buffer[length] = '\0';
+    return length;
+}
+
+/**
+ * Function: linetab_tokenize
+ * Description:
+ *  - Finds the tokens parse_line would find in a line: a label if the first
+ *    token starts the line, the opcode, and the rest of the line without
+ *    leading whitespace. Lines parse_line cannot parse are left to it.
+ * Parameters:
+ *  - line: The line, as getline reads it.
+ *  - length: Length of the line.
+ *  - entry: Entry to set the tokens of.
+ * Returns:
+ *  - none
+ */
+void linetab_tokenize(const char * line, int length, linetab_entry_t * entry)
+{
+    int pos = 0;
+    int start;
+
+    entry->flags = 0;
+    if(length > 0 && line[0] == '.')
+    {
+        entry->flags = LINETAB_COMMENT;
+        return;
+    }
+
+    // first token, as strtok finds it; lines without one are not parsed
+    while(pos < length && (line[pos] == ' ' || line[pos] == '\t'))
+    {
+        pos++;
+    }
+    if(pos == length)
+    {
+        entry->flags = LINETAB_UNTOKENIZED;
+        return;
+    }
+    start = pos;
+    while(pos < length && line[pos] != ' ' && line[pos] != '\t')
+    {
+        pos++;
+    }
+
+    // a token on the first column is the label, the opcode follows it
+    if(start == 0)
+    {
+        entry->flags |= LINETAB_LABEL;
+        entry->label = (unsigned char) start;
+        entry->labelLength = (unsigned char)(pos - start);
+
+        if(pos < length)
+        {
+            pos++;      // strtok ends the token on the delimiter
+        }
+        while(pos < length && (line[pos] == ' ' || line[pos] == '\t'))
+        {
+            pos++;
+        }
+        if(pos == length)
+        {
+            return;
+        }
+        start = pos;
+        while(pos < length && line[pos] != ' ' && line[pos] != '\t')
+        {
+            pos++;
+        }
+    }
+
+    entry->flags |= LINETAB_OPCODE;
+    entry->opcode = (unsigned char) start;
+    entry->opcodeLength = (unsigned char)(pos - start);
+    if(pos < length)
+    {
+        pos++;
+    }
+
+    // rest of the line, up to a newline
+    while(pos < length && line[pos] == '\n')
+    {
+        pos++;
+    }
+    if(pos == length)
+    {
+        return;
+    }
+    start = pos;
+    while(pos < length && line[pos] != '\n')
+    {
+        pos++;
+    }
+    while(start < pos && isspace((unsigned char) line[start]))
+    {
+        start++;
+    }
+
+    entry->flags |= LINETAB_OPERATORS;
+    entry->operators = (unsigned char) start;
+    entry->operatorsLength = (unsigned char)(pos - start);
+}
+
+/**
+ * Function: linetab_map
+ * Description:
+ *  - Maps the input file read-only.
+ * Parameters:
+ *  - table: Pointer to the line table.
+ *  - fileName: Name of the input file.
+ * Returns:
+ *  - SUCCESS, or FAILURE if the file could not be mapped.
+ */
+int linetab_map(linetab_t * table, const char * fileName)
+{
+#ifdef _WIN32
+    LARGE_INTEGER size;
+
+    table->file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(table->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(table->file, &size))
+    {
+        return FAILURE;
+    }
+    table->size = (size_t) size.QuadPart;
+    if(table->size > 0)
+    {
+        table->mapping = CreateFileMappingA(table->file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if(table->mapping != NULL)
+        {
+            table->base = (const char *) MapViewOfFile(table->mapping, FILE_MAP_READ, 0, 0, 0);
+        }
+    }
+#else
+    struct stat status;
+    int fd = open(fileName, O_RDONLY);
+    void * base;
+
+    if(fd < 0)
+    {
+        return FAILURE;
+    }
+    if(fstat(fd, &status) == 0 && status.st_size > 0)
+    {
+        table->size = (size_t) status.st_size;
+        base = mmap(NULL, table->size, PROT_READ, MAP_SHARED, fd, 0);
+        table->base = (base != MAP_FAILED) ? (const char *) base : NULL;
+    }
+    close(fd);
+#endif
+
+    // an empty file has no lines
+    return (table->base != NULL || table->size == 0) ? SUCCESS : FAILURE;
+}
+
+/**
+ * Function: linetab_split
+ * Description:
+ *  - Cuts the input into chunks of about LINETAB_CHUNK_SIZE bytes, each
+ *    ending with a newline (except the last).
+ * Parameters:
+ *  - table: Pointer to the line table.
+ * Returns:
+ *  - SUCCESS, or FAILURE if out of memory.
+ */
+int linetab_split(linetab_t * table)
+{
+    const char * newline;
+    size_t start = 0;
+    size_t end;
+    int count = 0;
+    int pass;
+
+    // count the chunks, then fill them in
+    for(pass = 0; pass < 2; pass++)
+    {
+        start = 0;
+        count = 0;
+        while(start < table->size)
+        {
+            end = start + LINETAB_CHUNK_SIZE;
+            if(end >= table->size)
+            {
+                end = table->size;
+            }
+            else
+            {
+                newline = (const char *) memchr(table->base + end, '\n', table->size - end);
+                end = (newline != NULL) ? (size_t)(newline - table->base) + 1 : table->size;
+            }
+
+            if(pass == 1)
+            {
+                table->chunks[count].start = start;
+                table->chunks[count].end = end;
+            }
+            count++;
+            start = end;
+        }
+
+        if(pass == 0 && count > 0)
+        {
+            table->chunks = (linetab_chunk_t *) malloc(count * sizeof(linetab_chunk_t));
+            if(table->chunks == NULL)
+            {
+                return FAILURE;
+            }
+            memset(table->chunks, 0, count * sizeof(linetab_chunk_t));
+        }
+    }
+
+    table->numChunks = count;
+    return SUCCESS;
+}
+
+/**
+ * Function: linetab_tokenizeChunk
+ * Description:
+ *  - Splits a chunk into lines, as getline reads them, and tokenizes them.
+ * Parameters:
+ *  - table: Pointer to the line table.
+ *  - chunk: The chunk.
+ * Returns:
+ *  - none
+ */
+void linetab_tokenizeChunk(linetab_t * table, linetab_chunk_t * chunk)
+{
+    char line[CURRENT_LINE_SIZE];
+    linetab_entry_t * entry;
+    linetab_entry_t * tmpLines;
+    const char * newline;
+    size_t pos = chunk->start;
+    size_t size;
+    int length;
+
+    while(pos < chunk->end)
+    {
+        if(chunk->size == chunk->capacity)
+        {
+            // at least doubling, starting from a guess of 32 bytes per line
+            chunk->capacity = (chunk->capacity > 0) ? 2 * chunk->capacity :
+                (int)((chunk->end - chunk->start) / 32) + 16;
+            tmpLines = (linetab_entry_t *) realloc(chunk->lines, chunk->capacity * sizeof(linetab_entry_t));
+            if(tmpLines == NULL)
+            {
+                chunk->failed = TRUE;
+                break;
+            }
+            chunk->lines = tmpLines;
+        }
+
+        // lines longer than the getline buffer are read in pieces
+        size = chunk->end - pos;
+        if(size > CURRENT_LINE_SIZE - 1)
+        {
+            size = CURRENT_LINE_SIZE - 1;
+        }
+        newline = (const char *) memchr(table->base + pos, '\n', size);
+        if(newline != NULL)
+        {
+            size = newline - (table->base + pos) + 1;
+        }
+
+        entry = &chunk->lines[chunk->size++];
+        memset(entry, 0, sizeof(linetab_entry_t));
+        entry->offset = pos;
+        entry->size = (unsigned char) size;
+
+        // parse_line stops at a NUL, leave such lines to it
+        length = linetab_copyLine(table, entry, line, sizeof(line));
+        if(memchr(line, '\0', length) != NULL)
+        {
+            entry->flags = LINETAB_UNTOKENIZED;
+        }
+        else
+        {
+            linetab_tokenize(line, length, entry);
+        }
+
+        pos += size;
+    }
+
+    THREAD_STORE(&chunk->ready, TRUE);
+}
+
+/**
+ * Function: linetab_help
+ * Description:
+ *  - Takes the next chunk no thread has taken yet, if any, and tokenizes it.
+ * Parameters:
+ *  - table: Pointer to the line table.
+ * Returns:
+ *  - TRUE if a chunk was tokenized, FALSE if none was left.
+ */
+BOOL linetab_help(linetab_t * table)
+{
+    long index = THREAD_INCREMENT(&table->nextChunk) - 1;
+
+    if(index >= table->numChunks)
+    {
+        return FALSE;
+    }
+
+    linetab_tokenizeChunk(table, &table->chunks[index]);
+    return TRUE;
+}
+
+/**
+ * Function: linetab_work
+ * Description:
+ *  - Worker thread: tokenizes chunks until none is left, staying within
+ *    LINETAB_WINDOW chunks of the processing.
+ * Parameters:
+ *  - argument: Pointer to the line table.
+ * Returns:
+ *  - 0
+ */
+THREAD_RESULT linetab_work(void * argument)
+{
+    linetab_t * table = (linetab_t *) argument;
+    long index;
+
+    while(!THREAD_LOAD(&table->stopping))
+    {
+        index = THREAD_INCREMENT(&table->nextChunk) - 1;
+        if(index >= table->numChunks)
+        {
+            break;
+        }
+
+        while(index - THREAD_LOAD(&table->consumed) >= LINETAB_WINDOW && !THREAD_LOAD(&table->stopping))
+        {
+            thread_yield();
+        }
+        if(THREAD_LOAD(&table->stopping))
+        {
+            break;
+        }
+
+        linetab_tokenizeChunk(table, &table->chunks[index]);
+    }
+
+    return THREAD_RETURN;
+}
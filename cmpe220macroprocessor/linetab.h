@@ -0,0 +1,76 @@
+/*
+ * linetab.h - Contains functions and definitions for the line table, the
+ * input file split into lines and tokenized ahead of processing.
+ */
+
+#ifndef LINETAB_H_
+#define LINETAB_H_
+
+#include <stddef.h>
+#include "thread.h"
+
+#define LINETAB_CHUNK_SIZE      (1024 * 1024)   // bytes of input per chunk
+#define LINETAB_MAX_THREADS     (16)
+
+// linetab_entry_t flags
+#define LINETAB_COMMENT         (0x01)      // line starts with '.'
+#define LINETAB_LABEL           (0x02)
+#define LINETAB_OPCODE          (0x04)
+#define LINETAB_OPERATORS       (0x08)
+#define LINETAB_UNTOKENIZED     (0x10)      // parse_line has to parse the line
+
+// One line as getline reads it: the tokens are offsets into the line, and
+// cover what parse_line would find
+typedef struct linetab_entry_s
+{
+    size_t          offset;             // start of the line in the input
+    unsigned char   size;               // bytes of input, less than CURRENT_LINE_SIZE
+    unsigned char   flags;
+    unsigned char   label;
+    unsigned char   labelLength;
+    unsigned char   opcode;
+    unsigned char   opcodeLength;
+    unsigned char   operators;
+    unsigned char   operatorsLength;
+} linetab_entry_t;
+
+// Lines of one chunk of the input, set by a worker thread
+typedef struct
+{
+    size_t              start;
+    size_t              end;
+    linetab_entry_t *   lines;
+    int                 size;
+    int                 capacity;
+    volatile long       ready;          // lines are complete, or failed
+    int                 failed;         // out of memory
+} linetab_chunk_t;
+
+// Mapped input file, cut into chunks on newline boundaries. Worker threads
+// take the chunks in order and tokenize them, while linetab_next hands the
+// lines of ready chunks to the sequential processing.
+typedef struct linetab_s
+{
+    const char *        base;
+    size_t              size;
+    void *              file;           // platform handles
+    void *              mapping;
+    linetab_chunk_t *   chunks;
+    int                 numChunks;
+    volatile long       nextChunk;      // next chunk a thread takes
+    volatile long       consumed;       // chunks linetab_next is done with
+    volatile long       stopping;       // the lines are no longer needed
+    thread_t            threads[LINETAB_MAX_THREADS];
+    int                 numThreads;
+    int                 chunk;          // position of linetab_next
+    int                 line;
+    int                 failed;         // out of memory in a chunk
+} linetab_t;
+
+linetab_t *                 linetab_open(const char * fileName, int numThreads);
+void                        linetab_close(linetab_t * table);
+const linetab_entry_t *     linetab_next(linetab_t * table);
+int                         linetab_copyLine(const linetab_t * table, const linetab_entry_t * entry, char * buffer, int size);
+void                        linetab_tokenize(const char * line, int length, linetab_entry_t * entry);
+
+#endif /* LINETAB_H_ */
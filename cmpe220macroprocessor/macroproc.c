@@ -0,0 +1,510 @@
+/*
+ * macroproc.c - Contains the library API of the macroprocessor.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "definitions.h"
+#include "macroproc.h"
+
+// Options and mapped library kept between expansions
+struct macroproc_s
+{
+    budget_t *  budget;
+    catalog_t * catalog;
+    include_path_t * includePath;
+    int         labelBase;
+    int         labelDigits;
+};
+
+// Expansion in progress, returning one line at a time
+struct macroproc_iter_s
+{
+    stream_t *  input;
+    stream_t *  output;
+    budget_t *  savedBudget;
+    library_t * savedLibrary;
+    catalog_t * catalog;
+    catalog_snapshot_t * snapshot;  // library of this expansion
+    include_path_t * savedIncludePath;
+    size_t      readPos;        // start of the next line in the output buffer
+    char        savedChar;      // character replaced by the NUL ending the last line
+    int         result;         // result of the last step
+};
+
+// The engine keeps its tables in globals: one iterator may be open at a time
+static macroproc_iter_t * openIterator = NULL;
+
+// local function definitions
+void macroproc_setDiag(macroproc_diag_t * diag, int result, stream_t * input);
+
+/**
+ * Function: macroproc_create
+ * Description:
+ *  - Allocates a context with the default options of the command line
+ *    program.
+ * Parameters:
+ *  - none
+ * Returns:
+ *  - If successful, returns pointer to new context. Otherwise, returns NULL.
+ */
+macroproc_t * macroproc_create(void)
+{
+    macroproc_t * context = (macroproc_t *) malloc(sizeof(macroproc_t));
+    if(context)
+    {
+        memset(context, 0, sizeof(macroproc_t));
+        context->labelBase = DEFAULT_UNIQUE_LABEL_BASE;
+        context->labelDigits = DEFAULT_UNIQUE_LABEL_DIGITS;
+        context->budget = budget_alloc();
+        context->catalog = catalog_alloc();
+        if(context->budget == NULL || context->catalog == NULL)
+        {
+            budget_free(context->budget);
+            catalog_free(context->catalog);
+            free(context);
+            context = NULL;
+        }
+    }
+
+    return context;
+}
+
+/**
+ * Function: macroproc_destroy
+ * Description:
+ *  - De-allocates a context and unmaps its library. No iterator of the
+ *    context may be open.
+ * Parameters:
+ *  - context: Pointer to the context.
+ * Returns:
+ *  - none
+ */
+void macroproc_destroy(macroproc_t * context)
+{
+    if(context)
+    {
+        budget_free(context->budget);
+        catalog_free(context->catalog);
+        include_pathFree(context->includePath);
+        free(context);
+    }
+}
+
+/**
+ * Function: macroproc_setLimit
+ * Description:
+ *  - Sets an expansion budget, as the -l and -L options do.
+ * Parameters:
+ *  - context: Pointer to the context.
+ *  - spec: "name=limit", for example "loops=5000".
+ *  - perInvocation: Non-zero to limit each top level invocation, zero to
+ *    limit each expansion.
+ * Returns:
+ *  - SUCCESS, or FAILURE if the name is unknown or the limit is not 0 or
+ *    more digits.
+ */
+int macroproc_setLimit(macroproc_t * context, const char * spec, int perInvocation)
+{
+    if(context == NULL)
+    {
+        return FAILURE;
+    }
+
+    return budget_setLimit(context->budget, spec, perInvocation);
+}
+
+/**
+ * Function: macroproc_setLabelFormat
+ * Description:
+ *  - Sets the unique label format, as the -b and -w options do.
+ * Parameters:
+ *  - context: Pointer to the context.
+ *  - base: Number of distinct digits, 2 to 62.
+ *  - digits: Number of digits after the '$'.
+ * Returns:
+ *  - SUCCESS, or FAILURE if base or digits are out of range.
+ */
+int macroproc_setLabelFormat(macroproc_t * context, int base, int digits)
+{
+    if(context == NULL || setUniqueLabelFormat(base, digits) != SUCCESS)
+    {
+        return FAILURE;
+    }
+
+    context->labelBase = base;
+    context->labelDigits = digits;
+    return SUCCESS;
+}
+
+/**
+ * Function: macroproc_addIncludeDir
+ * Description:
+ *  - Adds a directory to search for INCLUDE files, as the -I option does.
+ * Parameters:
+ *  - context: Pointer to the context.
+ *  - dir: Directory, searched after the current directory and the
+ *    directories added before it.
+ * Returns:
+ *  - SUCCESS, or FAILURE if too many directories were added.
+ */
+int macroproc_addIncludeDir(macroproc_t * context, const char * dir)
+{
+    if(context == NULL)
+    {
+        return FAILURE;
+    }
+
+    if(context->includePath == NULL)
+    {
+        context->includePath = include_pathAlloc();
+    }
+
+    return include_addDir(context->includePath, dir);
+}
+
+/**
+ * Function: macroproc_loadLibrary
+ * Description:
+ *  - Maps a library written with --emit-library, or processes a file of
+ *    definitions into one. Its macros are available to every following
+ *    expansion, replacing those of any library loaded before. An open
+ *    iterator goes on with the library it started with. If the file cannot
+ *    be loaded, the library loaded before stays.
+ * Parameters:
+ *  - context: Pointer to the context.
+ *  - fileName: Name of the library file.
+ *  - diag: Filled in with what went wrong, may be NULL.
+ * Returns:
+ *  - SUCCESS or FAILURE
+ */
+int macroproc_loadLibrary(macroproc_t * context, const char * fileName, macroproc_diag_t * diag)
+{
+    int result = FAILURE;
+
+    if(context != NULL && fileName != NULL)
+    {
+        QUIET = TRUE;
+        memset(ERROR_MESSAGE, 0, sizeof(ERROR_MESSAGE));
+        result = catalog_reload(context->catalog, fileName);
+        QUIET = FALSE;
+    }
+
+    macroproc_setDiag(diag, result, NULL);
+    return result;
+}
+
+/**
+ * Function: macroproc_expand
+ * Description:
+ *  - Expands the macros of an assembly program held in memory, and writes
+ *    the expanded program to memory. Nothing is printed to the console.
+ * Parameters:
+ *  - context: Pointer to the context.
+ *  - input: Assembly program. Need not be NUL terminated.
+ *  - inputSize: Size of the program, in bytes.
+ *  - output: Output buffer, see macroproc_buffer_t.
+ *  - diag: Filled in with what went wrong, may be NULL.
+ * Returns:
+ *  - SUCCESS or FAILURE
+ */
+int macroproc_expand(macroproc_t * context, const char * input, size_t inputSize,
+    macroproc_buffer_t * output, macroproc_diag_t * diag)
+{
+    int         result = FAILURE;
+    stream_t *  inputStream = NULL;
+    stream_t *  outputStream = NULL;
+    budget_t *  savedBudget = budget;
+    library_t * savedLibrary = library;
+    include_path_t * savedIncludePath = includePath;
+    catalog_snapshot_t * snapshot;
+
+    if(context == NULL || output == NULL || openIterator != NULL)
+    {
+        macroproc_setDiag(diag, FAILURE, NULL);
+        return FAILURE;
+    }
+
+    inputStream = stream_allocInput(input, inputSize);
+    outputStream = stream_allocOutput(output->data, output->capacity);
+    if(inputStream != NULL && outputStream != NULL)
+    {
+        // the engine reads its options from globals
+        snapshot = catalog_pin(context->catalog);
+        budget = context->budget;
+        library = snapshot->library;
+        includePath = context->includePath;
+        setUniqueLabelFormat(context->labelBase, context->labelDigits);
+        EMIT_LIBRARY_FILE = NULL;
+        VERBOSE = FALSE;
+        STATS = FALSE;
+        QUIET = TRUE;
+
+        result = processInput(inputStream, outputStream);
+        catalog_release(context->catalog, snapshot);
+        if(outputStream->failed && !outputStream->isGrowable)
+        {
+            // replaces the error reported by processInput
+            sprintf_s(ERROR_MESSAGE, sizeof(ERROR_MESSAGE), "ERROR: The output needs %u bytes, the buffer holds %u\n",
+                (unsigned int)(outputStream->outputSize + 1), (unsigned int) output->capacity);
+            result = FAILURE;
+        }
+
+        if(outputStream->isGrowable)
+        {
+            output->capacity = outputStream->outputCapacity;
+            output->data = stream_release(outputStream);
+        }
+        output->size = outputStream->outputSize;
+
+        budget = savedBudget;
+        library = savedLibrary;
+        includePath = savedIncludePath;
+        QUIET = FALSE;
+    }
+
+    macroproc_setDiag(diag, result, inputStream);
+    stream_free(inputStream);
+    stream_free(outputStream);
+    return result;
+}
+
+/**
+ * Function: macroproc_freeBuffer
+ * Description:
+ *  - Frees an output buffer allocated by macroproc_expand.
+ * Parameters:
+ *  - buffer: Output buffer.
+ * Returns:
+ *  - none
+ */
+void macroproc_freeBuffer(macroproc_buffer_t * buffer)
+{
+    if(buffer)
+    {
+        free(buffer->data);
+        buffer->data = NULL;
+        buffer->capacity = 0;
+        buffer->size = 0;
+    }
+}
+
+/**
+ * Function: macroproc_open
+ * Description:
+ *  - Starts an expansion whose lines are read with macroproc_nextLine. Until
+ *    macroproc_close, no other expansion can run and the options of the
+ *    context must not change, except for its library.
+ * Parameters:
+ *  - context: Pointer to the context.
+ *  - input: Assembly program. Need not be NUL terminated, and must stay
+ *    valid until macroproc_close.
+ *  - inputSize: Size of the program, in bytes.
+ *  - diag: Filled in with what went wrong, may be NULL.
+ * Returns:
+ *  - If successful, returns pointer to new iterator. Otherwise, returns NULL.
+ */
+macroproc_iter_t * macroproc_open(macroproc_t * context, const char * input, size_t inputSize,
+    macroproc_diag_t * diag)
+{
+    macroproc_iter_t * iter;
+
+    if(context == NULL || openIterator != NULL)
+    {
+        macroproc_setDiag(diag, FAILURE, NULL);
+        return NULL;
+    }
+
+    iter = (macroproc_iter_t *) malloc(sizeof(macroproc_iter_t));
+    if(iter == NULL)
+    {
+        macroproc_setDiag(diag, FAILURE, NULL);
+        return NULL;
+    }
+
+    memset(iter, 0, sizeof(macroproc_iter_t));
+    iter->input = stream_allocInput(input, inputSize);
+    iter->output = stream_allocOutput(NULL, 0);
+    if(iter->input == NULL || iter->output == NULL)
+    {
+        stream_free(iter->input);
+        stream_free(iter->output);
+        free(iter);
+        macroproc_setDiag(diag, FAILURE, NULL);
+        return NULL;
+    }
+
+    // the engine reads its options from globals
+    iter->savedBudget = budget;
+    iter->savedLibrary = library;
+    iter->savedIncludePath = includePath;
+    iter->catalog = context->catalog;
+    iter->snapshot = catalog_pin(context->catalog);
+    budget = context->budget;
+    library = iter->snapshot->library;
+    includePath = context->includePath;
+    setUniqueLabelFormat(context->labelBase, context->labelDigits);
+    EMIT_LIBRARY_FILE = NULL;
+    VERBOSE = FALSE;
+    STATS = FALSE;
+    QUIET = TRUE;
+    openIterator = iter;
+
+    iter->result = processBegin(iter->input, iter->output);
+    if(iter->result != SUCCESS)
+    {
+        macroproc_close(iter, diag);
+        return NULL;
+    }
+
+    macroproc_setDiag(diag, SUCCESS, NULL);
+    return iter;
+}
+
+/**
+ * Function: macroproc_nextLine
+ * Description:
+ *  - Returns the next expanded line, stepping the engine only until the line
+ *    is complete. The line stays valid until the next call.
+ * Parameters:
+ *  - iter: Pointer to the iterator.
+ *  - length: Set to the length of the line, with its newline. May be NULL.
+ * Returns:
+ *  - The line, NUL terminated, or NULL after the last line or an error
+ *    (macroproc_close tells which).
+ */
+const char * macroproc_nextLine(macroproc_iter_t * iter, size_t * length)
+{
+    stream_t *  output;
+    char *      start;
+    char *      newline;
+    size_t      size;
+
+    if(iter == NULL)
+    {
+        return NULL;
+    }
+
+    // put back the character after the line returned last time
+    output = iter->output;
+    if(iter->readPos > 0)
+    {
+        output->output[iter->readPos] = iter->savedChar;
+    }
+
+    for(;;)
+    {
+        start = output->output + iter->readPos;
+        size = output->outputSize - iter->readPos;
+        newline = (char *) memchr(start, '\n', size);
+        if(newline != NULL)
+        {
+            size = newline - start + 1;
+            break;
+        }
+
+        if(iter->result != SUCCESS)
+        {
+            // a last line without a newline, when the input ends with one
+            if(size == 0 || output->failed)
+            {
+                if(length)
+                {
+                    *length = 0;
+                }
+                return NULL;
+            }
+            break;
+        }
+
+        // drop the lines already returned, so the buffer only holds what the
+        // consumer has not read yet
+        if(iter->readPos > 0)
+        {
+            memmove(output->output, start, size + 1);
+            output->outputSize = size;
+            iter->readPos = 0;
+        }
+
+        iter->result = processStep(iter->input, output);
+    }
+
+    iter->readPos += size;
+    iter->savedChar = output->output[iter->readPos];
+    output->output[iter->readPos] = '\0';
+    if(length)
+    {
+        *length = size;
+    }
+
+    return start;
+}
+
+/**
+ * Function: macroproc_close
+ * Description:
+ *  - Ends an expansion and frees the iterator. Closing before the last line
+ *    was read skips the rest of the input.
+ * Parameters:
+ *  - iter: Pointer to the iterator.
+ *  - diag: Filled in with what went wrong, may be NULL.
+ * Returns:
+ *  - SUCCESS, or FAILURE if the expansion failed.
+ */
+int macroproc_close(macroproc_iter_t * iter, macroproc_diag_t * diag)
+{
+    int result;
+
+    if(iter == NULL)
+    {
+        macroproc_setDiag(diag, FAILURE, NULL);
+        return FAILURE;
+    }
+
+    result = processEnd(iter->output, iter->result);
+    macroproc_setDiag(diag, result, iter->input);
+    catalog_release(iter->catalog, iter->snapshot);
+
+    budget = iter->savedBudget;
+    library = iter->savedLibrary;
+    includePath = iter->savedIncludePath;
+    QUIET = FALSE;
+    openIterator = NULL;
+
+    stream_free(iter->input);
+    stream_free(iter->output);
+    free(iter);
+    return result;
+}
+
+/**
+ * Function: macroproc_setDiag
+ * Description:
+ *  - Fills in the diagnostics of an API call.
+ * Parameters:
+ *  - diag: Diagnostics, may be NULL.
+ *  - result: Result of the call.
+ *  - input: Input stream, or NULL if none was read.
+ * Returns:
+ *  - none
+ */
+void macroproc_setDiag(macroproc_diag_t * diag, int result, stream_t * input)
+{
+    if(diag == NULL)
+    {
+        return;
+    }
+
+    memset(diag, 0, sizeof(macroproc_diag_t));
+    diag->result = result;
+    if(result != SUCCESS)
+    {
+        strcpy_s(diag->message, sizeof(diag->message), ERROR_MESSAGE);
+        if(input != NULL)
+        {
+            diag->lineNumber = input->lineNumber;
+            strcpy_s(diag->line, sizeof(diag->line), currentLine);
+        }
+    }
+}
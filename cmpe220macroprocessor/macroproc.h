@@ -0,0 +1,64 @@
+/*
+ * macroproc.h - Library API of the macroprocessor, for programs that expand
+ * assembly source in memory instead of running the command line program.
+ *
+ * The engine keeps its tables in globals, so a process runs one expansion at
+ * a time. A context keeps the options and the mapped library between
+ * expansions; every expansion starts with no macros defined other than those
+ * of the library. Loading another library while an iterator is open is
+ * allowed: the iterator keeps the library it started with. Files read by
+ * INCLUDE are kept for the life of the thread, and only read again when
+ * they change.
+ *
+ * macroproc_expand writes the whole expanded program at once. An iterator
+ * instead returns one expanded line per macroproc_nextLine call, expanding
+ * only as much of the input as that line needs, so a consumer that stops
+ * early does no further work and memory stays bounded by the longest burst
+ * of output a single source line produces.
+ */
+
+#ifndef MACROPROC_H_
+#define MACROPROC_H_
+
+#include <stddef.h>
+
+#define MACROPROC_MESSAGE_SIZE  (256)
+
+typedef struct macroproc_s macroproc_t;
+typedef struct macroproc_iter_s macroproc_iter_t;
+
+// Output of an expansion. Set data to NULL to have the output allocated (free
+// it with macroproc_freeBuffer), or to a caller buffer of capacity bytes. If
+// the caller buffer is too small the expansion fails, and size tells how many
+// bytes (not counting the NUL) were needed.
+typedef struct
+{
+    char *  data;
+    size_t  capacity;
+    size_t  size;
+} macroproc_buffer_t;
+
+// What went wrong, if anything
+typedef struct
+{
+    int     result;                             // 0 on success, -1 on failure
+    int     lineNumber;                         // input line being read when it failed, 0 if none
+    char    line[MACROPROC_MESSAGE_SIZE];       // text of the line being processed
+    char    message[MACROPROC_MESSAGE_SIZE];    // first error reported
+} macroproc_diag_t;
+
+macroproc_t *   macroproc_create(void);
+void            macroproc_destroy(macroproc_t * context);
+int             macroproc_setLimit(macroproc_t * context, const char * spec, int perInvocation);
+int             macroproc_setLabelFormat(macroproc_t * context, int base, int digits);
+int             macroproc_addIncludeDir(macroproc_t * context, const char * dir);
+int             macroproc_loadLibrary(macroproc_t * context, const char * fileName, macroproc_diag_t * diag);
+int             macroproc_expand(macroproc_t * context, const char * input, size_t inputSize,
+                    macroproc_buffer_t * output, macroproc_diag_t * diag);
+void            macroproc_freeBuffer(macroproc_buffer_t * buffer);
+macroproc_iter_t * macroproc_open(macroproc_t * context, const char * input, size_t inputSize,
+                    macroproc_diag_t * diag);
+const char *    macroproc_nextLine(macroproc_iter_t * iter, size_t * length);
+int             macroproc_close(macroproc_iter_t * iter, macroproc_diag_t * diag);
+
+#endif /* MACROPROC_H_ */
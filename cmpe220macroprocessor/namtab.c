@@ -8,6 +8,9 @@
 #include "definitions.h"
 #include "namtab.h"
 
+// local function definitions
+void namtab_entryFree(namtab_entry_t * entry);
+
 /**
  * Function: namtab_alloc
  * Description:
@@ -25,7 +28,7 @@ namtab_t * namtab_alloc(void)
     if(table)
     {
         // initialize to zero
-        memset(table, 0, sizeof(table));
+        memset(table, 0, sizeof(namtab_t));
 
         // allocate memory for array (start with capacity of 1)
         array = (namtab_entry_t **) malloc(sizeof(namtab_entry_t *));
@@ -61,13 +64,19 @@ void namtab_free(namtab_t * table)
             for(i = 0; i < table->size; i++)
             {
                 //printf("%s: Free item %d @ 0x%08x\n", __func__, i, table->array[i]);
-                free(table->array[i]);
+                namtab_entryFree(table->array[i]);
             }
 
             //printf("%s: Free array @ 0x%08x\n", __func__, table->array);
             free(table->array);
         }
 
+        for(i = 0; i < table->numRetired; i++)
+        {
+            namtab_entryFree(table->retired[i]);
+        }
+        free(table->retired);
+
         //printf("%s: Free table @ 0x%08x\n", __func__, table);
         free(table);
     }
@@ -128,6 +137,11 @@ int namtab_add(namtab_t * table, const char * symbol, int start, int end)
                 strcpy_s(tmpData->symbol, bufsize, symbol);
                 tmpData->deftabStart = start;
                 tmpData->deftabEnd = end;
+                tmpData->effects = 0;
+                tmpData->staticParams = NULL;
+                tmpData->dynamicParams = NULL;
+                tmpData->variants = NULL;
+                tmpData->digest = 0;
 
                 // add new string to array
                 result = table->size++;
@@ -153,6 +167,7 @@ int namtab_add(namtab_t * table, const char * symbol, int start, int end)
  * Function: namtab_get
  * Description:
  *  - Retrieves a pointer to the NAMTAB entry associated with the given symbol.
+ *    Symbols not in the table are passed to the resolver, if one is set.
  * Parameters:
  *  - table: Pointer to NAMTAB.
  *  - symbol: Symbol name to search for.
@@ -175,6 +190,12 @@ namtab_entry_t * namtab_get(namtab_t * table, const char * symbol)
                 break;
             }
         }
+
+        // enter the symbol on its first use
+        if(result == NULL && table->resolver != NULL)
+        {
+            result = table->resolver(table->resolverContext, table, symbol);
+        }
     }
 
     return result;
@@ -199,4 +220,136 @@ namtab_entry_t * namtab_getIndex(namtab_t * table, int index)
     }
 
     return result;
-}
\ No newline at end of file
+}
+/**
+ * Function: namtab_find
+ * Description:
+ *  - Finds the entry of a symbol, without calling the resolver.
+ * Parameters:
+ *  - table: Pointer to NAMTAB data structure.
+ *  - symbol: Symbol name to search for.
+ * Returns:
+ *  - Index of the entry, or -1 if the symbol is not in the table.
+ */
+int namtab_find(namtab_t * table, const char * symbol)
+{
+    int i;
+
+    if(table && symbol)
+    {
+        for(i = 0; i < table->size; i++)
+        {
+            if(strcmp(table->array[i]->symbol, symbol) == 0)
+            {
+                return i;
+            }
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Function: namtab_replace
+ * Description:
+ *  - Replaces an entry with another one, for a macro defined again: the
+ *    new entry takes the place of the old one, which is moved to the retired
+ *    entries. The caller frees it with namtab_removeRetired once no
+ *    invocation is expanding it, and retires its DEFTAB lines.
+ * Parameters:
+ *  - table: Pointer to NAMTAB data structure.
+ *  - index: Index of the entry to replace.
+ *  - replacement: Index of the new entry, after index. The entries after it
+ *    move down by one.
+ * Returns:
+ *  - SUCCESS, or FAILURE if the indexes are not valid or memory ran out.
+ */
+int namtab_replace(namtab_t * table, int index, int replacement)
+{
+    namtab_entry_t ** tmpArray;
+
+    if(table == NULL || index < 0 || replacement <= index || replacement >= table->size)
+    {
+        return FAILURE;
+    }
+
+    if(table->numRetired >= table->retiredCapacity)
+    {
+        tmpArray = (namtab_entry_t **) realloc(table->retired, (2 * table->retiredCapacity + 1) * sizeof(namtab_entry_t *));
+        if(tmpArray == NULL)
+        {
+            return FAILURE;
+        }
+        table->retired = tmpArray;
+        table->retiredCapacity = 2 * table->retiredCapacity + 1;
+    }
+
+    table->retired[table->numRetired++] = table->array[index];
+    table->array[index] = table->array[replacement];
+    memmove(&table->array[replacement], &table->array[replacement + 1],
+        (table->size - replacement - 1) * sizeof(namtab_entry_t *));
+    table->size--;
+    table->redefinitions++;
+
+    return SUCCESS;
+}
+
+/**
+ * Function: namtab_removeRetired
+ * Description:
+ *  - Frees a retired entry.
+ * Parameters:
+ *  - table: Pointer to NAMTAB data structure.
+ *  - index: Index in the retired entries. The last one takes its place.
+ * Returns:
+ *  - none
+ */
+void namtab_removeRetired(namtab_t * table, int index)
+{
+    if(table && index >= 0 && index < table->numRetired)
+    {
+        namtab_entryFree(table->retired[index]);
+        table->retired[index] = table->retired[--table->numRetired];
+    }
+}
+
+/**
+ * Function: namtab_entryFree
+ * Description:
+ *  - De-allocates an entry.
+ * Parameters:
+ *  - entry: Pointer to the entry.
+ * Returns:
+ *  - none
+ */
+void namtab_entryFree(namtab_entry_t * entry)
+{
+    if(entry)
+    {
+        free(entry->symbol);
+        free(entry->staticParams);
+        free(entry->dynamicParams);
+        expcache_free(entry->variants);
+        free(entry);
+    }
+}
+
+/**
+ * Function: namtab_setResolver
+ * Description:
+ *  - Sets the function called by namtab_get for symbols not in the table.
+ * Parameters:
+ *  - table: Pointer to NAMTAB data structure.
+ *  - resolver: Function to call, or NULL for none.
+ *  - context: Passed to the resolver.
+ * Returns:
+ *  - none
+ */
+void namtab_setResolver(namtab_t * table, namtab_resolver_t resolver, void * context)
+{
+    if(table)
+    {
+        table->resolver = resolver;
+        table->resolverContext = context;
+    }
+}
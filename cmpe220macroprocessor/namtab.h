@@ -5,18 +5,51 @@
 #ifndef NAMTAB_H_
 #define NAMTAB_H_
 
+#include "expcache.h"
+
+// Effects of a macro body, found when the macro is defined
+#define MACRO_READS_SET     (0x01)  // references variables that are not parameters
+#define MACRO_WRITES_SET    (0x02)  // contains SET
+#define MACRO_UNIQUE_LABELS (0x04)  // contains '$' labels
+#define MACRO_INVOKES       (0x08)  // invokes other macros
+#define MACRO_DEFINES       (0x10)  // contains nested MACRO definitions
+#define MACRO_CONDITIONALS  (0x20)  // contains IF or WHILE
+
+// Expansion of a macro without these effects depends only on its invocation
+#define MACRO_IMPURE        (MACRO_READS_SET | MACRO_WRITES_SET | MACRO_INVOKES | MACRO_DEFINES)
+
+// Output of these must be written as it happens, so no variants are specialized
+#define MACRO_NOT_SPECIALIZABLE (MACRO_INVOKES | MACRO_DEFINES)
+
 typedef struct
 {
-    char *  symbol;
-    int     deftabStart;
-    int     deftabEnd;
+    char *          symbol;
+    int             deftabStart;
+    int             deftabEnd;
+    int             effects;
+    char *          staticParams;   // parameters feeding IF/WHILE/SET, comma separated
+    char *          dynamicParams;  // all other parameters, comma separated
+    expcache_t *    variants;       // branch-free bodies, keyed by static parameter values
+    unsigned long long digest;      // of the definition lines, 0 until needed (see watch.c)
 } namtab_entry_t;
 
-typedef struct
+struct namtab_s;
+
+// Called when a symbol is not in NAMTAB, to enter it from somewhere else (a
+// macro library). Returns the new entry, or NULL if the symbol is unknown.
+typedef namtab_entry_t * (*namtab_resolver_t)(void * context, struct namtab_s * table, const char * symbol);
+
+typedef struct namtab_s
 {
     int                 size;
     int                 capacity;
     namtab_entry_t **   array;
+    namtab_resolver_t   resolver;
+    void *              resolverContext;
+    namtab_entry_t **   retired;        // replaced, freed once no invocation expands them
+    int                 numRetired;
+    int                 retiredCapacity;
+    int                 redefinitions;
 } namtab_t;
 
 namtab_t *          namtab_alloc(void);
@@ -24,5 +57,9 @@ void                namtab_free(namtab_t * table);
 int                 namtab_add(namtab_t * table, const char * symbol, int start, int end);
 namtab_entry_t *    namtab_get(namtab_t * table, const char * symbol);
 namtab_entry_t *    namtab_getIndex(namtab_t * table, int index);
+int                 namtab_find(namtab_t * table, const char * symbol);
+int                 namtab_replace(namtab_t * table, int index, int replacement);
+void                namtab_removeRetired(namtab_t * table, int index);
+void                namtab_setResolver(namtab_t * table, namtab_resolver_t resolver, void * context);
 
 #endif /* NAMTAB_H_ */
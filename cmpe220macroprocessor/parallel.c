@@ -0,0 +1,1181 @@
+/*
+ * parallel.c - Contains functions for the parallel expansion of an input.
+ *
+ * Pass one reads the top level lines on the calling thread: it makes the
+ * definitions and records every other line as an item. Pass two cuts the
+ * items into regions and expands them on worker threads, each with its own
+ * copy of the tables, into a buffer per region. The buffers are written in
+ * order, so the output is the one a serial run writes.
+ *
+ * Invocation IDs depend on all invocations before a line, so the workers
+ * count them from 0 in each region and leave the '$' labels unstamped. The
+ * merge stamps them, with the IDs of the regions before added up.
+ *
+ * Items that set or read SET variables (a top level SET, or an invocation of
+ * a macro that may) depend on the items before them, and are processed in
+ * order by the calling thread. Pass one stops at an invocation of a macro
+ * that may define macros, since the lines after it depend on the definitions;
+ * the rest of the input is processed as usual.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "definitions.h"
+#include "parser.h"
+#include "parallel.h"
+
+// local function definitions
+BOOL parallel_isPossible(void);
+parallel_t * parallel_alloc(void);
+void parallel_free(parallel_t * parallel);
+int parallel_scan(parallel_t * parallel, stream_t * inputFile, stream_t * outputFile);
+int parallel_stopAt(parallel_t * parallel);
+int parallel_addItem(parallel_t * parallel, const char * line, int visible, int kind);
+int parallel_updateMacros(parallel_t * parallel);
+int parallel_findMacro(const char * symbol, int count);
+int parallel_split(parallel_t * parallel);
+void parallel_start(parallel_t * parallel);
+void parallel_finish(parallel_t * parallel);
+int parallel_workerInit(parallel_t * parallel, parallel_worker_t * worker);
+void parallel_workerFree(parallel_worker_t * worker);
+int parallel_runItem(parallel_t * parallel, parallel_item_t * item, stream_t * inputFile, stream_t * outputFile);
+int parallel_runSerial(parallel_t * parallel, parallel_region_t * region, stream_t * outputFile);
+void parallel_expandRegion(parallel_t * parallel, parallel_worker_t * worker, parallel_region_t * region);
+BOOL parallel_help(parallel_t * parallel);
+BOOL parallel_wait(parallel_t * parallel, parallel_region_t * region);
+int parallel_merge(parallel_t * parallel, parallel_region_t * region, stream_t * outputFile);
+void parallel_write(stream_t * outputFile, char * text, size_t size);
+void parallel_release(parallel_region_t * region);
+THREAD_RESULT parallel_work(void * argument);
+
+/**
+ * Function: parallel_process
+ * Description:
+ *  - Processes the input in two passes when THREADS allows it, after
+ *    processBegin. processStep goes on from where the passes stopped: after
+ *    END, at the end of the input, or after the invocation pass one stopped
+ *    at. Without threads, or with options that need a serial run (see
+ *    parallel_isPossible), nothing is done.
+ * Parameters:
+ *  - inputFile: Input stream.
+ *  - outputFile: Output stream.
+ * Returns:
+ *  - SUCCESS or FAILURE, with the errors reported as processStep does.
+ */
+int parallel_process(stream_t * inputFile, stream_t * outputFile)
+{
+    parallel_t * parallel;
+    parallel_region_t * region;
+    char opcode[SHORT_STRING_SIZE];
+    int result;
+    int i;
+
+    if(!parallel_isPossible())
+    {
+        return SUCCESS;
+    }
+
+    parallel = parallel_alloc();
+    if(parallel == NULL)
+    {
+        return SUCCESS;
+    }
+
+    // pass one, OPCODE is left as processStep expects it after the last line
+    result = parallel_scan(parallel, inputFile, outputFile);
+    strcpy_s(opcode, sizeof(opcode), OPCODE);
+
+    // pass two
+    if(result == SUCCESS)
+    {
+        result = parallel_split(parallel);
+    }
+    if(result == SUCCESS)
+    {
+        parallel_start(parallel);
+        for(i = 0; i < parallel->numRegions && result == SUCCESS; i++)
+        {
+            region = &parallel->regions[i];
+            if(!region->serial && parallel_wait(parallel, region))
+            {
+                result = parallel_merge(parallel, region, outputFile);
+            }
+            else
+            {
+                result = parallel_runSerial(parallel, region, outputFile);
+            }
+            parallel_release(region);
+            THREAD_STORE(&parallel->merged, i + 1);
+        }
+        parallel_finish(parallel);
+    }
+    else
+    {
+        printError("ERROR: Out of memory in pass one\n");
+    }
+
+    strcpy_s(OPCODE, sizeof(OPCODE), opcode);
+    if(result == SUCCESS && parallel->stopLine != NULL)
+    {
+        // the input is at this line, so it is processed as usual
+        strcpy_s(currentLine, sizeof(currentLine), parallel->stopLine);
+        if(processLine(inputFile, outputFile, currentLine) != SUCCESS)
+        {
+            printError("ERROR in processLine\n");
+            result = FAILURE;
+        }
+    }
+    else if(result == SUCCESS && parallel->defineFailed)
+    {
+        if(parallel->defineError != NULL)
+        {
+            printError("%s", parallel->defineError);
+        }
+        printError("ERROR in processLine\n");
+        result = FAILURE;
+    }
+
+    parallel_free(parallel);
+    return result;
+}
+
+/**
+ * Function: parallel_deferLabels
+ * Description:
+ *  - Writes a line as writeExpandedLine does, but leaves its '$' labels to
+ *    be stamped by the merge.
+ * Parameters:
+ *  - labels: Labels of the region being expanded.
+ *  - outputFile: Output stream of the region.
+ *  - line: Line to write.
+ *  - bufsize: Size of the line buffer.
+ *  - labelCount: Number of '$' markers to stamp, from DEFTAB.
+ *  - uniqueId: Invocation ID, counted from the start of the region.
+ * Returns:
+ *  - SUCCESS, or FAILURE if memory ran out.
+ */
+int parallel_deferLabels(parallel_labels_t * labels, stream_t * outputFile, const char * line, size_t bufsize, int labelCount, int uniqueId)
+{
+    parallel_label_t * array;
+    parallel_label_t * label;
+    size_t length = strlen(line);
+
+    if(labels->size >= labels->capacity)
+    {
+        array = (parallel_label_t *) realloc(labels->array, 2 * (labels->capacity + 8) * sizeof(parallel_label_t));
+        if(array == NULL)
+        {
+            labels->failed = TRUE;
+            return FAILURE;
+        }
+        labels->array = array;
+        labels->capacity = 2 * (labels->capacity + 8);
+    }
+
+    label = &labels->array[labels->size++];
+    label->offset = outputFile->outputSize;
+    label->length = length;
+    label->bufsize = bufsize;
+    label->labelCount = labelCount;
+    label->uniqueId = uniqueId;
+
+    stream_puts(outputFile, line);
+    if(length == 0 || line[length-1] != '\n')
+        stream_puts(outputFile, "\n");
+
+    return SUCCESS;
+}
+
+/**
+ * Function: parallel_isPossible
+ * Description:
+ *  - Checks the options for a parallel expansion. Statistics, verbose
+ *    output, libraries, the input lines of the tokenized output and limits
+ *    for the whole file need a serial run.
+ * Parameters:
+ *  - none
+ * Returns:
+ *  - TRUE if the input can be expanded in parallel.
+ */
+BOOL parallel_isPossible(void)
+{
+    if(THREADS <= 1 || VERBOSE || STATS || library != NULL || EMIT_LIBRARY_FILE != NULL || TOKENS_FILE != NULL ||
+       namtab == NULL || namtab->resolver != NULL || deftab == NULL || budget == NULL)
+    {
+        return FALSE;
+    }
+
+    // limits per invocation are kept by each thread, the depth by each stack
+    return budget->fileLimit[BUDGET_LINES] == 0 && budget->fileLimit[BUDGET_LOOPS] == 0 &&
+        budget->fileLimit[BUDGET_TIME] == 0 && budget->invocationLimit[BUDGET_TIME] == 0;
+}
+
+/**
+ * Function: parallel_alloc
+ * Description:
+ *  - Allocates the state of a parallel expansion.
+ * Parameters:
+ *  - none
+ * Returns:
+ *  - If successful, returns pointer to new state. Otherwise, returns NULL.
+ */
+parallel_t * parallel_alloc(void)
+{
+    parallel_t * parallel = (parallel_t *) malloc(sizeof(parallel_t));
+
+    if(parallel)
+    {
+        memset(parallel, 0, sizeof(parallel_t));
+        parallel->input = stream_allocInput("", 0);
+        if(parallel->input == NULL)
+        {
+            free(parallel);
+            parallel = NULL;
+        }
+    }
+
+    return parallel;
+}
+
+/**
+ * Function: parallel_free
+ * Description:
+ *  - De-allocates the state of a parallel expansion.
+ * Parameters:
+ *  - parallel: Pointer to the state.
+ * Returns:
+ *  - none
+ */
+void parallel_free(parallel_t * parallel)
+{
+    int i;
+    int j;
+
+    if(parallel)
+    {
+        for(i = 0; i < parallel->numRegions; i++)
+        {
+            parallel_release(&parallel->regions[i]);
+        }
+        for(i = 0; i < parallel->numMacros; i++)
+        {
+            for(j = 0; j < parallel->macros[i].numInvokes; j++)
+            {
+                free(parallel->macros[i].invokes[j]);
+            }
+            free(parallel->macros[i].invokes);
+        }
+        free(parallel->macros);
+        free(parallel->regions);
+        free(parallel->items);
+        free(parallel->text);
+        free(parallel->stopLine);
+        free(parallel->defineError);
+        stream_free(parallel->input);
+        free(parallel);
+    }
+}
+
+/**
+ * Function: parallel_scan
+ * Description:
+ *  - Pass one: reads top level lines as processStep does, makes the
+ *    definitions and records the other lines as items, until END, the end
+ *    of the input, or an invocation of a macro that may define macros.
+ * Parameters:
+ *  - parallel: Pointer to the state.
+ *  - inputFile: Input stream.
+ *  - outputFile: Output stream, for define.
+ * Returns:
+ *  - SUCCESS, or FAILURE if memory ran out.
+ */
+int parallel_scan(parallel_t * parallel, stream_t * inputFile, stream_t * outputFile)
+{
+    parse_info_t * parseInfo;
+    int macro;
+    int kind;
+    int result;
+    BOOL quiet = QUIET;
+
+    while(getline(inputFile) != NULL)
+    {
+        parseInfo = parse_info_alloc();
+        if(parseInfo == NULL || parse_inputLine(parseInfo, currentLine, inputFile) == FAILURE)
+        {
+            // processLine reports the error when it parses the line again
+            parse_info_free(parseInfo);
+            return parallel_stopAt(parallel);
+        }
+
+        // as processLine sets it, so END is found where processStep finds it
+        strcpy_s(OPCODE, sizeof(OPCODE), (parseInfo->opcode != NULL) ? parseInfo->opcode : "");
+
+        kind = PARALLEL_PLAIN;
+        if(namtab_get(namtab, parseInfo->opcode) != NULL)
+        {
+            macro = parallel_findMacro(parseInfo->opcode, namtab->size);
+            if(parallel_updateMacros(parallel) != SUCCESS)
+            {
+                parse_info_free(parseInfo);
+                return FAILURE;
+            }
+
+            // the lines after it depend on the definitions it makes
+            if(parallel->macros[macro].flags & PARALLEL_DEFINES)
+            {
+                parse_info_free(parseInfo);
+                return parallel_stopAt(parallel);
+            }
+
+            kind = (parallel->macros[macro].flags & PARALLEL_DEPENDS_SET) ? PARALLEL_SERIAL : PARALLEL_INVOKE;
+        }
+        else if(parseInfo->opcode != NULL && strncmp("MACRO", parseInfo->opcode, strlen("MACRO")) == 0)
+        {
+            // a definition replacing another one changes the NAMTAB indexes
+            // the regions are visible through, so the rest runs in order
+            if(parseInfo->label != NULL && namtab_get(namtab, parseInfo->label) != NULL)
+            {
+                parse_info_free(parseInfo);
+                return parallel_stopAt(parallel);
+            }
+
+            // an error is reported after the lines before the definition
+            QUIET = TRUE;
+            result = define(inputFile, outputFile, currentLine);
+            QUIET = quiet;
+            parse_info_free(parseInfo);
+
+            if(result != SUCCESS)
+            {
+                parallel->defineFailed = TRUE;
+                if(ERROR_MESSAGE[0] != '\0')
+                {
+                    parallel->defineError = _strdup(ERROR_MESSAGE);
+                    ERROR_MESSAGE[0] = '\0';
+                }
+                return SUCCESS;
+            }
+            continue;
+        }
+        else if(parseInfo->opcode != NULL && strcmp("INCLUDE", parseInfo->opcode) == 0)
+        {
+            // the lines of the file are read next; processLine reports an
+            // error when it runs the line again
+            QUIET = TRUE;
+            result = include_push(inputFile, parseInfo->operators);
+            QUIET = quiet;
+            parse_info_free(parseInfo);
+
+            if(result != SUCCESS)
+            {
+                ERROR_MESSAGE[0] = '\0';
+                return parallel_stopAt(parallel);
+            }
+            continue;
+        }
+        else if(parseInfo->opcode != NULL && strncmp(parseInfo->opcode, "SET", strlen("SET")) == SUCCESS)
+        {
+            kind = PARALLEL_SERIAL;
+        }
+        parse_info_free(parseInfo);
+
+        if(parallel_addItem(parallel, currentLine, namtab->size, kind) != SUCCESS)
+        {
+            return FAILURE;
+        }
+
+        if(strncmp("END", OPCODE, strlen("END")) == 0)
+        {
+            break;
+        }
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Function: parallel_stopAt
+ * Description:
+ *  - Ends pass one at the line in currentLine, which is processed as usual
+ *    after pass two.
+ * Parameters:
+ *  - parallel: Pointer to the state.
+ * Returns:
+ *  - SUCCESS, or FAILURE if memory ran out.
+ */
+int parallel_stopAt(parallel_t * parallel)
+{
+    parallel->stopLine = _strdup(currentLine);
+    return (parallel->stopLine != NULL) ? SUCCESS : FAILURE;
+}
+
+/**
+ * Function: parallel_addItem
+ * Description:
+ *  - Records a top level line.
+ * Parameters:
+ *  - parallel: Pointer to the state.
+ *  - line: The line.
+ *  - visible: Number of macros defined before the line.
+ *  - kind: PARALLEL_PLAIN, PARALLEL_INVOKE or PARALLEL_SERIAL.
+ * Returns:
+ *  - SUCCESS, or FAILURE if memory ran out.
+ */
+int parallel_addItem(parallel_t * parallel, const char * line, int visible, int kind)
+{
+    size_t length = strlen(line) + 1;
+    size_t capacity;
+    char * text;
+    parallel_item_t * items;
+
+    if(parallel->textSize + length > parallel->textCapacity)
+    {
+        capacity = 2 * parallel->textCapacity + 64 * CURRENT_LINE_SIZE;
+        text = (char *) realloc(parallel->text, capacity);
+        if(text == NULL)
+        {
+            return FAILURE;
+        }
+        parallel->text = text;
+        parallel->textCapacity = capacity;
+    }
+
+    if(parallel->numItems >= parallel->itemCapacity)
+    {
+        items = (parallel_item_t *) realloc(parallel->items, 2 * (parallel->itemCapacity + 64) * sizeof(parallel_item_t));
+        if(items == NULL)
+        {
+            return FAILURE;
+        }
+        parallel->items = items;
+        parallel->itemCapacity = 2 * (parallel->itemCapacity + 64);
+    }
+
+    memcpy(parallel->text + parallel->textSize, line, length);
+    parallel->items[parallel->numItems].text = parallel->textSize;
+    parallel->items[parallel->numItems].visible = visible;
+    parallel->items[parallel->numItems].kind = kind;
+    parallel->numItems++;
+    parallel->textSize += length;
+
+    return SUCCESS;
+}
+
+/**
+ * Function: parallel_updateMacros
+ * Description:
+ *  - Finds the effects of the macros defined since the last call, and of
+ *    the macros they may invoke. An opcode made of a parameter may invoke
+ *    any macro.
+ * Parameters:
+ *  - parallel: Pointer to the state.
+ * Returns:
+ *  - SUCCESS, or FAILURE if memory ran out.
+ */
+int parallel_updateMacros(parallel_t * parallel)
+{
+    parallel_macro_t * macros;
+    parallel_macro_t * macro;
+    namtab_entry_t * entry;
+    parse_info_t * parseInfo;
+    char ** invokes;
+    int count = namtab->size;
+    int all = 0;
+    int flags;
+    int i;
+    int j;
+    int k;
+    BOOL changed = TRUE;
+
+    if(parallel->numMacros == count)
+    {
+        return SUCCESS;
+    }
+
+    macros = (parallel_macro_t *) realloc(parallel->macros, count * sizeof(parallel_macro_t));
+    if(macros == NULL)
+    {
+        return FAILURE;
+    }
+    parallel->macros = macros;
+    memset(macros + parallel->numMacros, 0, (count - parallel->numMacros) * sizeof(parallel_macro_t));
+
+    // opcodes of the new bodies, after the prototype
+    for(i = parallel->numMacros; i < count; i++)
+    {
+        entry = namtab_getIndex(namtab, i);
+        macro = &macros[i];
+        parallel->numMacros = i + 1;
+
+        for(j = entry->deftabStart + 1; j < entry->deftabEnd; j++)
+        {
+            parseInfo = parse_info_alloc();
+            if(parseInfo == NULL)
+            {
+                return FAILURE;
+            }
+            if(parse_line(parseInfo, deftab_get(deftab, j)) == SUCCESS && parseInfo->opcode != NULL)
+            {
+                invokes = (char **) realloc(macro->invokes, (macro->numInvokes + 1) * sizeof(char *));
+                if(invokes == NULL || (invokes[macro->numInvokes] = _strdup(parseInfo->opcode)) == NULL)
+                {
+                    if(invokes != NULL)
+                    {
+                        macro->invokes = invokes;
+                    }
+                    parse_info_free(parseInfo);
+                    return FAILURE;
+                }
+                macro->invokes = invokes;
+                macro->numInvokes++;
+            }
+            parse_info_free(parseInfo);
+        }
+    }
+
+    for(i = 0; i < count; i++)
+    {
+        entry = namtab_getIndex(namtab, i);
+        macros[i].flags = 0;
+        if(entry->effects & (MACRO_READS_SET | MACRO_WRITES_SET))
+        {
+            macros[i].flags |= PARALLEL_DEPENDS_SET;
+        }
+        if(entry->effects & MACRO_DEFINES)
+        {
+            macros[i].flags |= PARALLEL_DEFINES;
+        }
+        all |= macros[i].flags;
+    }
+
+    // a macro has the effects of the macros it may invoke
+    while(changed)
+    {
+        changed = FALSE;
+        for(i = 0; i < count; i++)
+        {
+            flags = macros[i].flags;
+            for(k = 0; k < macros[i].numInvokes; k++)
+            {
+                if(strchr(macros[i].invokes[k], '&') != NULL)
+                {
+                    flags |= all;
+                }
+                else if((j = parallel_findMacro(macros[i].invokes[k], count)) >= 0)
+                {
+                    flags |= macros[j].flags;
+                }
+            }
+            if(flags != macros[i].flags)
+            {
+                macros[i].flags = flags;
+                changed = TRUE;
+            }
+        }
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Function: parallel_findMacro
+ * Description:
+ *  - Finds a macro among the first ones of NAMTAB, as namtab_get does.
+ * Parameters:
+ *  - symbol: Name of the macro.
+ *  - count: Number of macros to look at.
+ * Returns:
+ *  - Index of the macro in NAMTAB, or -1.
+ */
+int parallel_findMacro(const char * symbol, int count)
+{
+    int i;
+
+    for(i = 0; i < count; i++)
+    {
+        if(strcmp(namtab_getIndex(namtab, i)->symbol, symbol) == 0)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Function: parallel_split
+ * Description:
+ *  - Cuts the items into regions of at most PARALLEL_REGION_LINES lines.
+ *    The items of a region have the same macros defined, and are all serial
+ *    or none is.
+ * Parameters:
+ *  - parallel: Pointer to the state.
+ * Returns:
+ *  - SUCCESS, or FAILURE if memory ran out.
+ */
+int parallel_split(parallel_t * parallel)
+{
+    parallel_region_t * regions;
+    parallel_region_t * region = NULL;
+    parallel_item_t * item;
+    int serial;
+    int i;
+
+    for(i = 0; i < parallel->numItems; i++)
+    {
+        item = &parallel->items[i];
+        serial = (item->kind == PARALLEL_SERIAL);
+
+        if(region == NULL || region->serial != serial || region->visible != item->visible ||
+           region->count >= PARALLEL_REGION_LINES)
+        {
+            if(parallel->numRegions >= parallel->regionCapacity)
+            {
+                regions = (parallel_region_t *) realloc(parallel->regions, 2 * (parallel->regionCapacity + 16) * sizeof(parallel_region_t));
+                if(regions == NULL)
+                {
+                    return FAILURE;
+                }
+                parallel->regions = regions;
+                parallel->regionCapacity = 2 * (parallel->regionCapacity + 16);
+            }
+
+            region = &parallel->regions[parallel->numRegions++];
+            memset(region, 0, sizeof(parallel_region_t));
+            region->first = i;
+            region->visible = item->visible;
+            region->serial = serial;
+        }
+
+        region->count++;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Function: parallel_start
+ * Description:
+ *  - Copies the tables of pass one for the calling thread and for THREADS-1
+ *    worker threads, and starts the workers. The regions are expanded by
+ *    the calling thread alone if no worker starts, and processed serially
+ *    if its own copy fails.
+ * Parameters:
+ *  - parallel: Pointer to the state.
+ * Returns:
+ *  - none
+ */
+void parallel_start(parallel_t * parallel)
+{
+    int numThreads = (THREADS < PARALLEL_MAX_THREADS) ? THREADS : PARALLEL_MAX_THREADS;
+    parallel_worker_t * worker;
+    int i;
+
+    parallel->deftab = deftab;
+
+    if(parallel_workerInit(parallel, &parallel->workers[0]) != SUCCESS)
+    {
+        return;
+    }
+
+    // the calling thread is one of them
+    for(i = 1; i < numThreads; i++)
+    {
+        worker = &parallel->workers[parallel->numThreads + 1];
+        if(parallel_workerInit(parallel, worker) != SUCCESS)
+        {
+            break;
+        }
+        if(thread_start(&parallel->threads[parallel->numThreads], parallel_work, worker) != SUCCESS)
+        {
+            parallel_workerFree(worker);
+            break;
+        }
+        parallel->numThreads++;
+    }
+}
+
+/**
+ * Function: parallel_finish
+ * Description:
+ *  - Stops the worker threads and de-allocates the copies of the tables.
+ * Parameters:
+ *  - parallel: Pointer to the state.
+ * Returns:
+ *  - none
+ */
+void parallel_finish(parallel_t * parallel)
+{
+    int i;
+
+    THREAD_STORE(&parallel->stopping, TRUE);
+    for(i = 0; i < parallel->numThreads; i++)
+    {
+        thread_join(parallel->threads[i]);
+    }
+
+    for(i = 0; i <= parallel->numThreads; i++)
+    {
+        parallel_workerFree(&parallel->workers[i]);
+    }
+}
+
+/**
+ * Function: parallel_workerInit
+ * Description:
+ *  - Allocates the tables of a thread. NAMTAB is copied, since expansions
+ *    keep variants and effects in its entries; DEFTAB is shared.
+ * Parameters:
+ *  - parallel: Pointer to the state.
+ *  - worker: The tables to allocate.
+ * Returns:
+ *  - SUCCESS, or FAILURE if memory ran out.
+ */
+int parallel_workerInit(parallel_t * parallel, parallel_worker_t * worker)
+{
+    namtab_entry_t * entry;
+    namtab_entry_t * copy;
+    int i;
+
+    memset(worker, 0, sizeof(parallel_worker_t));
+    worker->parallel = parallel;
+    worker->namtab = namtab_alloc();
+    worker->argtab = argtab_alloc();
+    worker->expstack = expstack_alloc();
+    worker->expcache = (expcache != NULL) ? expcache_alloc() : NULL;
+    worker->budget = budget_alloc();
+    worker->input = stream_allocInput("", 0);
+
+    if(worker->namtab == NULL || worker->argtab == NULL || worker->expstack == NULL ||
+       (expcache != NULL && worker->expcache == NULL) || worker->budget == NULL || worker->input == NULL)
+    {
+        parallel_workerFree(worker);
+        return FAILURE;
+    }
+
+    // same limits, usage of its own
+    memcpy(worker->budget, budget, sizeof(budget_t));
+    budget_reset(worker->budget);
+
+    for(i = 0; i < namtab->size; i++)
+    {
+        entry = namtab_getIndex(namtab, i);
+        if(namtab_add(worker->namtab, entry->symbol, entry->deftabStart, entry->deftabEnd) < 0)
+        {
+            parallel_workerFree(worker);
+            return FAILURE;
+        }
+
+        copy = namtab_getIndex(worker->namtab, i);
+        copy->effects = entry->effects;
+        copy->staticParams = (entry->staticParams != NULL) ? _strdup(entry->staticParams) : NULL;
+        copy->dynamicParams = (entry->dynamicParams != NULL) ? _strdup(entry->dynamicParams) : NULL;
+        if((entry->staticParams != NULL && copy->staticParams == NULL) ||
+           (entry->dynamicParams != NULL && copy->dynamicParams == NULL))
+        {
+            parallel_workerFree(worker);
+            return FAILURE;
+        }
+    }
+    worker->numMacros = worker->namtab->size;
+
+    return SUCCESS;
+}
+
+/**
+ * Function: parallel_workerFree
+ * Description:
+ *  - De-allocates the tables of a thread.
+ * Parameters:
+ *  - worker: The tables.
+ * Returns:
+ *  - none
+ */
+void parallel_workerFree(parallel_worker_t * worker)
+{
+    if(worker->namtab != NULL)
+    {
+        worker->namtab->size = worker->numMacros;
+    }
+    namtab_free(worker->namtab);
+    argtab_free(worker->argtab);
+    expstack_free(worker->expstack);
+    expcache_free(worker->expcache);
+    budget_free(worker->budget);
+    stream_free(worker->input);
+    memset(worker, 0, sizeof(parallel_worker_t));
+}
+
+/**
+ * Function: parallel_runItem
+ * Description:
+ *  - Processes one item with the tables of the calling thread, as
+ *    processStep processes a top level line and the expansion it starts.
+ * Parameters:
+ *  - parallel: Pointer to the state.
+ *  - item: The item.
+ *  - inputFile: Input stream, not read by the item.
+ *  - outputFile: Output stream.
+ * Returns:
+ *  - SUCCESS or FAILURE
+ */
+int parallel_runItem(parallel_t * parallel, parallel_item_t * item, stream_t * inputFile, stream_t * outputFile)
+{
+    strcpy_s(currentLine, sizeof(currentLine), parallel->text + item->text);
+    if(processLine(inputFile, outputFile, currentLine) != SUCCESS)
+    {
+        return FAILURE;
+    }
+
+    while(EXPANDING)
+    {
+        if(expandStep(inputFile, outputFile) != SUCCESS)
+        {
+            return FAILURE;
+        }
+
+        // back at the top level, the invocation is complete
+        if(!EXPANDING)
+        {
+            budget_endInvocation(budget);
+        }
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Function: parallel_runSerial
+ * Description:
+ *  - Processes the items of a region on the calling thread, with its
+ *    tables, writing to the output as a serial run does. Macros defined
+ *    after the region are hidden from it.
+ * Parameters:
+ *  - parallel: Pointer to the state.
+ *  - region: The region.
+ *  - outputFile: Output stream.
+ * Returns:
+ *  - SUCCESS or FAILURE, with the error reported as processStep does.
+ */
+int parallel_runSerial(parallel_t * parallel, parallel_region_t * region, stream_t * outputFile)
+{
+    int numMacros = namtab->size;
+    int result = SUCCESS;
+    int i;
+
+    namtab->size = region->visible;
+    for(i = 0; i < region->count && result == SUCCESS; i++)
+    {
+        result = parallel_runItem(parallel, &parallel->items[region->first + i], parallel->input, outputFile);
+    }
+    namtab->size = numMacros;
+
+    if(result != SUCCESS)
+    {
+        printError("ERROR in processLine\n");
+    }
+
+    return result;
+}
+
+/**
+ * Function: parallel_expandRegion
+ * Description:
+ *  - Expands the items of a region into its buffer, with the tables of a
+ *    worker. Errors are not reported, a region that failed is processed
+ *    again by parallel_runSerial. The state of the calling thread is kept.
+ * Parameters:
+ *  - parallel: Pointer to the state.
+ *  - worker: Tables to expand with.
+ *  - region: The region.
+ * Returns:
+ *  - none
+ */
+void parallel_expandRegion(parallel_t * parallel, parallel_worker_t * worker, parallel_region_t * region)
+{
+    deftab_t * savedDeftab = deftab;
+    namtab_t * savedNamtab = namtab;
+    argtab_t * savedArgtab = argtab;
+    expstack_t * savedExpstack = expstack;
+    expcache_t * savedExpcache = expcache;
+    budget_t * savedBudget = budget;
+    BOOL savedQuiet = QUIET;
+    BOOL savedExpandLabel = EXPAND_LABEL;
+    int savedUniqueId = UNIQUE_ID;
+    char savedLabel[SHORT_STRING_SIZE];
+    char savedOpcode[SHORT_STRING_SIZE];
+    char savedError[CURRENT_LINE_SIZE];
+    stream_t * output = stream_allocOutput(NULL, 0);
+    int result = (output != NULL) ? SUCCESS : FAILURE;
+    int i;
+
+    memcpy(savedLabel, EXPANDED_LABEL, sizeof(savedLabel));
+    memcpy(savedOpcode, OPCODE, sizeof(savedOpcode));
+    memcpy(savedError, ERROR_MESSAGE, sizeof(savedError));
+
+    deftab = parallel->deftab;
+    namtab = worker->namtab;
+    namtab->size = region->visible;
+    argtab = worker->argtab;
+    expstack = worker->expstack;
+    expcache = worker->expcache;
+    budget = worker->budget;
+    QUIET = TRUE;
+    EXPANDING = FALSE;
+    EXPAND_LABEL = FALSE;
+    UNIQUE_ID = 0;
+    memset(EXPANDED_LABEL, 0, sizeof(EXPANDED_LABEL));
+    DEFERRED_LABELS = &region->labels;
+
+    for(i = 0; i < region->count && result == SUCCESS; i++)
+    {
+        result = parallel_runItem(parallel, &parallel->items[region->first + i], worker->input, output);
+    }
+
+    if(result != SUCCESS)
+    {
+        unwindFrames();
+    }
+
+    region->uniqueIds = UNIQUE_ID;
+    region->expandLabel = EXPAND_LABEL;
+    if(EXPAND_LABEL && (region->expandedLabel = _strdup(EXPANDED_LABEL)) == NULL)
+    {
+        result = FAILURE;
+    }
+    if(output != NULL)
+    {
+        region->failed = (result != SUCCESS || output->failed || region->labels.failed);
+        region->outputSize = output->outputSize;
+        region->output = stream_release(output);
+        stream_free(output);
+    }
+    else
+    {
+        region->failed = TRUE;
+    }
+
+    namtab->size = worker->numMacros;
+    DEFERRED_LABELS = NULL;
+    deftab = savedDeftab;
+    namtab = savedNamtab;
+    argtab = savedArgtab;
+    expstack = savedExpstack;
+    expcache = savedExpcache;
+    budget = savedBudget;
+    QUIET = savedQuiet;
+    EXPANDING = FALSE;
+    EXPAND_LABEL = savedExpandLabel;
+    UNIQUE_ID = savedUniqueId;
+    memcpy(EXPANDED_LABEL, savedLabel, sizeof(savedLabel));
+    memcpy(OPCODE, savedOpcode, sizeof(savedOpcode));
+    memcpy(ERROR_MESSAGE, savedError, sizeof(savedError));
+
+    THREAD_STORE(&region->done, TRUE);
+}
+
+/**
+ * Function: parallel_help
+ * Description:
+ *  - Takes the next region no thread has taken yet, if any, and expands it
+ *    on the calling thread.
+ * Parameters:
+ *  - parallel: Pointer to the state.
+ * Returns:
+ *  - TRUE if a region was taken, FALSE if none was left.
+ */
+BOOL parallel_help(parallel_t * parallel)
+{
+    long index;
+
+    if(parallel->workers[0].namtab == NULL)
+    {
+        return FALSE;
+    }
+
+    index = THREAD_INCREMENT(&parallel->nextRegion) - 1;
+    if(index >= parallel->numRegions)
+    {
+        return FALSE;
+    }
+
+    if(!parallel->regions[index].serial)
+    {
+        parallel_expandRegion(parallel, &parallel->workers[0], &parallel->regions[index]);
+    }
+    return TRUE;
+}
+
+/**
+ * Function: parallel_wait
+ * Description:
+ *  - Waits for a region to be expanded, expanding other regions meanwhile.
+ * Parameters:
+ *  - parallel: Pointer to the state.
+ *  - region: The region.
+ * Returns:
+ *  - TRUE when the region is expanded, FALSE if no thread can expand it.
+ */
+BOOL parallel_wait(parallel_t * parallel, parallel_region_t * region)
+{
+    while(!THREAD_LOAD(&region->done))
+    {
+        if(!parallel_help(parallel))
+        {
+            if(parallel->numThreads == 0)
+            {
+                return FALSE;
+            }
+            thread_yield();
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+ * Function: parallel_merge
+ * Description:
+ *  - Writes the buffer of an expanded region, stamping its labels with the
+ *    invocation IDs of the regions before added. The region is processed
+ *    again by parallel_runSerial if it failed, if a label of the invocation
+ *    before it is still to be written, or if an ID does not fit.
+ * Parameters:
+ *  - parallel: Pointer to the state.
+ *  - region: The region.
+ *  - outputFile: Output stream.
+ * Returns:
+ *  - SUCCESS or FAILURE
+ */
+int parallel_merge(parallel_t * parallel, parallel_region_t * region, stream_t * outputFile)
+{
+    parallel_label_t * label;
+    char line[CURRENT_LINE_SIZE];
+    char prefix[MAX_UNIQUE_LABEL_DIGITS + 2];
+    size_t pos = 0;
+    int i;
+
+    if(region->failed || EXPAND_LABEL)
+    {
+        return parallel_runSerial(parallel, region, outputFile);
+    }
+    for(i = 0; i < region->labels.size; i++)
+    {
+        label = &region->labels.array[i];
+        if(label->uniqueId >= UNIQUE_LABEL_LIMIT - UNIQUE_ID || label->bufsize > sizeof(line) ||
+           label->length >= label->bufsize)
+        {
+            return parallel_runSerial(parallel, region, outputFile);
+        }
+    }
+
+    for(i = 0; i < region->labels.size; i++)
+    {
+        label = &region->labels.array[i];
+        parallel_write(outputFile, region->output + pos, label->offset - pos);
+
+        memcpy(line, region->output + label->offset, label->length);
+        line[label->length] = '\0';
+        getUniquePrefix(UNIQUE_ID + label->uniqueId, prefix, sizeof(prefix));
+        stampUniqueLabels(line, label->bufsize, prefix, label->labelCount);
+        stream_puts(outputFile, line);
+
+        pos = label->offset + label->length;
+    }
+    parallel_write(outputFile, region->output + pos, region->outputSize - pos);
+
+    // the state the last item of the region left
+    UNIQUE_ID += region->uniqueIds;
+    EXPAND_LABEL = region->expandLabel;
+    if(region->expandedLabel != NULL)
+    {
+        strcpy_s(EXPANDED_LABEL, sizeof(EXPANDED_LABEL), region->expandedLabel);
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Function: parallel_write
+ * Description:
+ *  - Writes part of a region buffer.
+ * Parameters:
+ *  - outputFile: Output stream.
+ *  - text: Start of the part, in a NUL terminated buffer.
+ *  - size: Size of the part.
+ * Returns:
+ *  - none
+ */
+void parallel_write(stream_t * outputFile, char * text, size_t size)
+{
+    char saved = text[size];
+
+    if(size > 0)
+    {
+        text[size] = '\0';
+        stream_puts(outputFile, text);
+        text[size] = saved;
+    }
+}
+
+/**
+ * Function: parallel_release
+ * Description:
+ *  - De-allocates the buffer and labels of a region.
+ * Parameters:
+ *  - region: The region.
+ * Returns:
+ *  - none
+ */
+void parallel_release(parallel_region_t * region)
+{
+    free(region->output);
+    free(region->labels.array);
+    free(region->expandedLabel);
+    region->output = NULL;
+    region->labels.array = NULL;
+    region->expandedLabel = NULL;
+}
+
+/**
+ * Function: parallel_work
+ * Description:
+ *  - Worker thread: expands regions until none is left, staying within
+ *    PARALLEL_WINDOW regions of the merge.
+ * Parameters:
+ *  - argument: Tables of the worker.
+ * Returns:
+ *  - 0
+ */
+THREAD_RESULT parallel_work(void * argument)
+{
+    parallel_worker_t * worker = (parallel_worker_t *) argument;
+    parallel_t * parallel = worker->parallel;
+    long index;
+
+    while(!THREAD_LOAD(&parallel->stopping))
+    {
+        index = THREAD_INCREMENT(&parallel->nextRegion) - 1;
+        if(index >= parallel->numRegions)
+        {
+            break;
+        }
+
+        while(index - THREAD_LOAD(&parallel->merged) >= PARALLEL_WINDOW && !THREAD_LOAD(&parallel->stopping))
+        {
+            thread_yield();
+        }
+        if(THREAD_LOAD(&parallel->stopping))
+        {
+            break;
+        }
+
+        if(!parallel->regions[index].serial)
+        {
+            parallel_expandRegion(parallel, worker, &parallel->regions[index]);
+        }
+    }
+
+    return THREAD_RETURN;
+}
@@ -0,0 +1,129 @@
+/*
+ * parallel.h - Contains functions and definitions for the parallel expansion
+ * of an input, in two passes.
+ */
+
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#include <stddef.h>
+#include "thread.h"
+#include "deftab.h"
+#include "namtab.h"
+#include "argtab.h"
+#include "expstack.h"
+#include "expcache.h"
+#include "budget.h"
+#include "stream.h"
+
+#define PARALLEL_REGION_LINES   (1024)  // top level lines per region
+#define PARALLEL_MAX_THREADS    (16)
+
+// Regions the workers may expand ahead of the merge, to bound the memory used
+// by their output
+#define PARALLEL_WINDOW         (4 * PARALLEL_MAX_THREADS)
+
+// parallel_item_t kinds
+#define PARALLEL_PLAIN          (0)     // line without an invocation
+#define PARALLEL_INVOKE         (1)     // invocation that does not depend on SET state
+#define PARALLEL_SERIAL         (2)     // SET, or invocation that may depend on SET state
+
+// Top level line found by pass one
+typedef struct
+{
+    size_t  text;           // offset of the line in parallel_t text
+    int     visible;        // macros defined before the line
+    int     kind;
+} parallel_item_t;
+
+// Line a worker wrote without stamping its '$' labels, see writeExpandedLine
+typedef struct
+{
+    size_t  offset;         // start of the line in the output of the region
+    size_t  length;         // length of the line, without the newline added to it
+    size_t  bufsize;        // size of the buffer the line was stamped in
+    int     labelCount;
+    int     uniqueId;       // invocation ID, counted from 0 in each region
+} parallel_label_t;
+
+typedef struct parallel_labels_s
+{
+    parallel_label_t *  array;
+    int                 size;
+    int                 capacity;
+    int                 failed;         // out of memory
+} parallel_labels_t;
+
+// Consecutive items with the same macros defined. Regions of serial items
+// are processed by the main thread, the others by any thread.
+typedef struct
+{
+    int                 first;
+    int                 count;
+    int                 visible;
+    int                 serial;
+    volatile long       done;           // expanded, or failed
+    int                 failed;
+    char *              output;
+    size_t              outputSize;
+    parallel_labels_t   labels;
+    int                 uniqueIds;      // invocation IDs used by the region
+    int                 expandLabel;    // EXPAND_LABEL left by the last item
+    char *              expandedLabel;
+} parallel_region_t;
+
+// Tables a thread expands regions with, copies of the ones of pass one
+typedef struct
+{
+    struct parallel_s * parallel;
+    namtab_t *          namtab;
+    int                 numMacros;
+    argtab_t *          argtab;
+    expstack_t *        expstack;
+    expcache_t *        expcache;
+    budget_t *          budget;
+    stream_t *          input;          // empty, invocations do not read the input
+} parallel_worker_t;
+
+// parallel_macro_t flags, of the macro or of a macro it may invoke
+#define PARALLEL_DEPENDS_SET    (0x01)  // reads or writes SET variables
+#define PARALLEL_DEFINES        (0x02)  // defines macros
+
+// Macro as pass one sees it, with the opcodes of its body
+typedef struct
+{
+    int     flags;
+    char ** invokes;                    // opcodes of the body
+    int     numInvokes;
+} parallel_macro_t;
+
+typedef struct parallel_s
+{
+    char *              text;           // lines of the items, NUL terminated
+    size_t              textSize;
+    size_t              textCapacity;
+    parallel_item_t *   items;
+    int                 numItems;
+    int                 itemCapacity;
+    parallel_region_t * regions;
+    int                 numRegions;
+    int                 regionCapacity;
+    parallel_macro_t *  macros;
+    int                 numMacros;
+    deftab_t *          deftab;         // shared, no region adds to it
+    stream_t *          input;          // empty, for the items of the main thread
+    volatile long       nextRegion;     // next region a thread takes
+    volatile long       merged;         // regions written to the output
+    volatile long       stopping;
+    parallel_worker_t   workers[PARALLEL_MAX_THREADS];  // the first one is for the main thread
+    thread_t            threads[PARALLEL_MAX_THREADS];
+    int                 numThreads;
+    char *              stopLine;       // line pass one stopped at, processed as usual
+    int                 defineFailed;   // a definition of pass one failed
+    char *              defineError;
+} parallel_t;
+
+int     parallel_process(stream_t * inputFile, stream_t * outputFile);
+int     parallel_deferLabels(parallel_labels_t * labels, stream_t * outputFile, const char * line, size_t bufsize, int labelCount, int uniqueId);
+
+#endif /* PARALLEL_H_ */
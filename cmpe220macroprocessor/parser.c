@@ -10,6 +10,9 @@
 #include "definitions.h"
 #include "parser.h"
 
+// local function definitions
+char * parse_copyToken(const char * token, int length);
+
 /**
  * Function: parse_info_alloc
  * Description:
@@ -180,7 +183,7 @@ int parse_line(parse_info_t * parse_info, const char * line)
     }
 
     // at this point we've done the parsing, check to see if keyword macro parameters are used
-    if( parse_info->opcode != NULL &&
+    if( parse_info->opcode != NULL && parse_info->operators != NULL &&
         strncmp("MACRO", parse_info->opcode, strlen("MACRO")) == 0 &&
         strstr(parse_info->operators, "=") != NULL )
     {
@@ -191,6 +194,106 @@ int parse_line(parse_info_t * parse_info, const char * line)
     return 0;
 }
 
+/**
+ * Function: parse_tokens
+ * Description:
+ *  - Fills in the specified parse_info_t struct from the tokens of a line in
+ *    the line table, as parse_line would from the line.
+ * Parameters:
+ *  - parse_info: Pointer to a valid parse_info_t struct.
+ *  - line: The line, as getline read it.
+ *  - tokens: Tokens of the line.
+ * Returns:
+ *  - If successful, returns 0. Otherwise, returns -1.
+ */
+int parse_tokens(parse_info_t * parse_info, const char * line, const linetab_entry_t * tokens)
+{
+    if(parse_info == NULL || line == NULL || tokens == NULL)
+    {
+        return -1;
+    }
+
+    if(tokens->flags & LINETAB_UNTOKENIZED)
+    {
+        return parse_line(parse_info, line);
+    }
+
+    parse_info_clear(parse_info);
+    if(tokens->flags & LINETAB_COMMENT)
+    {
+        parse_info->isComment = TRUE;
+        return 0;
+    }
+
+    if(tokens->flags & LINETAB_LABEL)
+    {
+        parse_info->label = parse_copyToken(line + tokens->label, tokens->labelLength);
+    }
+    if(tokens->flags & LINETAB_OPCODE)
+    {
+        parse_info->opcode = parse_copyToken(line + tokens->opcode, tokens->opcodeLength);
+    }
+    if(tokens->flags & LINETAB_OPERATORS)
+    {
+        parse_info->operators = parse_copyToken(line + tokens->operators, tokens->operatorsLength);
+    }
+
+    if( parse_info->opcode != NULL &&
+        strncmp("MACRO", parse_info->opcode, strlen("MACRO")) == 0 &&
+        parse_info->operators != NULL &&
+        strstr(parse_info->operators, "=") != NULL )
+    {
+        parse_info->hasKeywordMacroParameters = TRUE;
+    }
+
+    return 0;
+}
+
+/**
+ * Function: parse_inputLine
+ * Description:
+ *  - Parses a line read from the input, from its tokens if the input was
+ *    tokenized ahead. Lines of an expansion are always parsed.
+ * Parameters:
+ *  - parse_info: Pointer to a valid parse_info_t struct.
+ *  - line: The line getline read last.
+ *  - input: The input stream.
+ * Returns:
+ *  - If successful, returns 0. Otherwise, returns -1.
+ */
+int parse_inputLine(parse_info_t * parse_info, const char * line, stream_t * input)
+{
+    if(!EXPANDING && input != NULL && input->tokens != NULL)
+    {
+        return parse_tokens(parse_info, line, input->tokens);
+    }
+
+    return parse_line(parse_info, line);
+}
+
+/**
+ * Function: parse_copyToken
+ * Description:
+ *  - Copies a token into a new string.
+ * Parameters:
+ *  - token: Start of the token.
+ *  - length: Length of the token.
+ * Returns:
+ *  - The new string, or NULL if out of memory.
+ */
+char * parse_copyToken(const char * token, int length)
+{
+    char * result = (char *) malloc(length + 1);
+
+    if(result)
+    {
+        memcpy(result, token, length);
+        result[length] = '\0';
+    }
+
+    return result;
+}
+
 /**
  * Function: parse_info_print
  * Description:
@@ -21,5 +21,7 @@ void            parse_info_free(parse_info_t * parse_info);
 void            parse_info_clear(parse_info_t * parse_info);
 void            parse_info_print(parse_info_t * parse_info);
 int             parse_line(parse_info_t * parse_info, const char * line);
+int             parse_tokens(parse_info_t * parse_info, const char * line, const linetab_entry_t * tokens);
+int             parse_inputLine(parse_info_t * parse_info, const char * line, stream_t * input);
 int				parse_reconstruct_string(parse_info_t * parse_info, char *returnString);
 #endif // PARSER_H_
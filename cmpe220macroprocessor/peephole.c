@@ -0,0 +1,1081 @@
+/*
+ * peephole.c - Contains functions for the peephole optimizer over the output
+ * (--peephole).
+ *
+ * Every line written to the output goes through peephole_line, whether it was
+ * expanded, replayed from a cache or merged from a thread, so instructions
+ * that separate invocations leave next to each other are seen together: the
+ * CLEAR X that ends one expansion and the CLEAR X that starts the next, or a
+ * store and a load of the same word. The lines are held in a run of
+ * straight-line code, which ends before a label and after J, RSUB, a
+ * directive or data. When the run ends, a window of two instructions, the one
+ * before and the current one, slides over it with the value each register is
+ * known to hold, and the rules of PEEPHOLE_RULE_TABLE remove the instructions
+ * that change nothing.
+ *
+ * Control may come to a labeled line, or to the target of a * jump, from
+ * elsewhere: such a line is never removed, and what the registers hold is
+ * forgotten there. A * jump over removed lines is given a new displacement.
+ * The addresses are counted from the first line and leave out the literal
+ * pools; a * jump back into a run written before, over a line removed for
+ * what the registers held before its target, is reported.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include "definitions.h"
+#include "peephole.h"
+#include "stream.h"
+#include "asmpass.h"
+#include "linetab.h"
+
+#define PEEPHOLE_REGISTER_A     (0)
+#define PEEPHOLE_REGISTER_X     (1)
+#define PEEPHOLE_REGISTER_B     (3)
+#define PEEPHOLE_REGISTER_F     (6)
+
+const char PEEPHOLE_REGISTER_NAMES[] = "AXLBSTF";
+
+// instructions that change no register, those that change only A or F, and
+// those that write memory without changing a register
+const char * PEEPHOLE_KEEP[] = { "COMP", "COMPF", "COMPR", "HIO", "J", "JEQ", "JGT", "JLT", "SIO", "TD", "TIO", "WD" };
+const char * PEEPHOLE_SET_A[] = { "ADD", "AND", "DIV", "FIX", "LDCH", "MUL", "OR", "RD", "SUB" };
+const char * PEEPHOLE_SET_F[] = { "ADDF", "DIVF", "FLOAT", "MULF", "NORM", "SUBF" };
+const char * PEEPHOLE_STORES[] = { "SSK", "STCH", "STI", "STSW" };
+
+// Rule of the optimizer: returns the instruction to remove, the current one
+// or the one before it, or NULL
+typedef struct
+{
+    const char *        name;
+    peephole_line_t *   (*match)(peephole_t * pass, peephole_line_t * previous, peephole_line_t * line);
+} peephole_rule_t;
+
+// local function definitions
+void peephole_parse(peephole_t * pass, peephole_line_t * line);
+void peephole_optimize(peephole_t * pass);
+void peephole_markTargets(peephole_t * pass);
+void peephole_adjust(peephole_t * pass);
+void peephole_rewrite(peephole_t * pass, peephole_line_t * line, int displacement);
+void peephole_remember(peephole_t * pass, const peephole_line_t * line);
+void peephole_apply(peephole_t * pass, const peephole_line_t * line);
+void peephole_set(peephole_t * pass, int reg, const char * value, int length, int since);
+void peephole_forget(peephole_t * pass, int reg);
+void peephole_forgetMemory(peephole_t * pass);
+int peephole_holds(const peephole_t * pass, int reg, const char * value, int length);
+int peephole_isTracked(const peephole_line_t * line);
+int peephole_isConstant(const char * value);
+int peephole_isOneOf(const char * opcode, const char ** list, int size);
+int peephole_getRegister(const char * opcode, const char * prefix);
+int peephole_getOperandRegister(const peephole_line_t * line, int which);
+int peephole_getLoaded(const peephole_line_t * line);
+peephole_line_t * peephole_matchClear(peephole_t * pass, peephole_line_t * previous, peephole_line_t * line);
+peephole_line_t * peephole_matchStoreLoad(peephole_t * pass, peephole_line_t * previous, peephole_line_t * line);
+peephole_line_t * peephole_matchReload(peephole_t * pass, peephole_line_t * previous, peephole_line_t * line);
+peephole_line_t * peephole_matchStoreSame(peephole_t * pass, peephole_line_t * previous, peephole_line_t * line);
+peephole_line_t * peephole_matchDeadLoad(peephole_t * pass, peephole_line_t * previous, peephole_line_t * line);
+
+// by PEEPHOLE_RULE_*
+const peephole_rule_t PEEPHOLE_RULE_TABLE[PEEPHOLE_RULES] =
+{
+    { "repeated-clear", peephole_matchClear },
+    { "load-after-store", peephole_matchStoreLoad },
+    { "reload", peephole_matchReload },
+    { "store-unchanged", peephole_matchStoreSame },
+    { "dead-load", peephole_matchDeadLoad }
+};
+
+/**
+ * Function: peephole_alloc
+ * Description:
+ *  - Allocates a peephole pass writing the lines it keeps to an output
+ *    stream, with stream_putLine.
+ * Parameters:
+ *  - output: The output stream.
+ * Returns:
+ *  - If successful, returns pointer to new pass. Otherwise, returns NULL.
+ */
+peephole_t * peephole_alloc(struct stream_s * output)
+{
+    peephole_t * pass;
+
+    if(output == NULL)
+    {
+        return NULL;
+    }
+
+    pass = (peephole_t *) malloc(sizeof(peephole_t));
+    if(pass)
+    {
+        memset(pass, 0, sizeof(peephole_t));
+        pass->output = output;
+        pass->protectUntil = -1;
+        pass->fence = -1;
+    }
+
+    return pass;
+}
+
+/**
+ * Function: peephole_free
+ * Description:
+ *  - Frees the pass, with the lines it still holds.
+ * Parameters:
+ *  - pass: Pointer to the pass.
+ * Returns:
+ *  - none
+ */
+void peephole_free(peephole_t * pass)
+{
+    int i;
+
+    if(pass == NULL)
+    {
+        return;
+    }
+
+    for(i = 0; i < pass->numLines; i++)
+    {
+        free(pass->run[i].text);
+    }
+    free(pass->removed);
+    free(pass);
+}
+
+/**
+ * Function: peephole_getRuleName
+ * Description:
+ *  - Name of a rule, for the statistics.
+ * Parameters:
+ *  - rule: PEEPHOLE_RULE_*.
+ * Returns:
+ *  - The name, or "" for an unknown rule.
+ */
+const char * peephole_getRuleName(int rule)
+{
+    return (rule >= 0 && rule < PEEPHOLE_RULES) ? PEEPHOLE_RULE_TABLE[rule].name : "";
+}
+
+/**
+ * Function: peephole_line
+ * Description:
+ *  - Adds one output line to the run, and optimizes and writes the run when
+ *    the line ends it.
+ * Parameters:
+ *  - pass: Pointer to the pass.
+ *  - line: The line, without its newline.
+ *  - length: Length of the line.
+ *  - newline: Newline to write after it, a string constant.
+ *  - origin: Its origin in the tokenized output.
+ * Returns:
+ *  - none
+ */
+void peephole_line(peephole_t * pass, const char * line, size_t length, const char * newline, unsigned int origin)
+{
+    peephole_line_t * held;
+    peephole_line_t labeled;
+
+    if(pass == NULL || line == NULL)
+    {
+        return;
+    }
+
+    held = &pass->run[pass->numLines];
+    held->text = (char *) malloc(length + 1);
+    if(held->text == NULL)
+    {
+        pass->output->failed = TRUE;
+        return;
+    }
+    memcpy(held->text, line, length);
+    held->text[length] = '\0';
+    held->length = length;
+    held->newline = newline;
+    held->origin = origin;
+    peephole_parse(pass, held);
+
+    // control may come to a label from anywhere, it starts a run
+    if(held->isEntry && pass->numLines > 0)
+    {
+        labeled = *held;
+        peephole_flush(pass);
+        pass->run[0] = labeled;
+    }
+    pass->numLines++;
+
+    if(pass->run[pass->numLines - 1].isBarrier || pass->numLines == PEEPHOLE_MAX_RUN)
+    {
+        peephole_flush(pass);
+    }
+}
+
+/**
+ * Function: peephole_flush
+ * Description:
+ *  - Optimizes the run, and writes the lines kept to the output stream.
+ *    Called when the run ends, and when the output is complete.
+ * Parameters:
+ *  - pass: Pointer to the pass.
+ * Returns:
+ *  - none
+ */
+void peephole_flush(peephole_t * pass)
+{
+    peephole_line_t * line;
+    int i;
+
+    if(pass == NULL || pass->numLines == 0)
+    {
+        return;
+    }
+
+    peephole_optimize(pass);
+    for(i = 0; i < pass->numLines; i++)
+    {
+        line = &pass->run[i];
+        if(line->rule >= 0)
+        {
+            peephole_remember(pass, line);
+        }
+        else
+        {
+            pass->lineNumber++;
+            stream_putLine(pass->output, line->text, line->length, line->newline, line->origin);
+        }
+        free(line->text);
+    }
+    pass->numLines = 0;
+}
+
+/**
+ * Function: peephole_parse
+ * Description:
+ *  - Finds the opcode and first operand of a line, and assigns its address.
+ * Parameters:
+ *  - pass: Pointer to the pass.
+ *  - line: The line, with its text set.
+ * Returns:
+ *  - none
+ */
+void peephole_parse(peephole_t * pass, peephole_line_t * line)
+{
+    linetab_entry_t entry;
+    char opcode[CURRENT_LINE_SIZE];
+    char operand[CURRENT_LINE_SIZE];
+    int end;
+    int quoted = FALSE;
+    int i;
+
+    line->address = pass->address;
+    line->size = 0;
+    line->format = 0;
+    line->opcode[0] = '\0';
+    line->operand = 0;
+    line->operandLength = 0;
+    line->isEntry = FALSE;
+    line->isBarrier = TRUE;
+    line->isRelative = FALSE;
+    line->displacement = 0;
+    line->rule = -1;
+    line->since = line->address;
+
+    // a line too long to tokenize is left as it is
+    if(line->length >= CURRENT_LINE_SIZE)
+    {
+        return;
+    }
+    linetab_tokenize(line->text, (int) line->length, &entry);
+
+    // comments and blank lines have no code, and do not end the run
+    if(entry.flags == LINETAB_COMMENT || entry.flags == LINETAB_UNTOKENIZED)
+    {
+        line->isBarrier = FALSE;
+        return;
+    }
+    line->isEntry = ((entry.flags & LINETAB_LABEL) != 0);
+    if(!(entry.flags & LINETAB_OPCODE))
+    {
+        return;
+    }
+
+    memcpy(opcode, line->text + entry.opcode, entry.opcodeLength);
+    opcode[entry.opcodeLength] = '\0';
+    if(entry.flags & LINETAB_OPERATORS)
+    {
+        // the first operand ends at a space, unless it is quoted
+        for(end = entry.operators; end < entry.operators + entry.operatorsLength &&
+            (quoted || !isspace((unsigned char) line->text[end])); end++)
+        {
+            if(line->text[end] == '\'')
+            {
+                quoted = !quoted;
+            }
+        }
+        line->operand = entry.operators;
+        line->operandLength = end - entry.operators;
+    }
+    memcpy(operand, line->text + line->operand, line->operandLength);
+    operand[line->operandLength] = '\0';
+
+    line->format = asmpass_getFormat(opcode);
+    line->size = asmpass_getLength(opcode, operand);
+    pass->address += line->size;
+    if(line->format == 0)
+    {
+        if(strcmp("LTORG", opcode) == 0 || strcmp("ORG", opcode) == 0)
+        {
+            pass->fence = line->address;
+        }
+        return;
+    }
+
+    strcpy_s(line->opcode, PEEPHOLE_OPCODE_SIZE, opcode + (opcode[0] == '+'));
+    line->isBarrier = (strcmp("J", line->opcode) == 0 || strcmp("RSUB", line->opcode) == 0);
+
+    // *, *+n or *-n: relative to the address of the instruction
+    if(operand[0] == '*')
+    {
+        i = (operand[1] == '+' || operand[1] == '-') ? 2 : 1;
+        while(isdigit((unsigned char) operand[i]))
+        {
+            i++;
+        }
+        line->isRelative = (operand[i] == '\0' && (i == 1 || i > 2));
+        line->displacement = line->isRelative ? atoi(operand + 1) : 0;
+    }
+}
+
+/**
+ * Function: peephole_optimize
+ * Description:
+ *  - Slides the window over the instructions of the run, and marks those the
+ *    rules remove.
+ * Parameters:
+ *  - pass: Pointer to the pass.
+ * Returns:
+ *  - none
+ */
+void peephole_optimize(peephole_t * pass)
+{
+    peephole_line_t * line;
+    peephole_line_t * previous = NULL;
+    peephole_line_t * candidate;
+    int i;
+    int r;
+
+    // a * jump written before reaches over these lines, they are kept
+    for(i = 0; i < pass->numLines; i++)
+    {
+        if(pass->run[i].address <= pass->protectUntil)
+        {
+            pass->run[i].isEntry = TRUE;
+        }
+    }
+    peephole_markTargets(pass);
+
+    peephole_forget(pass, -1);
+    for(i = 0; i < pass->numLines; i++)
+    {
+        line = &pass->run[i];
+        if(line->format == 0)
+        {
+            continue;
+        }
+        if(line->isEntry)
+        {
+            peephole_forget(pass, -1);
+            previous = NULL;
+        }
+
+        for(r = 0; r < PEEPHOLE_RULES; r++)
+        {
+            candidate = PEEPHOLE_RULE_TABLE[r].match(pass, previous, line);
+            if(candidate != NULL && !candidate->isEntry)
+            {
+                candidate->rule = r;
+                pass->hits[r]++;
+                break;
+            }
+        }
+
+        // a removed instruction changed nothing
+        if(line->rule < 0)
+        {
+            peephole_apply(pass, line);
+            previous = line;
+        }
+    }
+
+    peephole_adjust(pass);
+}
+
+/**
+ * Function: peephole_markTargets
+ * Description:
+ *  - Marks the targets of the * jumps of the run, which control may come to
+ *    from elsewhere. A jump past the run keeps the lines up to its target.
+ * Parameters:
+ *  - pass: Pointer to the pass.
+ * Returns:
+ *  - none
+ */
+void peephole_markTargets(peephole_t * pass)
+{
+    int start = pass->run[0].address;
+    int end = pass->run[pass->numLines - 1].address + pass->run[pass->numLines - 1].size;
+    int target;
+    int i;
+    int j;
+
+    for(i = 0; i < pass->numLines; i++)
+    {
+        if(!pass->run[i].isRelative)
+        {
+            continue;
+        }
+
+        target = pass->run[i].address + pass->run[i].displacement;
+        if(target >= end)
+        {
+            if(target > pass->protectUntil)
+            {
+                pass->protectUntil = target;
+            }
+        }
+        else if(target >= start)
+        {
+            for(j = 0; j < pass->numLines && (pass->run[j].format == 0 || pass->run[j].address < target); j++)
+            {
+            }
+            if(j < pass->numLines && pass->run[j].address == target)
+            {
+                pass->run[j].isEntry = TRUE;
+            }
+            else
+            {
+                // into the middle of an instruction: nothing is moved
+                for(j = 0; j < pass->numLines; j++)
+                {
+                    pass->run[j].isEntry = TRUE;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Function: peephole_adjust
+ * Description:
+ *  - Gives the * jumps of the run over removed lines their new displacement.
+ * Parameters:
+ *  - pass: Pointer to the pass.
+ * Returns:
+ *  - none
+ */
+void peephole_adjust(peephole_t * pass)
+{
+    peephole_line_t * line;
+    peephole_line_t * other;
+    int start = pass->run[0].address;
+    int target;
+    int removed;
+    int unsafe;
+    int kept = 0;
+    int i;
+    int j;
+
+    for(i = 0; i < pass->numLines; i++)
+    {
+        line = &pass->run[i];
+        if(line->rule >= 0)
+        {
+            continue;
+        }
+        kept++;
+        if(!line->isRelative || line->displacement == 0)
+        {
+            continue;
+        }
+
+        target = line->address + line->displacement;
+        removed = 0;
+        unsafe = FALSE;
+        for(j = 0; j < pass->numLines; j++)
+        {
+            other = &pass->run[j];
+            if(other->rule >= 0 && ((target > line->address) ?
+                (other->address >= line->address && other->address < target) :
+                (other->address >= target && other->address < line->address)))
+            {
+                removed += other->size;
+            }
+        }
+
+        // back into the runs written before, which forgot the registers at
+        // their start but not at this target
+        for(j = pass->numRemoved - 1; target < start && j >= 0 && pass->removed[j].address >= target; j--)
+        {
+            removed += pass->removed[j].size;
+            if(pass->removed[j].since < target || target < pass->fence)
+            {
+                unsafe = TRUE;
+            }
+        }
+        if(unsafe)
+        {
+            pass->numUnsafe++;
+            printError("WARNING: --peephole removed a line the jump on output line %d may need; label its target\n",
+                pass->lineNumber + kept);
+        }
+
+        if(removed > 0)
+        {
+            peephole_rewrite(pass, line, (line->displacement > 0) ? line->displacement - removed : line->displacement + removed);
+        }
+    }
+}
+
+/**
+ * Function: peephole_rewrite
+ * Description:
+ *  - Replaces the operand of a * jump with a new displacement. The comment
+ *    after it stays where it was.
+ * Parameters:
+ *  - pass: Pointer to the pass.
+ *  - line: The jump.
+ *  - displacement: Its new displacement.
+ * Returns:
+ *  - none
+ */
+void peephole_rewrite(peephole_t * pass, peephole_line_t * line, int displacement)
+{
+    char operand[CURRENT_LINE_SIZE];
+    char * text;
+    size_t rest = line->operand + line->operandLength;
+    int length;
+
+    if(displacement == 0)
+    {
+        strcpy_s(operand, sizeof(operand), "*");
+    }
+    else
+    {
+        sprintf_s(operand, sizeof(operand), "*%+d", displacement);
+    }
+    length = (int) strlen(operand);
+    while(length < line->operandLength && rest < line->length)
+    {
+        operand[length++] = ' ';
+    }
+
+    text = (char *) malloc(line->length - line->operandLength + length + 1);
+    if(text == NULL)
+    {
+        pass->output->failed = TRUE;
+        return;
+    }
+    memcpy(text, line->text, line->operand);
+    memcpy(text + line->operand, operand, length);
+    memcpy(text + line->operand + length, line->text + rest, line->length - rest + 1);
+
+    free(line->text);
+    line->text = text;
+    line->length = line->length - line->operandLength + length;
+    line->operandLength = length;
+    line->displacement = displacement;
+    pass->numAdjusted++;
+}
+
+/**
+ * Function: peephole_remember
+ * Description:
+ *  - Keeps the address of a removed line, for the * jumps of later runs.
+ * Parameters:
+ *  - pass: Pointer to the pass.
+ *  - line: The removed line.
+ * Returns:
+ *  - none
+ */
+void peephole_remember(peephole_t * pass, const peephole_line_t * line)
+{
+    peephole_removed_t * tmp;
+    int capacity;
+
+    if(pass->numRemoved == pass->removedCapacity)
+    {
+        capacity = (pass->removedCapacity > 0) ? pass->removedCapacity * 2 : 64;
+        tmp = (peephole_removed_t *) realloc(pass->removed, capacity * sizeof(peephole_removed_t));
+        if(tmp == NULL)
+        {
+            pass->output->failed = TRUE;
+            return;
+        }
+        pass->removed = tmp;
+        pass->removedCapacity = capacity;
+    }
+
+    pass->removed[pass->numRemoved].address = line->address;
+    pass->removed[pass->numRemoved].size = line->size;
+    pass->removed[pass->numRemoved].since = line->since;
+    pass->numRemoved++;
+    pass->bytesRemoved += line->size;
+}
+
+/**
+ * Function: peephole_apply
+ * Description:
+ *  - Updates what the registers hold after an instruction that is kept.
+ * Parameters:
+ *  - pass: Pointer to the pass.
+ *  - line: The instruction.
+ * Returns:
+ *  - none
+ */
+void peephole_apply(peephole_t * pass, const peephole_line_t * line)
+{
+    const char * value = line->text + line->operand;
+    int reg;
+    int source;
+
+    if((reg = peephole_getRegister(line->opcode, "LD")) >= 0)
+    {
+        if(peephole_isTracked(line))
+        {
+            peephole_set(pass, reg, value, line->operandLength, line->address);
+        }
+        else
+        {
+            peephole_forget(pass, reg);
+        }
+    }
+    else if((reg = peephole_getRegister(line->opcode, "ST")) >= 0)
+    {
+        // the word stored to may be one a register was loaded from; a
+        // register holding a constant keeps it
+        peephole_forgetMemory(pass);
+        if(peephole_isTracked(line) && !peephole_isConstant(value) && pass->registers[reg].value == NULL)
+        {
+            peephole_set(pass, reg, value, line->operandLength, line->address);
+        }
+    }
+    else if(peephole_isOneOf(line->opcode, PEEPHOLE_STORES, sizeof(PEEPHOLE_STORES) / sizeof(PEEPHOLE_STORES[0])))
+    {
+        peephole_forgetMemory(pass);
+    }
+    else if(strcmp("CLEAR", line->opcode) == 0)
+    {
+        reg = peephole_getOperandRegister(line, 0);
+        if(reg >= 0)
+        {
+            peephole_set(pass, reg, "#0", 2, line->address);
+        }
+        else
+        {
+            peephole_forget(pass, -1);
+        }
+    }
+    else if(strcmp("RMO", line->opcode) == 0)
+    {
+        source = peephole_getOperandRegister(line, 0);
+        reg = peephole_getOperandRegister(line, 1);
+        if(source >= 0 && reg >= 0)
+        {
+            pass->registers[reg] = pass->registers[source];
+        }
+        else
+        {
+            peephole_forget(pass, reg);
+        }
+    }
+    else if(peephole_isOneOf(line->opcode, PEEPHOLE_KEEP, sizeof(PEEPHOLE_KEEP) / sizeof(PEEPHOLE_KEEP[0])))
+    {
+    }
+    else if(peephole_isOneOf(line->opcode, PEEPHOLE_SET_A, sizeof(PEEPHOLE_SET_A) / sizeof(PEEPHOLE_SET_A[0])))
+    {
+        peephole_forget(pass, PEEPHOLE_REGISTER_A);
+    }
+    else if(peephole_isOneOf(line->opcode, PEEPHOLE_SET_F, sizeof(PEEPHOLE_SET_F) / sizeof(PEEPHOLE_SET_F[0])))
+    {
+        peephole_forget(pass, PEEPHOLE_REGISTER_F);
+    }
+    else if(strcmp("TIX", line->opcode) == 0 || strcmp("TIXR", line->opcode) == 0)
+    {
+        peephole_forget(pass, PEEPHOLE_REGISTER_X);
+    }
+    else if(strcmp("ADDR", line->opcode) == 0 || strcmp("SUBR", line->opcode) == 0 ||
+        strcmp("MULR", line->opcode) == 0 || strcmp("DIVR", line->opcode) == 0)
+    {
+        peephole_forget(pass, peephole_getOperandRegister(line, 1));
+    }
+    else if(strcmp("SHIFTL", line->opcode) == 0 || strcmp("SHIFTR", line->opcode) == 0)
+    {
+        peephole_forget(pass, peephole_getOperandRegister(line, 0));
+    }
+    else
+    {
+        // JSUB, RSUB, LPS, SVC: anything may have changed
+        peephole_forget(pass, -1);
+    }
+}
+
+/**
+ * Function: peephole_set
+ * Description:
+ *  - Records the value a register holds.
+ * Parameters:
+ *  - pass: Pointer to the pass.
+ *  - reg: The register.
+ *  - value: Operand its value came from, in the line, or a constant.
+ *  - length: Length of the operand.
+ *  - since: Address of the instruction.
+ * Returns:
+ *  - none
+ */
+void peephole_set(peephole_t * pass, int reg, const char * value, int length, int since)
+{
+    pass->registers[reg].value = value;
+    pass->registers[reg].length = length;
+    pass->registers[reg].since = since;
+}
+
+/**
+ * Function: peephole_forget
+ * Description:
+ *  - Forgets what a register holds.
+ * Parameters:
+ *  - pass: Pointer to the pass.
+ *  - reg: The register, or -1 for all of them.
+ * Returns:
+ *  - none
+ */
+void peephole_forget(peephole_t * pass, int reg)
+{
+    int i;
+
+    for(i = 0; i < PEEPHOLE_REGISTERS; i++)
+    {
+        if(reg < 0 || i == reg)
+        {
+            pass->registers[i].value = NULL;
+        }
+    }
+}
+
+/**
+ * Function: peephole_forgetMemory
+ * Description:
+ *  - Forgets the registers that hold a word of memory, after a store.
+ * Parameters:
+ *  - pass: Pointer to the pass.
+ * Returns:
+ *  - none
+ */
+void peephole_forgetMemory(peephole_t * pass)
+{
+    int i;
+
+    for(i = 0; i < PEEPHOLE_REGISTERS; i++)
+    {
+        if(pass->registers[i].value != NULL && !peephole_isConstant(pass->registers[i].value))
+        {
+            pass->registers[i].value = NULL;
+        }
+    }
+}
+
+/**
+ * Function: peephole_holds
+ * Description:
+ *  - Checks if a register is known to hold a value.
+ * Parameters:
+ *  - pass: Pointer to the pass.
+ *  - reg: The register.
+ *  - value: The operand the value comes from.
+ *  - length: Length of the operand.
+ * Returns:
+ *  - TRUE if it does.
+ */
+int peephole_holds(const peephole_t * pass, int reg, const char * value, int length)
+{
+    return reg >= 0 && pass->registers[reg].value != NULL && pass->registers[reg].length == length &&
+        memcmp(pass->registers[reg].value, value, length) == 0;
+}
+
+/**
+ * Function: peephole_isTracked
+ * Description:
+ *  - Checks if the operand of an instruction always names the same word or
+ *    constant: not indexed, indirect or relative.
+ * Parameters:
+ *  - line: The instruction.
+ * Returns:
+ *  - TRUE if it does.
+ */
+int peephole_isTracked(const peephole_line_t * line)
+{
+    const char * operand = line->text + line->operand;
+
+    return line->operandLength > 0 && operand[0] != '@' &&
+        memchr(operand, ',', line->operandLength) == NULL && memchr(operand, '*', line->operandLength) == NULL;
+}
+
+/**
+ * Function: peephole_isConstant
+ * Description:
+ *  - Checks if an operand is a constant, which no store changes.
+ * Parameters:
+ *  - value: The operand.
+ * Returns:
+ *  - TRUE for #value and =literal.
+ */
+int peephole_isConstant(const char * value)
+{
+    return value[0] == '#' || value[0] == '=';
+}
+
+/**
+ * Function: peephole_isOneOf
+ * Description:
+ *  - Looks up an opcode in a list.
+ * Parameters:
+ *  - opcode: The opcode.
+ *  - list: The list.
+ *  - size: Number of opcodes in the list.
+ * Returns:
+ *  - TRUE if the opcode is in the list.
+ */
+int peephole_isOneOf(const char * opcode, const char ** list, int size)
+{
+    int i;
+
+    for(i = 0; i < size; i++)
+    {
+        if(strcmp(opcode, list[i]) == 0)
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/**
+ * Function: peephole_getRegister
+ * Description:
+ *  - Register a load (LDA to LDX) or store (STA to STX) is of.
+ * Parameters:
+ *  - opcode: Opcode, without +.
+ *  - prefix: "LD" or "ST".
+ * Returns:
+ *  - Number of the register, or -1 if the opcode is not such a load or store.
+ */
+int peephole_getRegister(const char * opcode, const char * prefix)
+{
+    const char * found;
+
+    if(strncmp(opcode, prefix, 2) != 0 || opcode[2] == '\0' || opcode[3] != '\0')
+    {
+        return -1;
+    }
+    found = strchr(PEEPHOLE_REGISTER_NAMES, opcode[2]);
+    return (found != NULL) ? (int) (found - PEEPHOLE_REGISTER_NAMES) : -1;
+}
+
+/**
+ * Function: peephole_getOperandRegister
+ * Description:
+ *  - Register operand of a format 2 instruction, as in CLEAR X or RMO A,S.
+ * Parameters:
+ *  - line: The instruction.
+ *  - which: 0 for the first register, 1 for the second.
+ * Returns:
+ *  - Number of the register, or -1 if it is not one of A X L B S T F.
+ */
+int peephole_getOperandRegister(const peephole_line_t * line, int which)
+{
+    const char * operand = line->text + line->operand;
+    const char * found;
+    int pos = 0;
+
+    if(which == 1)
+    {
+        while(pos < line->operandLength && operand[pos] != ',')
+        {
+            pos++;
+        }
+        pos++;
+    }
+    if(pos >= line->operandLength || (pos + 1 < line->operandLength && operand[pos + 1] != ','))
+    {
+        return -1;
+    }
+    found = strchr(PEEPHOLE_REGISTER_NAMES, operand[pos]);
+    return (found != NULL) ? (int) (found - PEEPHOLE_REGISTER_NAMES) : -1;
+}
+
+/**
+ * Function: peephole_getLoaded
+ * Description:
+ *  - Register an instruction sets whole, without reading it: a load of a
+ *    register other than B (which base relative operands read), or CLEAR.
+ * Parameters:
+ *  - line: The instruction.
+ * Returns:
+ *  - Number of the register, or -1.
+ */
+int peephole_getLoaded(const peephole_line_t * line)
+{
+    int reg;
+
+    if(strcmp("CLEAR", line->opcode) == 0)
+    {
+        return peephole_getOperandRegister(line, 0);
+    }
+    reg = peephole_getRegister(line->opcode, "LD");
+    if(reg == PEEPHOLE_REGISTER_B ||
+        (reg == PEEPHOLE_REGISTER_X && memchr(line->text + line->operand, ',', line->operandLength) != NULL))
+    {
+        return -1;
+    }
+    return reg;
+}
+
+/**
+ * Function: peephole_matchClear
+ * Description:
+ *  - Rule: CLEAR of a register known to be 0, as in CLEAR X at the end of one
+ *    expansion and at the start of the next.
+ * Parameters:
+ *  - pass: Pointer to the pass.
+ *  - previous: Instruction before, or NULL.
+ *  - line: Current instruction.
+ * Returns:
+ *  - The instruction to remove, or NULL.
+ */
+peephole_line_t * peephole_matchClear(peephole_t * pass, peephole_line_t * previous, peephole_line_t * line)
+{
+    int reg;
+
+    (void) previous;
+    if(strcmp("CLEAR", line->opcode) != 0)
+    {
+        return NULL;
+    }
+    reg = peephole_getOperandRegister(line, 0);
+    if(!peephole_holds(pass, reg, "#0", 2))
+    {
+        return NULL;
+    }
+    line->since = pass->registers[reg].since;
+    return line;
+}
+
+/**
+ * Function: peephole_matchStoreLoad
+ * Description:
+ *  - Rule: load of a register right after it was stored to the same operand,
+ *    as in STA TEMP, LDA TEMP.
+ * Parameters:
+ *  - pass: Pointer to the pass.
+ *  - previous: Instruction before, or NULL.
+ *  - line: Current instruction.
+ * Returns:
+ *  - The instruction to remove, or NULL.
+ */
+peephole_line_t * peephole_matchStoreLoad(peephole_t * pass, peephole_line_t * previous, peephole_line_t * line)
+{
+    int reg = peephole_getRegister(line->opcode, "LD");
+
+    (void) pass;
+    if(reg < 0 || previous == NULL || !peephole_isTracked(line) ||
+        peephole_getRegister(previous->opcode, "ST") != reg || previous->operandLength != line->operandLength ||
+        memcmp(previous->text + previous->operand, line->text + line->operand, line->operandLength) != 0)
+    {
+        return NULL;
+    }
+    line->since = previous->address;
+    return line;
+}
+
+/**
+ * Function: peephole_matchReload
+ * Description:
+ *  - Rule: load of the value a register already holds, as in LDA #0 after
+ *    CLEAR A, or a second LDT LENGTH with no store in between.
+ * Parameters:
+ *  - pass: Pointer to the pass.
+ *  - previous: Instruction before, or NULL.
+ *  - line: Current instruction.
+ * Returns:
+ *  - The instruction to remove, or NULL.
+ */
+peephole_line_t * peephole_matchReload(peephole_t * pass, peephole_line_t * previous, peephole_line_t * line)
+{
+    int reg = peephole_getRegister(line->opcode, "LD");
+
+    (void) previous;
+    if(reg < 0 || !peephole_isTracked(line) ||
+        !peephole_holds(pass, reg, line->text + line->operand, line->operandLength))
+    {
+        return NULL;
+    }
+    line->since = pass->registers[reg].since;
+    return line;
+}
+
+/**
+ * Function: peephole_matchStoreSame
+ * Description:
+ *  - Rule: store of a register to the word its value was loaded from or
+ *    stored to, with no store in between.
+ * Parameters:
+ *  - pass: Pointer to the pass.
+ *  - previous: Instruction before, or NULL.
+ *  - line: Current instruction.
+ * Returns:
+ *  - The instruction to remove, or NULL.
+ */
+peephole_line_t * peephole_matchStoreSame(peephole_t * pass, peephole_line_t * previous, peephole_line_t * line)
+{
+    int reg = peephole_getRegister(line->opcode, "ST");
+
+    (void) previous;
+    if(reg < 0 || !peephole_isTracked(line) || peephole_isConstant(line->text + line->operand) ||
+        !peephole_holds(pass, reg, line->text + line->operand, line->operandLength))
+    {
+        return NULL;
+    }
+    line->since = pass->registers[reg].since;
+    return line;
+}
+
+/**
+ * Function: peephole_matchDeadLoad
+ * Description:
+ *  - Rule: load or CLEAR of a register that the next instruction sets again
+ *    without reading it. CLEAR A before LDCH stays: LDCH sets one byte.
+ * Parameters:
+ *  - pass: Pointer to the pass.
+ *  - previous: Instruction before, or NULL.
+ *  - line: Current instruction.
+ * Returns:
+ *  - The instruction to remove, or NULL.
+ */
+peephole_line_t * peephole_matchDeadLoad(peephole_t * pass, peephole_line_t * previous, peephole_line_t * line)
+{
+    int reg;
+
+    (void) pass;
+    if(previous == NULL)
+    {
+        return NULL;
+    }
+    reg = peephole_getLoaded(previous);
+    if(reg < 0 || peephole_getLoaded(line) != reg)
+    {
+        return NULL;
+    }
+    previous->since = previous->address;
+    return previous;
+}
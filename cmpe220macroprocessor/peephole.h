@@ -0,0 +1,89 @@
+/*
+ * peephole.h - Contains functions and definitions for the peephole optimizer
+ * run on the output lines as they are written (--peephole).
+ */
+
+#ifndef PEEPHOLE_H_
+#define PEEPHOLE_H_
+
+#include <stddef.h>
+
+#define PEEPHOLE_MAX_RUN        (256)   // lines held before a run is optimized anyway
+#define PEEPHOLE_REGISTERS      (7)     // A X L B S T F, by their SIC/XE numbers
+#define PEEPHOLE_OPCODE_SIZE    (8)
+
+// Rules, in the order they are tried
+#define PEEPHOLE_RULE_CLEAR         (0)     // CLEAR of a register known to be 0
+#define PEEPHOLE_RULE_STORE_LOAD    (1)     // load right after a store of the register to the same operand
+#define PEEPHOLE_RULE_RELOAD        (2)     // load of the value the register already holds
+#define PEEPHOLE_RULE_STORE_SAME    (3)     // store of a register to where its value was loaded from
+#define PEEPHOLE_RULE_DEAD_LOAD     (4)     // load or CLEAR of a register the next instruction loads again
+#define PEEPHOLE_RULES              (5)
+
+// Output line held in the run, with the tokens the rules look at
+typedef struct
+{
+    char *          text;           // the line, without its newline
+    size_t          length;
+    const char *    newline;        // "\n", "\r\n", or "" for a last line without one
+    unsigned int    origin;         // origin in the tokenized output, from tokout_mark
+    int             address;        // of its code, counting the lines removed before it
+    int             size;           // bytes of code or data
+    int             format;         // 1 to 4, or 0 if it is not an instruction
+    char            opcode[PEEPHOLE_OPCODE_SIZE];   // of an instruction, without +
+    int             operand;        // span of the first operand in text
+    int             operandLength;
+    int             isEntry;        // labeled, or the target of a * jump: control may come from elsewhere
+    int             isBarrier;      // ends the run: not an instruction, or J or RSUB
+    int             isRelative;     // the operand is *, *+n or *-n
+    int             displacement;
+    int             rule;           // rule that removed it, or -1
+    int             since;          // address of the first instruction its removal relies on
+} peephole_line_t;
+
+// Value a register is known to hold: the operand it was loaded from or
+// stored to, or a #constant or =literal
+typedef struct
+{
+    const char *    value;          // NULL if not known
+    int             length;
+    int             since;          // address of the instruction that set it
+} peephole_register_t;
+
+// Line removed from a run that was written, for the * jumps of later runs
+typedef struct
+{
+    int             address;
+    int             size;
+    int             since;
+} peephole_removed_t;
+
+// Peephole pass over the output. The lines are held in runs of straight-line
+// code, and each run is optimized when it ends, when the * jumps into it are
+// all known; the kept lines are written to the output stream.
+typedef struct peephole_s
+{
+    struct stream_s *       output;
+    peephole_line_t         run[PEEPHOLE_MAX_RUN];
+    int                     numLines;
+    int                     address;        // of the next line
+    int                     protectUntil;   // a written * jump reaches this address, -1 for none
+    int                     fence;          // last LTORG or ORG: the addresses do not count the literal pool
+    peephole_register_t     registers[PEEPHOLE_REGISTERS];
+    peephole_removed_t *    removed;        // lines removed from the written runs, by address
+    int                     numRemoved;
+    int                     removedCapacity;
+    int                     bytesRemoved;
+    int                     hits[PEEPHOLE_RULES];
+    int                     numAdjusted;    // * jumps given a new displacement
+    int                     numUnsafe;      // * jumps back over lines removed from a written run
+    int                     lineNumber;     // output lines written
+} peephole_t;
+
+peephole_t *    peephole_alloc(struct stream_s * output);
+void            peephole_free(peephole_t * pass);
+void            peephole_line(peephole_t * pass, const char * line, size_t length, const char * newline, unsigned int origin);
+void            peephole_flush(peephole_t * pass);
+const char *    peephole_getRuleName(int rule);
+
+#endif /* PEEPHOLE_H_ */
@@ -0,0 +1,483 @@
+/*
+ * pipeline.c - Contains functions for pipelined file I/O.
+ *
+ * A reader thread reads the input file into batches while the expansion runs,
+ * and a writer thread writes the batches of expanded text. The threads are
+ * connected to the expansion by two lock-free rings, so reading and writing
+ * happen while lines are being expanded, and the output is written in the
+ * order it was produced. A thread that finds its ring empty or full spins
+ * briefly and then sleeps until the other side moves.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "definitions.h"
+#include "pipeline.h"
+#include "thread.h"
+
+// local function definitions
+void pipeline_free(pipeline_t * pipeline);
+pipeline_batch_t * pipeline_batchAlloc(void);
+void pipeline_batchFree(pipeline_batch_t * batch);
+void pipeline_push(pipeline_ring_t * ring, pipeline_batch_t * batch);
+pipeline_batch_t * pipeline_pop(pipeline_ring_t * ring);
+THREAD_RESULT pipeline_read(void * argument);
+THREAD_RESULT pipeline_write(void * argument);
+
+/**
+ * Function: pipeline_start
+ * Description:
+ *  - Starts the reader and writer threads of open files. The files are not
+ *    closed by pipeline_finish.
+ * Parameters:
+ *  - inputFile: File to read, or NULL to only write.
+ *  - outputFile: File to write.
+ * Returns:
+ *  - If successful, returns pointer to new pipeline. Otherwise, returns NULL.
+ */
+pipeline_t * pipeline_start(FILE * inputFile, FILE * outputFile)
+{
+    pipeline_t * pipeline;
+    pipeline_batch_t * batch;
+
+    if(outputFile == NULL)
+    {
+        return NULL;
+    }
+
+    pipeline = (pipeline_t *) malloc(sizeof(pipeline_t));
+    if(pipeline == NULL)
+    {
+        return NULL;
+    }
+
+    memset(pipeline, 0, sizeof(pipeline_t));
+    pipeline->inputFile = inputFile;
+    pipeline->outputFile = outputFile;
+    pipeline->inputDone = (inputFile == NULL);
+
+    pipeline->input.event = thread_eventAlloc();
+    pipeline->output.event = thread_eventAlloc();
+    if(pipeline->input.event == NULL || pipeline->output.event == NULL)
+    {
+        pipeline_free(pipeline);
+        return NULL;
+    }
+
+    if(inputFile != NULL && thread_start(&pipeline->reader, pipeline_read, pipeline) != SUCCESS)
+    {
+        pipeline_free(pipeline);
+        return NULL;
+    }
+
+    if(thread_start(&pipeline->writer, pipeline_write, pipeline) != SUCCESS)
+    {
+        // stop the reader, taking what it read so it can end the text
+        THREAD_STORE(&pipeline->stopping, TRUE);
+        if(inputFile != NULL)
+        {
+            while((batch = pipeline_pop(&pipeline->input)) != NULL)
+            {
+                pipeline_batchFree(batch);
+            }
+            thread_join(pipeline->reader);
+        }
+        pipeline_free(pipeline);
+        return NULL;
+    }
+
+    return pipeline;
+}
+
+/**
+ * Function: pipeline_finish
+ * Description:
+ *  - Writes the rest of the output, stops both threads and de-allocates the
+ *    pipeline. Input that was not read yet is skipped.
+ * Parameters:
+ *  - pipeline: Pointer to the pipeline.
+ * Returns:
+ *  - SUCCESS, or FAILURE after a read or write error.
+ */
+int pipeline_finish(pipeline_t * pipeline)
+{
+    pipeline_batch_t * batch;
+    int result = SUCCESS;
+
+    if(pipeline == NULL)
+    {
+        return FAILURE;
+    }
+
+    // the reader stops at its next batch
+    THREAD_STORE(&pipeline->stopping, TRUE);
+
+    // hand over the last batch and the end of the text, and wait for the writer
+    if(pipeline->outputBatch != NULL)
+    {
+        pipeline_push(&pipeline->output, pipeline->outputBatch);
+        pipeline->outputBatch = NULL;
+    }
+    pipeline_push(&pipeline->output, NULL);
+    thread_join(pipeline->writer);
+
+    // take what the reader pushed until it stopped, so it does not wait on a
+    // full ring
+    pipeline_batchFree(pipeline->inputBatch);
+    pipeline->inputBatch = NULL;
+    if(pipeline->inputFile != NULL)
+    {
+        if(!pipeline->inputDone)
+        {
+            while((batch = pipeline_pop(&pipeline->input)) != NULL)
+            {
+                pipeline_batchFree(batch);
+            }
+        }
+        thread_join(pipeline->reader);
+    }
+
+    if(pipeline->readFailed || pipeline->writeFailed)
+    {
+        result = FAILURE;
+    }
+
+    pipeline_free(pipeline);
+    return result;
+}
+
+/**
+ * Function: pipeline_gets
+ * Description:
+ *  - Reads the next line, with its newline, as fgets does. Waits for the
+ *    reader thread when it has not read the line yet.
+ * Parameters:
+ *  - pipeline: Pointer to the pipeline.
+ *  - buffer: Buffer for the line.
+ *  - size: Size of the buffer. Longer lines are read in pieces.
+ * Returns:
+ *  - buffer, or NULL at the end of the input.
+ */
+char * pipeline_gets(pipeline_t * pipeline, char * buffer, int size)
+{
+    pipeline_batch_t * batch;
+    const char * start;
+    const char * newline = NULL;
+    size_t length = 0;
+    size_t count;
+
+    if(pipeline == NULL || buffer == NULL || size <= 1)
+    {
+        return NULL;
+    }
+
+    // a line may continue in the next batch
+    while(newline == NULL && length < (size_t)(size - 1))
+    {
+        batch = pipeline->inputBatch;
+        if(batch == NULL || batch->pos >= batch->size)
+        {
+            if(pipeline->inputDone)
+            {
+                break;
+            }
+
+            pipeline_batchFree(batch);
+            pipeline->inputBatch = pipeline_pop(&pipeline->input);
+            if(pipeline->inputBatch == NULL)
+            {
+                pipeline->inputDone = TRUE;
+            }
+            continue;
+        }
+
+        start = batch->data + batch->pos;
+        count = batch->size - batch->pos;
+        if(count > (size_t)(size - 1) - length)
+        {
+            count = (size_t)(size - 1) - length;
+        }
+        newline = (const char *) memchr(start, '\n', count);
+        if(newline != NULL)
+        {
+            count = newline - start + 1;
+        }
+
+        memcpy(buffer + length, start, count);
+        length += count;
+        batch->pos += count;
+    }
+
+    if(length == 0)
+    {
+        return NULL;
+    }
+
+    buffer[length] = '\0';
+    return buffer;
+}
+
+/**
+ * Function: pipeline_puts
+ * Description:
+ *  - Writes text, without adding a newline. Full batches are handed to the
+ *    writer thread.
+ * Parameters:
+ *  - pipeline: Pointer to the pipeline.
+ *  - text: Text to write.
+ * Returns:
+ *  - SUCCESS, or FAILURE if the writer failed or memory ran out.
+ */
+int pipeline_puts(pipeline_t * pipeline, const char * text)
+{
+    size_t length;
+    size_t count;
+
+    if(pipeline == NULL || text == NULL || THREAD_LOAD(&pipeline->writeFailed))
+    {
+        return FAILURE;
+    }
+
+    length = strlen(text);
+    while(length > 0)
+    {
+        if(pipeline->outputBatch == NULL)
+        {
+            pipeline->outputBatch = pipeline_batchAlloc();
+            if(pipeline->outputBatch == NULL)
+            {
+                THREAD_STORE(&pipeline->writeFailed, TRUE);
+                return FAILURE;
+            }
+        }
+
+        count = PIPELINE_BATCH_SIZE - pipeline->outputBatch->size;
+        if(count > length)
+        {
+            count = length;
+        }
+        memcpy(pipeline->outputBatch->data + pipeline->outputBatch->size, text, count);
+        pipeline->outputBatch->size += count;
+        text += count;
+        length -= count;
+
+        if(pipeline->outputBatch->size == PIPELINE_BATCH_SIZE)
+        {
+            pipeline_push(&pipeline->output, pipeline->outputBatch);
+            pipeline->outputBatch = NULL;
+        }
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Function: pipeline_free
+ * Description:
+ *  - De-allocates a pipeline whose threads have ended.
+ * Parameters:
+ *  - pipeline: Pointer to the pipeline.
+ * Returns:
+ *  - none
+ */
+void pipeline_free(pipeline_t * pipeline)
+{
+    if(pipeline)
+    {
+        thread_eventFree(pipeline->input.event);
+        thread_eventFree(pipeline->output.event);
+        free(pipeline);
+    }
+}
+
+/**
+ * Function: pipeline_batchAlloc
+ * Description:
+ *  - Allocates an empty batch of PIPELINE_BATCH_SIZE bytes.
+ * Parameters:
+ *  - none
+ * Returns:
+ *  - If successful, returns pointer to new batch. Otherwise, returns NULL.
+ */
+pipeline_batch_t * pipeline_batchAlloc(void)
+{
+    pipeline_batch_t * batch = (pipeline_batch_t *) malloc(sizeof(pipeline_batch_t));
+
+    if(batch)
+    {
+        memset(batch, 0, sizeof(pipeline_batch_t));
+        batch->data = (char *) malloc(PIPELINE_BATCH_SIZE);
+        if(batch->data == NULL)
+        {
+            free(batch);
+            batch = NULL;
+        }
+    }
+
+    return batch;
+}
+
+/**
+ * Function: pipeline_batchFree
+ * Description:
+ *  - De-allocates a batch.
+ * Parameters:
+ *  - batch: Pointer to the batch.
+ * Returns:
+ *  - none
+ */
+void pipeline_batchFree(pipeline_batch_t * batch)
+{
+    if(batch)
+    {
+        free(batch->data);
+        free(batch);
+    }
+}
+
+/**
+ * Function: pipeline_push
+ * Description:
+ *  - Adds a batch to a ring, waiting while the ring is full, and wakes the
+ *    consumer if it sleeps. Only the producer thread of the ring may call it.
+ * Parameters:
+ *  - ring: Pointer to the ring.
+ *  - batch: Batch, or NULL for the end of the text.
+ * Returns:
+ *  - none
+ */
+void pipeline_push(pipeline_ring_t * ring, pipeline_batch_t * batch)
+{
+    long tail = ring->tail;
+    int spin = 0;
+
+    // the ring is full while head is a whole ring behind
+    while(tail - THREAD_LOAD(&ring->head) >= PIPELINE_RING_SIZE)
+    {
+        if(++spin < PIPELINE_SPIN)
+        {
+            thread_yield();
+        }
+        else
+        {
+            thread_eventWait(ring->event, &ring->head, tail - PIPELINE_RING_SIZE);
+        }
+    }
+
+    // the slot is written before the consumer can see the new tail
+    ring->slots[tail & (PIPELINE_RING_SIZE - 1)] = batch;
+    THREAD_STORE(&ring->tail, tail + 1);
+    thread_eventSignal(ring->event);
+}
+
+/**
+ * Function: pipeline_pop
+ * Description:
+ *  - Takes the oldest batch from a ring, waiting while the ring is empty, and
+ *    wakes the producer if it sleeps. Only the consumer thread of the ring may
+ *    call it.
+ * Parameters:
+ *  - ring: Pointer to the ring.
+ * Returns:
+ *  - The batch, or NULL at the end of the text.
+ */
+pipeline_batch_t * pipeline_pop(pipeline_ring_t * ring)
+{
+    long head = ring->head;
+    pipeline_batch_t * batch;
+    int spin = 0;
+
+    while(THREAD_LOAD(&ring->tail) == head)
+    {
+        if(++spin < PIPELINE_SPIN)
+        {
+            thread_yield();
+        }
+        else
+        {
+            thread_eventWait(ring->event, &ring->tail, head);
+        }
+    }
+
+    // the slot is read before the producer can reuse it
+    batch = ring->slots[head & (PIPELINE_RING_SIZE - 1)];
+    THREAD_STORE(&ring->head, head + 1);
+    thread_eventSignal(ring->event);
+    return batch;
+}
+
+/**
+ * Function: pipeline_read
+ * Description:
+ *  - Reader thread: reads the input file into batches until the end of the
+ *    file, or until the expansion is done.
+ * Parameters:
+ *  - argument: Pointer to the pipeline.
+ * Returns:
+ *  - 0
+ */
+THREAD_RESULT pipeline_read(void * argument)
+{
+    pipeline_t * pipeline = (pipeline_t *) argument;
+    pipeline_batch_t * batch;
+
+    while(!THREAD_LOAD(&pipeline->stopping))
+    {
+        batch = pipeline_batchAlloc();
+        if(batch == NULL)
+        {
+            THREAD_STORE(&pipeline->readFailed, TRUE);
+            break;
+        }
+
+        batch->size = fread(batch->data, 1, PIPELINE_BATCH_SIZE, pipeline->inputFile);
+        if(batch->size == 0)
+        {
+            if(ferror(pipeline->inputFile))
+            {
+                THREAD_STORE(&pipeline->readFailed, TRUE);
+            }
+            pipeline_batchFree(batch);
+            break;
+        }
+
+        pipeline_push(&pipeline->input, batch);
+    }
+
+    pipeline_push(&pipeline->input, NULL);
+    return THREAD_RETURN;
+}
+
+/**
+ * Function: pipeline_write
+ * Description:
+ *  - Writer thread: writes batches to the output file until the end of the
+ *    text. After a write error the batches are dropped.
+ * Parameters:
+ *  - argument: Pointer to the pipeline.
+ * Returns:
+ *  - 0
+ */
+THREAD_RESULT pipeline_write(void * argument)
+{
+    pipeline_t * pipeline = (pipeline_t *) argument;
+    pipeline_batch_t * batch;
+
+    while((batch = pipeline_pop(&pipeline->output)) != NULL)
+    {
+        if(!THREAD_LOAD(&pipeline->writeFailed) &&
+            fwrite(batch->data, 1, batch->size, pipeline->outputFile) != batch->size)
+        {
+            THREAD_STORE(&pipeline->writeFailed, TRUE);
+        }
+        pipeline_batchFree(batch);
+    }
+
+    if(fflush(pipeline->outputFile) != 0)
+    {
+        THREAD_STORE(&pipeline->writeFailed, TRUE);
+    }
+
+    return THREAD_RETURN;
+}
@@ -0,0 +1,57 @@
+/*
+ * pipeline.h - Contains functions and definitions for pipelined file I/O.
+ */
+
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include <stdio.h>
+#include "thread.h"
+
+#define PIPELINE_BATCH_SIZE     (16 * 1024)     // bytes of text per batch
+#define PIPELINE_RING_SIZE      (64)            // batches per ring, a power of two
+#define PIPELINE_SPIN           (64)            // yields before a waiting thread sleeps
+
+// Text passed between threads, a whole batch at a time
+typedef struct
+{
+    char *  data;
+    size_t  size;
+    size_t  pos;            // bytes consumed so far
+} pipeline_batch_t;
+
+// Lock-free ring with one producer and one consumer. head is only written by
+// the consumer and tail only by the producer. A side that waits longer than
+// a short spin sleeps on the event until the other side moves its counter.
+typedef struct
+{
+    pipeline_batch_t *  slots[PIPELINE_RING_SIZE];
+    volatile long       head;
+    volatile long       tail;
+    thread_event_t *    event;
+} pipeline_ring_t;
+
+// Reader thread -> expansion (calling thread) -> writer thread. A NULL batch
+// marks the end of the text in either ring.
+typedef struct pipeline_s
+{
+    FILE *              inputFile;
+    FILE *              outputFile;
+    pipeline_ring_t     input;
+    pipeline_ring_t     output;
+    pipeline_batch_t *  inputBatch;     // batch being read by the expansion
+    pipeline_batch_t *  outputBatch;    // batch being filled by the expansion
+    thread_t            reader;
+    thread_t            writer;
+    volatile long       stopping;       // the expansion is done, the reader can stop
+    volatile long       readFailed;
+    volatile long       writeFailed;
+    int                 inputDone;      // the expansion has seen the end of the text
+} pipeline_t;
+
+pipeline_t *    pipeline_start(FILE * inputFile, FILE * outputFile);
+int             pipeline_finish(pipeline_t * pipeline);
+char *          pipeline_gets(pipeline_t * pipeline, char * buffer, int size);
+int             pipeline_puts(pipeline_t * pipeline, const char * text);
+
+#endif /* PIPELINE_H_ */
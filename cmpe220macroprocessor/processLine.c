@@ -19,6 +19,8 @@
 #include <fcntl.h>
 #include "definitions.h"
 #include "parser.h"
+#include "asmpass.h"
+#include "tokout.h"
 
 /**
 * Function: processLine
@@ -35,15 +37,15 @@
 * Returns:
 * SUCCESS (0) or FAILURE (-1)
 */
-int processLine(FILE * inputFile, FILE* outputFile, const char *macroLine)
+int processLine(stream_t * inputFile, stream_t * outputFile, const char *macroLine)
 {
 	int result = FAILURE;
 	parse_info_t *parseInfo = parse_info_alloc();
 
 	// Get OPCODE (strtok)
-	if(parse_line(parseInfo, macroLine) == FAILURE)
+	if(parse_inputLine(parseInfo, macroLine, inputFile) == FAILURE)
 	{
-		printf("Error in parse_line.\n");
+		printError("Error in parse_line.\n");
         parse_info_free(parseInfo);
 		return FAILURE;
 	}
@@ -64,14 +66,31 @@ int processLine(FILE * inputFile, FILE* outputFile, const char *macroLine)
 
 	if (namtab_get(namtab, parseInfo->opcode) != NULL)
 	{
+		// watch mode tells which invocations a changed macro affects
+		if (watch != NULL && !EXPANDING)
+			watch_addSite(watch, parseInfo->opcode, inputFile->lineNumber);
+
+		// the lines of the expansion come from the invocation
+		if (outputFile->tokout != NULL && !EXPANDING)
+			tokout_setOrigin(outputFile->tokout, inputFile->lineNumber, parseInfo->opcode);
+
 		//Call expand
 		result = expand(inputFile, outputFile, parseInfo->opcode);
+
+		// back at the top level, the invocation is complete
+		if (!EXPANDING)
+			budget_endInvocation(budget);
 	}
 	else if (parseInfo->opcode != NULL && strncmp("MACRO", parseInfo->opcode, strlen("MACRO")) == 0)
 	{
 		//Call define
 		result = define(inputFile, outputFile, macroLine);
 	}
+	else if(parseInfo->opcode != NULL && strcmp("INCLUDE", parseInfo->opcode) == 0)
+	{
+		//read the included file next
+		result = include_push(inputFile, parseInfo->operators);
+	}
 	else if(parseInfo->opcode != NULL && strncmp(parseInfo->opcode, "SET", strlen("SET")) == SUCCESS)
 	{
 		if(parseInfo->label != NULL)
@@ -108,3 +127,239 @@ int processLine(FILE * inputFile, FILE* outputFile, const char *macroLine)
 	return result;
 }
 
+
+/**
+* Function: processBegin
+* Description:
+*  - Starts processing an input: resets the state, allocates the tables and
+*    enters the macros of the mapped library (if any). processStep is then
+*    called until it returns END_OF_INPUT, and processEnd finishes.
+*
+* Parameters:
+* inputFile - Input stream
+* outputFile - Output stream
+*
+* Returns:
+* SUCCESS (0) or FAILURE (-1)
+*/
+int processBegin(stream_t * inputFile, stream_t * outputFile)
+{
+	// every input starts from the same state
+	EXPANDING = FALSE;
+	EXPAND_LABEL = FALSE;
+	UNIQUE_ID = 0;
+	memset(OPCODE, 0, sizeof(OPCODE));
+	memset(EXPANDED_LABEL, 0, sizeof(EXPANDED_LABEL));
+	memset(ERROR_MESSAGE, 0, sizeof(ERROR_MESSAGE));
+	memset(currentLine, 0, sizeof(currentLine));
+	budget_reset(budget);
+
+	argtab = argtab_alloc();
+	deftab = deftab_alloc();
+	namtab = namtab_alloc();
+	expstack = expstack_alloc();
+	expcache = (watch != NULL) ? watch->expcache : expcache_alloc();	// watch mode keeps it between runs
+	included = depfile_alloc();
+
+	if (inputFile == NULL || outputFile == NULL)
+	{
+		return FAILURE;
+	}
+
+	// macros of the library are entered on first use
+	if (library != NULL && library_load(library) != SUCCESS)
+	{
+		printError("ERROR: Could not load macro library\n");
+		return FAILURE;
+	}
+
+	return SUCCESS;
+}
+
+/**
+* Function: processStep
+* Description:
+*  - Does the next piece of work: one line of the expansion in progress, or
+*    one line of the input. A step may write no line (a definition, a SET or
+*    a conditional) or several (a nested invocation that is replayed).
+*
+* Parameters:
+* inputFile - Input stream
+* outputFile - Output stream
+*
+* Returns:
+* SUCCESS (0), FAILURE (-1), or END_OF_INPUT after END or the end of the input
+*/
+int processStep(stream_t * inputFile, stream_t * outputFile)
+{
+	if (EXPANDING)
+	{
+		if (expandStep(inputFile, outputFile) != SUCCESS)
+		{
+			printError("ERROR in processLine\n");
+			return FAILURE;
+		}
+
+		// back at the top level, the invocation is complete, and no frame reads
+		// the definitions it replaced
+		if (!EXPANDING)
+		{
+			budget_endInvocation(budget);
+			reclaimDefinitions();
+		}
+
+		return SUCCESS;
+	}
+
+	if (strncmp("END", OPCODE, strlen("END")) == 0)
+	{
+		return END_OF_INPUT;
+	}
+
+	//Getline will fill currentLine buffer, stop at the end of the input
+	if (getline(inputFile) == NULL)
+	{
+		return END_OF_INPUT;
+	}
+
+	if(VERBOSE)
+	{
+		printf("currentLine is %s", currentLine);
+	}
+
+	if (outputFile->tokout != NULL)
+	{
+		tokout_setOrigin(outputFile->tokout, inputFile->lineNumber, NULL);
+	}
+
+	if (processLine(inputFile, outputFile, currentLine) != SUCCESS)
+	{
+		printError("ERROR in processLine\n");
+		return FAILURE;
+	}
+
+	return SUCCESS;
+}
+
+/**
+* Function: processEnd
+* Description:
+*  - Finishes processing an input: writes the library to emit (if any),
+*    prints the statistics and frees the tables.
+*
+* Parameters:
+* outputFile - Output stream
+* result - Result of the last processStep
+*
+* Returns:
+* SUCCESS (0) or FAILURE (-1)
+*/
+int processEnd(stream_t * outputFile, int result)
+{
+	if (result == END_OF_INPUT)
+	{
+		result = SUCCESS;
+	}
+
+	// save the macros and SET variables of this input as a library
+	if (result == SUCCESS && EMIT_LIBRARY_FILE != NULL)
+	{
+		result = library_emit(EMIT_LIBRARY_FILE);
+	}
+
+	// the passes end with the last line, the lines the peephole pass held,
+	// the literals placed by END and the program length
+	stream_endLine(outputFile);
+	if (result == SUCCESS && outputFile->failed)
+	{
+		printError("ERROR: Could not write the output\n");
+		result = FAILURE;
+	}
+	if (outputFile->tokout != NULL && tokout_finish(outputFile->tokout) != SUCCESS && result == SUCCESS)
+	{
+		printError("ERROR: Could not write the tokenized output\n");
+		result = FAILURE;
+	}
+	if (outputFile->asmpass != NULL && asmpass_finish(outputFile->asmpass) != SUCCESS && result == SUCCESS)
+	{
+		printError("ERROR: Could not write the symbol table\n");
+		result = FAILURE;
+	}
+
+	// compare the macros with those of the last run, while they are here
+	if (watch != NULL)
+	{
+		watch_end(watch, namtab);
+	}
+
+	if(STATS)
+	{
+		printStatistics(outputFile);
+	}
+
+	processFree();
+	return result;
+}
+
+/**
+* Function: processFree
+* Description:
+*  - Frees the tables allocated by processBegin.
+*
+* Parameters:
+* none
+*
+* Returns:
+* none
+*/
+void processFree(void)
+{
+	// de-allocate data structures
+	unwindFrames();
+	if (watch == NULL)
+	{
+		expcache_free(expcache);
+	}
+	expstack_free(expstack);
+	namtab_free(namtab);
+	deftab_free(deftab);
+	argtab_free(argtab);
+	depfile_free(included);
+	included = NULL;
+	expcache = NULL;
+	expstack = NULL;
+	namtab = NULL;
+	deftab = NULL;
+	argtab = NULL;
+}
+
+/**
+* Function: processInput
+* Description:
+*  - Processes a whole input, stepping until END or the end of the input.
+*    Used by main, and by the library API.
+*
+* Parameters:
+* inputFile - Input stream
+* outputFile - Output stream
+*
+* Returns:
+* SUCCESS (0) or FAILURE (-1)
+*/
+int processInput(stream_t * inputFile, stream_t * outputFile)
+{
+	int result = processBegin(inputFile, outputFile);
+
+	// with threads, the two passes of parallel.c go as far as they can
+	if (result == SUCCESS && THREADS > 1)
+	{
+		result = parallel_process(inputFile, outputFile);
+	}
+
+	while (result == SUCCESS)
+	{
+		result = processStep(inputFile, outputFile);
+	}
+
+	return processEnd(outputFile, result);
+}
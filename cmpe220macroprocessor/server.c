@@ -0,0 +1,904 @@
+/*
+ * server.c - Contains functions for the expansion server (--serve) and its
+ * client (--connect).
+ *
+ * The server maps the macro library once, then expands inputs sent over a
+ * local (Unix domain) socket, so a small file costs neither the start of a
+ * process nor loading the macros again. Each worker of the pool accepts
+ * connections on the one socket, and expands with its own tables, budget
+ * and cache of included files. The library is shared through the catalog:
+ * each request pins the library current when it starts, so LIBRARY replaces
+ * it without waiting for the requests being served.
+ *
+ * A connection carries requests one after the other. Each is a line,
+ * followed by a body if it has one, and gets a response in the same form:
+ *
+ *   EXPAND <bytes>\n<input>    expands an input sent inline
+ *   FILE <path>\n              expands a file the server reads, kept
+ *                              tokenized until it changes
+ *   LIBRARY <path>\n           loads a library, or a file of definitions, for
+ *                              the requests from now on
+ *   STATS\n                    reports the counters of the server
+ *
+ *   OK <bytes>\n<output>       or   ERROR <bytes>\n<message>
+ *
+ * Paths in FILE and INCLUDE are relative to the directory the server was
+ * started in. SIGINT or SIGTERM stop the server once the requests being
+ * served are done.
+ */
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <afunix.h>
+#include <psapi.h>
+#pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "psapi.lib")
+#define SERVER_INVALID_SOCKET   INVALID_SOCKET
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#define SERVER_INVALID_SOCKET   (-1)
+#endif
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "definitions.h"
+#include "server.h"
+
+// Server stopped by a signal
+static server_t * runningServer = NULL;
+
+// local function definitions
+THREAD_RESULT server_work(void * argument);
+void server_serve(server_worker_t * worker, server_connection_t * connection);
+int server_expand(server_worker_t * worker, stream_t * input, stream_t * output);
+int server_respond(server_socket_t socket, const char * status, const char * body, size_t size);
+void server_getStats(server_t * server, char * text, size_t size);
+long long server_getPercentile(server_stats_t * stats, int percent);
+int server_getBucket(long long microseconds);
+long long server_getBucketLimit(int index);
+long server_getMemory(void);
+server_socket_t server_open(const char * socketName, int listening);
+void server_close(server_socket_t socket);
+int server_readLine(server_connection_t * connection, char * line, size_t size);
+char * server_readBody(server_connection_t * connection, size_t size);
+int server_send(server_socket_t socket, const char * data, size_t size);
+
+/**
+ * Function: server_run
+ * Description:
+ *  - Runs the server until it is stopped: maps the library, and serves
+ *    requests on the socket.
+ * Parameters:
+ *  - socketName: Path of the socket. A socket left by a server that was
+ *    not stopped is replaced.
+ *  - numWorkers: Number of requests served at once.
+ * Returns:
+ *  - SUCCESS, or FAILURE if the server could not start.
+ */
+int server_run(const char * socketName, int numWorkers)
+{
+    server_t * server;
+    server_worker_t * worker;
+    char text[SERVER_HEADER_SIZE];
+    BOOL printStats = STATS;
+    int result = SUCCESS;
+    int i;
+
+    server = (server_t *) malloc(sizeof(server_t));
+    if(server == NULL)
+    {
+        return FAILURE;
+    }
+    memset(server, 0, sizeof(server_t));
+    server->socketName = socketName;
+    server->numWorkers = (numWorkers > 0) ? numWorkers : 1;
+    server->started = thread_now();
+    server->workers = (server_worker_t *) malloc(server->numWorkers * sizeof(server_worker_t));
+    server->catalog = catalog_alloc();
+    server->listener = server_open(socketName, TRUE);
+    if(server->workers == NULL || server->catalog == NULL || server->listener == SERVER_INVALID_SOCKET)
+    {
+        printError("ERROR: Could not listen on socket %s\n", socketName);
+        server_close(server->listener);
+        catalog_free(server->catalog);
+        free(server->workers);
+        free(server);
+        return FAILURE;
+    }
+    if(NUM_LIBRARY_FILES > 0 && catalog_reloadFiles(server->catalog, LIBRARY_FILES, NUM_LIBRARY_FILES) != SUCCESS)
+    {
+        result = FAILURE;
+    }
+
+    // the options are read by every worker, and not written once they start
+    STATS = FALSE;
+    VERBOSE = FALSE;
+    EMIT_LIBRARY_FILE = NULL;
+
+    // each worker expands with its own copy of the limits
+    memset(server->workers, 0, server->numWorkers * sizeof(server_worker_t));
+    for(i = 0; i < server->numWorkers && result == SUCCESS; i++)
+    {
+        worker = &server->workers[i];
+        worker->server = server;
+        worker->budget = budget_alloc();
+        if(worker->budget == NULL)
+        {
+            result = FAILURE;
+            break;
+        }
+        memcpy(worker->budget, budget, sizeof(budget_t));
+    }
+
+    runningServer = server;
+    signal(SIGINT, server_stop);
+    signal(SIGTERM, server_stop);
+
+    for(i = 0; i < server->numWorkers && result == SUCCESS; i++)
+    {
+        worker = &server->workers[i];
+        worker->started = (thread_start(&worker->thread, server_work, worker) == SUCCESS);
+        if(!worker->started)
+        {
+            printError("ERROR: Could not start the server threads\n");
+            result = FAILURE;
+        }
+    }
+    if(result != SUCCESS)
+    {
+        server_stop(0);
+    }
+
+    for(i = 0; i < server->numWorkers; i++)
+    {
+        worker = &server->workers[i];
+        if(worker->started)
+        {
+            thread_join(worker->thread);
+        }
+        budget_free(worker->budget);
+    }
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    runningServer = NULL;
+
+    if(printStats && result == SUCCESS)
+    {
+        server_getStats(server, text, sizeof(text));
+        fprintf((MESSAGE_FILE != NULL) ? MESSAGE_FILE : stdout, "\n%s", text);
+    }
+
+    // server_stop closed it on Windows, where closing is what wakes accept
+#ifndef _WIN32
+    server_close(server->listener);
+#endif
+    remove(socketName);
+    catalog_free(server->catalog);
+    free(server->workers);
+    free(server);
+
+    return result;
+}
+
+/**
+ * Function: server_request
+ * Description:
+ *  - Sends one request to a server, and waits for the response.
+ * Parameters:
+ *  - socketName: Path of the socket of the server.
+ *  - header: Request line, without the newline.
+ *  - body: Body of the request, or NULL.
+ *  - bodySize: Size of the body.
+ *  - response: Set to the body of the response (NUL terminated, to be freed),
+ *    or to NULL if there was none.
+ *  - responseSize: Set to the size of the response body.
+ * Returns:
+ *  - SUCCESS if the response is OK, otherwise FAILURE.
+ */
+int server_request(const char * socketName, const char * header, const char * body, size_t bodySize,
+    char ** response, size_t * responseSize)
+{
+    server_connection_t connection;
+    char status[SERVER_HEADER_SIZE];
+    char * size;
+    int result = FAILURE;
+
+    *response = NULL;
+    *responseSize = 0;
+
+    memset(&connection, 0, sizeof(connection));
+    connection.socket = server_open(socketName, FALSE);
+    if(connection.socket == SERVER_INVALID_SOCKET)
+    {
+        return FAILURE;
+    }
+
+    if(server_send(connection.socket, header, strlen(header)) == SUCCESS &&
+       server_send(connection.socket, "\n", 1) == SUCCESS &&
+       (body == NULL || server_send(connection.socket, body, bodySize) == SUCCESS) &&
+       server_readLine(&connection, status, sizeof(status)) == SUCCESS &&
+       (size = strchr(status, ' ')) != NULL)
+    {
+        *responseSize = (size_t) strtoul(size + 1, NULL, 10);
+        *response = server_readBody(&connection, *responseSize);
+        if(*response == NULL)
+        {
+            *responseSize = 0;
+        }
+        else if(strncmp("OK ", status, strlen("OK ")) == 0)
+        {
+            result = SUCCESS;
+        }
+    }
+
+    server_close(connection.socket);
+    return result;
+}
+
+/**
+ * Function: server_readAll
+ * Description:
+ *  - Reads a whole file, such as standard input, to send it inline.
+ * Parameters:
+ *  - file: File to read.
+ *  - size: Set to the number of bytes read.
+ * Returns:
+ *  - The bytes read (NUL terminated, to be freed), or NULL if the file is
+ *    larger than SERVER_MAX_BODY or out of memory.
+ */
+char * server_readAll(FILE * file, size_t * size)
+{
+    size_t capacity = SERVER_BUFFER_SIZE;
+    size_t count;
+    char * data = (char *) malloc(capacity + 1);
+    char * grown;
+
+    *size = 0;
+    while(data != NULL && (count = fread(data + *size, 1, capacity - *size, file)) > 0)
+    {
+        *size += count;
+        if(*size == capacity)
+        {
+            grown = (capacity < SERVER_MAX_BODY) ? (char *) realloc(data, 2 * capacity + 1) : NULL;
+            if(grown == NULL)
+            {
+                free(data);
+                return NULL;
+            }
+            data = grown;
+            capacity *= 2;
+        }
+    }
+
+    if(data != NULL)
+    {
+        data[*size] = '\0';
+    }
+    return data;
+}
+
+/**
+ * Function: server_work
+ * Description:
+ *  - Thread of a worker: accepts connections and serves their requests
+ *    until the server stops.
+ * Parameters:
+ *  - argument: The worker.
+ * Returns:
+ *  - THREAD_RETURN
+ */
+THREAD_RESULT server_work(void * argument)
+{
+    server_worker_t * worker = (server_worker_t *) argument;
+    server_t * server = worker->server;
+    server_connection_t * connection;
+
+    // the expansion context of this thread
+    budget = worker->budget;
+    QUIET = TRUE;
+
+    connection = (server_connection_t *) malloc(sizeof(server_connection_t));
+    while(connection != NULL && !THREAD_LOAD(&server->stopping))
+    {
+        memset(connection, 0, sizeof(server_connection_t));
+        connection->socket = accept(server->listener, NULL, NULL);
+        if(connection->socket == SERVER_INVALID_SOCKET)
+        {
+            // interrupted, or out of descriptors for a while
+            if(!THREAD_LOAD(&server->stopping))
+            {
+                thread_sleep(10);
+            }
+            continue;
+        }
+
+        server_serve(worker, connection);
+        server_close(connection->socket);
+    }
+
+    free(connection);
+    budget = NULL;
+
+    return THREAD_RETURN;
+}
+
+/**
+ * Function: server_serve
+ * Description:
+ *  - Serves the requests of a connection, until it is closed.
+ * Parameters:
+ *  - worker: Worker serving the connection.
+ *  - connection: The connection.
+ * Returns:
+ *  - none
+ */
+void server_serve(server_worker_t * worker, server_connection_t * connection)
+{
+    server_stats_t * stats = &worker->server->stats;
+    char line[SERVER_HEADER_SIZE];
+    char text[SERVER_HEADER_SIZE];
+    include_file_t * file;
+    stream_t * input;
+    stream_t * output;
+    char * body;
+    size_t size;
+    long long started;
+    int result;
+
+    while(server_readLine(connection, line, sizeof(line)) == SUCCESS)
+    {
+        started = thread_now();
+        memset(ERROR_MESSAGE, 0, sizeof(ERROR_MESSAGE));
+        input = NULL;
+        body = NULL;
+
+        if(strcmp("STATS", line) == 0)
+        {
+            server_getStats(worker->server, text, sizeof(text));
+            server_respond(connection->socket, "OK", text, strlen(text));
+            continue;
+        }
+        else if(strncmp("LIBRARY ", line, strlen("LIBRARY ")) == 0)
+        {
+            // requests being expanded keep the library they started with
+            if(catalog_reload(worker->server->catalog, line + strlen("LIBRARY ")) == SUCCESS)
+            {
+                sprintf_s(text, sizeof(text), "Library %.512s loaded, generation %ld\n",
+                    line + strlen("LIBRARY "), THREAD_LOAD(&worker->server->catalog->generation));
+                server_respond(connection->socket, "OK", text, strlen(text));
+            }
+            else
+            {
+                server_respond(connection->socket, "ERROR", ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+            }
+            continue;
+        }
+        else if(strncmp("EXPAND ", line, strlen("EXPAND ")) == 0 &&
+                (size = (size_t) strtoul(line + strlen("EXPAND "), NULL, 10)) <= SERVER_MAX_BODY)
+        {
+            body = server_readBody(connection, size);
+            if(body == NULL)
+            {
+                break;
+            }
+            input = stream_allocInput(body, size);
+        }
+        else if(strncmp("FILE ", line, strlen("FILE ")) == 0)
+        {
+            // kept tokenized like an included file, until it changes
+            file = include_load(include_getCache(), line + strlen("FILE "));
+            input = (file != NULL) ? stream_allocTokens(file->text, file->size, file->lines, file->numLines) : NULL;
+            if(input != NULL)
+            {
+                input->source = file;
+            }
+            else
+            {
+                include_release(file);
+            }
+            if(file == NULL)
+            {
+                printError("ERROR: Could not read input file %s\n", line + strlen("FILE "));
+            }
+        }
+        else
+        {
+            sprintf_s(text, sizeof(text), "ERROR: Unknown request %.64s\n", line);
+            server_respond(connection->socket, "ERROR", text, strlen(text));
+            break;
+        }
+
+        output = stream_allocOutput(NULL, 0);
+        result = (input != NULL && output != NULL) ? server_expand(worker, input, output) : FAILURE;
+        if(result == SUCCESS)
+        {
+            server_respond(connection->socket, "OK", output->output, output->outputSize);
+        }
+        else
+        {
+            if(ERROR_MESSAGE[0] == '\0')
+            {
+                printError("ERROR: Could not expand the input\n");
+            }
+            server_respond(connection->socket, "ERROR", ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+            THREAD_INCREMENT(&stats->failures);
+        }
+        stream_free(input);
+        stream_free(output);
+        free(body);
+
+        THREAD_INCREMENT(&stats->requests);
+        THREAD_INCREMENT(&stats->latency[server_getBucket(thread_now() - started)]);
+    }
+}
+
+/**
+ * Function: server_expand
+ * Description:
+ *  - Expands one input with the context of this thread and the library
+ *    current when it starts, and adds its cache counters to those of the
+ *    server.
+ * Parameters:
+ *  - worker: Worker expanding the input.
+ *  - input: Input stream.
+ *  - output: Memory output stream.
+ * Returns:
+ *  - SUCCESS or FAILURE
+ */
+int server_expand(server_worker_t * worker, stream_t * input, stream_t * output)
+{
+    server_stats_t * stats = &worker->server->stats;
+    catalog_snapshot_t * snapshot;
+    expcache_t * variants;
+    int result;
+    int i;
+
+    // DEFTAB refers to the mapped lines until processEnd frees it
+    snapshot = catalog_pin(worker->server->catalog);
+    library = snapshot->library;
+
+    result = processBegin(input, output);
+    while(result == SUCCESS)
+    {
+        result = processStep(input, output);
+    }
+
+    // the tables are freed by processEnd
+    if(expcache != NULL)
+    {
+        THREAD_ADD(&stats->expansionHits, expcache->hits);
+        THREAD_ADD(&stats->expansionMisses, expcache->misses);
+    }
+    for(i = 0; namtab != NULL && i < namtab->size; i++)
+    {
+        variants = namtab->array[i]->variants;
+        if(variants != NULL)
+        {
+            THREAD_ADD(&stats->variantHits, variants->hits);
+            THREAD_ADD(&stats->variantMisses, variants->misses);
+        }
+    }
+
+    result = processEnd(output, result);
+    library = NULL;
+    catalog_release(worker->server->catalog, snapshot);
+
+    return result;
+}
+
+/**
+ * Function: server_respond
+ * Description:
+ *  - Sends a response.
+ * Parameters:
+ *  - socket: Socket of the connection.
+ *  - status: "OK" or "ERROR".
+ *  - body: Body of the response.
+ *  - size: Size of the body.
+ * Returns:
+ *  - SUCCESS or FAILURE
+ */
+int server_respond(server_socket_t socket, const char * status, const char * body, size_t size)
+{
+    char header[SHORT_STRING_SIZE * 2];
+
+    sprintf_s(header, sizeof(header), "%s %u\n", status, (unsigned int) size);
+    if(server_send(socket, header, strlen(header)) != SUCCESS)
+    {
+        return FAILURE;
+    }
+
+    return server_send(socket, body, size);
+}
+
+/**
+ * Function: server_getStats
+ * Description:
+ *  - Describes the counters of the server.
+ * Parameters:
+ *  - server: The server.
+ *  - text: Buffer for the description.
+ *  - size: Size of the buffer.
+ * Returns:
+ *  - none
+ */
+void server_getStats(server_t * server, char * text, size_t size)
+{
+    server_stats_t * stats = &server->stats;
+    long expansions = THREAD_LOAD(&stats->expansionHits) + THREAD_LOAD(&stats->expansionMisses);
+    long variants = THREAD_LOAD(&stats->variantHits) + THREAD_LOAD(&stats->variantMisses);
+    include_cache_t * cache = (include_cache_t *) THREAD_LOAD_POINTER(&includeCache);
+    long includeHits = (cache != NULL) ? THREAD_LOAD(&cache->hits) : 0;
+    long includeMisses = (cache != NULL) ? THREAD_LOAD(&cache->misses) : 0;
+    long includes = includeHits + includeMisses;
+    catalog_t * catalog = server->catalog;
+
+    sprintf_s(text, size,
+        "Server statistics:\n"
+        "    Requests: %ld served, %ld failed, %d workers, up %lld s\n"
+        "    Latency: p50 %lld us, p90 %lld us, p99 %lld us\n"
+        "    Expansion cache: %ld hits, %ld misses (%ld%% hits)\n"
+        "    Specialized variants: %ld hits, %ld misses (%ld%% hits)\n"
+        "    Include cache: %ld hits, %ld misses (%ld%% hits)\n"
+        "    Library: generation %ld, %ld pinned, %ld reclaimed\n"
+        "    Memory: %ld KB peak resident\n",
+        THREAD_LOAD(&stats->requests), THREAD_LOAD(&stats->failures), server->numWorkers,
+        (thread_now() - server->started) / 1000000,
+        server_getPercentile(stats, 50), server_getPercentile(stats, 90), server_getPercentile(stats, 99),
+        THREAD_LOAD(&stats->expansionHits), THREAD_LOAD(&stats->expansionMisses),
+        (expansions > 0) ? 100 * THREAD_LOAD(&stats->expansionHits) / expansions : 0,
+        THREAD_LOAD(&stats->variantHits), THREAD_LOAD(&stats->variantMisses),
+        (variants > 0) ? 100 * THREAD_LOAD(&stats->variantHits) / variants : 0,
+        includeHits, includeMisses, (includes > 0) ? 100 * includeHits / includes : 0,
+        THREAD_LOAD(&catalog->generation), THREAD_LOAD(&catalog->pinned), THREAD_LOAD(&catalog->reclaimed),
+        server_getMemory());
+}
+
+/**
+ * Function: server_getPercentile
+ * Description:
+ *  - Latency that a share of the requests took at most, to within a bucket
+ *    of the histogram (a quarter of a power of two).
+ * Parameters:
+ *  - stats: Counters of the server.
+ *  - percent: Share of the requests, 1 to 100.
+ * Returns:
+ *  - Latency in microseconds, 0 if no request was served.
+ */
+long long server_getPercentile(server_stats_t * stats, int percent)
+{
+    long long total = 0;
+    long long count = 0;
+    long long wanted;
+    int i;
+
+    for(i = 0; i < SERVER_LATENCY_BUCKETS; i++)
+    {
+        total += THREAD_LOAD(&stats->latency[i]);
+    }
+
+    wanted = (total * percent + 99) / 100;
+    for(i = 0; total > 0 && i < SERVER_LATENCY_BUCKETS; i++)
+    {
+        count += THREAD_LOAD(&stats->latency[i]);
+        if(count >= wanted)
+        {
+            return server_getBucketLimit(i);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Function: server_getBucket
+ * Description:
+ *  - Bucket of the latency histogram: 0 to 3 microseconds have a bucket
+ *    each, then each power of two is split into 4 buckets.
+ * Parameters:
+ *  - microseconds: Latency of a request.
+ * Returns:
+ *  - Index of the bucket.
+ */
+int server_getBucket(long long microseconds)
+{
+    int octave = 0;
+    int index;
+
+    if(microseconds < 4)
+    {
+        return (microseconds > 0) ? (int) microseconds : 0;
+    }
+
+    // the top 3 bits of the latency, 4 to 7
+    while((microseconds >> octave) >= 8)
+    {
+        octave++;
+    }
+    index = 4 * (octave + 1) + (int) ((microseconds >> octave) - 4);
+
+    return (index < SERVER_LATENCY_BUCKETS) ? index : SERVER_LATENCY_BUCKETS - 1;
+}
+
+/**
+ * Function: server_getBucketLimit
+ * Description:
+ *  - Latency above those of a bucket of the histogram.
+ * Parameters:
+ *  - index: Index of the bucket.
+ * Returns:
+ *  - Latency in microseconds.
+ */
+long long server_getBucketLimit(int index)
+{
+    if(index < 4)
+    {
+        return index + 1;
+    }
+
+    return (long long) (4 + index % 4 + 1) << (index / 4 - 1);
+}
+
+/**
+ * Function: server_getMemory
+ * Description:
+ *  - Measures the most memory the process has had resident.
+ * Parameters:
+ *  - none
+ * Returns:
+ *  - Kilobytes, or 0 if unknown.
+ */
+long server_getMemory(void)
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+
+    if(GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    {
+        return (long) (counters.PeakWorkingSetSize / 1024);
+    }
+#else
+    struct rusage usage;
+
+    if(getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+        return (long) usage.ru_maxrss;
+    }
+#endif
+
+    return 0;
+}
+
+/**
+ * Function: server_stop
+ * Description:
+ *  - Stops the server: workers accept no more connections, and end once
+ *    their connections are closed. Called on SIGINT and SIGTERM.
+ * Parameters:
+ *  - signalNumber: The signal, 0 if none.
+ * Returns:
+ *  - none
+ */
+void server_stop(int signalNumber)
+{
+    (void) signalNumber;
+
+    if(runningServer != NULL)
+    {
+        THREAD_STORE(&runningServer->stopping, TRUE);
+
+        // wakes up the workers waiting in accept
+#ifdef _WIN32
+        closesocket(runningServer->listener);
+#else
+        shutdown(runningServer->listener, SHUT_RDWR);
+#endif
+    }
+}
+
+/**
+ * Function: server_open
+ * Description:
+ *  - Opens a local socket: listens on it for the server, or connects to it
+ *    for a client.
+ * Parameters:
+ *  - socketName: Path of the socket.
+ *  - listening: TRUE for the server, FALSE for a client.
+ * Returns:
+ *  - The socket, or SERVER_INVALID_SOCKET on failure.
+ */
+server_socket_t server_open(const char * socketName, int listening)
+{
+    struct sockaddr_un address;
+    server_socket_t result;
+#ifdef _WIN32
+    WSADATA data;
+
+    if(WSAStartup(MAKEWORD(2, 2), &data) != 0)
+    {
+        return SERVER_INVALID_SOCKET;
+    }
+#else
+    // a client that goes away must not end the server
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(strlen(socketName) >= sizeof(address.sun_path))
+    {
+        return SERVER_INVALID_SOCKET;
+    }
+    strcpy_s(address.sun_path, sizeof(address.sun_path), socketName);
+
+    result = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(result == SERVER_INVALID_SOCKET)
+    {
+        return SERVER_INVALID_SOCKET;
+    }
+
+    if(listening)
+    {
+        remove(socketName);
+        if(bind(result, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(result, SOMAXCONN) != 0)
+        {
+            server_close(result);
+            return SERVER_INVALID_SOCKET;
+        }
+    }
+    else if(connect(result, (struct sockaddr *) &address, sizeof(address)) != 0)
+    {
+        server_close(result);
+        return SERVER_INVALID_SOCKET;
+    }
+
+    return result;
+}
+
+/**
+ * Function: server_close
+ * Description:
+ *  - Closes a socket.
+ * Parameters:
+ *  - socket: The socket, may be SERVER_INVALID_SOCKET.
+ * Returns:
+ *  - none
+ */
+void server_close(server_socket_t socket)
+{
+    if(socket != SERVER_INVALID_SOCKET)
+    {
+#ifdef _WIN32
+        closesocket(socket);
+#else
+        close(socket);
+#endif
+    }
+}
+
+/**
+ * Function: server_readLine
+ * Description:
+ *  - Reads a request or response line.
+ * Parameters:
+ *  - connection: The connection.
+ *  - line: Buffer for the line, without the newline.
+ *  - size: Size of the buffer.
+ * Returns:
+ *  - SUCCESS, or FAILURE if the connection was closed or the line is too long.
+ */
+int server_readLine(server_connection_t * connection, char * line, size_t size)
+{
+    size_t length = 0;
+    int count;
+
+    for(;;)
+    {
+        while(connection->start < connection->end)
+        {
+            line[length] = connection->buffer[connection->start++];
+            if(line[length] == '\n')
+            {
+                line[length] = '\0';
+                return SUCCESS;
+            }
+            if(++length == size)
+            {
+                return FAILURE;
+            }
+        }
+
+        count = recv(connection->socket, connection->buffer, sizeof(connection->buffer), 0);
+        if(count <= 0)
+        {
+            return FAILURE;
+        }
+        connection->start = 0;
+        connection->end = (size_t) count;
+    }
+}
+
+/**
+ * Function: server_readBody
+ * Description:
+ *  - Reads the body of a request or response.
+ * Parameters:
+ *  - connection: The connection.
+ *  - size: Size of the body.
+ * Returns:
+ *  - The body (NUL terminated, to be freed), or NULL if the connection was
+ *    closed first or out of memory.
+ */
+char * server_readBody(server_connection_t * connection, size_t size)
+{
+    char * body = (char *) malloc(size + 1);
+    size_t length = 0;
+    size_t buffered;
+    int count;
+
+    while(body != NULL && length < size)
+    {
+        // what came with the header line first
+        buffered = connection->end - connection->start;
+        if(buffered > 0)
+        {
+            if(buffered > size - length)
+            {
+                buffered = size - length;
+            }
+            memcpy(body + length, connection->buffer + connection->start, buffered);
+            connection->start += buffered;
+            length += buffered;
+            continue;
+        }
+
+        count = recv(connection->socket, body + length, (int) (size - length), 0);
+        if(count <= 0)
+        {
+            free(body);
+            return NULL;
+        }
+        length += (size_t) count;
+    }
+
+    if(body != NULL)
+    {
+        body[size] = '\0';
+    }
+    return body;
+}
+
+/**
+ * Function: server_send
+ * Description:
+ *  - Sends bytes, all of them.
+ * Parameters:
+ *  - socket: Socket of the connection.
+ *  - data: Bytes to send.
+ *  - size: Number of bytes.
+ * Returns:
+ *  - SUCCESS, or FAILURE if the connection was closed.
+ */
+int server_send(server_socket_t socket, const char * data, size_t size)
+{
+    int count;
+
+    while(size > 0)
+    {
+        count = send(socket, data, (int) ((size < SERVER_MAX_BODY) ? size : SERVER_MAX_BODY), 0);
+        if(count <= 0)
+        {
+            return FAILURE;
+        }
+        data += count;
+        size -= (size_t) count;
+    }
+
+    return SUCCESS;
+}
@@ -0,0 +1,78 @@
+/*
+ * server.h - Contains functions and definitions for the expansion server
+ * (--serve) and its client (--connect), which talk over a local socket.
+ */
+
+#ifndef SERVER_H_
+#define SERVER_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "thread.h"
+#include "budget.h"
+#include "catalog.h"
+
+#define SERVER_HEADER_SIZE      (1024)              // longest request or response line
+#define SERVER_MAX_BODY         (64 * 1024 * 1024)  // largest input sent inline
+#define SERVER_BUFFER_SIZE      (4096)
+#define SERVER_LATENCY_BUCKETS  (128)               // 4 per power of two microseconds
+
+#ifdef _WIN32
+typedef uintptr_t   server_socket_t;    // SOCKET
+#else
+typedef int         server_socket_t;
+#endif
+
+// Bytes received on a connection and not consumed yet
+typedef struct
+{
+    server_socket_t socket;
+    char            buffer[SERVER_BUFFER_SIZE];
+    size_t          start;
+    size_t          end;
+} server_connection_t;
+
+// Counters of all the workers, updated with THREAD_ADD. The include cache is
+// shared by the workers and keeps its own.
+typedef struct
+{
+    volatile long   requests;
+    volatile long   failures;
+    volatile long   expansionHits;
+    volatile long   expansionMisses;
+    volatile long   variantHits;
+    volatile long   variantMisses;
+    volatile long   latency[SERVER_LATENCY_BUCKETS];    // requests by time taken
+} server_stats_t;
+
+struct server_s;
+
+// Thread of the pool, with its own expansion context. The engine tables are
+// THREAD_LOCAL, so the workers expand at the same time.
+typedef struct
+{
+    struct server_s *   server;
+    thread_t            thread;
+    budget_t *          budget;     // limits of the command line
+    int                 started;
+} server_worker_t;
+
+typedef struct server_s
+{
+    const char *        socketName;
+    server_socket_t     listener;
+    server_worker_t *   workers;
+    int                 numWorkers;
+    catalog_t *         catalog;    // library shared by the workers
+    server_stats_t      stats;
+    long long           started;    // thread_now() when the server started
+    volatile long       stopping;
+} server_t;
+
+int     server_run(const char * socketName, int numWorkers);
+int     server_request(const char * socketName, const char * header, const char * body, size_t bodySize,
+            char ** response, size_t * responseSize);
+char *  server_readAll(FILE * file, size_t * size);
+void    server_stop(int signalNumber);
+
+#endif /* SERVER_H_ */
@@ -0,0 +1,195 @@
+/*
+ * sha256.c - Contains functions for SHA-256 hashing (FIPS 180-4).
+ */
+
+#include <string.h>
+#include "sha256.h"
+
+#define SHA256_ROTATE(x, n)     (((x) >> (n)) | ((x) << (32 - (n))))
+
+static const unsigned int sha256_constants[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+// local function definitions
+void sha256_transform(sha256_t * context, const unsigned char * block);
+
+/**
+ * Function: sha256_init
+ * Description:
+ *  - Starts a new hash.
+ * Parameters:
+ *  - context: Pointer to the hash.
+ * Returns:
+ *  - none
+ */
+void sha256_init(sha256_t * context)
+{
+    context->state[0] = 0x6a09e667;
+    context->state[1] = 0xbb67ae85;
+    context->state[2] = 0x3c6ef372;
+    context->state[3] = 0xa54ff53a;
+    context->state[4] = 0x510e527f;
+    context->state[5] = 0x9b05688c;
+    context->state[6] = 0x1f83d9ab;
+    context->state[7] = 0x5be0cd19;
+    context->blockSize = 0;
+    context->length = 0;
+}
+
+/**
+ * Function: sha256_update
+ * Description:
+ *  - Adds bytes to a hash.
+ * Parameters:
+ *  - context: Pointer to the hash.
+ *  - data: Bytes to add.
+ *  - size: Number of bytes.
+ * Returns:
+ *  - none
+ */
+void sha256_update(sha256_t * context, const void * data, size_t size)
+{
+    const unsigned char * bytes = (const unsigned char *) data;
+    size_t count;
+
+    context->length += size;
+    while(size > 0)
+    {
+        // whole blocks are hashed in place
+        if(context->blockSize == 0 && size >= SHA256_BLOCK_SIZE)
+        {
+            sha256_transform(context, bytes);
+            bytes += SHA256_BLOCK_SIZE;
+            size -= SHA256_BLOCK_SIZE;
+            continue;
+        }
+
+        count = SHA256_BLOCK_SIZE - context->blockSize;
+        if(count > size)
+        {
+            count = size;
+        }
+        memcpy(context->block + context->blockSize, bytes, count);
+        context->blockSize += count;
+        bytes += count;
+        size -= count;
+
+        if(context->blockSize == SHA256_BLOCK_SIZE)
+        {
+            sha256_transform(context, context->block);
+            context->blockSize = 0;
+        }
+    }
+}
+
+/**
+ * Function: sha256_final
+ * Description:
+ *  - Pads the bytes added to a hash and returns the digest.
+ * Parameters:
+ *  - context: Pointer to the hash.
+ *  - digest: Buffer for the SHA256_DIGEST_SIZE bytes of the digest.
+ * Returns:
+ *  - none
+ */
+void sha256_final(sha256_t * context, unsigned char digest[SHA256_DIGEST_SIZE])
+{
+    unsigned long long bits = context->length * 8;
+    int i;
+
+    // a 1 bit, zeros up to the last 8 bytes of a block, and the length in bits
+    context->block[context->blockSize++] = 0x80;
+    if(context->blockSize > SHA256_BLOCK_SIZE - 8)
+    {
+        memset(context->block + context->blockSize, 0, SHA256_BLOCK_SIZE - context->blockSize);
+        sha256_transform(context, context->block);
+        context->blockSize = 0;
+    }
+    memset(context->block + context->blockSize, 0, SHA256_BLOCK_SIZE - 8 - context->blockSize);
+    for(i = 0; i < 8; i++)
+    {
+        context->block[SHA256_BLOCK_SIZE - 1 - i] = (unsigned char)(bits >> (8 * i));
+    }
+    sha256_transform(context, context->block);
+
+    for(i = 0; i < 8; i++)
+    {
+        digest[4 * i] = (unsigned char)(context->state[i] >> 24);
+        digest[4 * i + 1] = (unsigned char)(context->state[i] >> 16);
+        digest[4 * i + 2] = (unsigned char)(context->state[i] >> 8);
+        digest[4 * i + 3] = (unsigned char)(context->state[i]);
+    }
+}
+
+/**
+ * Function: sha256_transform
+ * Description:
+ *  - Hashes one block into the state.
+ * Parameters:
+ *  - context: Pointer to the hash.
+ *  - block: SHA256_BLOCK_SIZE bytes.
+ * Returns:
+ *  - none
+ */
+void sha256_transform(sha256_t * context, const unsigned char * block)
+{
+    unsigned int w[64];
+    unsigned int a, b, c, d, e, f, g, h;
+    unsigned int s0, s1, t1, t2;
+    int i;
+
+    for(i = 0; i < 16; i++)
+    {
+        w[i] = ((unsigned int) block[4 * i] << 24) | ((unsigned int) block[4 * i + 1] << 16) |
+            ((unsigned int) block[4 * i + 2] << 8) | (unsigned int) block[4 * i + 3];
+    }
+    for(i = 16; i < 64; i++)
+    {
+        s0 = SHA256_ROTATE(w[i - 15], 7) ^ SHA256_ROTATE(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        s1 = SHA256_ROTATE(w[i - 2], 17) ^ SHA256_ROTATE(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = context->state[0];
+    b = context->state[1];
+    c = context->state[2];
+    d = context->state[3];
+    e = context->state[4];
+    f = context->state[5];
+    g = context->state[6];
+    h = context->state[7];
+
+    for(i = 0; i < 64; i++)
+    {
+        s1 = SHA256_ROTATE(e, 6) ^ SHA256_ROTATE(e, 11) ^ SHA256_ROTATE(e, 25);
+        t1 = h + s1 + ((e & f) ^ (~e & g)) + sha256_constants[i] + w[i];
+        s0 = SHA256_ROTATE(a, 2) ^ SHA256_ROTATE(a, 13) ^ SHA256_ROTATE(a, 22);
+        t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    context->state[0] += a;
+    context->state[1] += b;
+    context->state[2] += c;
+    context->state[3] += d;
+    context->state[4] += e;
+    context->state[5] += f;
+    context->state[6] += g;
+    context->state[7] += h;
+}
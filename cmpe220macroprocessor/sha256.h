@@ -0,0 +1,25 @@
+/*
+ * sha256.h - Contains functions and definitions for SHA-256 hashing.
+ */
+
+#ifndef SHA256_H_
+#define SHA256_H_
+
+#include <stddef.h>
+
+#define SHA256_DIGEST_SIZE  (32)
+#define SHA256_BLOCK_SIZE   (64)
+
+typedef struct
+{
+    unsigned int        state[8];
+    unsigned char       block[SHA256_BLOCK_SIZE];   // bytes not hashed yet
+    size_t              blockSize;
+    unsigned long long  length;                     // bytes hashed so far
+} sha256_t;
+
+void    sha256_init(sha256_t * context);
+void    sha256_update(sha256_t * context, const void * data, size_t size);
+void    sha256_final(sha256_t * context, unsigned char digest[SHA256_DIGEST_SIZE]);
+
+#endif /* SHA256_H_ */
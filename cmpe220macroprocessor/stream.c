@@ -0,0 +1,613 @@
+/*
+ * stream.c - Contains functions for input and output streams.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "definitions.h"
+#include "stream.h"
+#include "pipeline.h"
+#include "linetab.h"
+#include "asmpass.h"
+#include "tokout.h"
+#include "peephole.h"
+#include "include.h"
+
+// local function definitions
+int stream_write(stream_t * stream, const char * text);
+void stream_passLines(stream_t * stream, const char * text);
+void stream_passLine(stream_t * stream, const char * newline);
+
+/**
+ * Function: stream_allocFile
+ * Description:
+ *  - Allocates a stream reading or writing an open file. The file is not
+ *    closed by stream_free.
+ * Parameters:
+ *  - file: Open file.
+ * Returns:
+ *  - If successful, returns pointer to new stream. Otherwise, returns NULL.
+ */
+stream_t * stream_allocFile(FILE * file)
+{
+    stream_t * stream;
+
+    if(file == NULL)
+    {
+        return NULL;
+    }
+
+    stream = (stream_t *) malloc(sizeof(stream_t));
+    if(stream)
+    {
+        memset(stream, 0, sizeof(stream_t));
+        stream->file = file;
+    }
+
+    return stream;
+}
+
+/**
+ * Function: stream_allocInput
+ * Description:
+ *  - Allocates a stream reading lines from memory. The data is not copied,
+ *    and must stay valid until the stream is freed.
+ * Parameters:
+ *  - data: Input text.
+ *  - size: Size of the input text, in bytes.
+ * Returns:
+ *  - If successful, returns pointer to new stream. Otherwise, returns NULL.
+ */
+stream_t * stream_allocInput(const char * data, size_t size)
+{
+    stream_t * stream;
+
+    if(data == NULL && size > 0)
+    {
+        return NULL;
+    }
+
+    stream = (stream_t *) malloc(sizeof(stream_t));
+    if(stream)
+    {
+        memset(stream, 0, sizeof(stream_t));
+        stream->input = data;
+        stream->inputSize = size;
+    }
+
+    return stream;
+}
+
+/**
+ * Function: stream_allocOutput
+ * Description:
+ *  - Allocates a stream writing to memory. With a caller buffer, output that
+ *    does not fit is dropped and the stream fails, but outputSize still
+ *    counts the bytes needed. Without one, the stream owns a buffer that
+ *    grows as needed.
+ * Parameters:
+ *  - buffer: Caller buffer, or NULL for a growable buffer.
+ *  - capacity: Size of the caller buffer, in bytes.
+ * Returns:
+ *  - If successful, returns pointer to new stream. Otherwise, returns NULL.
+ */
+stream_t * stream_allocOutput(char * buffer, size_t capacity)
+{
+    stream_t * stream = (stream_t *) malloc(sizeof(stream_t));
+
+    if(stream)
+    {
+        memset(stream, 0, sizeof(stream_t));
+        if(buffer != NULL)
+        {
+            stream->output = buffer;
+            stream->outputCapacity = capacity;
+        }
+        else
+        {
+            // start with room for a few lines
+            stream->isGrowable = TRUE;
+            stream->outputCapacity = 4 * CURRENT_LINE_SIZE;
+            stream->output = (char *) malloc(stream->outputCapacity);
+            if(stream->output == NULL)
+            {
+                free(stream);
+                return NULL;
+            }
+        }
+
+        if(stream->outputCapacity > 0)
+        {
+            stream->output[0] = '\0';
+        }
+    }
+
+    return stream;
+}
+
+/**
+ * Function: stream_allocPipeline
+ * Description:
+ *  - Allocates a stream reading the input file, or writing the output file, of
+ *    a pipeline. The pipeline is not finished by stream_free.
+ * Parameters:
+ *  - pipeline: Started pipeline.
+ * Returns:
+ *  - If successful, returns pointer to new stream. Otherwise, returns NULL.
+ */
+stream_t * stream_allocPipeline(struct pipeline_s * pipeline)
+{
+    stream_t * stream;
+
+    if(pipeline == NULL)
+    {
+        return NULL;
+    }
+
+    stream = (stream_t *) malloc(sizeof(stream_t));
+    if(stream)
+    {
+        memset(stream, 0, sizeof(stream_t));
+        stream->pipeline = pipeline;
+    }
+
+    return stream;
+}
+
+/**
+ * Function: stream_allocLines
+ * Description:
+ *  - Allocates a stream reading the lines of a line table, with their tokens.
+ *    The line table is not closed by stream_free.
+ * Parameters:
+ *  - lines: Open line table.
+ * Returns:
+ *  - If successful, returns pointer to new stream. Otherwise, returns NULL.
+ */
+stream_t * stream_allocLines(struct linetab_s * lines)
+{
+    stream_t * stream;
+
+    if(lines == NULL)
+    {
+        return NULL;
+    }
+
+    stream = (stream_t *) malloc(sizeof(stream_t));
+    if(stream)
+    {
+        memset(stream, 0, sizeof(stream_t));
+        stream->lines = lines;
+    }
+
+    return stream;
+}
+
+/**
+ * Function: stream_allocTokens
+ * Description:
+ *  - Allocates a stream reading lines from memory, with their tokens. The
+ *    data and tokens are not copied, and must stay valid until the stream is
+ *    freed.
+ * Parameters:
+ *  - data: Input text.
+ *  - size: Size of the input text, in bytes.
+ *  - tokens: Tokens of each line, as stream_gets splits the text.
+ *  - numTokens: Number of lines.
+ * Returns:
+ *  - If successful, returns pointer to new stream. Otherwise, returns NULL.
+ */
+stream_t * stream_allocTokens(const char * data, size_t size, const struct linetab_entry_s * tokens, int numTokens)
+{
+    stream_t * stream = stream_allocInput(data, size);
+
+    if(stream)
+    {
+        stream->inputTokens = tokens;
+        stream->numInputTokens = numTokens;
+    }
+
+    return stream;
+}
+
+/**
+ * Function: stream_free
+ * Description:
+ *  - De-allocates the memory associated with the stream, including a growable
+ *    output buffer that was not released, and the included file being read.
+ *    The cached file the input was read from is released.
+ * Parameters:
+ *  - stream: Pointer to the stream.
+ * Returns:
+ *  - none
+ */
+void stream_free(stream_t * stream)
+{
+    if(stream)
+    {
+        if(stream->isGrowable)
+        {
+            free(stream->output);
+        }
+        stream_free(stream->include);
+        include_release(stream->source);
+        free(stream->line);
+        free(stream);
+    }
+}
+
+/**
+ * Function: stream_gets
+ * Description:
+ *  - Reads the next line, with its newline, as fgets does. The lines of an
+ *    included file come first, and do not count as lines of the stream.
+ * Parameters:
+ *  - stream: Pointer to the stream.
+ *  - buffer: Buffer for the line.
+ *  - size: Size of the buffer. Longer lines are read in pieces.
+ * Returns:
+ *  - buffer, or NULL at the end of the input.
+ */
+char * stream_gets(stream_t * stream, char * buffer, int size)
+{
+    const char * start;
+    const char * newline;
+    size_t length;
+
+    if(stream == NULL || buffer == NULL || size <= 1)
+    {
+        return NULL;
+    }
+
+    // an included file ends where the INCLUDE line was
+    while(stream->include != NULL)
+    {
+        if(stream_gets(stream->include, buffer, size) != NULL)
+        {
+            stream->tokens = stream->include->tokens;
+            return buffer;
+        }
+        stream_free(stream->include);
+        stream->include = NULL;
+    }
+    stream->tokens = NULL;
+
+    if(stream->lines != NULL)
+    {
+        stream->tokens = linetab_next(stream->lines);
+        if(stream->tokens == NULL)
+        {
+            return NULL;
+        }
+        linetab_copyLine(stream->lines, stream->tokens, buffer, size);
+        stream->lineNumber++;
+        return buffer;
+    }
+
+    if(stream->file != NULL || stream->pipeline != NULL)
+    {
+        if(stream->file != NULL && fgets(buffer, size, stream->file) == NULL)
+        {
+            return NULL;
+        }
+        if(stream->pipeline != NULL && pipeline_gets(stream->pipeline, buffer, size) == NULL)
+        {
+            return NULL;
+        }
+        stream->lineNumber++;
+        return buffer;
+    }
+
+    if(stream->inputPos >= stream->inputSize)
+    {
+        return NULL;
+    }
+
+    // copy up to and including the newline, or what fits
+    start = stream->input + stream->inputPos;
+    length = stream->inputSize - stream->inputPos;
+    newline = (const char *) memchr(start, '\n', length);
+    if(newline != NULL)
+    {
+        length = newline - start + 1;
+    }
+    if(length > (size_t)(size - 1))
+    {
+        length = size - 1;
+    }
+
+    memcpy(buffer, start, length);
+    buffer[length] = '\0';
+    stream->inputPos += length;
+    if(stream->lineNumber < stream->numInputTokens)
+    {
+        stream->tokens = &stream->inputTokens[stream->lineNumber];
+    }
+    stream->lineNumber++;
+    return buffer;
+}
+
+/**
+ * Function: stream_puts
+ * Description:
+ *  - Writes text to the stream, without adding a newline.
+ * Parameters:
+ *  - stream: Pointer to the stream.
+ *  - text: Text to write.
+ * Returns:
+ *  - SUCCESS, or FAILURE if the text could not be written.
+ */
+int stream_puts(stream_t * stream, const char * text)
+{
+    if(stream == NULL || text == NULL)
+    {
+        return FAILURE;
+    }
+
+    // the passes see each line as it is written, wherever it came from
+    if(stream->asmpass != NULL || stream->tokout != NULL || stream->peephole != NULL)
+    {
+        stream_passLines(stream, text);
+    }
+
+    // the peephole pass writes the lines it keeps, with stream_putLine
+    if(stream->peephole != NULL)
+    {
+        return stream->failed ? FAILURE : SUCCESS;
+    }
+    return stream_write(stream, text);
+}
+
+/**
+ * Function: stream_putLine
+ * Description:
+ *  - Writes a line kept by the peephole pass, and hands it to the passes
+ *    after it.
+ * Parameters:
+ *  - stream: Pointer to the stream.
+ *  - line: The line, without its newline.
+ *  - length: Length of the line.
+ *  - newline: Newline to write after it.
+ *  - origin: Its origin in the tokenized output.
+ * Returns:
+ *  - SUCCESS, or FAILURE if the line could not be written.
+ */
+int stream_putLine(stream_t * stream, const char * line, size_t length, const char * newline, unsigned int origin)
+{
+    if(stream == NULL || line == NULL)
+    {
+        return FAILURE;
+    }
+
+    if(stream->tokout != NULL)
+    {
+        tokout_line(stream->tokout, line, length, origin);
+    }
+    if(stream->asmpass != NULL)
+    {
+        asmpass_line(stream->asmpass, line);
+    }
+    if(stream_write(stream, line) != SUCCESS)
+    {
+        return FAILURE;
+    }
+    return stream_write(stream, newline);
+}
+
+/**
+ * Function: stream_write
+ * Description:
+ *  - Writes text to the file, pipeline or memory of the stream.
+ * Parameters:
+ *  - stream: Pointer to the stream.
+ *  - text: Text to write.
+ * Returns:
+ *  - SUCCESS, or FAILURE if the text could not be written.
+ */
+int stream_write(stream_t * stream, const char * text)
+{
+    size_t length;
+    size_t capacity;
+    char * tmpOutput;
+
+    if(stream->file != NULL)
+    {
+        if(fputs(text, stream->file) < 0)
+        {
+            stream->failed = TRUE;
+            return FAILURE;
+        }
+        return SUCCESS;
+    }
+
+    if(stream->pipeline != NULL)
+    {
+        if(pipeline_puts(stream->pipeline, text) != SUCCESS)
+        {
+            stream->failed = TRUE;
+            return FAILURE;
+        }
+        return SUCCESS;
+    }
+
+    // grow the buffer, at least doubling it, keeping room for the NUL
+    length = strlen(text);
+    if(stream->outputSize + length + 1 > stream->outputCapacity && stream->isGrowable && !stream->failed)
+    {
+        capacity = (2 * stream->outputCapacity > stream->outputSize + length + 1) ?
+            2 * stream->outputCapacity : stream->outputSize + length + 1;
+        tmpOutput = (char *) realloc(stream->output, capacity);
+        if(tmpOutput == NULL)
+        {
+            stream->failed = TRUE;
+            return FAILURE;
+        }
+        stream->output = tmpOutput;
+        stream->outputCapacity = capacity;
+    }
+
+    if(stream->failed || stream->outputSize + length + 1 > stream->outputCapacity)
+    {
+        // keep counting, so the caller learns the size needed
+        stream->outputSize += length;
+        stream->failed = TRUE;
+        return FAILURE;
+    }
+
+    memcpy(stream->output + stream->outputSize, text, length + 1);
+    stream->outputSize += length;
+    return SUCCESS;
+}
+
+/**
+ * Function: stream_release
+ * Description:
+ *  - Hands the growable output buffer over to the caller, who frees it.
+ * Parameters:
+ *  - stream: Pointer to the stream.
+ * Returns:
+ *  - The output buffer, or NULL if the stream has no growable buffer.
+ */
+char * stream_release(stream_t * stream)
+{
+    char * result = NULL;
+
+    if(stream != NULL && stream->isGrowable)
+    {
+        result = stream->output;
+        stream->output = NULL;
+        stream->outputCapacity = 0;
+        stream->isGrowable = FALSE;
+    }
+
+    return result;
+}
+
+/**
+ * Function: stream_endLine
+ * Description:
+ *  - Hands a last output line without a newline to the passes of the
+ *    stream, and has the peephole pass write the lines it holds, when the
+ *    output is complete.
+ * Parameters:
+ *  - stream: Pointer to the stream.
+ * Returns:
+ *  - none
+ */
+void stream_endLine(stream_t * stream)
+{
+    if(stream == NULL)
+    {
+        return;
+    }
+
+    if(stream->lineSize > 0)
+    {
+        stream_passLine(stream, "");
+    }
+    if(stream->peephole != NULL)
+    {
+        peephole_flush(stream->peephole);
+    }
+}
+
+/**
+ * Function: stream_passLines
+ * Description:
+ *  - Collects the text written to the stream into lines for its passes
+ *    (--peephole, --symtab, --tokens). A line may be written in several pieces, and is
+ *    handed over when its newline comes.
+ * Parameters:
+ *  - stream: Pointer to the stream.
+ *  - text: Text written to the stream.
+ * Returns:
+ *  - none
+ */
+void stream_passLines(stream_t * stream, const char * text)
+{
+    const char * end;
+    size_t length;
+    size_t capacity;
+    char * tmp;
+
+    while(*text != '\0')
+    {
+        end = strchr(text, '\n');
+        length = (end != NULL) ? (size_t) (end - text) : strlen(text);
+
+        if(stream->lineSize + length + 1 > stream->lineCapacity)
+        {
+            capacity = (stream->lineCapacity > 0) ? stream->lineCapacity * 2 : CURRENT_LINE_SIZE;
+            while(capacity < stream->lineSize + length + 1)
+            {
+                capacity *= 2;
+            }
+            tmp = (char *) realloc(stream->line, capacity);
+            if(tmp == NULL)
+            {
+                stream->failed = TRUE;
+                return;
+            }
+            stream->line = tmp;
+            stream->lineCapacity = capacity;
+        }
+        memcpy(stream->line + stream->lineSize, text, length);
+        stream->lineSize += length;
+        stream->line[stream->lineSize] = '\0';
+
+        if(end == NULL)
+        {
+            return;
+        }
+        stream_passLine(stream, "\n");
+        text = end + 1;
+    }
+}
+
+/**
+ * Function: stream_passLine
+ * Description:
+ *  - Hands the collected line, without its newline, to the passes. The
+ *    peephole pass comes first, and hands on the lines it keeps.
+ * Parameters:
+ *  - stream: Pointer to the stream.
+ *  - newline: Newline the line ended with, "" for none.
+ * Returns:
+ *  - none
+ */
+void stream_passLine(stream_t * stream, const char * newline)
+{
+    unsigned int origin;
+
+    if(stream->line == NULL)
+    {
+        return;
+    }
+    if(stream->lineSize > 0 && stream->line[stream->lineSize - 1] == '\r')
+    {
+        stream->line[--stream->lineSize] = '\0';
+        newline = (*newline != '\0') ? "\r\n" : "\r";
+    }
+
+    // the origin is the one the line was written from, not the one it is
+    // written to the tokenized output with
+    origin = tokout_mark(stream->tokout);
+    if(stream->peephole != NULL)
+    {
+        peephole_line(stream->peephole, stream->line, stream->lineSize, newline, origin);
+    }
+    else
+    {
+        if(stream->tokout != NULL)
+        {
+            tokout_line(stream->tokout, stream->line, stream->lineSize, origin);
+        }
+        if(stream->asmpass != NULL)
+        {
+            asmpass_line(stream->asmpass, stream->line);
+        }
+    }
+    stream->lineSize = 0;
+    stream->line[0] = '\0';
+}
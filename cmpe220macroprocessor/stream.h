@@ -0,0 +1,57 @@
+/*
+ * stream.h - Contains functions and definitions for input and output streams.
+ */
+
+#ifndef STREAM_H_
+#define STREAM_H_
+
+#include <stdio.h>
+
+// Buffer size of standard input and output in a pipeline: output is written
+// in chunks of this size, and memory does not grow with the input
+#define STREAM_CHUNK_SIZE   (64 * 1024)
+
+// Source of input lines or destination of output lines: a file, or memory
+// for callers that expand buffers in-process. An input may have a file
+// included into it (INCLUDE), which is read before the rest of the input.
+typedef struct stream_s
+{
+    FILE *          file;           // NULL for memory streams
+    struct pipeline_s * pipeline;   // file read or written by pipeline threads
+    struct linetab_s * lines;       // input file tokenized ahead
+    const struct linetab_entry_s * tokens;  // tokens of the line read last, if tokenized
+    const char *    input;          // memory input
+    size_t          inputSize;
+    size_t          inputPos;
+    const struct linetab_entry_s * inputTokens;     // tokens of each memory input line, or NULL
+    int             numInputTokens;
+    struct stream_s * include;      // included file being read, or NULL
+    struct include_file_s * source; // cached file the memory input is, released with the stream
+    int             lineNumber;     // lines read so far
+    char *          output;         // memory output, always NUL terminated
+    size_t          outputSize;     // bytes written, or needed if the buffer was too small
+    size_t          outputCapacity;
+    int             isGrowable;     // output buffer is owned and grows as needed
+    int             failed;         // buffer too small, out of memory or write error
+    struct asmpass_s * asmpass;     // pass 1 of the output lines (--symtab), or NULL
+    struct tokout_s * tokout;       // tokenized output lines (--tokens), or NULL
+    struct peephole_s * peephole;   // peephole optimizer of the output lines (--peephole), or NULL
+    char *          line;           // output line for the passes, until its newline
+    size_t          lineSize;
+    size_t          lineCapacity;
+} stream_t;
+
+stream_t *  stream_allocFile(FILE * file);
+stream_t *  stream_allocInput(const char * data, size_t size);
+stream_t *  stream_allocOutput(char * buffer, size_t capacity);
+stream_t *  stream_allocPipeline(struct pipeline_s * pipeline);
+stream_t *  stream_allocLines(struct linetab_s * lines);
+stream_t *  stream_allocTokens(const char * data, size_t size, const struct linetab_entry_s * tokens, int numTokens);
+void        stream_free(stream_t * stream);
+char *      stream_gets(stream_t * stream, char * buffer, int size);
+int         stream_puts(stream_t * stream, const char * text);
+int         stream_putLine(stream_t * stream, const char * line, size_t length, const char * newline, unsigned int origin);
+char *      stream_release(stream_t * stream);
+void        stream_endLine(stream_t * stream);
+
+#endif /* STREAM_H_ */
@@ -9,7 +9,13 @@
 #include "argtab.h"
 #include "deftab.h"
 #include "namtab.h"
+#include "expcache.h"
+#include "expstack.h"
 #include "parser.h"
+#include "macroproc.h"
+#include "asmpass.h"
+#include "tokout.h"
+#include "peephole.h"
 #include "test.h"
 
 /**
@@ -26,6 +32,20 @@ void runTests(void)
     debug_testDataStructures();
     debug_testParser();
     debug_testUniqueLabelGenerator();
+    debug_testLibraryApi();
+    debug_testLineTable();
+    debug_testParallel();
+    debug_testFileCache();
+    debug_testDepfile();
+    debug_testInclude();
+    debug_testWatch();
+    debug_testServer();
+    debug_testCatalog();
+    debug_testRedefinition();
+    debug_testLibraryFiles();
+    debug_testAsmPass();
+    debug_testTokenizedOutput();
+    debug_testPeephole();
 }
 
 void debug_testDataStructures(void)
@@ -34,6 +54,10 @@ void debug_testDataStructures(void)
     argtab_t * argtab;
     namtab_t * namtab;
     namtab_entry_t * namtabEntry;
+    expstack_t * expstack;
+    expstack_frame_t * frame;
+    expcache_t * expcache;
+    expcache_entry_t * cacheEntry;
     char * string;
     int start = 0;
     int end = 0;
@@ -88,7 +112,48 @@ void debug_testDataStructures(void)
         printf("    %s\n", string);
     }
 
+    /* EXPSTACK TESTS */
+    printf("\n%s: START EXPSTACK TESTS\n\n", __func__);
+    expstack = expstack_alloc();
+    for(i = 0; i < 10; i++)
+    {
+        // push enough frames to grow the stack
+        frame = expstack_push(expstack, namtabEntry);
+        frame->uniqueId = i;
+    }
+    printf("%s: testing with null pointers\n", __func__);
+    expstack_push(NULL, namtabEntry);
+    expstack_push(expstack, NULL);
+    frame = expstack_top(expstack);
+    printf("%s: depth = %d, top uniqueId = %d, cursor = %d\n", __func__, expstack->size, frame->uniqueId, frame->cursor);
+    while(!expstack_isEmpty(expstack))
+    {
+        expstack_pop(expstack);
+    }
+    printf("%s: depth after pop = %d\n", __func__, expstack->size);
+
+    /* EXPCACHE TESTS */
+    printf("\n%s: START EXPCACHE TESTS\n\n", __func__);
+    expcache = expcache_alloc();
+    cacheEntry = expcache_entryAlloc("MACRO_TWO\n\nF1,BUFFER");
+    for(i = 0; i < 10; i++)
+    {
+        expcache_entryAddLine(cacheEntry, "$LOOP  TD  =X'F1'", 1);
+    }
+    printf("%s: add = %d\n", __func__, expcache_add(expcache, cacheEntry));
+    printf("%s: add again = %d\n", __func__, expcache_add(expcache, cacheEntry));
+    printf("%s: testing with null pointers\n", __func__);
+    expcache_add(NULL, cacheEntry);
+    expcache_entryAddLine(NULL, "Oops!", 0);
+    expcache_entryAddLine(cacheEntry, NULL, 0);
+    cacheEntry = expcache_get(expcache, "MACRO_TWO\n\nF1,BUFFER");
+    printf("%s: lines = %d, first = '%s' (%d markers)\n", __func__,
+        cacheEntry->size, cacheEntry->lines[0], cacheEntry->labelCount[0]);
+    printf("%s: missing key found = %d\n", __func__, expcache_get(expcache, "MACRO_TWO\n\nF2,BUFFER") != NULL);
+
     printf("\n%s: CLEAN-UP\n\n", __func__);
+    expcache_free(expcache);
+    expstack_free(expstack);
     namtab_free(namtab);
     argtab_free(argtab);
     deftab_free(deftab);
@@ -147,11 +212,1064 @@ void debug_testParser(void)
 void debug_testUniqueLabelGenerator(void)
 {
     int i = 0;
-    char prefix[UNIQUE_LABEL_DIGITS + 2];
+    char prefix[MAX_UNIQUE_LABEL_DIGITS + 2];
+    const int ids[] = { 0, 1, 25, 26, 675, 1295, 1296, 3843, 3844, 238327 };
+    const int formats[][2] = { { 26, 2 }, { 36, 2 }, { 62, 2 }, { 62, 3 } };
+    int f;
+
     printf("\n%s: START UNIQUE LABEL GENERATOR TESTS\n\n", __func__);
-    for(i = 0; i < MAX_UNIQUE_LABELS; i++)
+    for(f = 0; f < (int)(sizeof(formats) / sizeof(formats[0])); f++)
+    {
+        setUniqueLabelFormat(formats[f][0], formats[f][1]);
+        printf("base=%d, digits=%d, limit=%d\n", UNIQUE_LABEL_BASE, UNIQUE_LABEL_DIGITS, UNIQUE_LABEL_LIMIT);
+        for(i = 0; i < (int)(sizeof(ids) / sizeof(ids[0])); i++)
+        {
+            if(getUniquePrefix(ids[i], prefix, sizeof(prefix)) == SUCCESS)
+            {
+                printf("    id=%d, prefix=%s\n", ids[i], prefix);
+            }
+            else
+            {
+                printf("    id=%d, out of range\n", ids[i]);
+            }
+        }
+    }
+
+    printf("%s: testing invalid formats\n", __func__);
+    printf("    base=63: %d, digits=0: %d\n", setUniqueLabelFormat(63, 2), setUniqueLabelFormat(36, 0));
+    setUniqueLabelFormat(DEFAULT_UNIQUE_LABEL_BASE, DEFAULT_UNIQUE_LABEL_DIGITS);
+}
+
+void debug_testLibraryApi(void)
+{
+    const char * program =
+        "WRBUFF    MACRO   &OUTDEV,&BUFADR\n"
+        "$LOOP     TD     =X'&OUTDEV'\n"
+        "          JEQ     $LOOP\n"
+        "          STCH    &BUFADR\n"
+        "          MEND\n"
+        "FIRST     WRBUFF  05,BUFFER\n"
+        "          WRBUFF  06,BUFFER\n"
+        "          END     FIRST\n";
+    const char * noMend = "LOOSE     MACRO   &A\n          LDA     &A\n";
+    char small[64];
+    macroproc_t * context;
+    macroproc_buffer_t output;
+    macroproc_diag_t diag;
+    macroproc_iter_t * iter;
+    const char * line;
+    size_t length;
+    int i;
+
+    printf("\n%s: START LIBRARY API TESTS\n\n", __func__);
+    context = macroproc_create();
+
+    printf("%s: growable buffer, expanded twice\n", __func__);
+    for(i = 0; i < 2; i++)
+    {
+        memset(&output, 0, sizeof(output));
+        macroproc_expand(context, program, strlen(program), &output, &diag);
+        printf("result=%d, size=%u\n%s", diag.result, (unsigned int) output.size, output.data);
+        macroproc_freeBuffer(&output);
+    }
+
+    printf("%s: caller buffer too small\n", __func__);
+    output.data = small;
+    output.capacity = sizeof(small);
+    macroproc_expand(context, program, strlen(program), &output, &diag);
+    printf("result=%d, size=%u, message=%s", diag.result, (unsigned int) output.size, diag.message);
+
+    printf("%s: macro without MEND\n", __func__);
+    memset(&output, 0, sizeof(output));
+    macroproc_expand(context, noMend, strlen(noMend), &output, &diag);
+    printf("result=%d, line %d, message=%s", diag.result, diag.lineNumber, diag.message);
+    macroproc_freeBuffer(&output);
+
+    printf("%s: line by line, stopping after the first invocation\n", __func__);
+    iter = macroproc_open(context, program, strlen(program), &diag);
+    for(i = 0; i < 4 && (line = macroproc_nextLine(iter, &length)) != NULL; i++)
+    {
+        printf("%u: %s", (unsigned int) length, line);
+    }
+    printf("result=%d\n", macroproc_close(iter, &diag));
+
+    printf("%s: missing library\n", __func__);
+    macroproc_loadLibrary(context, "missing.mlb", &diag);
+    printf("result=%d, message=%s", diag.result, diag.message);
+
+    macroproc_destroy(context);
+}
+
+/**
+ * Function: debug_isSameToken
+ * Description:
+ *  - Compares two tokens of a parse_info_t, either of which may be NULL.
+ */
+BOOL debug_isSameToken(const char * a, const char * b)
+{
+    if(a == NULL || b == NULL)
+    {
+        return a == b;
+    }
+    return strcmp(a, b) == 0;
+}
+
+/**
+ * Function: debug_isSameParse
+ * Description:
+ *  - Compares what parse_line and parse_tokens found in a line.
+ */
+BOOL debug_isSameParse(parse_info_t * a, parse_info_t * b)
+{
+    return a->isComment == b->isComment &&
+        a->hasKeywordMacroParameters == b->hasKeywordMacroParameters &&
+        debug_isSameToken(a->label, b->label) &&
+        debug_isSameToken(a->opcode, b->opcode) &&
+        debug_isSameToken(a->operators, b->operators);
+}
+
+void debug_testLineTable(void)
+{
+    const char * lines[] = {
+        "COPY      START   0             COPY FILE FROM INPUT TO OUTPUT\n",
+        "          LDA     ALPHA\n",
+        "          RSUB\n",
+        "FIRST\n",
+        "\n",
+        "     \n",
+        ".COMMENT\n",
+        "\tLDA\t\tBETA , GAMMA  \n",
+        "RDBUFF    MACRO   &INDEV=F1,&BUFADR\n",
+        "LABEL     END     \n"
+    };
+    const char * files[] = { "Fig4-1.txt", "Fig4-8.txt", "NestedIFWhile.txt", "SpecializedMacro.txt" };
+    char line[CURRENT_LINE_SIZE];
+    linetab_entry_t entry;
+    const linetab_entry_t * next;
+    linetab_t * table;
+    parse_info_t * parsed = parse_info_alloc();
+    parse_info_t * tokenized = parse_info_alloc();
+    int count;
+    int differ;
+    int i;
+
+    printf("\n%s: START LINE TABLE TESTS\n\n", __func__);
+
+    differ = 0;
+    for(i = 0; i < (int)(sizeof(lines) / sizeof(lines[0])); i++)
+    {
+        memset(&entry, 0, sizeof(entry));
+        linetab_tokenize(lines[i], (int) strlen(lines[i]), &entry);
+        parse_line(parsed, lines[i]);
+        parse_tokens(tokenized, lines[i], &entry);
+        if(!debug_isSameParse(parsed, tokenized))
+        {
+            printf("%s: differs: %s", __func__, lines[i]);
+            differ++;
+        }
+    }
+    printf("%s: %d lines, %d differ\n", __func__, i, differ);
+
+    // the files, on two threads
+    for(i = 0; i < (int)(sizeof(files) / sizeof(files[0])); i++)
+    {
+        table = linetab_open(files[i], 2);
+        if(table == NULL)
+        {
+            printf("%s: could not open %s\n", __func__, files[i]);
+            continue;
+        }
+
+        count = 0;
+        differ = 0;
+        while((next = linetab_next(table)) != NULL)
+        {
+            linetab_copyLine(table, next, line, sizeof(line));
+            parse_line(parsed, line);
+            parse_tokens(tokenized, line, next);
+            if(!debug_isSameParse(parsed, tokenized))
+            {
+                differ++;
+            }
+            count++;
+        }
+        printf("%s: %s: %d lines, %d differ\n", __func__, files[i], count, differ);
+        linetab_close(table);
+    }
+
+    parse_info_free(parsed);
+    parse_info_free(tokenized);
+}
+
+/**
+ * Function: debug_testParallel
+ * Description:
+ *  - Expands a program of several regions serially and on four threads,
+ *    and compares the outputs.
+ */
+void debug_testParallel(void)
+{
+    const char * header =
+        "COPY      START   0\n"
+        "&COUNT    SET     1\n"
+        "WRBUFF    MACRO   &OUTDEV,&BUFADR\n"
+        "$LOOP     TD     =X'&OUTDEV'\n"
+        "          JEQ     $LOOP\n"
+        "          STCH    &BUFADR\n"
+        "          MEND\n"
+        "COUNTER   MACRO   &A\n"
+        "$NEXT     LDA     &COUNT\n"
+        "          STA     &A\n"
+        "          MEND\n";
+    const char * later =
+        "LATER     MACRO   &A\n"
+        "          WRBUFF  &A,BUFFER\n"
+        "          MEND\n";
+    size_t size = strlen(header) + strlen(later) + 3000 * CURRENT_LINE_SIZE;
+    char * program = (char *) malloc(size);
+    size_t length;
+    macroproc_t * context;
+    macroproc_buffer_t serial;
+    macroproc_buffer_t parallel;
+    macroproc_diag_t diag;
+    int threads = THREADS;
+    int i;
+
+    printf("\n%s: START PARALLEL EXPANSION TESTS\n\n", __func__);
+    if(program == NULL)
+    {
+        return;
+    }
+
+    strcpy_s(program, size, header);
+    length = strlen(program);
+    for(i = 0; i < 3000; i++)
+    {
+        if(i == 1500)
+        {
+            strcpy_s(program + length, size - length, later);
+        }
+        else if(i % 100 == 0)
+        {
+            sprintf_s(program + length, size - length, "&COUNT    SET     &COUNT+1\n          COUNTER C%d\n", i);
+        }
+        else if(i % 3 == 0)
+        {
+            sprintf_s(program + length, size - length, "          LDA     A%d\n", i);
+        }
+        else
+        {
+            sprintf_s(program + length, size - length, "L%-8d %s  %02d,B%d\n", i, (i > 1500 && i % 2) ? "LATER " : "WRBUFF", i % 100, i);
+        }
+        length += strlen(program + length);
+    }
+
+    context = macroproc_create();
+    memset(&serial, 0, sizeof(serial));
+    memset(&parallel, 0, sizeof(parallel));
+
+    // more invocations than two digits can count
+    macroproc_setLabelFormat(context, DEFAULT_UNIQUE_LABEL_BASE, 3);
+
+    THREADS = 1;
+    macroproc_expand(context, program, length, &serial, &diag);
+    printf("%s: serial result=%d, size=%u\n", __func__, diag.result, (unsigned int) serial.size);
+
+    THREADS = 4;
+    macroproc_expand(context, program, length, &parallel, &diag);
+    printf("%s: 4 threads result=%d, size=%u, same=%d\n", __func__, diag.result, (unsigned int) parallel.size,
+        serial.size == parallel.size && memcmp(serial.data, parallel.data, serial.size) == 0);
+    THREADS = threads;
+    setUniqueLabelFormat(DEFAULT_UNIQUE_LABEL_BASE, DEFAULT_UNIQUE_LABEL_DIGITS);
+
+    macroproc_freeBuffer(&serial);
+    macroproc_freeBuffer(&parallel);
+    macroproc_destroy(context);
+    free(program);
+}
+
+/**
+ * Function: debug_testFileCache
+ * Description:
+ *  - Checks SHA-256 against the FIPS 180-4 examples, that the cache key
+ *    follows the options, and that an unchanged output file is not written.
+ */
+void debug_testFileCache(void)
+{
+    const char * expected[] = {
+        "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855",
+        "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+        "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0"
+    };
+    char chunk[1000];
+    char hex[FILECACHE_KEY_SIZE];
+    char key[FILECACHE_KEY_SIZE];
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    sha256_t context;
+    filecache_t * cache;
+    int changed;
+    int i;
+    int j;
+
+    printf("\n%s: START FILE CACHE TESTS\n\n", __func__);
+
+    // "", "abc", and a million 'a' added 1000 at a time
+    memset(chunk, 'a', sizeof(chunk));
+    for(i = 0; i < 3; i++)
+    {
+        sha256_init(&context);
+        if(i == 1)
+        {
+            sha256_update(&context, "abc", 3);
+        }
+        for(j = 0; i == 2 && j < 1000; j++)
+        {
+            sha256_update(&context, chunk, sizeof(chunk));
+        }
+        sha256_final(&context, digest);
+        for(j = 0; j < SHA256_DIGEST_SIZE; j++)
+        {
+            sprintf_s(hex + 2 * j, sizeof(hex) - 2 * j, "%02x", digest[j]);
+        }
+        printf("%s: sha256 %d same=%d\n", __func__, i, strcmp(hex, expected[i]) == 0);
+    }
+
+    // the same input and options give the same key, other options another
+    cache = filecache_open(".", "Fig4-1.txt", NULL, 0);
+    if(cache == NULL)
+    {
+        printf("%s: could not hash Fig4-1.txt\n", __func__);
+        return;
+    }
+    strcpy_s(key, sizeof(key), cache->key);
+    filecache_free(cache);
+
+    cache = filecache_open(".", "Fig4-1.txt", NULL, 0);
+    printf("%s: same options, same key=%d\n", __func__, strcmp(key, cache->key) == 0);
+    filecache_free(cache);
+
+    setUniqueLabelFormat(DEFAULT_UNIQUE_LABEL_BASE, DEFAULT_UNIQUE_LABEL_DIGITS + 1);
+    cache = filecache_open(".", "Fig4-1.txt", NULL, 0);
+    printf("%s: other options, same key=%d\n", __func__, strcmp(key, cache->key) == 0);
+    filecache_free(cache);
+    setUniqueLabelFormat(DEFAULT_UNIQUE_LABEL_BASE, DEFAULT_UNIQUE_LABEL_DIGITS);
+
+    // the second copy finds the same bytes and leaves the file alone
+    remove("testcache.txt");
+    filecache_install("Fig4-1.txt", "testcache.txt", &changed);
+    printf("%s: first install changed=%d\n", __func__, changed);
+    filecache_install("Fig4-1.txt", "testcache.txt", &changed);
+    printf("%s: second install changed=%d\n", __func__, changed);
+    remove("testcache.txt");
+}
+
+/**
+ * Function: debug_testDepfile
+ * Description:
+ *  - Checks the names of -MD dependency files, and the escaping of the
+ *    names in the rule.
+ */
+void debug_testDepfile(void)
+{
+    const char * expected = "out\\ 1.txt: in.txt \\\n lib$$.bin \\\n \\#2.lib\n";
+    const char * outputs[] = { "out.txt", "out", "dir.v/out", "dir.v\\out.txt" };
+    char text[CURRENT_LINE_SIZE];
+    depfile_t * depfile;
+    char * name;
+    FILE * file = NULL;
+    size_t size = 0;
+    int i;
+
+    printf("\n%s: START DEPENDENCY FILE TESTS\n\n", __func__);
+
+    for(i = 0; i < (int)(sizeof(outputs) / sizeof(outputs[0])); i++)
+    {
+        name = depfile_getName(outputs[i]);
+        printf("%s: %s -> %s\n", __func__, outputs[i], name);
+        free(name);
+    }
+
+    // in.txt is read twice, but listed once
+    depfile = depfile_alloc();
+    depfile_add(depfile, "in.txt");
+    depfile_add(depfile, "lib$.bin");
+    depfile_add(depfile, "in.txt");
+    depfile_add(depfile, "#2.lib");
+    depfile_write(depfile, "testdepfile.d", "out 1.txt");
+    depfile_free(depfile);
+
+    if(fopen_s(&file, "testdepfile.d", "r") == 0 && file != NULL)
+    {
+        size = fread(text, 1, sizeof(text) - 1, file);
+        fclose(file);
+    }
+    text[size] = '\0';
+    printf("%s: rule same=%d\n", __func__, strcmp(text, expected) == 0);
+    remove("testdepfile.d");
+}
+
+/**
+ * Function: debug_testInclude
+ * Description:
+ *  - Expands a program that includes a file twice, in two expansions, and
+ *    compares it with the same program with the file pasted in. The file
+ *    is only read by the first expansion.
+ */
+void debug_testInclude(void)
+{
+    const char * prelude =
+        "WRBUFF    MACRO   &OUTDEV,&BUFADR\n"
+        "$LOOP     TD     =X'&OUTDEV'\n"
+        "          JEQ     $LOOP\n"
+        "          STCH    &BUFADR\n"
+        "          MEND\n";
+    const char * program =
+        "COPY      START   0\n"
+        "          INCLUDE testinclude.mac\n"
+        "          INCLUDE 'testinclude.mac'\n"
+        "FIRST     WRBUFF  05,BUFFER\n"
+        "          END     FIRST\n";
+    char pasted[CURRENT_LINE_SIZE * 2];
+    macroproc_t * context;
+    macroproc_buffer_t included;
+    macroproc_buffer_t expected;
+    macroproc_diag_t diag;
+    FILE * file = NULL;
+    long hits;
+    long misses;
+    int i;
+
+    printf("\n%s: START INCLUDE TESTS\n\n", __func__);
+
+    if(fopen_s(&file, "testinclude.mac", "w") != 0 || file == NULL)
     {
-        getUniquePrefix(i, prefix, sizeof(prefix));
-        printf("id=%d, prefix=%s\n", i, prefix);
+        printf("%s: could not write testinclude.mac\n", __func__);
+        return;
     }
-}
\ No newline at end of file
+    fputs(prelude, file);
+    fclose(file);
+
+    sprintf_s(pasted, sizeof(pasted), "COPY      START   0\n%sFIRST     WRBUFF  05,BUFFER\n          END     FIRST\n", prelude);
+
+    context = macroproc_create();
+    memset(&expected, 0, sizeof(expected));
+    macroproc_expand(context, pasted, strlen(pasted), &expected, &diag);
+
+    hits = (includeCache != NULL) ? THREAD_LOAD(&includeCache->hits) : 0;
+    misses = (includeCache != NULL) ? THREAD_LOAD(&includeCache->misses) : 0;
+    for(i = 0; i < 2; i++)
+    {
+        memset(&included, 0, sizeof(included));
+        macroproc_expand(context, program, strlen(program), &included, &diag);
+        printf("%s: expansion %d result=%d, same=%d\n", __func__, i + 1, diag.result,
+            included.size == expected.size && memcmp(included.data, expected.data, expected.size) == 0);
+        macroproc_freeBuffer(&included);
+    }
+    printf("%s: include cache %ld hits, %ld misses\n", __func__,
+        THREAD_LOAD(&includeCache->hits) - hits, THREAD_LOAD(&includeCache->misses) - misses);
+
+    macroproc_freeBuffer(&expected);
+    macroproc_destroy(context);
+    remove("testinclude.mac");
+}
+
+/**
+ * Function: debug_testWatch
+ * Description:
+ *  - Expands a program three times as watch mode does, the last time with a
+ *    macro body edited. Unchanged invocations are replayed, those of the
+ *    edited macro are expanded again, and only the bytes that changed are
+ *    written to the output file.
+ */
+void debug_testWatch(void)
+{
+    const char * versions[] = {
+        "COPY      START   0\n"
+        "WRBUFF    MACRO   &OUTDEV\n"
+        "$LOOP     TD     =X'&OUTDEV'\n"
+        "          JEQ     $LOOP\n"
+        "          MEND\n"
+        "FIRST     WRBUFF  05\n"
+        "          WRBUFF  06\n"
+        "          END     FIRST\n",
+        "COPY      START   0\n"
+        "WRBUFF    MACRO   &OUTDEV\n"
+        "$LOOP     TD     =X'&OUTDEV'\n"
+        "          JGT     $LOOP\n"
+        "          MEND\n"
+        "FIRST     WRBUFF  05\n"
+        "          WRBUFF  06\n"
+        "          END     FIRST\n" };
+    const int runs[] = { 0, 0, 1 };
+    char text[CURRENT_LINE_SIZE * 4];
+    macroproc_t * context;
+    macroproc_buffer_t expected[2];
+    macroproc_buffer_t buffer;
+    macroproc_diag_t diag;
+    stream_t * output;
+    FILE * file = NULL;
+    size_t size;
+    int i;
+
+    printf("\n%s: START WATCH TESTS\n\n", __func__);
+
+    context = macroproc_create();
+    for(i = 0; i < 2; i++)
+    {
+        memset(&expected[i], 0, sizeof(expected[i]));
+        macroproc_expand(context, versions[i], strlen(versions[i]), &expected[i], &diag);
+    }
+
+    watch = watch_alloc();
+    for(i = 0; i < (int)(sizeof(runs) / sizeof(runs[0])); i++)
+    {
+        watch_begin(watch);
+        memset(&buffer, 0, sizeof(buffer));
+        macroproc_expand(context, versions[runs[i]], strlen(versions[runs[i]]), &buffer, &diag);
+
+        output = stream_allocOutput(NULL, 0);
+        stream_puts(output, buffer.data);
+        watch_splice(watch, "testwatch.txt", output);
+        stream_free(output);
+
+        size = 0;
+        if(fopen_s(&file, "testwatch.txt", "rb") == 0 && file != NULL)
+        {
+            size = fread(text, 1, sizeof(text), file);
+            fclose(file);
+        }
+        printf("%s: run %d same=%d, %d macros changed, cache %d hits %d misses, bytes %u to %u written\n", __func__,
+            i + 1, size == expected[runs[i]].size && memcmp(text, expected[runs[i]].data, size) == 0,
+            watch->changedMacros, watch->expcache->hits, watch->expcache->misses,
+            (unsigned int) watch->spliceStart, (unsigned int) watch->spliceEnd);
+        macroproc_freeBuffer(&buffer);
+    }
+    watch_free(watch);
+    watch = NULL;
+
+    macroproc_freeBuffer(&expected[0]);
+    macroproc_freeBuffer(&expected[1]);
+    macroproc_destroy(context);
+    remove("testwatch.txt");
+}
+
+THREAD_RESULT debug_runServer(void * argument)
+{
+    // the limits are thread local, and server_run copies the caller's
+    budget = budget_alloc();
+    *(int *) argument = server_run("testserver.sock", 2);
+    budget_free(budget);
+    budget = NULL;
+    return THREAD_RETURN;
+}
+
+void debug_testServer(void)
+{
+    const char * source =
+        "COPY      START   0\n"
+        "WRBUFF    MACRO   &OUTDEV\n"
+        "$LOOP     TD     =X'&OUTDEV'\n"
+        "          JEQ     $LOOP\n"
+        "          MEND\n"
+        "FIRST     WRBUFF  05\n"
+        "          WRBUFF  06\n"
+        "          END     FIRST\n";
+    const char * broken = "BAD       MACRO\n          IF      (&A EQ\n";
+    char header[SERVER_HEADER_SIZE];
+    macroproc_t * context;
+    macroproc_buffer_t expected;
+    macroproc_diag_t diag;
+    thread_t thread;
+    char * response = NULL;
+    size_t size = 0;
+    BOOL stats = STATS;
+    BOOL verbose = VERBOSE;
+    int serverResult = FAILURE;
+    int result = FAILURE;
+    int i;
+
+    printf("\n%s: START SERVER TESTS\n\n", __func__);
+
+    context = macroproc_create();
+    memset(&expected, 0, sizeof(expected));
+    macroproc_expand(context, source, strlen(source), &expected, &diag);
+    macroproc_destroy(context);
+
+    if(thread_start(&thread, debug_runServer, &serverResult) != SUCCESS)
+    {
+        printf("%s: could not start the server\n", __func__);
+        macroproc_freeBuffer(&expected);
+        return;
+    }
+
+    // wait for the server to listen
+    sprintf_s(header, sizeof(header), "EXPAND %u", (unsigned int) strlen(source));
+    for(i = 0; i < 100 && result != SUCCESS; i++)
+    {
+        free(response);
+        response = NULL;
+        result = server_request("testserver.sock", header, source, strlen(source), &response, &size);
+        if(result != SUCCESS)
+        {
+            thread_sleep(20);
+        }
+    }
+    printf("%s: expand result=%d same=%d\n", __func__, result,
+        response != NULL && size == expected.size && memcmp(response, expected.data, size) == 0);
+    free(response);
+    response = NULL;
+
+    sprintf_s(header, sizeof(header), "EXPAND %u", (unsigned int) strlen(broken));
+    result = server_request("testserver.sock", header, broken, strlen(broken), &response, &size);
+    printf("%s: broken input result=%d response=%s", __func__, result, (response != NULL) ? response : "(none)\n");
+    free(response);
+    response = NULL;
+
+    if(server_request("testserver.sock", "STATS", NULL, 0, &response, &size) == SUCCESS)
+    {
+        printf("%s: %s", __func__, response);
+    }
+    free(response);
+
+    server_stop(0);
+    thread_join(thread);
+    printf("%s: server result=%d\n", __func__, serverResult);
+
+    STATS = stats;
+    VERBOSE = verbose;
+    macroproc_freeBuffer(&expected);
+}
+
+void debug_testCatalog(void)
+{
+    const char * preludes[] = {
+        "WRBUFF    MACRO   &OUTDEV\n"
+        "$LOOP     TD     =X'&OUTDEV'\n"
+        "          JEQ     $LOOP\n"
+        "          MEND\n",
+        "WRBUFF    MACRO   &OUTDEV\n"
+        "$LOOP     TD     =X'&OUTDEV'\n"
+        "          JGT     $LOOP\n"
+        "          MEND\n" };
+    const char * libraries[] = { "testcatalog1.mlb", "testcatalog2.mlb" };
+    const char * source =
+        "FIRST     WRBUFF  05\n"
+        "          WRBUFF  06\n"
+        "          END     FIRST\n";
+    macroproc_t * context;
+    macroproc_iter_t * iter;
+    macroproc_buffer_t buffer;
+    macroproc_diag_t diag;
+    catalog_t * catalog;
+    catalog_snapshot_t * first;
+    catalog_snapshot_t * second;
+    stream_t * input;
+    stream_t * output;
+    const char * line;
+    int i;
+
+    printf("\n%s: START CATALOG TESTS\n\n", __func__);
+
+    // a library of each prelude
+    for(i = 0; i < 2; i++)
+    {
+        input = stream_allocInput(preludes[i], strlen(preludes[i]));
+        output = stream_allocOutput(NULL, 0);
+        EMIT_LIBRARY_FILE = (char *) libraries[i];
+        processInput(input, output);
+        EMIT_LIBRARY_FILE = NULL;
+        stream_free(input);
+        stream_free(output);
+    }
+
+    // snapshots stay mapped while pinned
+    catalog = catalog_alloc();
+    catalog_reload(catalog, libraries[0]);
+    first = catalog_pin(catalog);
+    catalog_reload(catalog, libraries[1]);
+    second = catalog_pin(catalog);
+    printf("%s: pinned generations %ld and %ld, %ld reclaimed\n", __func__,
+        first->generation, second->generation, catalog->reclaimed);
+    catalog_release(catalog, first);
+    printf("%s: first released, %ld reclaimed\n", __func__, catalog->reclaimed);
+    catalog_release(catalog, second);
+    printf("%s: second released, %ld reclaimed\n", __func__, catalog->reclaimed);
+    catalog_free(catalog);
+
+    // an open iterator keeps the library it started with
+    context = macroproc_create();
+    macroproc_loadLibrary(context, libraries[0], &diag);
+    iter = macroproc_open(context, source, strlen(source), &diag);
+    line = macroproc_nextLine(iter, NULL);
+    macroproc_loadLibrary(context, libraries[1], &diag);
+    for(i = 0; line != NULL; i++)
+    {
+        if(strstr(line, "JEQ") != NULL || strstr(line, "JGT") != NULL)
+        {
+            printf("%s: iterator line: %s", __func__, line);
+        }
+        line = macroproc_nextLine(iter, NULL);
+    }
+    printf("%s: iterator closed, result=%d\n", __func__, macroproc_close(iter, &diag));
+
+    memset(&buffer, 0, sizeof(buffer));
+    macroproc_expand(context, source, strlen(source), &buffer, &diag);
+    printf("%s: next expansion uses %s\n", __func__,
+        (buffer.data != NULL && strstr(buffer.data, "JGT") != NULL) ? "the new library" : "the old library");
+    macroproc_freeBuffer(&buffer);
+    macroproc_destroy(context);
+
+    remove(libraries[0]);
+    remove(libraries[1]);
+}
+
+void debug_testRedefinition(void)
+{
+    const char * source =
+        "SELF      MACRO   &A\n"
+        "SELF      MACRO   &B\n"
+        "          STX     &B\n"
+        "          MEND\n"
+        "          LDX     &A\n"
+        "          MEND\n"
+        "          SELF    ONE\n"
+        "          SELF    TWO\n"
+        "          SELF    THREE\n"
+        "          END\n";
+    char * lines[3];
+    int depths[3] = { 0, 0, 0 };
+    deftab_t * table;
+    stream_t * input;
+    stream_t * output;
+    char * text;
+    int first, second;
+    int result;
+    int i;
+
+    printf("\n%s: START REDEFINITION TESTS\n\n", __func__);
+
+    // retired lines are reused by the next definition that fits
+    table = deftab_alloc();
+    for(i = 0; i < 3; i++)
+    {
+        lines[i] = _strdup("          LDA     &A");
+    }
+    first = deftab_addLines(table, lines, depths, 3);
+    for(i = 0; i < 2; i++)
+    {
+        lines[i] = _strdup("          STA     &A");
+    }
+    second = deftab_addLines(table, lines, depths, 2);
+    deftab_retire(table, first, first + 2);
+    printf("%s: retired %d-%d, size = %d, %d free\n", __func__, first, first + 2, table->size, table->freeLines);
+    for(i = 0; i < 2; i++)
+    {
+        lines[i] = _strdup("          LDX     &A");
+    }
+    first = deftab_addLines(table, lines, depths, 2);
+    printf("%s: next definition at %d, %d reused\n", __func__, first, table->reusedLines);
+    deftab_retire(table, second, second + 1);
+    printf("%s: last lines retired, size = %d, %d free\n", __func__, table->size, table->freeLines);
+    deftab_free(table);
+
+    // a macro redefining itself keeps expanding its old lines until it ends
+    input = stream_allocInput(source, strlen(source));
+    output = stream_allocOutput(NULL, 0);
+    result = processBegin(input, output);
+    while(result == SUCCESS)
+    {
+        result = processStep(input, output);
+    }
+    printf("%s: %d macros, %d redefined, %d retired left\n", __func__,
+        namtab->size, namtab->redefinitions, namtab->numRetired);
+    processEnd(output, result);
+    text = stream_release(output);
+    printf("%s", (text != NULL) ? text : "");
+    free(text);
+    stream_free(input);
+    stream_free(output);
+}
+
+void debug_testLibraryFiles(void)
+{
+    const char * definitions[] = {
+        "MA        MACRO   &X\n"
+        "          LDA     &X\n"
+        "          MEND\n"
+        "MB        MACRO   &Y\n"
+        "          STA     &Y\n"
+        "          MEND\n",
+        "MB        MACRO   &Y\n"
+        "          STX     &Y\n"
+        "          MEND\n"
+        "MC        MACRO   &Z\n"
+        "          LDX     &Z\n"
+        "          MEND\n" };
+    const char * fileNames[] = { "testlibrary1.mac", "testlibrary2.mac" };
+    const char * reversed[] = { "testlibrary2.mac", "testlibrary1.mac" };
+    const char * missing = "testlibrary3.mac";
+    const char * source =
+        "FIRST     MA      ONE\n"
+        "          MB      TWO\n"
+        "          MC      THREE\n"
+        "          END     FIRST\n";
+    const char * const * orders[] = { fileNames, reversed };
+    FILE * file = NULL;
+    stream_t * input;
+    stream_t * output;
+    char * text;
+    int i;
+
+    printf("\n%s: START LIBRARY FILES TESTS\n\n", __func__);
+
+    for(i = 0; i < 2; i++)
+    {
+        if(fopen_s(&file, fileNames[i], "w") != 0 || file == NULL)
+        {
+            printf("%s: could not write %s\n", __func__, fileNames[i]);
+            return;
+        }
+        fputs(definitions[i], file);
+        fclose(file);
+    }
+
+    // the macro of the later file is kept, whichever thread loaded it first
+    for(i = 0; i < 2; i++)
+    {
+        library = libload_open(orders[i], 2, 2);
+        if(library == NULL)
+        {
+            printf("%s: could not load the files\n", __func__);
+            break;
+        }
+        printf("%s: %s then %s, %d files, %u macros, %d replaced\n", __func__, orders[i][0], orders[i][1],
+            library->numFiles, library->header->numMacros, library->numReplaced);
+
+        input = stream_allocInput(source, strlen(source));
+        output = stream_allocOutput(NULL, 0);
+        processInput(input, output);
+        text = stream_release(output);
+        printf("%s", (text != NULL) ? text : "");
+        free(text);
+        stream_free(input);
+        stream_free(output);
+        library_close(library);
+        library = NULL;
+    }
+
+    library = libload_open(&missing, 1, 2);
+    printf("%s: missing file, loaded=%d\n", __func__, library != NULL);
+    library_close(library);
+    library = NULL;
+
+    remove(fileNames[0]);
+    remove(fileNames[1]);
+}
+
+void debug_testAsmPass(void)
+{
+    const char * source =
+        "LOADX     MACRO   &VALUE\n"
+        "          LDX     &VALUE\n"
+        "          MEND\n"
+        "PROG      START   1000\n"
+        "FIRST     LOADX   =C'EOF'\n"
+        "          +JSUB   READ\n"
+        "          FIX             FLOAT TO INTEGER\n"
+        "          COMPR   A,S\n"
+        "          LDA     =X'05'\n"
+        "          LTORG           LITERALS HERE\n"
+        "READ      LDCH    =C'EOF'\n"
+        "FIRST     RSUB            RETURN\n"
+        "TABLE     RESW    10\n"
+        "HEX       BYTE    X'ABC'\n"
+        "TEXT      BYTE    C'A B'\n"
+        "SIZE      EQU     *-TABLE\n"
+        "          ORG     TABLE+3\n"
+        "ENTRY     WORD    0\n"
+        "          ORG     HEX\n"
+        "          FOO     1\n"
+        "          END     FIRST\n";
+    const char * fileName = "testsymtab.txt";
+    FILE * file = NULL;
+    stream_t * input;
+    stream_t * output;
+    char line[CURRENT_LINE_SIZE];
+    int result;
+
+    printf("\n%s: START ASSEMBLER PASS 1 TESTS\n\n", __func__);
+
+    printf("%s: formats LDA %d, +LDA %d, CLEAR %d, +CLEAR %d, NORM %d, WORD %d\n", __func__,
+        asmpass_getFormat("LDA"), asmpass_getFormat("+LDA"), asmpass_getFormat("CLEAR"),
+        asmpass_getFormat("+CLEAR"), asmpass_getFormat("NORM"), asmpass_getFormat("WORD"));
+
+    if(fopen_s(&file, fileName, "w") != 0 || file == NULL)
+    {
+        printf("%s: could not write %s\n", __func__, fileName);
+        return;
+    }
+
+    input = stream_allocInput(source, strlen(source));
+    output = stream_allocOutput(NULL, 0);
+    output->asmpass = asmpass_alloc(file);
+    result = processInput(input, output);
+    printf("%s: result %d, %d symbols, %d literals, %d errors\n", __func__, result,
+        output->asmpass->numSymbols, output->asmpass->numLiterals, output->asmpass->numErrors);
+    asmpass_free(output->asmpass);
+    output->asmpass = NULL;
+    stream_free(input);
+    stream_free(output);
+    fclose(file);
+
+    // the sidecar, as an assembler would read it
+    if(fopen_s(&file, fileName, "r") == 0 && file != NULL)
+    {
+        while(fgets(line, sizeof(line), file) != NULL)
+        {
+            printf("%s: %s", __func__, line);
+        }
+        fclose(file);
+    }
+    remove(fileName);
+}
+
+void debug_testTokenizedOutput(void)
+{
+    const char * source =
+        "LOADX     MACRO   &VALUE\n"
+        "          LDX     &VALUE\n"
+        "          +JSUB   READ\n"
+        "          MEND\n"
+        "PROG      START   1000\n"
+        ". COMMENT LINE\n"
+        "FIRST     LOADX   =C'A B'\n"
+        "          CLEAR   X         CLEAR INDEX\n"
+        "          LOADX   ZERO\n"
+        "TEXT      BYTE    C'EOF'\n"
+        "          PRINT   ZERO\n"
+        "          END     FIRST\n";
+    const char * fileName = "testtokens.bin";
+    FILE * file = NULL;
+    stream_t * input;
+    stream_t * output;
+    const tokout_header_t * header;
+    const tokout_line_t * lines;
+    const tokout_origin_t * origins;
+    char * image = NULL;
+    size_t size = 0;
+    unsigned int i;
+    int result;
+
+    printf("\n%s: START TOKENIZED OUTPUT TESTS\n\n", __func__);
+
+    printf("%s: classes LDA %d, +LDA %d, CLEAR %d, RESW %d, LTORG %d, PRINT %d\n", __func__,
+        tokout_getClass("LDA"), tokout_getClass("+LDA"), tokout_getClass("CLEAR"),
+        tokout_getClass("RESW"), tokout_getClass("LTORG"), tokout_getClass("PRINT"));
+
+    if(fopen_s(&file, fileName, "wb") != 0 || file == NULL)
+    {
+        printf("%s: could not write %s\n", __func__, fileName);
+        return;
+    }
+    input = stream_allocInput(source, strlen(source));
+    output = stream_allocOutput(NULL, 0);
+    output->tokout = tokout_alloc(file);
+    result = processInput(input, output);
+    tokout_free(output->tokout);
+    output->tokout = NULL;
+    fclose(file);
+    stream_free(input);
+    stream_free(output);
+
+    // read back as a tool would, without lexing
+    if(fopen_s(&file, fileName, "rb") == 0 && file != NULL)
+    {
+        image = server_readAll(file, &size);
+        fclose(file);
+    }
+    header = tokout_check(image, size);
+    printf("%s: result %d, valid %d, truncated valid %d\n", __func__, result, header != NULL,
+        tokout_check(image, (size > 0) ? size - 1 : 0) != NULL);
+    if(header != NULL)
+    {
+        lines = (const tokout_line_t *) (image + header->lineOffset);
+        origins = (const tokout_origin_t *) (image + header->originOffset);
+        printf("%s: %u lines, %u origins\n", __func__, header->numLines, header->numOrigins);
+        for(i = 0; i < header->numLines; i++)
+        {
+            printf("%s: input line %u %-6s class %d [%.*s] [%.*s] [%.*s] [%.*s]\n", __func__,
+                origins[lines[i].origin].line,
+                (origins[lines[i].origin].macro != 0) ? image + origins[lines[i].origin].macro : "-", lines[i].opcodeClass,
+                lines[i].labelLength, image + lines[i].text + lines[i].label,
+                lines[i].opcodeLength, image + lines[i].text + lines[i].opcode,
+                lines[i].operandLength, image + lines[i].text + lines[i].operand,
+                lines[i].commentLength, image + lines[i].text + lines[i].comment);
+        }
+    }
+
+    free(image);
+    remove(fileName);
+}
+
+void debug_testPeephole(void)
+{
+    const char * source =
+        "RDREC     MACRO   &INDEV\n"
+        "          CLEAR   X\n"
+        "          CLEAR   A\n"
+        "          TD      =X'&INDEV'\n"
+        "          JEQ     *-3\n"
+        "          RD      =X'&INDEV'\n"
+        "          STA     TEMP\n"
+        "          MEND\n"
+        "PROG      START   1000\n"
+        "FIRST     CLEAR   X\n"
+        "          RDREC   F1\n"
+        "          LDA     TEMP\n"
+        "          COMP    LEN\n"
+        "          LDA     TEMP\n"
+        "          STA     TEMP\n"
+        ". COMMENT\n"
+        "          CLEAR   A\n"
+        "          LDCH    BUF\n"
+        "          LDT     LEN\n"
+        "          LDT     #4096\n"
+        "          LDX     #0\n"
+        "          JLT     *+10\n"
+        "          CLEAR   S\n"
+        "          CLEAR   S\n"
+        "          COMP    LEN\n"
+        "LOOP      CLEAR   X\n"
+        "          CLEAR   X\n"
+        "          TIX     LEN\n"
+        "          JLT     *-5\n"
+        "          J       LOOP\n"
+        "TEMP      RESW    1\n"
+        "BUF       RESB    4\n"
+        "LEN       WORD    4\n"
+        "          END     FIRST\n";
+    stream_t * input;
+    stream_t * output;
+    int result;
+    int i;
+
+    printf("\n%s: START PEEPHOLE TESTS\n\n", __func__);
+
+    input = stream_allocInput(source, strlen(source));
+    output = stream_allocOutput(NULL, 0);
+    output->peephole = peephole_alloc(output);
+    result = processInput(input, output);
+    printf("%s: result %d, %d lines (%d bytes) removed, %d jumps adjusted, %d warnings\n", __func__, result,
+        output->peephole->numRemoved, output->peephole->bytesRemoved, output->peephole->numAdjusted,
+        output->peephole->numUnsafe);
+    for(i = 0; i < PEEPHOLE_RULES; i++)
+    {
+        printf("%s: %s %d\n", __func__, peephole_getRuleName(i), output->peephole->hits[i]);
+    }
+    printf("%s: output\n%s", __func__, output->output);
+
+    peephole_free(output->peephole);
+    output->peephole = NULL;
+    stream_free(input);
+    stream_free(output);
+}
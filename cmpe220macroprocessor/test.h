@@ -9,5 +9,19 @@ void runTests(void);
 void debug_testDataStructures(void);
 void debug_testParser(void);
 void debug_testUniqueLabelGenerator(void);
+void debug_testLibraryApi(void);
+void debug_testLineTable(void);
+void debug_testParallel(void);
+void debug_testFileCache(void);
+void debug_testDepfile(void);
+void debug_testInclude(void);
+void debug_testWatch(void);
+void debug_testServer(void);
+void debug_testCatalog(void);
+void debug_testRedefinition(void);
+void debug_testLibraryFiles(void);
+void debug_testAsmPass(void);
+void debug_testTokenizedOutput(void);
+void debug_testPeephole(void);
 
 #endif // TEST_H_
\ No newline at end of file
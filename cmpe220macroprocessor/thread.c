@@ -0,0 +1,388 @@
+/*
+ * thread.c - Contains functions for threads.
+ */
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#else
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include "definitions.h"
+#include "thread.h"
+
+struct thread_lock_s
+{
+#ifdef _WIN32
+    SRWLOCK             lock;
+#else
+    pthread_mutex_t     lock;
+#endif
+};
+
+struct thread_event_s
+{
+#ifdef _WIN32
+    SRWLOCK             lock;
+    CONDITION_VARIABLE  condition;
+#else
+    pthread_mutex_t     lock;
+    pthread_cond_t      condition;
+#endif
+};
+
+/**
+ * Function: thread_start
+ * Description:
+ *  - Starts a thread.
+ * Parameters:
+ *  - thread: Set to the new thread.
+ *  - function: Function the thread runs.
+ *  - argument: Argument of the function.
+ * Returns:
+ *  - SUCCESS or FAILURE
+ */
+int thread_start(thread_t * thread, thread_function_t function, void * argument)
+{
+#ifdef _WIN32
+    *thread = (thread_t) _beginthreadex(NULL, 0, function, argument, 0, NULL);
+    return (*thread != NULL) ? SUCCESS : FAILURE;
+#else
+    return (pthread_create(thread, NULL, function, argument) == 0) ? SUCCESS : FAILURE;
+#endif
+}
+
+/**
+ * Function: thread_join
+ * Description:
+ *  - Waits for a thread to end.
+ * Parameters:
+ *  - thread: The thread.
+ * Returns:
+ *  - none
+ */
+void thread_join(thread_t thread)
+{
+#ifdef _WIN32
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+/**
+ * Function: thread_yield
+ * Description:
+ *  - Lets other threads run while this one waits for them.
+ * Parameters:
+ *  - none
+ * Returns:
+ *  - none
+ */
+void thread_yield(void)
+{
+#ifdef _WIN32
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+/**
+ * Function: thread_fence
+ * Description:
+ *  - Full memory barrier: the stores before it are seen by every thread
+ *    before the loads after it are made.
+ * Parameters:
+ *  - none
+ * Returns:
+ *  - none
+ */
+void thread_fence(void)
+{
+#ifdef _WIN32
+    MemoryBarrier();
+#else
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+/**
+ * Function: thread_sleep
+ * Description:
+ *  - Suspends this thread for a while.
+ * Parameters:
+ *  - milliseconds: Time to sleep.
+ * Returns:
+ *  - none
+ */
+void thread_sleep(int milliseconds)
+{
+#ifdef _WIN32
+    Sleep((DWORD) milliseconds);
+#else
+    struct timespec delay;
+
+    delay.tv_sec = milliseconds / 1000;
+    delay.tv_nsec = (long) (milliseconds % 1000) * 1000000L;
+    nanosleep(&delay, NULL);
+#endif
+}
+
+/**
+ * Function: thread_now
+ * Description:
+ *  - Reads a clock that only goes forward, to time things in wall time
+ *    (clock() counts the processor time of every thread).
+ * Parameters:
+ *  - none
+ * Returns:
+ *  - Microseconds since some point in the past.
+ */
+long long thread_now(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter;
+    LARGE_INTEGER frequency;
+
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (long long) (counter.QuadPart / frequency.QuadPart * 1000000 +
+        counter.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart);
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+}
+
+/**
+ * Function: thread_countProcessors
+ * Description:
+ *  - Counts the processors that threads can run on.
+ * Parameters:
+ *  - none
+ * Returns:
+ *  - Number of processors, at least 1.
+ */
+int thread_countProcessors(void)
+{
+    int count;
+#ifdef _WIN32
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+    count = (int) info.dwNumberOfProcessors;
+#else
+    count = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+    return (count > 0) ? count : 1;
+}
+
+/**
+ * Function: thread_lockAlloc
+ * Description:
+ *  - Allocates a lock, not held.
+ * Parameters:
+ *  - none
+ * Returns:
+ *  - If successful, returns pointer to new lock. Otherwise, returns NULL.
+ */
+thread_lock_t * thread_lockAlloc(void)
+{
+    thread_lock_t * lock = (thread_lock_t *) malloc(sizeof(thread_lock_t));
+
+    if(lock == NULL)
+    {
+        return NULL;
+    }
+
+#ifdef _WIN32
+    InitializeSRWLock(&lock->lock);
+#else
+    if(pthread_mutex_init(&lock->lock, NULL) != 0)
+    {
+        free(lock);
+        return NULL;
+    }
+#endif
+
+    return lock;
+}
+
+/**
+ * Function: thread_lockFree
+ * Description:
+ *  - De-allocates a lock. No thread may hold it.
+ * Parameters:
+ *  - lock: Pointer to the lock.
+ * Returns:
+ *  - none
+ */
+void thread_lockFree(thread_lock_t * lock)
+{
+    if(lock)
+    {
+#ifndef _WIN32
+        pthread_mutex_destroy(&lock->lock);
+#endif
+        free(lock);
+    }
+}
+
+/**
+ * Function: thread_lock
+ * Description:
+ *  - Takes a lock, waiting while another thread holds it.
+ * Parameters:
+ *  - lock: Pointer to the lock.
+ * Returns:
+ *  - none
+ */
+void thread_lock(thread_lock_t * lock)
+{
+#ifdef _WIN32
+    AcquireSRWLockExclusive(&lock->lock);
+#else
+    pthread_mutex_lock(&lock->lock);
+#endif
+}
+
+/**
+ * Function: thread_unlock
+ * Description:
+ *  - Gives up a lock taken by thread_lock.
+ * Parameters:
+ *  - lock: Pointer to the lock.
+ * Returns:
+ *  - none
+ */
+void thread_unlock(thread_lock_t * lock)
+{
+#ifdef _WIN32
+    ReleaseSRWLockExclusive(&lock->lock);
+#else
+    pthread_mutex_unlock(&lock->lock);
+#endif
+}
+
+/**
+ * Function: thread_eventAlloc
+ * Description:
+ *  - Allocates an event for threads to wait on.
+ * Parameters:
+ *  - none
+ * Returns:
+ *  - If successful, returns pointer to new event. Otherwise, returns NULL.
+ */
+thread_event_t * thread_eventAlloc(void)
+{
+    thread_event_t * event = (thread_event_t *) malloc(sizeof(thread_event_t));
+
+    if(event == NULL)
+    {
+        return NULL;
+    }
+
+#ifdef _WIN32
+    InitializeSRWLock(&event->lock);
+    InitializeConditionVariable(&event->condition);
+#else
+    if(pthread_mutex_init(&event->lock, NULL) != 0)
+    {
+        free(event);
+        return NULL;
+    }
+    if(pthread_cond_init(&event->condition, NULL) != 0)
+    {
+        pthread_mutex_destroy(&event->lock);
+        free(event);
+        return NULL;
+    }
+#endif
+
+    return event;
+}
+
+/**
+ * Function: thread_eventFree
+ * Description:
+ *  - De-allocates an event. No thread may be waiting on it.
+ * Parameters:
+ *  - event: Pointer to the event.
+ * Returns:
+ *  - none
+ */
+void thread_eventFree(thread_event_t * event)
+{
+    if(event)
+    {
+#ifndef _WIN32
+        pthread_cond_destroy(&event->condition);
+        pthread_mutex_destroy(&event->lock);
+#endif
+        free(event);
+    }
+}
+
+/**
+ * Function: thread_eventWait
+ * Description:
+ *  - Sleeps until a counter no longer holds a value. The thread that changes
+ *    the counter calls thread_eventSignal after it, so the change is not
+ *    missed between the test and the sleep.
+ * Parameters:
+ *  - event: Pointer to the event.
+ *  - value: The counter.
+ *  - unchanged: Value to wait on.
+ * Returns:
+ *  - none
+ */
+void thread_eventWait(thread_event_t * event, volatile long * value, long unchanged)
+{
+#ifdef _WIN32
+    AcquireSRWLockExclusive(&event->lock);
+    while(THREAD_LOAD(value) == unchanged)
+    {
+        SleepConditionVariableSRW(&event->condition, &event->lock, INFINITE, 0);
+    }
+    ReleaseSRWLockExclusive(&event->lock);
+#else
+    pthread_mutex_lock(&event->lock);
+    while(THREAD_LOAD(value) == unchanged)
+    {
+        pthread_cond_wait(&event->condition, &event->lock);
+    }
+    pthread_mutex_unlock(&event->lock);
+#endif
+}
+
+/**
+ * Function: thread_eventSignal
+ * Description:
+ *  - Wakes the threads waiting on an event, after a counter they wait on was
+ *    changed.
+ * Parameters:
+ *  - event: Pointer to the event.
+ * Returns:
+ *  - none
+ */
+void thread_eventSignal(thread_event_t * event)
+{
+#ifdef _WIN32
+    AcquireSRWLockExclusive(&event->lock);
+    WakeAllConditionVariable(&event->condition);
+    ReleaseSRWLockExclusive(&event->lock);
+#else
+    pthread_mutex_lock(&event->lock);
+    pthread_cond_broadcast(&event->condition);
+    pthread_mutex_unlock(&event->lock);
+#endif
+}
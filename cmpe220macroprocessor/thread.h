@@ -0,0 +1,74 @@
+/*
+ * thread.h - Contains functions and definitions for threads and the atomic
+ * operations shared between them.
+ */
+
+#ifndef THREAD_H_
+#define THREAD_H_
+
+// windows.h is only included by thread.c, it conflicts with BOOL in definitions.h
+#ifdef _WIN32
+#include <intrin.h>
+#else
+#include <pthread.h>
+#endif
+
+// Counters shared between threads are volatile longs. Loads acquire, stores
+// release, and THREAD_INCREMENT and THREAD_ADD return the new value.
+// Pointers published to other threads are loaded and exchanged with full
+// barriers; THREAD_EXCHANGE_POINTER returns the old value, and so does
+// THREAD_COMPARE_EXCHANGE_POINTER, which only stores v over expected.
+// thread_fence orders a store before a later load of another variable.
+// THREAD_LOCAL globals have one copy per thread.
+// A thread_lock_t guards data that is changed by more than one thread, and a
+// thread_event_t parks threads that wait for a counter to change, once
+// spinning on it has taken too long.
+#ifdef _WIN32
+typedef void *      thread_t;       // HANDLE
+#define THREAD_LOAD(p)              _InterlockedCompareExchange((p), 0, 0)
+#define THREAD_STORE(p, v)          _InterlockedExchange((p), (v))
+#define THREAD_INCREMENT(p)         _InterlockedIncrement(p)
+#define THREAD_ADD(p, v)            (_InterlockedExchangeAdd((p), (v)) + (v))
+#define THREAD_LOAD_POINTER(p)      _InterlockedCompareExchangePointer((void * volatile *)(p), NULL, NULL)
+#define THREAD_EXCHANGE_POINTER(p, v) _InterlockedExchangePointer((void * volatile *)(p), (v))
+#define THREAD_COMPARE_EXCHANGE_POINTER(p, expected, v) _InterlockedCompareExchangePointer((void * volatile *)(p), (v), (expected))
+#define THREAD_RESULT               unsigned __stdcall
+#define THREAD_RETURN               0
+#define THREAD_LOCAL                __declspec(thread)
+typedef unsigned (__stdcall * thread_function_t)(void * argument);
+#else
+typedef pthread_t   thread_t;
+#define THREAD_LOAD(p)              __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define THREAD_STORE(p, v)          __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define THREAD_INCREMENT(p)         __atomic_add_fetch((p), 1, __ATOMIC_ACQ_REL)
+#define THREAD_ADD(p, v)            __atomic_add_fetch((p), (v), __ATOMIC_ACQ_REL)
+#define THREAD_LOAD_POINTER(p)      __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define THREAD_EXCHANGE_POINTER(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define THREAD_COMPARE_EXCHANGE_POINTER(p, expected, v) __sync_val_compare_and_swap((p), (expected), (v))
+#define THREAD_RESULT               void *
+#define THREAD_RETURN               NULL
+#define THREAD_LOCAL                __thread
+typedef void * (* thread_function_t)(void * argument);
+#endif
+
+typedef struct thread_lock_s thread_lock_t;
+typedef struct thread_event_s thread_event_t;
+
+int     thread_start(thread_t * thread, thread_function_t function, void * argument);
+void    thread_join(thread_t thread);
+void    thread_yield(void);
+void    thread_fence(void);
+void    thread_sleep(int milliseconds);
+long long thread_now(void);
+int     thread_countProcessors(void);
+
+thread_lock_t *     thread_lockAlloc(void);
+void                thread_lockFree(thread_lock_t * lock);
+void                thread_lock(thread_lock_t * lock);
+void                thread_unlock(thread_lock_t * lock);
+thread_event_t *    thread_eventAlloc(void);
+void                thread_eventFree(thread_event_t * event);
+void                thread_eventWait(thread_event_t * event, volatile long * value, long unchanged);
+void                thread_eventSignal(thread_event_t * event);
+
+#endif /* THREAD_H_ */
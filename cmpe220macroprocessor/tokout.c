@@ -0,0 +1,469 @@
+/*
+ * tokout.c - Contains functions for the tokenized output (--tokens).
+ *
+ * Every line written to the output is also written to the tokenized output
+ * file, with the spans of its label, opcode, operand and comment, the class
+ * of its opcode, and the input line it came from, so an assembler or a
+ * linter can map the file and skip lexing the text. The lines are tokenized
+ * as they are written, by linetab_tokenize as the input lines are.
+ *
+ * The origin of a line is set by processStep for each input line, and for
+ * the invocation of a macro on it: the lines of an expansion, replayed or
+ * not, come from the invocation.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include "definitions.h"
+#include "tokout.h"
+#include "asmpass.h"
+#include "linetab.h"
+
+const char * TOKOUT_DATA[] = { "BYTE", "WORD", "RESB", "RESW" };
+const char * TOKOUT_DIRECTIVES[] = { "START", "END", "LTORG", "EQU", "ORG", "BASE", "NOBASE",
+    "USE", "CSECT", "EXTDEF", "EXTREF" };
+
+// local function definitions
+unsigned int tokout_addName(tokout_t * tokout, const char * name);
+int tokout_write(tokout_t * tokout, const void * data, size_t size);
+void tokout_split(const char * line, tokout_line_t * record);
+
+/**
+ * Function: tokout_alloc
+ * Description:
+ *  - Allocates a writer of a tokenized output file. The file is not closed
+ *    by tokout_free, and must be seekable: the header is written last.
+ * Parameters:
+ *  - file: File open for writing, in binary mode.
+ * Returns:
+ *  - If successful, returns pointer to new writer. Otherwise, returns NULL.
+ */
+tokout_t * tokout_alloc(FILE * file)
+{
+    tokout_header_t header;
+    tokout_t * tokout;
+
+    if(file == NULL)
+    {
+        return NULL;
+    }
+
+    tokout = (tokout_t *) malloc(sizeof(tokout_t));
+    if(tokout)
+    {
+        memset(tokout, 0, sizeof(tokout_t));
+        tokout->file = file;
+
+        // room for the header, then the strings start with ""
+        memset(&header, 0, sizeof(header));
+        if(fwrite(&header, sizeof(header), 1, file) != 1 || fputc('\0', file) == EOF)
+        {
+            free(tokout);
+            return NULL;
+        }
+        tokout->size = 1;
+    }
+
+    return tokout;
+}
+
+/**
+ * Function: tokout_free
+ * Description:
+ *  - Frees the writer, with its tables.
+ * Parameters:
+ *  - tokout: Pointer to the writer.
+ * Returns:
+ *  - none
+ */
+void tokout_free(tokout_t * tokout)
+{
+    tokout_name_t * name;
+    tokout_name_t * tmp;
+
+    if(tokout == NULL)
+    {
+        return;
+    }
+
+    HASH_ITER(hh, tokout->names, name, tmp)
+    {
+        HASH_DEL(tokout->names, name);
+        free(name->name);
+        free(name);
+    }
+
+    free(tokout->lines);
+    free(tokout->origins);
+    free(tokout);
+}
+
+/**
+ * Function: tokout_setOrigin
+ * Description:
+ *  - Sets the origin of the lines written from now on.
+ * Parameters:
+ *  - tokout: Pointer to the writer.
+ *  - line: Line of the input file being processed.
+ *  - macro: Macro invoked on that line, or NULL.
+ * Returns:
+ *  - none
+ */
+void tokout_setOrigin(tokout_t * tokout, int line, const char * macro)
+{
+    unsigned int offset;
+
+    if(tokout == NULL || tokout->failed)
+    {
+        return;
+    }
+
+    offset = (macro != NULL) ? tokout_addName(tokout, macro) : 0;
+    if(tokout->origin.line != (unsigned int) line || tokout->origin.macro != offset)
+    {
+        tokout->origin.line = (unsigned int) line;
+        tokout->origin.macro = offset;
+        tokout->originUsed = FALSE;
+    }
+}
+
+/**
+ * Function: tokout_mark
+ * Description:
+ *  - Adds the origin set last to the origin table, once for all the lines
+ *    written from it.
+ * Parameters:
+ *  - tokout: Pointer to the writer.
+ * Returns:
+ *  - Index of the origin, for tokout_line.
+ */
+unsigned int tokout_mark(tokout_t * tokout)
+{
+    unsigned int capacity;
+    void * tmp;
+
+    if(tokout == NULL || tokout->failed)
+    {
+        return 0;
+    }
+
+    // lines from one origin share its entry
+    if(!tokout->originUsed)
+    {
+        if(tokout->numOrigins == tokout->originsCapacity)
+        {
+            capacity = (tokout->originsCapacity > 0) ? tokout->originsCapacity * 2 : 64;
+            tmp = realloc(tokout->origins, capacity * sizeof(tokout_origin_t));
+            if(tmp == NULL)
+            {
+                tokout->failed = TRUE;
+                return 0;
+            }
+            tokout->origins = (tokout_origin_t *) tmp;
+            tokout->originsCapacity = capacity;
+        }
+        tokout->origins[tokout->numOrigins++] = tokout->origin;
+        tokout->originUsed = TRUE;
+    }
+
+    return tokout->numOrigins - 1;
+}
+
+/**
+ * Function: tokout_line
+ * Description:
+ *  - Writes one output line, and adds its record to the line table. A line
+ *    held back by the peephole pass is written after the origin changed, so
+ *    the origin is marked when the line is collected.
+ * Parameters:
+ *  - tokout: Pointer to the writer.
+ *  - line: The line, without its newline.
+ *  - length: Length of the line.
+ *  - origin: Its origin, from tokout_mark.
+ * Returns:
+ *  - none
+ */
+void tokout_line(tokout_t * tokout, const char * line, size_t length, unsigned int origin)
+{
+    tokout_line_t * record;
+    linetab_entry_t entry;
+    char opcode[CURRENT_LINE_SIZE];
+    unsigned int capacity;
+    void * tmp;
+
+    if(tokout == NULL || line == NULL || tokout->failed || origin >= tokout->numOrigins)
+    {
+        return;
+    }
+
+    if(tokout->numLines == tokout->linesCapacity)
+    {
+        capacity = (tokout->linesCapacity > 0) ? tokout->linesCapacity * 2 : 1024;
+        tmp = realloc(tokout->lines, capacity * sizeof(tokout_line_t));
+        if(tmp == NULL)
+        {
+            tokout->failed = TRUE;
+            return;
+        }
+        tokout->lines = (tokout_line_t *) tmp;
+        tokout->linesCapacity = capacity;
+    }
+    record = &tokout->lines[tokout->numLines++];
+    memset(record, 0, sizeof(tokout_line_t));
+    record->text = sizeof(tokout_header_t) + tokout->size;
+    record->origin = origin;
+    record->length = (unsigned short) ((length < 0xFFFF) ? length : 0xFFFF);
+
+    // the spans fit in a byte, longer lines are left untokenized
+    if(length < CURRENT_LINE_SIZE)
+    {
+        linetab_tokenize(line, (int) length, &entry);
+        record->flags = entry.flags;
+        if(entry.flags & LINETAB_COMMENT)
+        {
+            record->opcodeClass = TOKOUT_CLASS_COMMENT;
+        }
+        if(entry.flags & LINETAB_LABEL)
+        {
+            record->label = entry.label;
+            record->labelLength = entry.labelLength;
+        }
+        if(entry.flags & LINETAB_OPCODE)
+        {
+            record->opcode = entry.opcode;
+            record->opcodeLength = entry.opcodeLength;
+            memcpy(opcode, line + entry.opcode, entry.opcodeLength);
+            opcode[entry.opcodeLength] = '\0';
+            record->opcodeClass = (unsigned char) tokout_getClass(opcode);
+        }
+        if(entry.flags & LINETAB_OPERATORS)
+        {
+            record->operand = entry.operators;
+            record->operandLength = entry.operatorsLength;
+            tokout_split(line, record);
+        }
+    }
+    else
+    {
+        record->flags = LINETAB_UNTOKENIZED;
+    }
+    tokout->classes[record->opcodeClass]++;
+
+    tokout_write(tokout, line, length);
+    tokout_write(tokout, "", 1);
+}
+
+/**
+ * Function: tokout_finish
+ * Description:
+ *  - Writes the line and origin tables after the strings, then the header.
+ * Parameters:
+ *  - tokout: Pointer to the writer.
+ * Returns:
+ *  - SUCCESS, or FAILURE if the file could not be written.
+ */
+int tokout_finish(tokout_t * tokout)
+{
+    tokout_header_t header;
+    static const char padding[4] = { 0, 0, 0, 0 };
+
+    if(tokout == NULL)
+    {
+        return FAILURE;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TOKOUT_MAGIC, strlen(TOKOUT_MAGIC));
+    header.version = TOKOUT_VERSION;
+    header.stringOffset = sizeof(tokout_header_t);
+    header.stringSize = tokout->size;
+    tokout_write(tokout, padding, (4 - (sizeof(tokout_header_t) + tokout->size) % 4) % 4);
+
+    header.numLines = tokout->numLines;
+    header.lineOffset = sizeof(tokout_header_t) + tokout->size;
+    tokout_write(tokout, tokout->lines, tokout->numLines * sizeof(tokout_line_t));
+    header.numOrigins = tokout->numOrigins;
+    header.originOffset = header.lineOffset + tokout->numLines * sizeof(tokout_line_t);
+    tokout_write(tokout, tokout->origins, tokout->numOrigins * sizeof(tokout_origin_t));
+    header.fileSize = header.originOffset + tokout->numOrigins * sizeof(tokout_origin_t);
+
+    if(!tokout->failed && (fseek(tokout->file, 0, SEEK_SET) != 0 ||
+        fwrite(&header, sizeof(header), 1, tokout->file) != 1 || fflush(tokout->file) != 0))
+    {
+        tokout->failed = TRUE;
+    }
+    return tokout->failed ? FAILURE : SUCCESS;
+}
+
+/**
+ * Function: tokout_check
+ * Description:
+ *  - Checks a tokenized output file read or mapped into memory, so a tool
+ *    can use its tables without checking each offset.
+ * Parameters:
+ *  - image: Contents of the file.
+ *  - size: Size of the file.
+ * Returns:
+ *  - The header of the file, or NULL if the file is not a tokenized output
+ *    of this version, or is cut short.
+ */
+const tokout_header_t * tokout_check(const char * image, size_t size)
+{
+    const tokout_header_t * header = (const tokout_header_t *) image;
+    const tokout_line_t * lines;
+    unsigned int i;
+
+    if(image == NULL || size < sizeof(tokout_header_t) ||
+        memcmp(header->magic, TOKOUT_MAGIC, strlen(TOKOUT_MAGIC)) != 0 ||
+        header->version != TOKOUT_VERSION || header->fileSize != size ||
+        header->stringOffset + header->stringSize > header->lineOffset ||
+        header->lineOffset % 4 != 0 || header->originOffset % 4 != 0 ||
+        header->numLines > (size - header->lineOffset) / sizeof(tokout_line_t) ||
+        header->originOffset != header->lineOffset + header->numLines * sizeof(tokout_line_t) ||
+        header->originOffset + header->numOrigins * sizeof(tokout_origin_t) != size ||
+        header->stringSize == 0 || image[header->stringOffset + header->stringSize - 1] != '\0')
+    {
+        return NULL;
+    }
+
+    lines = (const tokout_line_t *) (image + header->lineOffset);
+    for(i = 0; i < header->numLines; i++)
+    {
+        if(lines[i].text < header->stringOffset || lines[i].origin >= header->numOrigins ||
+            lines[i].text + lines[i].length >= header->stringOffset + header->stringSize)
+        {
+            return NULL;
+        }
+    }
+
+    return header;
+}
+
+/**
+ * Function: tokout_getClass
+ * Description:
+ *  - Classifies an opcode: an instruction by its format, data, a directive,
+ *    or anything else.
+ * Parameters:
+ *  - opcode: The opcode, + in front for format 4.
+ * Returns:
+ *  - TOKOUT_CLASS_*
+ */
+int tokout_getClass(const char * opcode)
+{
+    int format = asmpass_getFormat(opcode);
+    int i;
+
+    if(format > 0)
+    {
+        return format;
+    }
+    for(i = 0; i < (int) (sizeof(TOKOUT_DATA) / sizeof(TOKOUT_DATA[0])); i++)
+    {
+        if(strcmp(TOKOUT_DATA[i], opcode) == 0)
+        {
+            return TOKOUT_CLASS_DATA;
+        }
+    }
+    for(i = 0; i < (int) (sizeof(TOKOUT_DIRECTIVES) / sizeof(TOKOUT_DIRECTIVES[0])); i++)
+    {
+        if(strcmp(TOKOUT_DIRECTIVES[i], opcode) == 0)
+        {
+            return TOKOUT_CLASS_DIRECTIVE;
+        }
+    }
+    return TOKOUT_CLASS_OTHER;
+}
+
+/**
+ * Function: tokout_addName
+ * Description:
+ *  - Finds a macro name in the strings, writing it the first time.
+ * Parameters:
+ *  - tokout: Pointer to the writer.
+ *  - name: The name.
+ * Returns:
+ *  - Offset of the name, or 0 if it could not be written.
+ */
+unsigned int tokout_addName(tokout_t * tokout, const char * name)
+{
+    tokout_name_t * found;
+
+    HASH_FIND_STR(tokout->names, name, found);
+    if(found != NULL)
+    {
+        return found->offset;
+    }
+
+    found = (tokout_name_t *) calloc(1, sizeof(tokout_name_t));
+    if(found == NULL || (found->name = _strdup(name)) == NULL)
+    {
+        free(found);
+        tokout->failed = TRUE;
+        return 0;
+    }
+    found->offset = sizeof(tokout_header_t) + tokout->size;
+    HASH_ADD_KEYPTR(hh, tokout->names, found->name, strlen(found->name), found);
+
+    tokout_write(tokout, name, strlen(name) + 1);
+    return found->offset;
+}
+
+/**
+ * Function: tokout_write
+ * Description:
+ *  - Writes bytes after the header.
+ * Parameters:
+ *  - tokout: Pointer to the writer.
+ *  - data: Bytes to write.
+ *  - size: Number of bytes.
+ * Returns:
+ *  - SUCCESS, or FAILURE if they could not be written.
+ */
+int tokout_write(tokout_t * tokout, const void * data, size_t size)
+{
+    if(tokout->failed || (size > 0 && fwrite(data, size, 1, tokout->file) != 1))
+    {
+        tokout->failed = TRUE;
+        return FAILURE;
+    }
+    tokout->size += (unsigned int) size;
+    return SUCCESS;
+}
+
+/**
+ * Function: tokout_split
+ * Description:
+ *  - Splits the operators of a line into the first operand and the comment
+ *    after it. A quoted constant may contain spaces.
+ * Parameters:
+ *  - line: The line.
+ *  - record: Its record, with the operators as the operand.
+ * Returns:
+ *  - none
+ */
+void tokout_split(const char * line, tokout_line_t * record)
+{
+    int pos = record->operand;
+    int end = record->operand + record->operandLength;
+    int quoted = FALSE;
+
+    while(pos < end && (quoted || !isspace((unsigned char) line[pos])))
+    {
+        if(line[pos] == '\'')
+        {
+            quoted = !quoted;
+        }
+        pos++;
+    }
+    record->operandLength = (unsigned char) (pos - record->operand);
+
+    while(pos < end && isspace((unsigned char) line[pos]))
+    {
+        pos++;
+    }
+    record->comment = (unsigned char) pos;
+    record->commentLength = (unsigned char) (end - pos);
+}
@@ -0,0 +1,113 @@
+/*
+ * tokout.h - Contains functions and definitions for the tokenized output
+ * (--tokens), written in the same pass as the text output.
+ */
+
+#ifndef TOKOUT_H_
+#define TOKOUT_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include "uthash\uthash.h"
+
+#define TOKOUT_MAGIC        "CMPETOKS"
+#define TOKOUT_VERSION      (1)
+
+// tokout_line_t opcode classes
+#define TOKOUT_CLASS_OTHER      (0)     // blank, too long to tokenize, or not SIC/XE
+#define TOKOUT_CLASS_FORMAT1    (1)     // instructions, by format
+#define TOKOUT_CLASS_FORMAT2    (2)
+#define TOKOUT_CLASS_FORMAT3    (3)
+#define TOKOUT_CLASS_FORMAT4    (4)     // + in front of a format 3 instruction
+#define TOKOUT_CLASS_DATA       (5)     // BYTE, WORD, RESB, RESW
+#define TOKOUT_CLASS_DIRECTIVE  (6)     // START, END, LTORG, EQU, ORG, BASE, ...
+#define TOKOUT_CLASS_COMMENT    (7)
+
+/*
+ * Tokenized output file layout. Every reference is an offset from the start
+ * of the file, so the file can be mapped anywhere; a tool reads the lines
+ * and their tokens without lexing the text output.
+ *
+ *   tokout_header_t
+ *   strings                         "", then the lines and macro names,
+ *                                   NUL terminated
+ *   tokout_line_t      [numLines]   one per output line, in order
+ *   tokout_origin_t    [numOrigins] input lines the output lines came from
+ *
+ * The tables are aligned to 4 bytes. The spans of a line are offsets into
+ * its text, and set as linetab_tokenize sets them (LINETAB_* flags); the
+ * operators are split into the first operand and the comment after it.
+ */
+typedef struct
+{
+    char            magic[8];
+    unsigned int    version;
+    unsigned int    fileSize;
+    unsigned int    stringOffset;
+    unsigned int    stringSize;
+    unsigned int    numLines;
+    unsigned int    lineOffset;
+    unsigned int    numOrigins;
+    unsigned int    originOffset;
+} tokout_header_t;
+
+typedef struct
+{
+    unsigned int    text;           // line without its newline, in the strings
+    unsigned int    origin;         // index into the origins
+    unsigned short  length;         // bytes of text, up to 65535
+    unsigned char   opcodeClass;    // TOKOUT_CLASS_*
+    unsigned char   flags;          // LINETAB_* flags of the spans set
+    unsigned char   label;
+    unsigned char   labelLength;
+    unsigned char   opcode;
+    unsigned char   opcodeLength;
+    unsigned char   operand;
+    unsigned char   operandLength;
+    unsigned char   comment;
+    unsigned char   commentLength;
+} tokout_line_t;
+
+typedef struct
+{
+    unsigned int    line;           // line of the input file, 0 before the first
+    unsigned int    macro;          // macro invoked on it, in the strings, 0 if none
+} tokout_origin_t;
+
+// Name of a macro in the strings, written once
+typedef struct
+{
+    char *          name;
+    unsigned int    offset;
+    UT_hash_handle  hh;
+} tokout_name_t;
+
+// Writer of a tokenized output file. The strings are written as the lines
+// come, the tables are kept and written after them by tokout_finish.
+typedef struct tokout_s
+{
+    FILE *              file;
+    unsigned int        size;           // bytes written after the header
+    tokout_line_t *     lines;
+    unsigned int        numLines;
+    unsigned int        linesCapacity;
+    tokout_origin_t *   origins;
+    unsigned int        numOrigins;
+    unsigned int        originsCapacity;
+    tokout_origin_t     origin;         // origin of the lines written from now on
+    int                 originUsed;     // a line was written with it
+    tokout_name_t *     names;
+    int                 classes[TOKOUT_CLASS_COMMENT + 1];  // lines of each class
+    int                 failed;         // out of memory or write error
+} tokout_t;
+
+tokout_t *              tokout_alloc(FILE * file);
+void                    tokout_free(tokout_t * tokout);
+void                    tokout_setOrigin(tokout_t * tokout, int line, const char * macro);
+unsigned int            tokout_mark(tokout_t * tokout);
+void                    tokout_line(tokout_t * tokout, const char * line, size_t length, unsigned int origin);
+int                     tokout_finish(tokout_t * tokout);
+const tokout_header_t * tokout_check(const char * image, size_t size);
+int                     tokout_getClass(const char * opcode);
+
+#endif /* TOKOUT_H_ */
@@ -0,0 +1,761 @@
+/*
+ * watch.c - Contains functions for watch mode (--watch).
+ *
+ * Between runs the process keeps what a full run would build again:
+ *
+ *  - the input and included files, read and tokenized (see include.c), which
+ *    are only read again when they change;
+ *  - the expansion cache, keyed by the digest of each macro definition as
+ *    well as the invocation, so an invocation is replayed unless its macro or
+ *    its line changed. Invocations of impure macros (see MACRO_IMPURE) depend
+ *    on the lines before them, and are always expanded;
+ *  - the definition digest of each macro and the lines invoking it, to tell
+ *    which macros an edit changed and which invocations it affects;
+ *  - the output, so only the bytes that changed are written to the file.
+ *
+ * Files are watched with inotify on Linux (on their directories, as editors
+ * often save by renaming a new file over the old one), and polled elsewhere.
+ */
+
+#ifdef _WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <io.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "definitions.h"
+#include "sha256.h"
+#include "watch.h"
+
+#ifdef __linux__
+#define WATCH_EVENTS    (IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO | IN_CREATE | IN_DELETE)
+#endif
+
+// local function definitions
+watch_macro_t * watch_getMacro(watch_t * watch, const char * symbol);
+void watch_purge(watch_t * watch);
+int watch_write(const char * fileName, const char * mode, const char * data, size_t offset, size_t size, size_t fileSize);
+int watch_isChanged(watch_t * watch);
+int watch_readEvents(watch_t * watch, int timeout);
+void watch_freeFiles(watch_t * watch);
+
+/**
+ * Function: watch_alloc
+ * Description:
+ *  - Allocates the state kept between the runs of watch mode.
+ * Parameters:
+ *  - none
+ * Returns:
+ *  - If successful, returns pointer to new state. Otherwise, returns NULL.
+ */
+watch_t * watch_alloc(void)
+{
+    watch_t * watch = (watch_t *) malloc(sizeof(watch_t));
+    if(watch != NULL)
+    {
+        memset(watch, 0, sizeof(watch_t));
+        watch->notify = -1;
+        watch->expcache = expcache_alloc();
+        if(watch->expcache == NULL)
+        {
+            free(watch);
+            return NULL;
+        }
+#ifdef __linux__
+        watch->notify = inotify_init();
+#endif
+    }
+
+    return watch;
+}
+
+/**
+ * Function: watch_free
+ * Description:
+ *  - De-allocates the state of watch mode.
+ * Parameters:
+ *  - watch: Pointer to the state.
+ * Returns:
+ *  - none
+ */
+void watch_free(watch_t * watch)
+{
+    watch_macro_t *i, *tmp;
+
+    if(watch)
+    {
+        HASH_ITER(hh, watch->macros, i, tmp)
+        {
+            HASH_DEL(watch->macros, i);
+            free(i->symbol);
+            free(i->sites);
+            free(i);
+        }
+        watch_freeFiles(watch);
+        expcache_free(watch->expcache);
+        free(watch->output);
+#ifdef __linux__
+        if(watch->notify >= 0)
+        {
+            close(watch->notify);
+        }
+#endif
+        free(watch);
+    }
+}
+
+/**
+ * Function: watch_begin
+ * Description:
+ *  - Starts a run: the invocation sites and counters of the last run are
+ *    cleared, the definitions and expansions are kept.
+ * Parameters:
+ *  - watch: Pointer to the state.
+ * Returns:
+ *  - none
+ */
+void watch_begin(watch_t * watch)
+{
+    watch_macro_t * macro;
+
+    watch->runs++;
+    watch->changedMacros = 0;
+    watch->changedSites = 0;
+    watch->expcache->hits = 0;
+    watch->expcache->misses = 0;
+    for(macro = watch->macros; macro != NULL; macro = (watch_macro_t *) macro->hh.next)
+    {
+        macro->numSites = 0;
+        macro->seen = FALSE;
+    }
+}
+
+/**
+ * Function: watch_addSite
+ * Description:
+ *  - Records a top level invocation of a macro.
+ * Parameters:
+ *  - watch: Pointer to the state.
+ *  - symbol: Name of the macro.
+ *  - lineNumber: Input line of the invocation.
+ * Returns:
+ *  - SUCCESS or FAILURE
+ */
+int watch_addSite(watch_t * watch, const char * symbol, int lineNumber)
+{
+    watch_macro_t * macro = watch_getMacro(watch, symbol);
+    int * sites;
+
+    if(macro == NULL)
+    {
+        return FAILURE;
+    }
+
+    if(macro->numSites == macro->capacity)
+    {
+        sites = (int *) realloc(macro->sites, (macro->capacity + 16) * sizeof(int));
+        if(sites == NULL)
+        {
+            return FAILURE;
+        }
+        macro->sites = sites;
+        macro->capacity += 16;
+    }
+    macro->sites[macro->numSites++] = lineNumber;
+    macro->seen = TRUE;
+
+    return SUCCESS;
+}
+
+/**
+ * Function: watch_end
+ * Description:
+ *  - Finishes a run, while its tables are still allocated: compares each
+ *    macro definition with the one of the last run, and drops the expansions
+ *    of definitions that are gone from the cache.
+ * Parameters:
+ *  - watch: Pointer to the state.
+ *  - table: NAMTAB of the run.
+ * Returns:
+ *  - none
+ */
+void watch_end(watch_t * watch, namtab_t * table)
+{
+    namtab_entry_t * entry;
+    watch_macro_t * macro;
+    unsigned long long digest;
+    int i, j;
+
+    for(i = 0; table != NULL && i < table->size; i++)
+    {
+        entry = namtab_getIndex(table, i);
+        macro = watch_getMacro(watch, entry->symbol);
+        if(macro == NULL)
+        {
+            continue;
+        }
+
+        // a macro that is new after the first run is a change too
+        digest = watch_getDigest(entry);
+        if(macro->digest != digest && (macro->digest != 0 || watch->runs > 1))
+        {
+            watch->changedMacros++;
+            watch->changedSites += macro->numSites;
+            if(VERBOSE)
+            {
+                printf("WATCH: %s changed, %d invocations affected", macro->symbol, macro->numSites);
+                for(j = 0; j < macro->numSites; j++)
+                {
+                    printf("%s%d", (j == 0) ? ", lines " : " ", macro->sites[j]);
+                }
+                printf("\n");
+            }
+        }
+        macro->digest = digest;
+        macro->seen = TRUE;
+    }
+
+    watch_purge(watch);
+}
+
+/**
+ * Function: watch_getDigest
+ * Description:
+ *  - Digest of a macro definition: of its lines in DEFTAB, computed the first
+ *    time it is needed.
+ * Parameters:
+ *  - entry: NAMTAB entry of the macro.
+ * Returns:
+ *  - The digest, never 0.
+ */
+unsigned long long watch_getDigest(namtab_entry_t * entry)
+{
+    unsigned char hash[SHA256_DIGEST_SIZE];
+    sha256_t context;
+    const char * line;
+    int i;
+
+    if(entry->digest == 0)
+    {
+        sha256_init(&context);
+        for(i = entry->deftabStart; i <= entry->deftabEnd; i++)
+        {
+            line = deftab_get(deftab, i);
+            if(line != NULL)
+            {
+                sha256_update(&context, line, strlen(line) + 1);
+            }
+        }
+        sha256_final(&context, hash);
+
+        for(i = 0; i < 8; i++)
+        {
+            entry->digest = (entry->digest << 8) | hash[i];
+        }
+        if(entry->digest == 0)
+        {
+            entry->digest = 1;
+        }
+    }
+
+    return entry->digest;
+}
+
+/**
+ * Function: watch_splice
+ * Description:
+ *  - Writes the output of a run to the output file: only the bytes from the
+ *    first to the last one that changed since the last run, or the whole
+ *    file on the first run or if the file was changed by someone else. The
+ *    file is written in binary mode, so its offsets are those of the output.
+ * Parameters:
+ *  - watch: Pointer to the state.
+ *  - fileName: Name of the output file.
+ *  - output: Memory output of the run, whose buffer is kept for the next run.
+ * Returns:
+ *  - SUCCESS, or FAILURE if the file could not be written.
+ */
+int watch_splice(watch_t * watch, const char * fileName, stream_t * output)
+{
+    const char * data = output->output;
+    size_t size = output->outputSize;
+    size_t start = 0;
+    size_t end = size;
+    size_t shared;
+    long long modified;
+    long long fileSize;
+    int result;
+
+    if(output->failed || data == NULL)
+    {
+        return FAILURE;
+    }
+
+    if(watch->output == NULL || include_getStatus(fileName, &modified, &fileSize) != SUCCESS ||
+       modified != watch->outputModified || fileSize != watch->outputFileSize)
+    {
+        result = watch_write(fileName, "wb", data, 0, size, size);
+    }
+    else
+    {
+        // the bytes before the first change and after the last one are kept
+        shared = (size < watch->outputSize) ? size : watch->outputSize;
+        while(start < shared && data[start] == watch->output[start])
+        {
+            start++;
+        }
+        if(size == watch->outputSize)
+        {
+            while(end > start && data[end - 1] == watch->output[end - 1])
+            {
+                end--;
+            }
+        }
+        result = (start == end && size == watch->outputSize) ? SUCCESS :
+            watch_write(fileName, "r+b", data, start, end - start, size);
+    }
+
+    watch->spliceStart = start;
+    watch->spliceEnd = end;
+    if(result == SUCCESS)
+    {
+        free(watch->output);
+        watch->outputSize = size;
+        watch->output = stream_release(output);
+        if(include_getStatus(fileName, &watch->outputModified, &watch->outputFileSize) != SUCCESS)
+        {
+            result = FAILURE;
+        }
+    }
+    if(result != SUCCESS)
+    {
+        // the next run writes the whole file
+        free(watch->output);
+        watch->output = NULL;
+    }
+
+    return result;
+}
+
+/**
+ * Function: watch_setFiles
+ * Description:
+ *  - Sets the files to watch, the files read by the last run, and how they
+ *    are now.
+ * Parameters:
+ *  - watch: Pointer to the state.
+ *  - files: Names of the files.
+ * Returns:
+ *  - SUCCESS or FAILURE
+ */
+int watch_setFiles(watch_t * watch, depfile_t * files)
+{
+    watch_file_t * file;
+    char * slash;
+    int i;
+
+    watch_freeFiles(watch);
+    if(files == NULL || files->size == 0)
+    {
+        return SUCCESS;
+    }
+
+    watch->files = (watch_file_t *) malloc(files->size * sizeof(watch_file_t));
+    if(watch->files == NULL)
+    {
+        return FAILURE;
+    }
+
+    for(i = 0; i < files->size; i++)
+    {
+        file = &watch->files[watch->numFiles];
+        memset(file, 0, sizeof(watch_file_t));
+        file->handle = -1;
+        file->path = watch_getFullPath(files->files[i]);
+        if(file->path == NULL)
+        {
+            continue;
+        }
+        watch->numFiles++;
+
+        if(include_getStatus(file->path, &file->modified, &file->fileSize) != SUCCESS)
+        {
+            // not there yet, it is read once it is
+            file->modified = -1;
+            file->fileSize = -1;
+        }
+
+        slash = strrchr(file->path, '/');
+#ifdef _WIN32
+        if(strrchr(file->path, '\\') > slash)
+        {
+            slash = strrchr(file->path, '\\');
+        }
+#endif
+        file->name = (slash != NULL) ? slash + 1 : file->path;
+
+#ifdef __linux__
+        if(watch->notify >= 0 && slash != NULL)
+        {
+            // the same directory gives the same handle
+            *slash = '\0';
+            file->handle = inotify_add_watch(watch->notify, (slash == file->path) ? "/" : file->path, WATCH_EVENTS);
+            *slash = '/';
+        }
+#endif
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Function: watch_wait
+ * Description:
+ *  - Waits until a watched file changes, and drops the changed files from
+ *    the include cache so the next run reads them again.
+ * Parameters:
+ *  - watch: Pointer to the state.
+ * Returns:
+ *  - SUCCESS, or FAILURE if the files can no longer be watched.
+ */
+int watch_wait(watch_t * watch)
+{
+    int changed = FALSE;
+
+    while(!changed)
+    {
+#ifdef __linux__
+        if(watch->notify >= 0)
+        {
+            changed = watch_readEvents(watch, -1);
+            if(changed == FAILURE)
+            {
+                return FAILURE;
+            }
+
+            // wait for the rest of the save
+            while(changed && watch_readEvents(watch, WATCH_SETTLE_MS) == TRUE)
+            {
+            }
+            continue;
+        }
+#endif
+        thread_sleep(WATCH_POLL_MS);
+        changed = watch_isChanged(watch);
+        if(changed)
+        {
+            thread_sleep(WATCH_SETTLE_MS);
+            watch_isChanged(watch);
+        }
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Function: watch_getFullPath
+ * Description:
+ *  - Full path of a file, which need not exist yet: its directory must.
+ * Parameters:
+ *  - fileName: Name of the file.
+ * Returns:
+ *  - Full path, to be freed, or NULL if the directory does not exist.
+ */
+char * watch_getFullPath(const char * fileName)
+{
+#ifdef _WIN32
+    return _fullpath(NULL, fileName, 0);
+#else
+    char directory[CURRENT_LINE_SIZE];
+    const char * name;
+    char * path;
+    char * full;
+    size_t size;
+
+    path = realpath(fileName, NULL);
+    if(path != NULL)
+    {
+        return path;
+    }
+
+    name = strrchr(fileName, '/');
+    if(name == NULL)
+    {
+        strcpy_s(directory, sizeof(directory), ".");
+        name = fileName;
+    }
+    else
+    {
+        sprintf_s(directory, sizeof(directory), "%.*s", (int) (name - fileName), fileName);
+        name++;
+    }
+
+    path = realpath((directory[0] != '\0') ? directory : "/", NULL);
+    if(path == NULL)
+    {
+        return NULL;
+    }
+    size = strlen(path) + strlen(name) + 2;
+    full = (char *) malloc(size);
+    if(full != NULL)
+    {
+        sprintf_s(full, size, "%s/%s", (strcmp(path, "/") == 0) ? "" : path, name);
+    }
+    free(path);
+
+    return full;
+#endif
+}
+
+/**
+ * Function: watch_getMacro
+ * Description:
+ *  - Finds the record of a macro, and adds one if there is none.
+ * Parameters:
+ *  - watch: Pointer to the state.
+ *  - symbol: Name of the macro.
+ * Returns:
+ *  - Pointer to the record, or NULL if out of memory.
+ */
+watch_macro_t * watch_getMacro(watch_t * watch, const char * symbol)
+{
+    watch_macro_t * macro = NULL;
+
+    HASH_FIND_STR(watch->macros, symbol, macro);
+    if(macro == NULL)
+    {
+        macro = (watch_macro_t *) malloc(sizeof(watch_macro_t));
+        if(macro == NULL)
+        {
+            return NULL;
+        }
+        memset(macro, 0, sizeof(watch_macro_t));
+        macro->symbol = _strdup(symbol);
+        if(macro->symbol == NULL)
+        {
+            free(macro);
+            return NULL;
+        }
+        HASH_ADD_KEYPTR(hh, watch->macros, macro->symbol, strlen(macro->symbol), macro);
+    }
+
+    return macro;
+}
+
+/**
+ * Function: watch_purge
+ * Description:
+ *  - Forgets the macros the last run did not see, and drops the expansions
+ *    recorded for a definition other than the current one.
+ * Parameters:
+ *  - watch: Pointer to the state.
+ * Returns:
+ *  - none
+ */
+void watch_purge(watch_t * watch)
+{
+    watch_macro_t *macro, *tmpMacro;
+    expcache_entry_t *entry, *tmpEntry;
+    const char * digest;
+    size_t length;
+
+    HASH_ITER(hh, watch->macros, macro, tmpMacro)
+    {
+        if(!macro->seen)
+        {
+            HASH_DEL(watch->macros, macro);
+            free(macro->symbol);
+            free(macro->sites);
+            free(macro);
+        }
+    }
+
+    // keys are "symbol\nlabel\noperands\ndigest" (see getCacheKey)
+    HASH_ITER(hh, watch->expcache->data, entry, tmpEntry)
+    {
+        length = strcspn(entry->key, "\n");
+        digest = strrchr(entry->key, '\n');
+        macro = NULL;
+        HASH_FIND(hh, watch->macros, entry->key, length, macro);
+        if(macro == NULL || digest == NULL || strtoull(digest + 1, NULL, 16) != macro->digest)
+        {
+            expcache_remove(watch->expcache, entry);
+        }
+    }
+}
+
+/**
+ * Function: watch_write
+ * Description:
+ *  - Writes bytes of the output to the output file, and sets the size of
+ *    the file.
+ * Parameters:
+ *  - fileName: Name of the output file.
+ *  - mode: "wb" to write a new file, "r+b" to write into the file.
+ *  - data: Whole output.
+ *  - offset: First byte to write.
+ *  - size: Number of bytes to write.
+ *  - fileSize: Size of the whole output.
+ * Returns:
+ *  - SUCCESS or FAILURE
+ */
+int watch_write(const char * fileName, const char * mode, const char * data, size_t offset, size_t size, size_t fileSize)
+{
+    FILE * file = NULL;
+    int result = SUCCESS;
+
+    if(fopen_s(&file, fileName, mode) != 0 || file == NULL)
+    {
+        return FAILURE;
+    }
+
+    if(fseek(file, (long) offset, SEEK_SET) != 0 || fwrite(data + offset, 1, size, file) != size ||
+       fflush(file) != 0)
+    {
+        result = FAILURE;
+    }
+#ifdef _WIN32
+    else if(_chsize_s(_fileno(file), (__int64) fileSize) != 0)
+#else
+    else if(ftruncate(fileno(file), (off_t) fileSize) != 0)
+#endif
+    {
+        result = FAILURE;
+    }
+
+    if(fclose(file) != 0)
+    {
+        result = FAILURE;
+    }
+
+    return result;
+}
+
+/**
+ * Function: watch_isChanged
+ * Description:
+ *  - Checks each watched file for a new size or modification time, and
+ *    drops the changed ones from the include cache.
+ * Parameters:
+ *  - watch: Pointer to the state.
+ * Returns:
+ *  - TRUE if a file changed, otherwise FALSE.
+ */
+int watch_isChanged(watch_t * watch)
+{
+    watch_file_t * file;
+    long long modified;
+    long long fileSize;
+    int changed = FALSE;
+    int i;
+
+    for(i = 0; i < watch->numFiles; i++)
+    {
+        file = &watch->files[i];
+        if(include_getStatus(file->path, &modified, &fileSize) != SUCCESS)
+        {
+            modified = -1;
+            fileSize = -1;
+        }
+        if(modified != file->modified || fileSize != file->fileSize)
+        {
+            file->modified = modified;
+            file->fileSize = fileSize;
+            include_forget(includeCache, file->path);
+            changed = TRUE;
+        }
+    }
+
+    return changed;
+}
+
+/**
+ * Function: watch_readEvents
+ * Description:
+ *  - Reads the inotify events that are ready, and drops the watched files
+ *    they name from the include cache.
+ * Parameters:
+ *  - watch: Pointer to the state.
+ *  - timeout: Milliseconds to wait for an event, -1 to wait until one comes.
+ * Returns:
+ *  - TRUE if a watched file changed, FALSE if not, FAILURE on error.
+ */
+int watch_readEvents(watch_t * watch, int timeout)
+{
+#ifdef __linux__
+    union
+    {
+        struct inotify_event event;     // aligns the buffer
+        char bytes[4096];
+    } buffer;
+    struct inotify_event * event;
+    struct pollfd ready;
+    ssize_t count;
+    ssize_t offset;
+    int changed = FALSE;
+    int i;
+
+    ready.fd = watch->notify;
+    ready.events = POLLIN;
+    ready.revents = 0;
+    if(poll(&ready, 1, timeout) <= 0)
+    {
+        return (timeout < 0) ? FAILURE : FALSE;
+    }
+
+    count = read(watch->notify, buffer.bytes, sizeof(buffer.bytes));
+    if(count <= 0)
+    {
+        return FAILURE;
+    }
+
+    for(offset = 0; offset < count; offset += sizeof(struct inotify_event) + event->len)
+    {
+        event = (struct inotify_event *) (buffer.bytes + offset);
+        for(i = 0; event->len > 0 && i < watch->numFiles; i++)
+        {
+            if(watch->files[i].handle == event->wd && strcmp(watch->files[i].name, event->name) == 0)
+            {
+                include_forget(includeCache, watch->files[i].path);
+                changed = TRUE;
+            }
+        }
+    }
+
+    return changed;
+#else
+    return FAILURE;
+#endif
+}
+
+/**
+ * Function: watch_freeFiles
+ * Description:
+ *  - Frees the list of watched files. The inotify watches stay, as other
+ *    files may share their directories.
+ * Parameters:
+ *  - watch: Pointer to the state.
+ * Returns:
+ *  - none
+ */
+void watch_freeFiles(watch_t * watch)
+{
+    int i;
+
+    for(i = 0; i < watch->numFiles; i++)
+    {
+        free(watch->files[i].path);
+    }
+    free(watch->files);
+    watch->files = NULL;
+    watch->numFiles = 0;
+}
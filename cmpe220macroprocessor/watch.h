@@ -0,0 +1,72 @@
+/*
+ * watch.h - Contains functions and definitions for watch mode (--watch), which
+ * expands the input again each time a file it was made from changes.
+ */
+
+#ifndef WATCH_H_
+#define WATCH_H_
+
+#include <stddef.h>
+#include "uthash\uthash.h"
+#include "expcache.h"
+#include "namtab.h"
+#include "depfile.h"
+#include "stream.h"
+
+// Time to wait for more changes after one is seen, as editors save a file in
+// several writes, and between checks when files are polled
+#define WATCH_SETTLE_MS     (100)
+#define WATCH_POLL_MS       (500)
+
+// File the output was made from, as it was when last read
+typedef struct
+{
+    char *      path;           // full path
+    const char * name;          // file name part of the path
+    long long   modified;
+    long long   fileSize;
+    int         handle;         // inotify watch of its directory, -1 if none
+} watch_file_t;
+
+// Definition of a macro in the last run, and where the input invokes it
+typedef struct watch_macro_s
+{
+    char *              symbol;         // the key
+    unsigned long long  digest;         // of the definition, 0 if not known yet
+    int *               sites;          // input line of each top level invocation
+    int                 numSites;
+    int                 capacity;
+    int                 seen;           // defined or invoked in the last run
+    UT_hash_handle      hh;
+} watch_macro_t;
+
+typedef struct
+{
+    watch_file_t *  files;
+    int             numFiles;
+    watch_macro_t * macros;
+    expcache_t *    expcache;       // expansions kept from run to run
+    char *          output;         // output file as last written
+    size_t          outputSize;
+    long long       outputModified; // of the output file, when last written
+    long long       outputFileSize;
+    int             notify;         // inotify descriptor, -1 when files are polled
+    int             runs;
+    int             changedMacros;  // found by the last run
+    int             changedSites;   // invocations of the changed macros
+    size_t          spliceStart;    // bytes of the output file written by the last run
+    size_t          spliceEnd;
+} watch_t;
+
+watch_t *           watch_alloc(void);
+void                watch_free(watch_t * watch);
+void                watch_begin(watch_t * watch);
+int                 watch_addSite(watch_t * watch, const char * symbol, int lineNumber);
+void                watch_end(watch_t * watch, namtab_t * table);
+unsigned long long  watch_getDigest(namtab_entry_t * entry);
+int                 watch_splice(watch_t * watch, const char * fileName, stream_t * output);
+int                 watch_setFiles(watch_t * watch, depfile_t * files);
+int                 watch_wait(watch_t * watch);
+char *              watch_getFullPath(const char * fileName);
+
+#endif /* WATCH_H_ */